@@ -32,8 +32,10 @@
 #include <cstring>
 #include <cmath>
 #include <array>
+#include <vector>
 #include <onnxruntime_cxx_api.h>
 #include <opencv2/opencv.hpp>
+#include "image_tensor.h"
 
 class DA2Network {
 public:
@@ -60,7 +62,6 @@ public:
 
   // deconstructor
   ~DA2Network() {
-    if(this->input_data != NULL) { delete[] this->input_data; }
     delete this->session_;
   }
 
@@ -86,27 +87,25 @@ public:
   // scale_factor lets the user resize the image for application to the network
   // smaller images are faster to process, images smaller than 200x200 don't work as well
   int set_input( const cv::Mat &src, const float scale_factor = 1.0 ) {
-    cv::Mat tmp;
+    const cv::Mat *image = &src;
 
     // check if we need to resize the input image before applying it to the network
+    // the resized image is kept, so cv::resize only allocates when the size changes
     if( scale_factor != 1.0 ) {
-      cv::resize( src, tmp, cv::Size(), scale_factor, scale_factor );
-    }
-    else {
-      tmp = src;
+      cv::resize( src, this->resized_, cv::Size(), scale_factor, scale_factor );
+      image = &this->resized_;
     }
 
-    // check if we need to allocate memory for the input tensor
-    if( tmp.rows != this->height_ || tmp.cols != this->width_ ) {
-      this->height_ = tmp.rows; // tmp is the image being applied to the network
-      this->width_ = tmp.cols;
+    // check if we need to make a new input tensor
+    if( image->rows != this->height_ || image->cols != this->width_ ) {
+      this->height_ = image->rows; // image is the one being applied to the network
+      this->width_ = image->cols;
 
-      if(this->input_data != NULL) {
-	delete[] this->input_data;
+      // the input buffer only grows, a smaller image uses the front of it
+      const size_t input_size = (size_t)this->height_ * this->width_ * 3;
+      if( this->input_data_.size() < input_size ) {
+	this->input_data_.resize( input_size );
       }
-      
-      // allocate the image data
-      this->input_data = new float[this->height_ * this->width_ * 3];
       this->input_shape_[2] = this->height_;
       this->input_shape_[3] = this->width_;
 
@@ -116,26 +115,15 @@ public:
       // if using cuda, this is one thing that needs to change
       // auto cuda_mem_info = Ort::MemoryInfo( "cuda", OrtArenaAllocator, OrtMemTypeDefault);
       this->input_tensor_ = Ort::Value::CreateTensor<float>(memory_info,
-							    this->input_data,
-							    this->height_ * this->width_ * 3,
+							    this->input_data_.data(),
+							    input_size,
 							    this->input_shape_.data(),
 							    this->input_shape_.size());
     }
 
-    // copy the data over to the input tensor data
+    // convert the pixels to the input tensor data in one pass
     // remember, the input data uses a plane representation per color channel, not interleaved
-    const int image_size = this->height_ * this->width_;
-    for(int i=0;i<tmp.rows;i++) {
-      cv::Vec3b *ptr = tmp.ptr<cv::Vec3b>(i);
-      float *fptrR = &(this->input_data[i*this->width_]);
-      float *fptrG = &(this->input_data[image_size + i*this->width_]);
-      float *fptrB = &(this->input_data[image_size*2 + i*this->width_]);
-      for(int j=0;j<tmp.cols;j++) {
-	fptrR[j] = ((ptr[j][2]/255.0) - 0.485) / 0.229;
-	fptrG[j] = ((ptr[j][1]/255.0) - 0.456) / 0.224;
-	fptrB[j] = ((ptr[j][0]/255.0) - 0.406) / 0.225;
-      }
-    }
+    imagenet_planar_rgb( *image, this->input_data_.data() );
 
     // all set to run
     return(0);
@@ -163,29 +151,19 @@ public:
 
     // get the output data
     const float *tensorData = outputTensor[0].GetTensorData<float>();
-    static cv::Mat tmp( out_height_, out_width_, CV_8UC1 ); // might as well re-use it if possible
-
-    // get the min and max of the output tensor and copy to a temporary cv::Mat
-    float max = -1e+6;
-    float min = 1e+6;
-    for(int i=0;i<out_height_*out_width_;i++) {
-      const float value = tensorData[i];
-      min = value < min ? value : min;
-      max = value > max ? value : max;
-    }
+    const size_t output_count = (size_t)out_height_ * out_width_;
+
+    // get the min and max of the output tensor in one pass
+    float min, max;
+    tensor_min_max( tensorData, output_count, min, max );
 
-    // copy the normalized data over to a temporary cv::Mat
+    // scale the data into a cv::Mat kept between calls, reallocated only when the output size changes
     // note that there is a little bit of a shift of the depth data to the right
-    for(int i=0,k=0;i<out_height_;i++) {
-      unsigned char *ptr = tmp.ptr<unsigned char>(i);
-      for(int j=0;j<out_width_;j++, k++) {
-	float value = 255 * (tensorData[k] - min) / (max - min);
-	ptr[j] = value > 255.0 ? (unsigned char)255 : (unsigned char)value;
-      }
-    }
-    
+    this->depth_.create( out_height_, out_width_, CV_8UC1 );
+    tensor_to_u8( tensorData, output_count, min, max, this->depth_.ptr<unsigned char>(0) );
+
     // rescale the output to the output size
-    cv::resize( tmp, dst, output_size);
+    cv::resize( this->depth_, dst, output_size);
 
     // outputTensor should de-allocate here automatically
     
@@ -212,29 +190,13 @@ public:
 
         // get the output data
         const float *tensorData = outputTensor[0].GetTensorData<float>();
-        static cv::Mat tmp(out_height_, out_width_, CV_32FC1); // Store as floating point to preserve depth accuracy
-
-        // find the min and max depth values to scale correctly (this step might still be useful for understanding depth range)
-        float max = -1e+6;
-        float min = 1e+6;
-        for (int i = 0; i < out_height_ * out_width_; i++) {
-            const float value = tensorData[i];
-            min = value < min ? value : min;
-            max = value > max ? value : max;
-        }
-
-        // Copy the depth data (no normalization to 255 here)
-        for (int i = 0, k = 0; i < out_height_; i++) {
-            float* ptr = tmp.ptr<float>(i);
-            for (int j = 0; j < out_width_; j++, k++) {
-                // Directly store the depth value
-                ptr[j] = tensorData[k];  // Already in floating point, scale to meters if necessary
-            }
-        }
 
+        // Wrap the depth data without copying it (no normalization to 255 here)
+        // Floating point preserves depth accuracy
+        cv::Mat depth(out_height_, out_width_, CV_32FC1, const_cast<float *>(tensorData));
 
-        // Rescale the output to the output size
-        cv::resize(tmp, dst, output_size);
+        // Rescale the output to the output size, this also copies it out of the tensor
+        cv::resize(depth, dst, output_size);
 
         return 0;
     }
@@ -259,7 +221,9 @@ private:
   Ort::Session *session_;
 
   // input data and input tensor variables
-  float *input_data = NULL;
+  std::vector<float> input_data_; // grows to the largest input seen, never shrinks
+  cv::Mat resized_;               // input resized by scale_factor
+  cv::Mat depth_;                 // 8-bit output before resizing
   Ort::Value input_tensor_{nullptr};
   std::array<int64_t, 4> input_shape_{1, 3, height_, width_ }; // batch, channel, height, width: 3-channel color image
   
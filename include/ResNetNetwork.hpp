@@ -0,0 +1,137 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: A wrapper for a ResNet-style embedding network run in batches with the ONNX Runtime API,
+ * modeled on DA2Network
+ */
+
+#ifndef PROJ2_RESNET_NETWORK_HPP
+#define PROJ2_RESNET_NETWORK_HPP
+
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <onnxruntime_cxx_api.h>
+#include <opencv2/opencv.hpp>
+#include "image_tensor.h"
+
+// Side of the square image the network takes
+#define RESNET_INPUT_SIZE 224
+// Images run through the network at once
+#define RESNET_MAX_BATCH 16
+
+/*
+  Runs images through an embedding network with a dynamic batch axis, e.g.
+  ResNet18 exported up to its average pool. Each image is resized to
+  RESNET_INPUT_SIZE square, converted to planar RGB with the ImageNet mean
+  and deviation, and written into its slot of one input buffer allocated
+  for the whole batch, so no memory is allocated per image. The output of
+  each image is flattened, [batch, 512] and [batch, 512, 1, 1] both give
+  512 floats per image, the layout of ResNet18_olym.csv.
+
+  A network exported with a fixed batch of 1 works with max_batch 1.
+*/
+class ResNetNetwork {
+public:
+    // network path and layer names, use Netron.app to look them up
+    explicit ResNetNetwork(const char *network_path, const char *input_layer_name = "input",
+                           const char *output_layer_name = "output", int max_batch = RESNET_MAX_BATCH) {
+        std::strncpy(network_path_, network_path, 255);
+        std::strncpy(input_names_, input_layer_name, 255);
+        std::strncpy(output_names_, output_layer_name, 255);
+        max_batch_ = max_batch > 0 ? max_batch : 1;
+
+        Ort::SessionOptions options;
+        options.SetGraphOptimizationLevel(ORT_ENABLE_ALL);
+        session_.reset(new Ort::Session(env_, network_path, options));
+
+        // one planar RGB image per batch slot, allocated once
+        input_data_.assign(static_cast<size_t>(max_batch_) * image_floats(), 0.0f);
+    }
+
+    ResNetNetwork(const ResNetNetwork &) = delete;
+    ResNetNetwork &operator=(const ResNetNetwork &) = delete;
+
+    int max_batch() const { return max_batch_; }
+    int pending() const { return batch_; }
+    bool full() const { return batch_ >= max_batch_; }
+
+    // Drops the images added since the last run, e.g. after a run threw
+    void clear() { batch_ = 0; }
+
+    // Adds a BGR image read with cv::imread to the next batch, non-zero if the batch is full
+    int add_input(const cv::Mat &src) {
+        if (full() || src.empty() || src.type() != CV_8UC3) {
+            return -1;
+        }
+        const cv::Mat *image = &src;
+        if (src.rows != RESNET_INPUT_SIZE || src.cols != RESNET_INPUT_SIZE) {
+            cv::resize(src, resized_, cv::Size(RESNET_INPUT_SIZE, RESNET_INPUT_SIZE));
+            image = &resized_;
+        }
+
+        // planes of R, G and B, normalized with the ImageNet statistics like DA2Network
+        imagenet_planar_rgb(*image, &input_data_[static_cast<size_t>(batch_) * image_floats()]);
+        batch_++;
+        return 0;
+    }
+
+    // Runs the images added since the last run, embeddings[i] is the i-th image added
+    int run_batch(std::vector<std::vector<float>> &embeddings) {
+        embeddings.resize(batch_);
+        if (batch_ == 0) {
+            return 0;
+        }
+
+        // the tensor only wraps the first batch_ slots of the buffer
+        std::array<int64_t, 4> input_shape = {batch_, 3, RESNET_INPUT_SIZE, RESNET_INPUT_SIZE};
+        auto memory_info = Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+        Ort::Value input_tensor = Ort::Value::CreateTensor<float>(memory_info, input_data_.data(),
+                                                                  static_cast<size_t>(batch_) * image_floats(),
+                                                                  input_shape.data(), input_shape.size());
+        Ort::RunOptions run_options;
+        const char *input_names[] = {input_names_};
+        const char *output_names[] = {output_names_};
+        auto outputTensor = session_->Run(run_options, input_names, &input_tensor, 1, output_names, 1);
+
+        // every dimension after the batch is part of the embedding
+        std::vector<int64_t> shape = outputTensor[0].GetTensorTypeAndShapeInfo().GetShape();
+        size_t size = 1;
+        for (size_t d = 1; d < shape.size(); d++) size *= static_cast<size_t>(shape[d]);
+        const float *tensorData = outputTensor[0].GetTensorData<float>();
+        if (shape.empty() || shape[0] != batch_ || tensorData == nullptr) {
+            std::cerr << "Unexpected output from " << network_path_ << std::endl;
+            batch_ = 0;
+            return -1;
+        }
+        for (int b = 0; b < batch_; b++) {
+            embeddings[b].assign(tensorData + b * size, tensorData + (b + 1) * size);
+        }
+        batch_ = 0;
+        return 0;
+    }
+
+private:
+    static size_t image_floats() { return static_cast<size_t>(3) * RESNET_INPUT_SIZE * RESNET_INPUT_SIZE; }
+
+    // network path and input/output layer names
+    char network_path_[256];
+    char input_names_[256];
+    char output_names_[256];
+
+    // batch slots in use and available
+    int batch_ = 0;
+    int max_batch_ = RESNET_MAX_BATCH;
+
+    std::vector<float> input_data_; // max_batch_ planar images
+    cv::Mat resized_;               // reused resize target
+
+    // ORT variables
+    Ort::Env env_;
+    std::unique_ptr<Ort::Session> session_;
+};
+
+#endif //PROJ2_RESNET_NETWORK_HPP
@@ -0,0 +1,55 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 14, 2025
+ * Purpose: Top N matching of many targets at once for the dot-product metrics
+ */
+
+#ifndef PROJ2_BATCH_SEARCH_H
+#define PROJ2_BATCH_SEARCH_H
+
+#include "feature_table.h"
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Metrics that reduce to dot products between the queries and the table rows
+enum class BatchMetric {
+    COSINE, // 1 - a.b on L2-normalized rows
+    SSD     // sqrt(||a||^2 + ||b||^2 - 2 a.b), same value as calculate_ssd
+};
+
+/**
+ * @brief Finds the N best rows of a table for each of Q query rows.
+ *
+ * The Q x rows distance matrix is computed in cache-sized tiles of queries
+ * and table rows, like a matrix multiply, and each query keeps its own
+ * bounded top N. Query tiles are spread over the worker threads.
+ *
+ * Distances match calculate_cosine_distance and calculate_ssd up to float
+ * rounding, rows with a zero norm are at cosine distance 1.
+ *
+ * @param table Candidate rows.
+ * @param queries Q query rows back to back, table.dim floats each.
+ * @param num_queries Number of query rows Q.
+ * @param exclude Row index to leave out for each query (usually its own row), nullptr for none.
+ * @param N Number of matches to keep per query.
+ * @param metric Distance metric.
+ * @param num_threads Worker threads, 0 uses every core.
+ * @param results results[q] holds the (distance, row index) pairs of query q, best first.
+ * @return non-zero failure.
+ */
+int batch_topN(const FeatureTable &table, const float *queries, size_t num_queries, const int *exclude,
+               int N, BatchMetric metric, int num_threads,
+               std::vector<std::vector<std::pair<float, int>>> &results);
+
+/**
+ * @brief Runs batch_topN with rows of the table itself as the queries.
+ *
+ * @param table Candidate rows, also the source of the queries.
+ * @param query_rows Rows of the table to use as queries, each one excluded from its own result.
+ * @return non-zero failure.
+ */
+int batch_topN_rows(const FeatureTable &table, const std::vector<int> &query_rows, int N, BatchMetric metric,
+                    int num_threads, std::vector<std::vector<std::pair<float, int>>> &results);
+
+#endif //PROJ2_BATCH_SEARCH_H
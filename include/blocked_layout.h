@@ -0,0 +1,161 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 18, 2025
+ * Purpose: Transposed block layout that puts one candidate per SIMD lane
+ */
+
+#ifndef PROJ2_BLOCKED_LAYOUT_H
+#define PROJ2_BLOCKED_LAYOUT_H
+
+#include "feature_arena.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+/*
+  The rows of a table are cut into blocks of LANES candidates. Inside a
+  block the values are stored column by column, so column d of all LANES
+  candidates sits in LANES consecutive floats:
+
+      block b, column d, lane l  ->  values[(b * dim + d) * LANES + l]
+
+  A kernel walks the columns once and updates LANES independent sums, one
+  per candidate. The compiler maps the lane loop onto SIMD registers and no
+  horizontal reduction is needed at the end. The last block is padded with
+  zero rows whose scores are ignored.
+ */
+struct BlockedFeatures {
+    int lanes = 0;              // 8 or 16, 0 while the layout is not built
+    size_t num_blocks = 0;
+    FeatureValues values;       // num_blocks * dim * lanes floats
+
+    const float *block(size_t b, int dim) const { return values.data() + b * dim * lanes; }
+};
+
+// Prefetch the next block while the current one is being scored
+#if defined(__GNUC__) || defined(__clang__)
+#define LAYOUT_PREFETCH(ptr) __builtin_prefetch((ptr), 0, 1)
+#else
+#define LAYOUT_PREFETCH(ptr) ((void)(ptr))
+#endif
+
+/*
+  Lane kernels. Each one scores the LANES candidates of a block against the
+  target and writes LANES scores to out. next is the following block (or
+  nullptr), which is prefetched one column ahead of use. The sums run over
+  the columns in the same order as the row kernels in distance_calculate.cpp,
+  so the scores match them (up to FMA contraction when it is enabled).
+ */
+
+// Euclidean distance, same as calculate_ssd
+template <int LANES>
+void lanes_ssd(const float *block, const float *next, const float *target, int dim, float *out) {
+    float acc[LANES] = {0};
+    for (int d = 0; d < dim; d++) {
+        if (next != nullptr) LAYOUT_PREFETCH(next + d * LANES);
+        const float *col = block + d * LANES;
+        const float t = target[d];
+        for (int l = 0; l < LANES; l++) {
+            float diff = col[l] - t;
+            acc[l] += diff * diff;
+        }
+    }
+    for (int l = 0; l < LANES; l++) out[l] = std::sqrt(acc[l]);
+}
+
+// Histogram intersection over columns [begin, end), same as calculate_histogramIntersection
+template <int LANES>
+void lanes_intersection(const float *block, const float *next, const float *target, int begin, int end, float *out) {
+    float acc[LANES] = {0};
+    for (int d = begin; d < end; d++) {
+        if (next != nullptr) LAYOUT_PREFETCH(next + d * LANES);
+        const float *col = block + d * LANES;
+        const float t = target[d];
+        for (int l = 0; l < LANES; l++) {
+            acc[l] += std::min(col[l], t);
+        }
+    }
+    for (int l = 0; l < LANES; l++) out[l] = acc[l];
+}
+
+// Two half-histograms, same as calculate_multiHist_distance and calculate_textureColor_distance
+template <int LANES>
+void lanes_two_halves(const float *block, const float *next, const float *target, int dim, float *out) {
+    int mid = dim / 2;
+    float first[LANES], second[LANES];
+    lanes_intersection<LANES>(block, next, target, 0, mid, first);
+    lanes_intersection<LANES>(block, next, target, mid, dim, second);
+    for (int l = 0; l < LANES; l++) out[l] = 0.5f * (1 - first[l]) + 0.5f * (1 - second[l]);
+}
+
+// Dot product, 1 - dot product is the cosine distance of unit rows
+template <int LANES>
+void lanes_dot(const float *block, const float *next, const float *target, int dim, float *out) {
+    float acc[LANES] = {0};
+    for (int d = 0; d < dim; d++) {
+        if (next != nullptr) LAYOUT_PREFETCH(next + d * LANES);
+        const float *col = block + d * LANES;
+        const float t = target[d];
+        for (int l = 0; l < LANES; l++) {
+            acc[l] += col[l] * t;
+        }
+    }
+    for (int l = 0; l < LANES; l++) out[l] = acc[l];
+}
+
+// Cosine distance from the three sums kept by the cosine kernels
+inline float cosine_from_sums(float dotProduct, float norm1, float norm2) {
+    if (norm1 == 0.0f || norm2 == 0.0f) return 1.0f;
+    return 1.0f - dotProduct / (std::sqrt(norm1) * std::sqrt(norm2));
+}
+
+// Cosine distance, same as calculate_cosine_distance
+template <int LANES>
+void lanes_cosine(const float *block, const float *next, const float *target, int dim, float *out) {
+    float dots[LANES] = {0}, norms1[LANES] = {0}, norm2 = 0.0f;
+    for (int d = 0; d < dim; d++) {
+        if (next != nullptr) LAYOUT_PREFETCH(next + d * LANES);
+        const float *col = block + d * LANES;
+        const float t = target[d];
+        for (int l = 0; l < LANES; l++) {
+            dots[l] += col[l] * t;
+            norms1[l] += col[l] * col[l];
+        }
+        norm2 += t * t;
+    }
+    for (int l = 0; l < LANES; l++) out[l] = cosine_from_sums(dots[l], norms1[l], norm2);
+}
+
+// Cosine distance that leaves out the leading face flag when both rows have a face, same as calculate_face_distance
+template <int LANES>
+void lanes_face(const float *block, const float *next, const float *target, int dim, float *out) {
+    // Sums over the whole row and over the row without the flag, in one pass
+    float dots[LANES], norms1[LANES], norm2 = target[0] * target[0];
+    float sub_dots[LANES] = {0}, sub_norms1[LANES] = {0}, sub_norm2 = 0.0f;
+    for (int l = 0; l < LANES; l++) {
+        dots[l] = block[l] * target[0];
+        norms1[l] = block[l] * block[l];
+    }
+    for (int d = 1; d < dim; d++) {
+        if (next != nullptr) LAYOUT_PREFETCH(next + d * LANES);
+        const float *col = block + d * LANES;
+        const float t = target[d];
+        for (int l = 0; l < LANES; l++) {
+            dots[l] += col[l] * t;
+            norms1[l] += col[l] * col[l];
+            sub_dots[l] += col[l] * t;
+            sub_norms1[l] += col[l] * col[l];
+        }
+        norm2 += t * t;
+        sub_norm2 += t * t;
+    }
+    bool target_face = target[0] > 0.5f;
+    for (int l = 0; l < LANES; l++) {
+        bool both = target_face && block[l] > 0.5f;
+        out[l] = both ? cosine_from_sums(sub_dots[l], sub_norms1[l], sub_norm2)
+                      : cosine_from_sums(dots[l], norms1[l], norm2);
+    }
+}
+
+#endif //PROJ2_BLOCKED_LAYOUT_H
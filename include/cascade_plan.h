@@ -0,0 +1,71 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Multi-stage cascade queries, each stage re-ranking the survivors of the previous one
+ */
+
+#ifndef PROJ2_CASCADE_PLAN_H
+#define PROJ2_CASCADE_PLAN_H
+
+#include "feature_table.h"
+#include "image_search.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct CascadeStage {
+    std::string metric;       // ssd, rgb-hist, multi-hist, texture-color, cosine or face
+    std::string feature_file; // table the stage scores
+    int keep;                 // candidates passed on, 0 keeps N on the last stage
+};
+
+/*
+  A cascade and the tables its stages loaded. The first stage loads its
+  whole table and scores every image; each later stage only reads the rows
+  of the candidates that reached it (see read_feature_table_rows), so an
+  expensive table such as the embeddings is never parsed in full. Matches
+  point into the tables, so the plan must outlive them.
+ */
+struct CascadePlan {
+    std::vector<CascadeStage> stages;
+    std::vector<FeatureTable> tables; // filled by run_cascade, one per stage
+};
+
+// What one stage did
+struct CascadeStageReport {
+    size_t candidates_in = 0;  // images scored, the whole collection for the first stage
+    size_t rows_loaded = 0;    // rows read from the stage's feature file
+    size_t candidates_out = 0; // images passed on
+    double load_ms = 0.0;
+    double search_ms = 0.0;
+};
+
+/**
+ * @brief Reads a cascade plan file.
+ *
+ * Each line holds a stage: a metric, its feature file and the number of
+ * candidates it keeps, e.g. "texture-color ../data/feature_vector_4.csv 200".
+ * The last stage may leave the count out to keep the N of the query. Empty
+ * lines and lines starting with '#' are skipped.
+ *
+ * @param plan_file Path of the plan file.
+ * @param plan Output plan.
+ * @return non-zero on failure.
+ */
+int load_cascade_plan(const char *plan_file, CascadePlan &plan);
+
+/**
+ * @brief Runs a cascade for a target image.
+ *
+ * @param plan Plan, its tables are (re)loaded for this query.
+ * @param target_image_filename Target image, must be in every stage's feature file.
+ * @param N Number of matches of the last stage.
+ * @param matches Output matches, scored and named by the last stage.
+ * @param report Output report of every stage.
+ * @param num_threads Search threads, 0 uses every core.
+ * @return non-zero on failure.
+ */
+int run_cascade(CascadePlan &plan, char *target_image_filename, int N, std::vector<Match> &matches,
+                std::vector<CascadeStageReport> &report, int num_threads);
+
+#endif //PROJ2_CASCADE_PLAN_H
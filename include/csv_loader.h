@@ -0,0 +1,59 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Parallel reader of feature CSV files mapped into memory
+ */
+
+#ifndef PROJ2_CSV_LOADER_H
+#define PROJ2_CSV_LOADER_H
+
+#include "feature_table.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Metadata line marking a file of unit-length rows
+#define NORMALIZED_TAG "#normalized=l2"
+
+// A line of a feature file that was left out of the table
+struct CsvRowError {
+    size_t line;         // 1-based line number in the file
+    std::string message; // what is wrong with it
+};
+
+/**
+ * @brief Parses the values of one feature row with std::from_chars.
+ *
+ * @param values First char after the filename's comma.
+ * @param end End of the line, a trailing '\r' is ignored.
+ * @param dim Number of values expected.
+ * @param out Output, dim floats.
+ * @return Empty if the row is well formed, else what is wrong with it.
+ */
+std::string parse_feature_row(const char *values, const char *end, int dim, float *out);
+
+/**
+ * @brief Reads a feature CSV file into a FeatureTable on a pool of threads.
+ *
+ * The file is mapped into memory instead of read a character at a time.
+ * A first pass splits it into newline-aligned chunks and finds where every
+ * row starts; rows are then ordered by filename, so the whole matrix is
+ * allocated once and every row is parsed with std::from_chars straight into
+ * its final place. The width of the table is the number of values of the
+ * first row.
+ *
+ * Rows with a different number of values or a field that is not a number
+ * are left out and reported instead of loading whatever atof made of them.
+ * Lines starting with '#' are metadata; "#normalized=l2" marks the table as
+ * normalized. Row norms are not computed here.
+ *
+ * @param filename Feature CSV file.
+ * @param table Output table, rows sorted by filename and indexed.
+ * @param num_threads Parsing threads, 0 uses every core.
+ * @param errors Optional output, the rows that were left out in file order.
+ * @return non-zero if the file can not be read or two rows name the same image.
+ */
+int load_feature_csv(const char *filename, FeatureTable &table, int num_threads,
+                     std::vector<CsvRowError> *errors = nullptr);
+
+#endif //PROJ2_CSV_LOADER_H
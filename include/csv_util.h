@@ -41,6 +41,8 @@ int append_image_data_csv( char *filename, char *image_filename, std::vector<flo
   If echo_file is true, it prints out the contents of the file as read
   into memory.
 
+  Lines starting with '#' hold file metadata and are skipped.
+
   The function returns a non-zero value if something goes wrong.
  */
 int read_image_data_csv( char *filename, std::vector<char *> &filenames, std::vector<std::vector<float>> &data, int echo_file = 0 );
@@ -15,6 +15,8 @@
  * @return float SSD value.
  */
 float calculate_ssd(std::vector<float>& v1, std::vector<float>& v2);
+// Same as above on n floats read in place from two rows
+float calculate_ssd(const float *v1, const float *v2, int n);
 /**
  * @brief Computes the histogram intersection between two normalized histograms.
  *
@@ -23,6 +25,7 @@ float calculate_ssd(std::vector<float>& v1, std::vector<float>& v2);
  * @return float Histogram intersection value.
  */
 float calculate_histogramIntersection(std::vector<float>& hist1, std::vector<float>& hist2);
+float calculate_histogramIntersection(const float *hist1, const float *hist2, int n);
 
 /**
  * @brief Computes the Cosine Distance between two feature vectors.
@@ -32,11 +35,19 @@ float calculate_histogramIntersection(std::vector<float>& hist1, std::vector<flo
  * @return Cosine Distance in the range [0, 1], where 0 means identical vectors.
  */
 float calculate_cosine_distance(std::vector<float>& vec1, std::vector<float>& vec2);
+float calculate_cosine_distance(const float *vec1, const float *vec2, int n);
 
-
-// Function to normalize a vector using L2 normalization (used in cosine distance)
-//  * @param vec Vector to normalize.
-// void l2_norm(std::vector<float>& vec);
+/**
+ * @brief Computes the dot product of two rows.
+ *
+ * On rows normalized to unit length, 1 - dot product is the cosine distance.
+ *
+ * @param vec1 First feature row.
+ * @param vec2 Second feature row.
+ * @param n Length of both rows.
+ * @return float Dot product.
+ */
+float calculate_dot_product(const float *vec1, const float *vec2, int n);
 
 
 // Function to calculate distance between two concatenated histograms
@@ -44,12 +55,22 @@ float calculate_cosine_distance(std::vector<float>& vec1, std::vector<float>& ve
 //  * @param hist2 Second concatenated histogram.
 //  * @return float Distance value.
 float calculate_multiHist_distance(std::vector<float> &hist1, std::vector<float> &hist2);
+float calculate_multiHist_distance(const float *hist1, const float *hist2, int n);
 
 // Function to calculate distance between two texture-color histograms
 //  * @param hist1 First texture-color histogram.
 //  * @param hist2 Second texture-color histogram.
 //  * @return float Distance value.
 float calculate_textureColor_distance(std::vector<float>& hist1, std::vector<float>& hist2);
+float calculate_textureColor_distance(const float *hist1, const float *hist2, int n);
+
+// Function to calculate cosine distance between two rows with a leading face flag
+// If both rows have a face the flag is left out, otherwise the whole row is compared
+//  * @param vec1 First feature row.
+//  * @param vec2 Second feature row.
+//  * @param n Length of both rows.
+//  * @return float Distance value.
+float calculate_face_distance(const float *vec1, const float *vec2, int n);
 
 #endif //PROJ2_DISTANCE_CALCULATE_H
 
@@ -0,0 +1,87 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Aligned float storage and a string arena owned by a feature table
+ */
+
+#ifndef PROJ2_FEATURE_ARENA_H
+#define PROJ2_FEATURE_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Alignment of feature buffers, one cache line and the widest SIMD load
+#define FEATURE_ALIGN 64
+
+/**
+ * @brief Allocator handing out FEATURE_ALIGN-aligned memory, so row 0 of a
+ * table and every block of a blocked layout start on a cache line.
+ */
+template <typename T>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U> &) {}
+
+    // posix_memalign rather than aligned operator new, which older macOS runtimes lack
+    T *allocate(size_t n) {
+        void *p = nullptr;
+        if (posix_memalign(&p, FEATURE_ALIGN, std::max<size_t>(n * sizeof(T), 1)) != 0) throw std::bad_alloc();
+        return static_cast<T *>(p);
+    }
+    void deallocate(T *p, size_t) { free(p); }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U> &) const { return false; }
+};
+
+// Contiguous aligned float buffer of a table
+typedef std::vector<float, AlignedAllocator<float>> FeatureValues;
+
+/**
+ * @brief Pool of NUL-terminated strings in fixed-size blocks.
+ *
+ * Blocks never move, so a string stays put while more are added and when
+ * the arena itself is moved; everything is freed at once with the arena.
+ * Like the ImageRegistry pool, but without a lock: a table fills its arena
+ * on one thread, or reserves the bytes up front and hands out the pieces.
+ */
+class NameArena {
+public:
+    NameArena() = default;
+    NameArena(NameArena &&) = default;
+    NameArena &operator=(NameArena &&) = default;
+    NameArena(const NameArena &) = delete;
+    NameArena &operator=(const NameArena &) = delete;
+
+    // Uninitialized bytes that never move, a block of their own if they do not fit the current one
+    char *allocate(size_t bytes);
+
+    // Copy of the first length chars of name, NUL terminated
+    char *store(const char *name, size_t length);
+
+    // Copy of a NUL-terminated name
+    char *store(const char *name);
+
+    // Frees every string
+    void clear();
+
+    // Bytes held by the blocks
+    size_t capacity() const { return capacity_; }
+
+private:
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    size_t block_used_ = 0; // bytes used in the last block
+    size_t block_size_ = 0; // bytes of the last block
+    size_t capacity_ = 0;
+};
+
+#endif //PROJ2_FEATURE_ARENA_H
@@ -11,6 +11,8 @@
 #include <opencv2/opencv.hpp>
 // Feature extraction function type
 typedef int (*FeatureFunction)(char*, std::vector<float>&);
+// Same extraction from an image already in memory, e.g. decoded from an upload
+typedef int (*ImageFeatureFunction)(const cv::Mat&, std::vector<float>&);
 
 // Different feature types
 enum class FeatureType {
@@ -20,11 +22,19 @@ enum class FeatureType {
     TEXTURE_COLOR,
     DEPTH,
     BANANA,
-    FACE
+    FACE,
+    RESNET
 };
 
 // Helper function to get feature function based on type
 FeatureFunction getFeatureFunction(FeatureType type);
+// Helper function to get the in-memory feature function based on type
+ImageFeatureFunction getImageFeatureFunction(FeatureType type);
+
+/*
+  Every extractor below also has an overload taking a decoded BGR image
+  instead of a filename. The filename versions read the image and call it.
+*/
 
 /*
   Given an image filename and a reference to a vector to store image features,
@@ -34,6 +44,7 @@ FeatureFunction getFeatureFunction(FeatureType type);
   The function returns a non-zero value in case of an error (e.g., image load failure).
 */
 int get7x7square(char *image_filename, std::vector<float> &image_data);
+int get7x7square(const cv::Mat &image, std::vector<float> &image_data);
 /**
  * @brief Calculates a 3D RGB color histogram for an image.
  *
@@ -42,6 +53,7 @@ int get7x7square(char *image_filename, std::vector<float> &image_data);
  * @return non-zero failure.
  */
 int calculateRGBHistogram(char *image_filename, std::vector<float>& hist);
+int calculateRGBHistogram(const cv::Mat &image, std::vector<float> &hist);
 
 /**
  * @brief Calculates a 3D RGB color histogram for an image.
@@ -51,15 +63,42 @@ int calculateRGBHistogram(char *image_filename, std::vector<float>& hist);
  * @return non-zero failure.
  */
 int getMultiHistogramFeature(char *image_filename, std::vector<float> &image_data);
+int getMultiHistogramFeature(const cv::Mat &image, std::vector<float> &image_data);
 
 int getTextureColorFeature(char* image_filename, std::vector<float>& feature);
+int getTextureColorFeature(const cv::Mat &image, std::vector<float> &feature);
 // Function to extract combined RGB and texture features using DA2 depth map
 // Compute mask based on depth closeness (50% range around median)
 int getTextureColorFeatureWithDepth(char* image_filename, std::vector<float>& feature);
+int getTextureColorFeatureWithDepth(const cv::Mat &image, std::vector<float> &feature);
 // Compute spatial variance of yellow regions
 int getBananaFeature(char *image_filename, std::vector<float>& feature);
+int getBananaFeature(const cv::Mat &image, std::vector<float> &feature);
 
 
 int getTextureColorFeatureWithFaceMask(char* image_filename, std::vector<float>& feature);
+int getTextureColorFeatureWithFaceMask(const cv::Mat &image, std::vector<float> &feature);
+
+/**
+ * @brief Calculates the ResNet18 embedding of an image in-process, the layout of ResNet18_olym.csv.
+ *
+ * @param image Input image filename.
+ * @param embedding The embedding, one float per output of the network.
+ * @return non-zero failure.
+ */
+int getResNetEmbedding(char *image_filename, std::vector<float> &embedding);
+int getResNetEmbedding(const cv::Mat &image, std::vector<float> &embedding);
+
+/**
+ * @brief Calculates the ResNet18 embeddings of several decoded images, RESNET_MAX_BATCH per network run.
+ *
+ * Safe to call from several threads, which take turns on the one network.
+ * A model that can not be loaded or run is reported and fails the call.
+ *
+ * @param images Input BGR images.
+ * @param embeddings Output embeddings, one per image in the same order.
+ * @return non-zero failure.
+ */
+int getResNetEmbeddings(const std::vector<cv::Mat> &images, std::vector<std::vector<float>> &embeddings);
 
 #endif //PROJ2_FEATURE_CALCULATE_H
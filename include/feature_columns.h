@@ -0,0 +1,92 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Binary feature files storing each named column group of the rows separately
+ */
+
+#ifndef PROJ2_FEATURE_COLUMNS_H
+#define PROJ2_FEATURE_COLUMNS_H
+
+#include "feature_table.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Suffix of a column file; "<file>.fcol:<group>,<group>" selects groups wherever a feature file is read
+#define COLUMN_FILE_SUFFIX ".fcol"
+// Width of the 8x8x8 RGB histogram that starts the texture-color and face rows
+#define COLOR_GROUP_WIDTH 512
+// Longest group or layout name, including the terminating NUL
+#define COLUMN_NAME_BYTES 16
+
+// Columns [first, first + width) of every row, stored as one block of the file
+struct ColumnGroup {
+    std::string name;
+    int first = 0;
+    int width = 0;
+};
+
+/**
+ * @brief Splits rows of dim floats into the column groups of a feature layout.
+ *
+ * texture-color: color (COLOR_GROUP_WIDTH bins), texture (the rest)
+ * face:          face_flag (1), color, texture
+ * banana:        blob_hist (all but the last), blob_total (1)
+ * plain:         values (every column)
+ *
+ * @param layout Layout name.
+ * @param dim Floats per row.
+ * @param groups Output groups, in column order.
+ * @return non-zero if the layout is unknown or the rows are too short for it.
+ */
+int column_layout(const std::string &layout, int dim, std::vector<ColumnGroup> &groups);
+
+// Names of all layouts, comma separated
+std::string column_layout_names();
+
+// True if a feature file path names a column file, with or without a group selector
+bool is_column_file(const char *path);
+
+/**
+ * @brief Writes a table as a column file.
+ *
+ * Each group is a row-major block of rows * width floats starting on a page
+ * boundary, so a reader maps and touches only the blocks it selects. The
+ * names come first, in the sorted row order of the table.
+ *
+ * @param filename Output file, overwritten.
+ * @param table Table to write.
+ * @param layout Layout splitting the rows into groups, see column_layout.
+ * @return non-zero failure.
+ */
+int write_feature_columns(const char *filename, const FeatureTable &table, const std::string &layout);
+
+/**
+ * @brief Lists the groups of a column file.
+ *
+ * @param filename Column file, without a group selector.
+ * @param groups Output groups in column order.
+ * @param rows Output number of rows.
+ * @param layout Output layout name.
+ * @return non-zero failure.
+ */
+int list_feature_columns(const char *filename, std::vector<ColumnGroup> &groups, size_t &rows, std::string &layout);
+
+/**
+ * @brief Reads the selected column groups of a column file into a table.
+ *
+ * "<file>.fcol:texture" loads only the texture columns and "<file>.fcol"
+ * every group; selected groups are concatenated in the order given. Only
+ * the selected blocks are mapped, and of those only the pages of the
+ * wanted rows are read. A normalized file stays normalized only when every
+ * group is loaded.
+ *
+ * @param path Column file with an optional ":group,group" selector.
+ * @param wanted image_registry() IDs of the rows to read, matched as find_table_row does; nullptr reads every row.
+ * @param table Output table sorted by filename.
+ * @param l2_normalize If true, rows that are not normalized yet are scaled to unit length.
+ * @return non-zero failure.
+ */
+int read_feature_columns(const char *path, const std::vector<int> *wanted, FeatureTable &table, int l2_normalize);
+
+#endif //PROJ2_FEATURE_COLUMNS_H
@@ -0,0 +1,197 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Append-only feature store of immutable segments with tombstones and compaction
+ */
+
+#ifndef PROJ2_FEATURE_STORE_H
+#define PROJ2_FEATURE_STORE_H
+
+#include "feature_table.h"
+#include "image_search.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Append segments that make the background compaction merge them into the base
+#define STORE_COMPACT_SEGMENTS 8
+// File listing the current segments, replaced by a rename on every write
+#define STORE_MANIFEST "MANIFEST"
+
+/**
+ * @brief One immutable file of a store: rows added by one write, or the
+ * compacted base, and the images the write deleted.
+ */
+struct StoreSegment {
+    std::string file;            // file name inside the store directory
+    uint64_t sequence = 0;       // order of the write, later segments win
+    bool base = false;           // written by a compaction, sorted by filename, no tombstones
+    FeatureTable table;          // rows, indexed
+    std::vector<int> tombstones; // image_registry() IDs deleted by the write
+};
+
+/**
+ * @brief What a reader sees of a store: a fixed list of segments.
+ *
+ * An image's live row is its row in the latest segment that wrote or
+ * deleted it, and owner maps every image ID to that segment. A snapshot is
+ * never changed after it is published, so a query keeps using the one it
+ * started with while writes and compactions publish new ones; the segments
+ * stay in memory for as long as a snapshot holds them.
+ */
+struct StoreSnapshot {
+    std::vector<std::shared_ptr<const StoreSegment>> segments; // base first, then oldest to newest
+    std::vector<int> owner; // per image ID the segment of its live row, -1 if deleted or never written
+    int dim = 0;
+    size_t live_rows = 0;
+
+    // True if row of segment s is the live row of its image
+    bool live(size_t s, size_t row) const {
+        int id = segments[s]->table.ids[row];
+        return static_cast<size_t>(id) < owner.size() && owner[id] == static_cast<int>(s);
+    }
+
+    // Segment and row of an image, false if the image is not in the store
+    bool find(const char *image_filename, size_t &segment, int &row) const;
+};
+
+// Segments and rows of a snapshot
+struct StoreStats {
+    size_t segments = 0;
+    size_t rows = 0;       // rows in all segments, live or not
+    size_t live_rows = 0;
+    size_t tombstones = 0;
+};
+
+/**
+ * @brief Directory of segment files and a MANIFEST naming the current ones.
+ *
+ * Every write is a new small segment file: add() writes the new rows,
+ * remove() writes tombstones. Nothing is rewritten, so a write costs the
+ * size of the change. Compaction merges the live rows of all segments into
+ * one base file sorted by filename and drops the rest; it runs on its own
+ * thread from a snapshot and only takes the write lock to publish the
+ * result, keeping any segment written meanwhile. Files and the manifest are
+ * written to a temporary name and renamed, so a crash leaves the last
+ * published state.
+ *
+ * Readers call snapshot() and never wait for writes, which only hold the
+ * snapshot lock to swap one pointer.
+ */
+class FeatureStore {
+public:
+    FeatureStore() = default;
+    FeatureStore(const FeatureStore &) = delete;
+    FeatureStore &operator=(const FeatureStore &) = delete;
+    ~FeatureStore();
+
+    /**
+     * @brief Opens a store directory, creating an empty store if it has no manifest.
+     *
+     * @param directory Store directory, must exist.
+     * @return non-zero failure.
+     */
+    int open(const std::string &directory);
+
+    /**
+     * @brief Adds or replaces the rows of a table as a new segment.
+     *
+     * @param rows Rows to write, same width as the store.
+     * @return non-zero failure.
+     */
+    int add(const FeatureTable &rows);
+
+    /**
+     * @brief Deletes images with a segment of tombstones.
+     *
+     * @param images Image paths in any of the feature file conventions.
+     * @return non-zero failure.
+     */
+    int remove(const std::vector<std::string> &images);
+
+    /**
+     * @brief Merges every segment of the current snapshot into a new base.
+     *
+     * @return non-zero failure.
+     */
+    int compact();
+
+    // Compacts on a background thread whenever at least max_segments append segments pile up
+    void start_background_compaction(size_t max_segments = STORE_COMPACT_SEGMENTS);
+
+    // Stops the background compaction, waiting for a running one
+    void stop_background_compaction();
+
+    // The current snapshot, kept alive by the caller for as long as it is read
+    std::shared_ptr<const StoreSnapshot> snapshot() const;
+
+    // Segments and rows of the current snapshot
+    StoreStats stats() const;
+
+private:
+    int publish(std::vector<std::shared_ptr<const StoreSegment>> segments, uint64_t next_sequence,
+                bool write = true);
+    int write_segment(StoreSegment &segment);
+    int write_manifest(const std::vector<std::shared_ptr<const StoreSegment>> &segments, uint64_t next_sequence);
+    void compaction_loop(size_t max_segments);
+
+    std::string directory_;
+    uint64_t next_sequence_ = 1;
+    std::mutex write_mutex_;    // one writer or compaction publish at a time
+    std::mutex compact_mutex_;  // one compaction at a time
+    mutable std::mutex snapshot_mutex_;
+    std::shared_ptr<const StoreSnapshot> snapshot_;
+
+    std::thread compactor_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+};
+
+/**
+ * @brief Finds the top N matches of a target in a store snapshot.
+ *
+ * Every segment is scanned with the metric of the search engine, skipping
+ * rows that a later segment replaced or deleted.
+ *
+ * @param snapshot Snapshot to search, must outlive the matches.
+ * @param metric ssd, rgb-hist, multi-hist, texture-color or cosine.
+ * @param target_image_filename Target image, must be live in the snapshot.
+ * @param N Number of matches.
+ * @param matches Output matches, best first; row is the row in the segment holding the match.
+ * @param num_threads Search threads, 0 uses every core.
+ * @return non-zero failure.
+ */
+int store_topN_matches(const StoreSnapshot &snapshot, const std::string &metric, const char *target_image_filename,
+                       int N, std::vector<Match> &matches, int num_threads);
+
+/**
+ * @brief Copies the live rows of a snapshot into one table sorted by filename.
+ *
+ * @param snapshot Snapshot to copy.
+ * @param table Output table, indexed.
+ * @return non-zero failure.
+ */
+int snapshot_feature_table(const StoreSnapshot &snapshot, FeatureTable &table);
+
+// True if a path names a feature store directory, one with a MANIFEST
+bool is_feature_store(const char *path);
+
+/**
+ * @brief Reads the live rows of a feature store as one table, so any search reads a store like a feature file.
+ *
+ * read_feature_table calls it for a store directory. The store is only read.
+ *
+ * @param directory Store directory.
+ * @param table Output table sorted by filename, indexed.
+ * @param l2_normalize If true, rows are scaled to unit length.
+ * @return non-zero failure.
+ */
+int read_feature_store(const char *directory, FeatureTable &table, int l2_normalize);
+
+#endif //PROJ2_FEATURE_STORE_H
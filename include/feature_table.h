@@ -0,0 +1,199 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 12, 2025
+ * Purpose: Contiguous in-memory feature table shared by the matchers
+ */
+
+#ifndef PROJ2_FEATURE_TABLE_H
+#define PROJ2_FEATURE_TABLE_H
+
+#include "blocked_layout.h"
+#include "feature_arena.h"
+#include "image_registry.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Share of the smaller table's images a join by image must match, fewer means the files name different images
+#define ALIGN_MIN_MATCHED 0.5
+
+/**
+ * @brief Feature vectors of a whole CSV file, one row per image.
+ *
+ * All rows have the same length and are stored back to back in a single
+ * aligned buffer, so a row is handed to a distance function as a pointer
+ * into the table instead of a copy. The filenames live in the table's own
+ * string arena. A table is moved, never copied: moving keeps every row and
+ * name where it is, so pointers handed out earlier (e.g. Match::filename)
+ * stay valid for as long as the table lives.
+ */
+struct FeatureTable {
+    std::vector<char *> filenames; // row i belongs to filenames[i], stored in names
+    NameArena names;               // owns the filenames
+    FeatureValues values;          // rows() * dim floats, row-major
+    int dim = 0;                   // floats per row
+    std::vector<float> norms;      // L2 norm of each row, empty until computed
+    bool normalized = false;       // rows have been scaled to unit L2 norm
+    BlockedFeatures blocked;       // optional transposed copy, see build_blocked_layout
+    std::vector<int> ids;          // image_registry() ID of each row
+    std::vector<int> row_of_id;    // row of each registry ID, -1 if the image is not in the table
+    bool bare_names = false;       // no row names a directory, like ResNet18_olym.csv
+
+    FeatureTable() = default;
+    FeatureTable(FeatureTable &&) = default;
+    FeatureTable &operator=(FeatureTable &&) = default;
+    FeatureTable(const FeatureTable &) = delete;
+    FeatureTable &operator=(const FeatureTable &) = delete;
+
+    size_t rows() const { return filenames.size(); }
+    const float *row(size_t i) const { return values.data() + i * dim; }
+    float *row(size_t i) { return values.data() + i * dim; }
+};
+
+/**
+ * @brief Packs rows read by read_image_data_csv into a FeatureTable.
+ *
+ * @param filenames Image filenames, copied into the table; the caller keeps its strings.
+ * @param data Feature rows, all of the same length.
+ * @param table Output table, rows in the order given.
+ * @return non-zero if the rows do not all have the same length.
+ */
+int pack_feature_table(const std::vector<char *> &filenames, const std::vector<std::vector<float>> &data,
+                       FeatureTable &table);
+
+/**
+ * @brief Sorts the rows of a table by filename.
+ *
+ * Only an index is sorted; the rows are then moved along the cycles of the
+ * permutation in place, one row of scratch at a time, so a large table is
+ * never copied. Names keep their place in the arena. Drops the blocked
+ * layout and reindexes the table.
+ *
+ * @param table Table to sort.
+ * @return non-zero if two rows name the same image.
+ */
+int sort_feature_table(FeatureTable &table);
+
+/**
+ * @brief Interns the filenames of a table and builds its ID to row index.
+ *
+ * pack_feature_table calls it, so every loaded table is indexed.
+ *
+ * @return non-zero if two rows name the same image.
+ */
+int index_feature_table(FeatureTable &table);
+
+/**
+ * @brief Finds the row of an image in O(1).
+ *
+ * Names are matched as ImageNameIndex does: a table of bare file names
+ * (bare_names) also matches a path with directories by its file name, so
+ * "../olympus/pic.0380.jpg" finds "pic.0380.jpg" in the ResNet18 table, and
+ * a bare file name finds the one path of a table with that file name.
+ *
+ * @param table Indexed table.
+ * @param image_filename Image path in any of the feature file conventions, see canonical_image_name.
+ * @return Row of the image, -1 if it is not in the table.
+ */
+int find_table_row(const FeatureTable &table, const char *image_filename);
+
+/**
+ * @brief Reorders the rows of a table to the rows of a reference table, joined by image ID.
+ *
+ * Afterwards row i of both tables describes the same image, so fused
+ * metrics read the two tables at the same index. Reference images missing
+ * from the table get a row of zeros; table rows missing from the reference
+ * are dropped. Both cases are counted in a warning. Images are matched
+ * with ImageNameIndex, so a table of paths and the bare file names of the
+ * ResNet18 table join in either direction. A join that matches fewer than
+ * ALIGN_MIN_MATCHED of the smaller table's images fails instead of
+ * searching rows of zeros.
+ *
+ * @param table Table to reorder.
+ * @param reference Table whose row order is kept.
+ * @return non-zero failure.
+ */
+int align_feature_table(FeatureTable &table, const FeatureTable &reference);
+
+/**
+ * @brief Builds a table holding the rows of another table in the row order of a reference table.
+ *
+ * Like align_feature_table, but the source is left alone and only the rows
+ * the reference needs are gathered into the new table.
+ *
+ * @param table Source table.
+ * @param reference Table whose row order is kept.
+ * @param aligned Output table.
+ * @return non-zero failure.
+ */
+int align_feature_table(const FeatureTable &table, const FeatureTable &reference, FeatureTable &aligned);
+
+// True if both tables describe the same images in the same row order
+bool feature_tables_aligned(const FeatureTable &a, const FeatureTable &b);
+
+// Hash of the width, the canonical image name of every row and every value, saved with indexes built on a table
+uint64_t feature_table_fingerprint(const FeatureTable &table);
+
+/**
+ * @brief Reads a feature CSV file straight into a FeatureTable.
+ *
+ * The "#normalized=l2" metadata line marks a file whose rows are already
+ * unit length. Row norms are always computed once here. The file is parsed
+ * in parallel by load_feature_csv; malformed rows are left out and reported,
+ * or fail the whole read if strict. A column file, optionally with a group
+ * selector, is read by read_feature_columns instead, and a feature store
+ * directory by read_feature_store.
+ *
+ * @param filename CSV file written by append_image_data_csv or write_feature_table_csv, a column file or a store.
+ * @param table Output table, rows sorted by filename.
+ * @param l2_normalize If true, rows of a file that is not normalized yet are scaled to unit length.
+ * @param strict If true, a single malformed row fails the read, e.g. for a file that may be half written.
+ * @return non-zero failure.
+ */
+int read_feature_table(char *filename, FeatureTable &table, int l2_normalize = 0, bool strict = false);
+
+/**
+ * @brief Reads only the rows of some images from a feature CSV file.
+ *
+ * Every line is still read, but only the values of the wanted images are
+ * parsed and kept, so loading the rows of a few candidates out of a large
+ * file (e.g. the embeddings) costs a scan of the names instead of a parse of
+ * the whole file. From a column file only the pages of the wanted rows are read.
+ *
+ * @param filename Feature CSV file, or a column file.
+ * @param wanted image_registry() IDs of the images to read, matched to row names as find_table_row does;
+ *               other rows are skipped.
+ * @param table Output table sorted by filename, may have fewer rows than wanted if images are missing from the file.
+ * @param l2_normalize If true, rows of a file that is not normalized yet are scaled to unit length.
+ * @return non-zero failure.
+ */
+int read_feature_table_rows(char *filename, const std::vector<int> &wanted, FeatureTable &table, int l2_normalize = 0);
+
+/**
+ * @brief Writes a FeatureTable as a feature CSV file, metadata line first.
+ *
+ * @param filename Output CSV file, overwritten.
+ * @param table Table to write.
+ * @return non-zero failure.
+ */
+int write_feature_table_csv(char *filename, FeatureTable &table);
+
+// Computes the L2 norm of every row into table.norms
+void compute_row_norms(FeatureTable &table);
+
+// Scales every row to unit L2 norm (zero rows stay zero) and marks the table normalized
+void normalize_feature_table(FeatureTable &table);
+
+/**
+ * @brief Builds the transposed block layout of a table next to its rows.
+ *
+ * Searches on a table with the layout score LANES candidates per kernel call.
+ * The layout copies the values, so it must be rebuilt after the rows change.
+ *
+ * @param table Table to lay out.
+ * @param lanes Candidates per block, 8 or 16; 0 drops the layout.
+ * @return non-zero if lanes is not supported.
+ */
+int build_blocked_layout(FeatureTable &table, int lanes);
+
+#endif //PROJ2_FEATURE_TABLE_H
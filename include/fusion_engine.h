@@ -0,0 +1,147 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Weighted fusion of any number of modalities with Fagin's threshold algorithm
+ */
+
+#ifndef PROJ2_FUSION_ENGINE_H
+#define PROJ2_FUSION_ENGINE_H
+
+#include "feature_table.h"
+#include "parallel_for.h"
+#include "search_engine.h"
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief One modality of a fused search: the distance of every row to the
+ * target under one metric.
+ *
+ * Random access scores any row. Sorted access, if the modality offers it,
+ * hands out rows from the smallest distance up.
+ */
+class FusionModality {
+public:
+    virtual ~FusionModality() = default;
+
+    // Random access: distance of a row to the target
+    virtual float distance(int row) const = 0;
+
+    // True if next_sorted can be called
+    virtual bool sorted_access() const = 0;
+
+    // Sorted access: the next row by ascending distance, false once every row was handed out
+    virtual bool next_sorted(int &row, float &distance) = 0;
+
+    // Smallest distance any row can have, the threshold term of a modality without sorted access
+    virtual float lower_bound() const = 0;
+
+    // False if the row must not be matched at all
+    virtual bool accept(int row) const = 0;
+};
+
+/**
+ * @brief Modality over the rows of a feature table with a search_engine metric policy.
+ *
+ * With sorted access every distance is computed once up front on a pool of
+ * threads, and the order is sorted lazily in batches that double in size,
+ * so a search that stops early never sorts the whole table. Without it,
+ * distances are computed only for the rows the fusion asks about.
+ *
+ * Every metric of search_engine.h is non-negative, so the lower bound is 0.
+ */
+template <typename Metric, typename Filter = AcceptAll>
+class TableModality : public FusionModality {
+public:
+    TableModality(const FeatureTable &table, const float *target, bool sorted, int num_threads)
+        : table_(table), target_(target), sorted_(sorted) {
+        if (!sorted_) return;
+        const size_t rows = table_.rows();
+        const size_t chunk = std::max<size_t>(64, TOPN_BLOCK_BYTES / std::max<size_t>(table_.dim * sizeof(float), 1));
+        distances_.resize(rows);
+        parallel_for((rows + chunk - 1) / chunk, num_threads, [&](size_t c, int) {
+            size_t end = std::min(rows, (c + 1) * chunk);
+            for (size_t i = c * chunk; i < end; i++) {
+                distances_[i] = Metric::distance(table_.row(i), target_, table_.dim);
+            }
+        });
+        order_.resize(rows);
+        for (size_t i = 0; i < rows; i++) order_[i] = std::make_pair(distances_[i], static_cast<int>(i));
+    }
+
+    float distance(int row) const override {
+        return sorted_ ? distances_[row] : Metric::distance(table_.row(row), target_, table_.dim);
+    }
+
+    bool sorted_access() const override { return sorted_; }
+
+    bool next_sorted(int &row, float &distance) override {
+        if (!sorted_ || next_ == order_.size()) return false;
+        if (next_ == sorted_end_) {
+            // Sort the next batch, ties by row like TopNOrder
+            size_t end = std::min(order_.size(), sorted_end_ + batch_);
+            std::nth_element(order_.begin() + sorted_end_, order_.begin() + (end - 1), order_.end());
+            std::sort(order_.begin() + sorted_end_, order_.begin() + end);
+            sorted_end_ = end;
+            batch_ *= 2;
+        }
+        row = order_[next_].second;
+        distance = order_[next_].first;
+        next_++;
+        return true;
+    }
+
+    float lower_bound() const override { return 0.0f; }
+
+    bool accept(int row) const override { return Filter::accept(table_.row(row), table_.dim); }
+
+private:
+    const FeatureTable &table_;
+    const float *target_;
+    bool sorted_;
+    std::vector<float> distances_;            // every row's distance, sorted access only
+    std::vector<std::pair<float, int>> order_; // (distance, row), sorted up to sorted_end_
+    size_t next_ = 0;
+    size_t sorted_end_ = 0;
+    size_t batch_ = 64;
+};
+
+// A modality and its weight in the fused distance
+struct FusionTerm {
+    FusionModality *modality;
+    float weight; // non-negative
+};
+
+// Work done by one fused search
+struct FusionStats {
+    size_t rows = 0;            // rows in the tables
+    size_t rows_seen = 0;       // distinct rows handed out by sorted access
+    size_t sorted_accesses = 0;
+    size_t random_accesses = 0; // distances of seen rows read from the other modalities
+};
+
+/**
+ * @brief Finds the N rows with the smallest weighted sum of modality
+ * distances with Fagin's threshold algorithm.
+ *
+ * The modalities with sorted access are read in turn, one row each per
+ * round. Every newly seen row is scored in full by random access into the
+ * other modalities. After each round the threshold is the weighted sum of
+ * the last distance read from each sorted modality and the lower bound of
+ * the others; no unseen row can score below it, so the search stops as soon
+ * as the N-th best score is below the threshold. The result is exact.
+ *
+ * @param terms Modalities and weights, at least one with sorted access; all describe the same rows.
+ * @param rows Number of rows.
+ * @param N Number of matches.
+ * @param exclude Row to leave out (the target itself), -1 for none.
+ * @param stats Optional counters of the work done, added to.
+ * @return (fused distance, row) pairs, best first.
+ */
+std::vector<std::pair<float, int>> threshold_topN(const std::vector<FusionTerm> &terms, size_t rows, int N,
+                                                  int exclude, FusionStats *stats = nullptr);
+
+#endif //PROJ2_FUSION_ENGINE_H
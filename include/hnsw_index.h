@@ -0,0 +1,121 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 24, 2025
+ * Purpose: HNSW graph index for approximate cosine search over unit-length embeddings
+ */
+
+#ifndef PROJ2_HNSW_INDEX_H
+#define PROJ2_HNSW_INDEX_H
+
+#include "feature_table.h"
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Graph parameters, see Malkov and Yashunin, "Efficient and robust approximate nearest neighbor search using HNSW graphs"
+struct HnswParams {
+    int M = 16;                // links per node on the upper layers, 2 * M on layer 0
+    int ef_construction = 200; // candidate list size while inserting
+    int ef_search = 64;        // default candidate list size while searching
+    unsigned int seed = 5330;  // seed of the random node levels
+};
+
+/**
+ * @brief Hierarchical navigable small world graph over the rows of a FeatureTable.
+ *
+ * The index only stores the graph. Distances are 1 - dot product read from
+ * the table the index was built on, so the table must be L2-normalized (see
+ * read_feature_table) and have the same rows when the index is loaded again;
+ * a fingerprint of the row names and values is saved to check that.
+ *
+ * The graph is kept in flat arrays: layer 0 holds 2 * M links per node,
+ * each layer above holds M, and every link list starts with its length.
+ * A saved index is memory-mapped by load, so the OS pages it in on demand.
+ */
+class HnswIndex {
+public:
+    HnswIndex() = default;
+    ~HnswIndex();
+    HnswIndex(const HnswIndex &) = delete;
+    HnswIndex &operator=(const HnswIndex &) = delete;
+
+    /**
+     * @brief Builds the graph over every row of a normalized table.
+     *
+     * @param table Table with unit-length rows.
+     * @param params Graph parameters.
+     * @param num_threads Threads inserting nodes at once, 0 uses every core.
+     * @return non-zero failure.
+     */
+    int build(const FeatureTable &table, const HnswParams &params, int num_threads);
+
+    // Writes the graph to a file, non-zero failure
+    int save(const char *filename) const;
+
+    /**
+     * @brief Memory-maps a graph written by save.
+     *
+     * @param filename Index file.
+     * @param table Table the index was built on.
+     * @return non-zero if the file can not be read or was built on another table.
+     */
+    int load(const char *filename, const FeatureTable &table);
+
+    /**
+     * @brief Finds the approximate N nearest rows of a unit-length query.
+     *
+     * The rows are read from the table given to build or load, which must still be alive.
+     *
+     * @param query Unit-length query of table.dim floats.
+     * @param N Number of matches.
+     * @param ef_search Candidate list size, larger is slower and more accurate; 0 uses the built value.
+     * @param exclude Row to leave out (the query itself), -1 for none.
+     * @return (1 - cosine similarity, row) pairs, best first.
+     */
+    std::vector<std::pair<float, int>> search(const float *query, int N, int ef_search, int exclude) const;
+
+    size_t size() const { return n_; }
+    const HnswParams &params() const { return params_; }
+
+private:
+    // Link list of node at layer, first value is the number of links
+    int *links(int node, int layer) const;
+    int max_links(int layer) const { return layer == 0 ? 2 * params_.M : params_.M; }
+    float distance(const float *query, int node) const;
+
+    typedef std::vector<std::pair<float, int>> Candidates;
+    int greedy_closest(const float *query, int node, int from_layer, int to_layer, bool locked) const;
+    Candidates search_layer(const float *query, int entry, int ef, int layer, bool locked) const;
+    void select_neighbors(Candidates &candidates, int M) const;
+    void insert(int node);
+    void release();
+
+    HnswParams params_;
+    size_t n_ = 0;
+    int dim_ = 0;
+    int max_level_ = -1;
+    int entry_point_ = -1;
+    uint64_t fingerprint_ = 0;       // feature_table_fingerprint of the table
+    const float *vectors_ = nullptr; // rows of the table, row-major
+
+    // The graph, in the vectors below after build or in the mapped file after load
+    const int *levels_ = nullptr;            // top layer of each node
+    const uint64_t *upper_offset_ = nullptr; // start of each node's upper layer lists in upper_
+    int *links0_ = nullptr;                  // n * (2M + 1) ints
+    int *upper_ = nullptr;                   // (M + 1) ints per node and layer above 0
+
+    std::vector<int> level_store_;
+    std::vector<uint64_t> offset_store_;
+    std::vector<int> links0_store_;
+    std::vector<int> upper_store_;
+    void *mapping_ = nullptr;
+    size_t mapping_bytes_ = 0;
+
+    // Build only: one lock per node, and one for the entry point
+    mutable std::vector<std::mutex> node_locks_;
+    std::mutex entry_lock_;
+};
+
+#endif //PROJ2_HNSW_INDEX_H
@@ -0,0 +1,68 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 21, 2025
+ * Purpose: Searching a loaded feature table with an image that is not in it
+ */
+
+#ifndef PROJ2_IMAGE_QUERY_H
+#define PROJ2_IMAGE_QUERY_H
+
+#include "feature_table.h"
+#include "image_search.h"
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+// Where the time of a query by image went, in milliseconds
+struct QueryTiming {
+    double decode_ms = 0.0;  // reading or decoding the image
+    double extract_ms = 0.0; // running the feature extractor
+    double search_ms = 0.0;  // searching the table
+};
+
+/**
+ * @brief True if the metric can search with a new image.
+ *
+ * ssd, rgb-hist, multi-hist and texture-color run their extractors
+ * in-process, and cosine runs the ResNet18 network on the query (see
+ * getResNetEmbedding). The fused metrics are not supported: they need the
+ * query's features for two tables at once.
+ */
+bool metric_supports_new_image(const std::string &metric);
+
+/**
+ * @brief Finds the N best matches of an image file that need not be in the table.
+ *
+ * The image is read, its features are computed with the extractor of the
+ * metric (see getImageFeatureFunction) and the table is searched with them.
+ *
+ * @param metric ssd, rgb-hist, multi-hist, texture-color or cosine.
+ * @param image_filename Path of the query image.
+ * @param data Table written by feature_writer with the matching feature type.
+ * @param N Number of matches.
+ * @param matches Output matches, best first.
+ * @param num_threads Search threads, 0 uses every core.
+ * @param timing Output decode, extraction and search times.
+ * @return non-zero failure.
+ */
+int find_topN_matches_image_file(const std::string &metric, const char *image_filename, FeatureTable &data, int N,
+                                 std::vector<Match> &matches, int num_threads, QueryTiming &timing);
+
+/**
+ * @brief Same as find_topN_matches_image_file for an encoded image in memory, e.g. an upload.
+ *
+ * @param buffer Encoded image bytes (jpg, png, ...).
+ */
+int find_topN_matches_image_buffer(const std::string &metric, const std::vector<unsigned char> &buffer,
+                                   FeatureTable &data, int N, std::vector<Match> &matches, int num_threads,
+                                   QueryTiming &timing);
+
+/**
+ * @brief Same search for an image that is already decoded.
+ *
+ * @param image BGR image as returned by cv::imread.
+ */
+int find_topN_matches_image(const std::string &metric, const cv::Mat &image, FeatureTable &data, int N,
+                            std::vector<Match> &matches, int num_threads, QueryTiming &timing);
+
+#endif //PROJ2_IMAGE_QUERY_H
@@ -0,0 +1,127 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 22, 2025
+ * Purpose: Process-wide registry giving every image one canonical ID
+ */
+
+#ifndef PROJ2_IMAGE_REGISTRY_H
+#define PROJ2_IMAGE_REGISTRY_H
+
+#include <cstddef>
+#include <memory>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Canonical name of an image path, the path relative to the collection root.
+ *
+ * Leading "./" and "../" components are dropped, so "../olympus/sub/pic.0380.jpg"
+ * (feature_writer) maps to "olympus/sub/pic.0380.jpg" and images with the same
+ * file name in different directories stay apart.
+ *
+ * @param path Image path.
+ * @return View into path, no copy is made.
+ */
+std::string_view canonical_image_name(std::string_view path);
+std::string_view canonical_image_name(const char *path);
+
+/**
+ * @brief File name of an image path without its directories.
+ *
+ * Only used to join the ResNet18 table, which names its images "pic.0380.jpg"
+ * without the directory the other feature files carry.
+ *
+ * @param path Image path.
+ * @return View into path, no copy is made.
+ */
+std::string_view image_base_name(std::string_view path);
+
+// True if an image path names a directory, false for a bare file name
+bool has_image_directory(std::string_view path);
+
+/**
+ * @brief True if a row name of a feature file names an image path.
+ *
+ * The canonical names must be equal, or one of the two is a bare file
+ * name, as in the ResNet18 file, equal to the file name of the other.
+ */
+bool image_name_matches(std::string_view row_name, const char *path);
+
+/**
+ * @brief Interns canonical image names and hands out dense IDs 0, 1, 2, ...
+ *
+ * The names are copied once into a pool of fixed-size blocks that never
+ * move, and a hash index maps a name to its ID. Lookups may run on any
+ * number of threads while other threads intern new names.
+ */
+class ImageRegistry {
+public:
+    // ID of the image, added if it is new
+    int intern(const char *path);
+    // ID of the image, -1 if it was never interned
+    int find(const char *path) const;
+    // Canonical name of an ID
+    const char *name(int id) const;
+    // Number of IDs handed out
+    size_t size() const;
+
+private:
+    const char *store(std::string_view name);
+
+    mutable std::shared_mutex mutex_;
+    std::vector<std::unique_ptr<char[]>> blocks_; // string pool
+    size_t block_used_ = 0;                       // bytes used in the last block
+    std::vector<const char *> names_;             // name of each ID, in the pool
+    std::unordered_map<std::string_view, int> index_;
+};
+
+// The registry shared by every feature table of the process
+ImageRegistry &image_registry();
+
+/**
+ * @brief Finds images of a set by name, the rule of image_name_matches for a whole table.
+ *
+ * A name matches the image of the set with the same canonical name. If
+ * there is none, a path matches a set of bare file names by its file name,
+ * and a bare file name matches the image of the set with that file name.
+ * A file name shared by two images of the set in different directories
+ * matches neither. Every join of two feature files resolves names here, so
+ * the ResNet18 table joins in either direction.
+ *
+ * The file name index is built on the first lookup that needs it; an index
+ * is used by one thread at a time.
+ */
+class ImageNameIndex {
+public:
+    /**
+     * @param slot_of_id Slot of every registry ID, -1 for images not in the set, e.g. FeatureTable::row_of_id;
+     *                   must outlive the index.
+     * @param bare True if no image of the set has a directory.
+     */
+    ImageNameIndex(const std::vector<int> &slot_of_id, bool bare);
+
+    // Indexes a list of registry IDs, the slot of ids[i] is i; negative IDs are skipped
+    explicit ImageNameIndex(const std::vector<int> &ids);
+
+    ImageNameIndex(const ImageNameIndex &) = delete;
+    ImageNameIndex &operator=(const ImageNameIndex &) = delete;
+
+    // Slot of the image a name matches, -1 if none
+    int find(const char *path) const;
+
+    // Slot of the image a registry ID matches, -1 if none
+    int find(int id) const;
+
+private:
+    int slot(int id) const;
+
+    std::vector<int> owned_; // slots of an ID list
+    const std::vector<int> &slot_of_id_;
+    bool bare_;
+    mutable bool have_file_names_ = false;
+    mutable std::unordered_map<std::string_view, int> file_names_; // file name -> slot, -1 if two images share it
+};
+
+#endif //PROJ2_IMAGE_REGISTRY_H
@@ -0,0 +1,145 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 12, 2025
+ * Purpose: Function prototypes for the top N matching of each distance metric
+ */
+
+#ifndef PROJ2_IMAGE_SEARCH_H
+#define PROJ2_IMAGE_SEARCH_H
+
+#include "feature_table.h"
+#include "predicate_bitmap.h"
+#include <string>
+#include <vector>
+
+// One match of a top N search
+struct Match {
+    char *filename; // filename as stored in the table the matches come from
+    float score;    // distance, or similarity for rgb-hist
+    int row;        // row of that table
+};
+
+/*
+  Linear scans of a filename list. The matchers look targets up with
+  find_table_row instead, which is O(1) and accepts both path conventions.
+ */
+// Function to find the index of the target image in the list of filenames
+int find_target_index(const char *target_image_filename, std::vector<char *> &filenames);
+
+// Since cosine function is paired with ResNet18.csv, the file directory is hard-coded
+int find_target_index_cosine(const char *target_image_filename, std::vector<char *> &filenames);
+
+/*
+  Every function below finds the N best matches of the target image and
+  appends their filenames to output. num_threads is the number of search
+  threads, 0 uses every core.
+
+  The functions return a non-zero value if the target image is not in the table.
+
+  The cosine based metrics use a dot product alone when the ResNet18
+  table is normalized (see read_feature_table).
+ */
+int find_topN_matches_ssd(char *target_image_filename, FeatureTable &data, int N,
+                          std::vector<char *> &output, int num_threads);
+int find_topN_matches_hist(char *target_image_filename, FeatureTable &data, int N,
+                           std::vector<char *> &output, int num_threads);
+int find_topN_matches_multiHist(char *target_image_filename, FeatureTable &data, int N,
+                                std::vector<char *> &output, int num_threads);
+int find_topN_matches_textureColor(char *target_image_filename, FeatureTable &data, int N,
+                                   std::vector<char *> &output, int num_threads);
+int find_topN_matches_cosine(char *target_image_filename, FeatureTable &data, int N,
+                             std::vector<char *> &output, int num_threads);
+
+class HnswIndex;
+// Approximate cosine matches from an HNSW index built on the normalized data table,
+// ef_search trades speed for recall (0 uses the value the index was built with)
+int find_topN_matches_cosine_ann(char *target_image_filename, FeatureTable &data, const HnswIndex &index, int N,
+                                 std::vector<char *> &output, int ef_search);
+
+class InvertedHistIndex;
+// Exact rgb-hist or multi-hist matches (the metric the index was built for) read from its posting lists
+int find_topN_matches_hist_inverted(char *target_image_filename, FeatureTable &data, const InvertedHistIndex &index,
+                                    int N, std::vector<char *> &output);
+
+/*
+  The fused metrics combine a feature table with the ResNet18 embeddings
+  in rnnData. The two tables are joined by image ID: callers should run
+  align_feature_table(data, rnnData) once after loading, otherwise every
+  query aligns a copy. The output is filled with the rnnData filenames.
+ */
+// 0.8 ResNet18 cosine + 0.2 texture-color with a depth mask
+int find_topN_matches_depthDNN(char *target_image_filename, FeatureTable &data, FeatureTable &rnnData, int N,
+                               std::vector<char *> &output, int num_threads);
+// 0.5 ResNet18 cosine + 0.5 blob histogram intersection, images without blobs are skipped
+int find_topN_matches_banana(char *target_image_filename, FeatureTable &data, FeatureTable &rnnData, int N,
+                             std::vector<char *> &output, int num_threads);
+// 0.3 ResNet18 face cosine + 0.7 texture-color with a face mask, rnnData should not be normalized
+// since the face flag test reads the raw first value
+int find_topN_matches_depthDNN_faces(char *target_image_filename, FeatureTable &data, FeatureTable &rnnData, int N,
+                                     std::vector<char *> &output, int num_threads);
+
+/*
+  Fusion with runtime weights and any number of modalities, searched with
+  the threshold algorithm (see fusion_engine.h). Every table must describe
+  the same images; tables not row-aligned with the first are aligned as a
+  copy per query, so callers should align them once after loading. The
+  matches are named from the first table.
+ */
+struct FusionStats;
+struct FusionSpec {
+    std::string metric; // modality metric, see fusion_modality_names
+    FeatureTable *table;
+    float weight;       // non-negative
+    bool sorted;        // read by sorted access; if none is, the heaviest modality is
+};
+
+// Modality metrics a FusionSpec accepts, comma separated
+std::string fusion_modality_names();
+
+/**
+ * @brief Fills the modalities of the depth, banana or face metric with its fixed weights.
+ *
+ * @param metric depth, banana or face.
+ * @param data Feature table of the metric.
+ * @param rnnData ResNet18 table, normalized except for face.
+ * @param specs Output modalities, ResNet18 first.
+ * @return non-zero if metric is not a fused metric.
+ */
+int fusion_preset(const std::string &metric, FeatureTable &data, FeatureTable &rnnData, std::vector<FusionSpec> &specs);
+
+// N best matches of the weighted sum of the modalities' distances, stats may be nullptr
+int find_topN_matches_fusion(char *target_image_filename, const std::vector<FusionSpec> &specs, int N,
+                             std::vector<Match> &matches, int num_threads, FusionStats *stats);
+
+/*
+  Metrics by name: ssd, rgb-hist, multi-hist, texture-color, cosine, depth,
+  banana and face. rnnData is only read by the metrics that use the ResNet18
+  embeddings and may be nullptr for the others.
+ */
+bool is_valid_metric(const std::string &metric);
+bool metric_uses_resnet(const std::string &metric);
+std::string metric_names();
+int find_topN_matches(const std::string &metric, char *target_image_filename, FeatureTable &data,
+                      FeatureTable *rnnData, int N, std::vector<Match> &matches, int num_threads);
+
+/*
+  Same search restricted to the images passing a filter expression over
+  predicate bitmaps (see evaluate_filter), e.g. "has_face & dir:olympus".
+  The expression is evaluated with word-wise bit operations into one bit
+  per scanned row before any distance is computed, and only the rows whose
+  bit is set are scored.
+ */
+int find_topN_matches_filtered(const std::string &metric, char *target_image_filename, FeatureTable &data,
+                               FeatureTable *rnnData, const PredicateSet &predicates, const std::string &filter,
+                               int N, std::vector<Match> &matches, int num_threads);
+
+/*
+  Same search with a target feature vector that is not a row of the table,
+  e.g. extracted from a new image. Only the single-table metrics (ssd,
+  rgb-hist, multi-hist, texture-color and cosine) support it. No row is
+  excluded from the matches.
+ */
+int find_topN_matches_vector(const std::string &metric, const std::vector<float> &target, FeatureTable &data, int N,
+                             std::vector<Match> &matches, int num_threads);
+
+#endif //PROJ2_IMAGE_SEARCH_H
@@ -0,0 +1,153 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Conversions between 8-bit images and the float tensors of the ONNX networks
+ */
+
+#ifndef PROJ2_IMAGE_TENSOR_H
+#define PROJ2_IMAGE_TENSOR_H
+
+#include <cstddef>
+#include <opencv2/opencv.hpp>
+
+// Pixels converted per step, the compiler maps each step onto SIMD registers
+#define TENSOR_LANES 16
+
+/*
+  Every kernel below works on TENSOR_LANES pixels at a time with no
+  dependency between lanes, the same way the blocked layout kernels do, so
+  the compiler turns each step into a few vector instructions. Tails
+  shorter than a step run through the same per-pixel expression.
+ */
+
+/**
+ * @brief Converts interleaved BGR bytes to three normalized float planes in one pass.
+ *
+ * plane_c[i] = pixel[i].c * scale[c] + offset[c] for c = R, G, B, so the
+ * ImageNet normalization ((v / 255) - mean) / std becomes scale = 1 / (255 * std)
+ * and offset = -mean / std.
+ *
+ * @param bgr Interleaved pixels, 3 bytes each.
+ * @param pixels Number of pixels.
+ * @param red Output red plane, pixels floats; green and blue likewise.
+ * @param scale Per-channel scale, R, G, B.
+ * @param offset Per-channel offset, R, G, B.
+ */
+inline void bgr_to_planar_rgb(const unsigned char *__restrict bgr, size_t pixels, float *__restrict red,
+                              float *__restrict green, float *__restrict blue, const float scale[3],
+                              const float offset[3]) {
+    const float sr = scale[0], sg = scale[1], sb = scale[2];
+    const float or_ = offset[0], og = offset[1], ob = offset[2];
+    size_t i = 0;
+    for (; i + TENSOR_LANES <= pixels; i += TENSOR_LANES) {
+        // Split the channels first, the normalization then runs on whole registers
+        const unsigned char *p = bgr + 3 * i;
+        float r[TENSOR_LANES], g[TENSOR_LANES], b[TENSOR_LANES];
+        for (int l = 0; l < TENSOR_LANES; l++) {
+            b[l] = p[3 * l];
+            g[l] = p[3 * l + 1];
+            r[l] = p[3 * l + 2];
+        }
+        for (int l = 0; l < TENSOR_LANES; l++) {
+            red[i + l] = r[l] * sr + or_;
+            green[i + l] = g[l] * sg + og;
+            blue[i + l] = b[l] * sb + ob;
+        }
+    }
+    for (; i < pixels; i++) {
+        red[i] = bgr[3 * i + 2] * sr + or_;
+        green[i] = bgr[3 * i + 1] * sg + og;
+        blue[i] = bgr[3 * i] * sb + ob;
+    }
+}
+
+/**
+ * @brief Finds the smallest and largest value of an array in one pass.
+ *
+ * Each lane keeps its own minimum and maximum; the lanes are combined at the end.
+ *
+ * @param data Values, count of them, at least one.
+ * @param count Number of values.
+ * @param min Output smallest value.
+ * @param max Output largest value.
+ */
+inline void tensor_min_max(const float *__restrict data, size_t count, float &min, float &max) {
+    float lo[TENSOR_LANES], hi[TENSOR_LANES];
+    for (int l = 0; l < TENSOR_LANES; l++) lo[l] = hi[l] = data[0];
+    size_t i = 0;
+    for (; i + TENSOR_LANES <= count; i += TENSOR_LANES) {
+        for (int l = 0; l < TENSOR_LANES; l++) {
+            const float value = data[i + l];
+            lo[l] = value < lo[l] ? value : lo[l];
+            hi[l] = value > hi[l] ? value : hi[l];
+        }
+    }
+    for (; i < count; i++) {
+        lo[0] = data[i] < lo[0] ? data[i] : lo[0];
+        hi[0] = data[i] > hi[0] ? data[i] : hi[0];
+    }
+    min = lo[0];
+    max = hi[0];
+    for (int l = 1; l < TENSOR_LANES; l++) {
+        min = lo[l] < min ? lo[l] : min;
+        max = hi[l] > max ? hi[l] : max;
+    }
+}
+
+/**
+ * @brief Scales values in [min, max] to bytes in [0, 255], truncating like a cast.
+ *
+ * Uses the same 255 * (v - min) / (max - min) as DA2Network always has, so
+ * the bytes do not change; a flat array (max == min) gives 0.
+ *
+ * @param data Values, count of them.
+ * @param count Number of values.
+ * @param min Smallest value, from tensor_min_max.
+ * @param max Largest value.
+ * @param out Output bytes, count of them.
+ */
+inline void tensor_to_u8(const float *__restrict data, size_t count, float min, float max,
+                         unsigned char *__restrict out) {
+    const float range = max - min;
+    if (!(range > 0.0f)) {
+        for (size_t i = 0; i < count; i++) out[i] = 0;
+        return;
+    }
+    size_t i = 0;
+    for (; i + TENSOR_LANES <= count; i += TENSOR_LANES) {
+        for (int l = 0; l < TENSOR_LANES; l++) {
+            const float value = 255 * (data[i + l] - min) / range;
+            out[i + l] = static_cast<unsigned char>(value > 255.0f ? 255.0f : value);
+        }
+    }
+    for (; i < count; i++) {
+        const float value = 255 * (data[i] - min) / range;
+        out[i] = static_cast<unsigned char>(value > 255.0f ? 255.0f : value);
+    }
+}
+
+/**
+ * @brief Writes a BGR image as the planar RGB input of an ImageNet-trained network.
+ *
+ * Each channel is normalized as ((v / 255) - mean) / std with the ImageNet
+ * mean (0.485, 0.456, 0.406) and deviation (0.229, 0.224, 0.225).
+ *
+ * @param image 8-bit BGR image, e.g. read with cv::imread.
+ * @param planes Output, three planes of image.rows * image.cols floats, R first.
+ */
+inline void imagenet_planar_rgb(const cv::Mat &image, float *planes) {
+    static const float scale[3] = {1.0f / (255.0f * 0.229f), 1.0f / (255.0f * 0.224f), 1.0f / (255.0f * 0.225f)};
+    static const float offset[3] = {-0.485f / 0.229f, -0.456f / 0.224f, -0.406f / 0.225f};
+    const size_t plane = static_cast<size_t>(image.rows) * image.cols;
+    float *red = planes, *green = planes + plane, *blue = planes + 2 * plane;
+    if (image.isContinuous()) {
+        bgr_to_planar_rgb(image.ptr<unsigned char>(0), plane, red, green, blue, scale, offset);
+        return;
+    }
+    for (int i = 0; i < image.rows; i++) {
+        const size_t row = static_cast<size_t>(i) * image.cols;
+        bgr_to_planar_rgb(image.ptr<unsigned char>(i), image.cols, red + row, green + row, blue + row, scale, offset);
+    }
+}
+
+#endif //PROJ2_IMAGE_TENSOR_H
@@ -0,0 +1,111 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Inverted index from histogram bin to impact-ordered postings for exact histogram intersection search
+ */
+
+#ifndef PROJ2_INVERTED_HIST_INDEX_H
+#define PROJ2_INVERTED_HIST_INDEX_H
+
+#include "feature_table.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Suffix of the index file saved next to a feature file
+#define INVERTED_FILE_SUFFIX ".inv"
+
+// Histogram metrics the index can rank with
+enum class InvertedHistMetric {
+    HIST_INTERSECTION, // rgb-hist, calculate_histogramIntersection, larger is better
+    MULTI_HIST         // multi-hist, calculate_multiHist_distance, smaller is better
+};
+
+// Work done by one search
+struct InvertedHistStats {
+    size_t query_bins = 0;         // nonzero bins of the query
+    size_t bins_scanned = 0;       // bins whose postings were read before the search stopped
+    size_t postings_scanned = 0;   // (row, weight) pairs accumulated
+    size_t candidates_scored = 0;  // rows scored again with the full distance function
+};
+
+/**
+ * @brief Posting list of every histogram bin: the rows with mass in the bin
+ * and their weight, heaviest first.
+ *
+ * min(a, b) is zero wherever either side is, so a query only accumulates
+ * over the postings of its own nonzero bins. Query bins are read heaviest
+ * first. Before each bin, the N-th best partial score is a lower bound tau
+ * on the final N-th score, and a row never seen so far can at most gain the
+ * remaining query mass; once that is below tau no new row can enter, and
+ * within a bin the same holds from the first posting whose weight is too
+ * small (later postings are lighter). The search then stops reading
+ * postings and scores the rows that can still reach tau with the full
+ * distance function, so the result is exact.
+ *
+ * multi-hist is 1 - (I_top + I_bottom) / 2, the same sum with every bin
+ * weighted by one half. The posting lists do not depend on the metric, so
+ * one saved file serves both.
+ */
+class InvertedHistIndex {
+public:
+    /**
+     * @brief Builds the posting lists of a histogram table.
+     *
+     * @param table Histogram feature table, must stay alive while the index is searched.
+     * @param metric Metric used to rank.
+     * @param num_threads Threads sorting the posting lists, 0 uses every core.
+     * @return non-zero failure.
+     */
+    int build(const FeatureTable &table, InvertedHistMetric metric, int num_threads);
+
+    // Writes the posting lists to a file, non-zero failure
+    int save(const char *filename) const;
+
+    /**
+     * @brief Reads posting lists written by save.
+     *
+     * @param filename Index file.
+     * @param table Table the index was built on, checked by its fingerprint; must stay alive while searched.
+     * @param metric Metric used to rank.
+     * @return non-zero if the file is missing, corrupt or was built on another table.
+     */
+    int load(const char *filename, const FeatureTable &table, InvertedHistMetric metric);
+
+    /**
+     * @brief Finds the exact N best rows of a query.
+     *
+     * @param query Query histogram of table.dim floats.
+     * @param N Number of matches.
+     * @param exclude Row to leave out (the query itself), -1 for none.
+     * @param stats Optional counters of the work done, added to.
+     * @return (score, row) pairs, best first, scored like the metric's search_topN.
+     */
+    std::vector<std::pair<float, int>> search(const float *query, int N, int exclude,
+                                              InvertedHistStats *stats = nullptr) const;
+
+    size_t size() const { return n_; }
+    size_t postings() const { return rows_.size(); }
+    InvertedHistMetric metric() const { return metric_; }
+
+private:
+    float weight() const { return metric_ == InvertedHistMetric::MULTI_HIST ? 0.5f : 1.0f; }
+    // Full score of a row, calculate_histogramIntersection or calculate_multiHist_distance
+    float score(const float *query, int row) const;
+
+    InvertedHistMetric metric_ = InvertedHistMetric::HIST_INTERSECTION;
+    size_t n_ = 0;
+    int dim_ = 0;
+    const float *vectors_ = nullptr; // rows of the table, row-major
+    uint64_t fingerprint_ = 0;       // feature_table_fingerprint of the table
+    std::vector<size_t> offsets_;    // postings of bin b are [offsets_[b], offsets_[b + 1])
+    std::vector<int32_t> rows_;
+    std::vector<float> weights_;     // row's value in the bin, descending within a bin
+};
+
+// The index file of a feature file: its path, without a column selector, plus INVERTED_FILE_SUFFIX
+std::string inverted_index_file_name(const char *feature_file);
+
+#endif //PROJ2_INVERTED_HIST_INDEX_H
@@ -0,0 +1,137 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Inverted file index with product-quantized residuals for histogram features
+ */
+
+#ifndef PROJ2_IVFPQ_INDEX_H
+#define PROJ2_IVFPQ_INDEX_H
+
+#include "feature_table.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Histogram metrics the index can rank with
+enum class IvfPqMetric {
+    HIST_INTERSECTION, // rgb-hist, calculate_histogramIntersection, larger is better
+    TEXTURE_COLOR      // texture-color, calculate_textureColor_distance, smaller is better
+};
+
+struct IvfPqParams {
+    int nlist = 64;           // coarse k-means clusters (inverted lists)
+    int subspace_dim = 8;     // floats per product quantizer subspace, each coded in one byte
+    int kmeans_iters = 15;    // Lloyd iterations of both quantizers
+    size_t train_rows = 16384; // rows sampled for training, 0 uses every row
+    unsigned int seed = 5330;
+};
+
+/**
+ * @brief IVF + PQ index: a coarse k-means quantizer picks the lists to scan,
+ * and the residual of every row to its list centroid is stored as one byte
+ * per subspace.
+ *
+ * Both metrics are sums over the bins (min(a, b) per bin), so a query builds
+ * one table per probed list holding the partial sum of every subspace code
+ * against centroid + residual codeword (asymmetric distance: the query is
+ * never quantized). Scoring a row is then one table read per subspace. The
+ * best rerank candidates are scored again exactly on the table rows.
+ *
+ * Only the codes, not the floats, are needed to scan: a row of 512 floats
+ * takes 64 bytes with the default subspace_dim. The index also keeps the row
+ * names and the fingerprint of the table, so it is loaded and searched on
+ * its own; the table is only read for the exact re-ranking.
+ */
+class IvfPqIndex {
+public:
+    /**
+     * @brief Trains both quantizers on a sample of the table and encodes every row.
+     *
+     * @param table Histogram feature table.
+     * @param metric Metric used to rank.
+     * @param params Index parameters, subspace_dim must divide the row.
+     * @param num_threads Threads for training and encoding, 0 uses every core.
+     * @return non-zero failure.
+     */
+    int build(const FeatureTable &table, IvfPqMetric metric, const IvfPqParams &params, int num_threads);
+
+    // Writes the quantizers and codes to a file, non-zero failure
+    int save(const char *filename) const;
+
+    // Reads an index written by save without its feature table, non-zero failure
+    int load(const char *filename);
+
+    // Reads an index written by save and checks it was built on table, non-zero failure
+    int load(const char *filename, const FeatureTable &table);
+
+    // True if the index was built on this table, same width, rows and fingerprint
+    bool built_on(const FeatureTable &table) const;
+
+    /**
+     * @brief Finds the N best rows of a query.
+     *
+     * @param table Table the index was built on, read for the exact re-ranking; nullptr
+     *              scores from the codes alone, like rerank 0.
+     * @param query Query of dim() floats.
+     * @param N Number of matches.
+     * @param nprobe Number of closest lists to scan.
+     * @param rerank Candidates re-scored exactly, at least N; 0 returns the approximate scores.
+     * @param exclude Row to leave out (the query itself), -1 for none.
+     * @param num_threads Threads scanning the probed lists, 0 uses every core.
+     * @return (score, row) pairs, best first, scored like the metric's search_topN.
+     */
+    std::vector<std::pair<float, int>> search(const FeatureTable *table, const float *query, int N, int nprobe,
+                                              int rerank, int exclude, int num_threads) const;
+
+    /**
+     * @brief Decodes the approximation of a row the index stores, its list centroid plus its codewords.
+     *
+     * Finds the row by scanning the lists, O(n), so an image of the index is
+     * queried without its feature file.
+     *
+     * @param row Row of the index.
+     * @param values Output dim() floats.
+     * @return non-zero if the row is not in the index.
+     */
+    int reconstruct(int row, std::vector<float> &values) const;
+
+    // Row of an image in the index, -1 if it is not there; names match like find_table_row
+    int find_row(const char *image_filename) const;
+    // Image name of a row
+    const std::string &row_name(int row) const { return names_[row]; }
+
+    size_t size() const { return n_; }
+    int dim() const { return dim_; }
+    int nlist() const { return nlist_; }
+    // Bytes of PQ code per row
+    int code_bytes() const { return subspaces_; }
+    IvfPqMetric metric() const { return metric_; }
+
+private:
+    // Sum of min(query, centroid + codeword) per subspace and code, times weight()
+    void adc_table(const float *query, int list, std::vector<float> &table) const;
+    /*
+      Both metrics are affine in the weighted intersection S: rgb-hist is S
+      with weight 1, texture-color is 1 - S with weight 0.5 for both halves.
+     */
+    float weight() const { return metric_ == IvfPqMetric::TEXTURE_COLOR ? 0.5f : 1.0f; }
+    float score_from_similarity(float similarity) const;
+
+    IvfPqMetric metric_ = IvfPqMetric::HIST_INTERSECTION;
+    size_t n_ = 0;
+    int dim_ = 0;
+    int nlist_ = 0;
+    int subspaces_ = 0;
+    int subspace_dim_ = 0;
+    int codewords_ = 0; // codewords per subspace, 256 unless there were fewer training rows
+    uint64_t fingerprint_ = 0;
+    std::vector<float> coarse_;                    // nlist * dim centroids
+    std::vector<float> codebooks_;                 // subspaces * codewords * subspace_dim floats
+    std::vector<std::vector<int>> list_rows_;      // table row of every entry of a list
+    std::vector<std::vector<uint8_t>> list_codes_; // subspaces bytes per entry of a list
+    std::vector<std::string> names_;               // image name of every row
+};
+
+#endif //PROJ2_IVFPQ_INDEX_H
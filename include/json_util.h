@@ -0,0 +1,42 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 20, 2025
+ * Purpose: Small helpers for writing JSON results
+ */
+
+#ifndef PROJ2_JSON_UTIL_H
+#define PROJ2_JSON_UTIL_H
+
+#include <cstdio>
+#include <string>
+
+/**
+ * @brief Quotes and escapes a string as a JSON string literal.
+ *
+ * @param text Text to quote.
+ * @return The text between double quotes with ", \ and control characters escaped.
+ */
+inline std::string json_string(const std::string &text) {
+    std::string out = "\"";
+    for (char c : text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    out += "\"";
+    return out;
+}
+
+#endif //PROJ2_JSON_UTIL_H
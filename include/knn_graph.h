@@ -0,0 +1,171 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Precomputed K nearest neighbors of every image of a feature file, answered without a scan
+ */
+
+#ifndef PROJ2_KNN_GRAPH_H
+#define PROJ2_KNN_GRAPH_H
+
+#include "feature_table.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Rows per side of a tile of the all-pairs computation, two tiles of rows stay in L2
+#define KNN_TILE_ROWS 64
+// Mutexes guarding the neighbor lists, row r uses r % KNN_LOCK_STRIPES
+#define KNN_LOCK_STRIPES 4096
+// Longest metric name, including the terminating NUL
+#define KNN_METRIC_BYTES 16
+// Longest row name a reader looks up, including the terminating NUL
+#define KNN_NAME_READ_BYTES 4096
+
+struct KnnGraphFileHeader;
+
+// Work done by a build or update
+struct KnnGraphStats {
+    size_t distance_evaluations = 0; // each pair once, shared by both of its rows
+    size_t rows_computed = 0;        // rows whose lists were computed from scratch
+};
+
+/**
+ * @brief The K best neighbors of every row of a table under one metric.
+ *
+ * Every metric the graph supports is symmetric, so the score of a pair is
+ * computed once and offered to the lists of both rows. The rows are split
+ * into tiles of KNN_TILE_ROWS and the pairs of two tiles are scored
+ * together while both tiles are in cache; tile pairs run in parallel.
+ * Lists are best first with ties by row, exactly what search_topN returns
+ * for the same target.
+ *
+ * The file holds one fixed-size record of K (score, row) pairs per row
+ * followed by the row names, so KnnGraphReader reads the answer for one
+ * image with a single read. The names let update carry the lists over to
+ * a newer version of the feature file, and an index of the rows sorted by
+ * name lets a reader find the target without the feature file.
+ */
+class KnnGraph {
+public:
+    /**
+     * @brief Computes the lists of every row.
+     *
+     * @param table Feature table.
+     * @param metric ssd, rgb-hist, multi-hist, texture-color or cosine.
+     * @param K Neighbors per row.
+     * @param num_threads Worker threads, 0 uses every core.
+     * @param stats Optional counters of the work done.
+     * @return non-zero failure.
+     */
+    int build(const FeatureTable &table, const std::string &metric, int K, int num_threads,
+              KnnGraphStats *stats = nullptr);
+
+    /**
+     * @brief Moves the graph onto a newer table without a full rebuild.
+     *
+     * Rows are matched by image name. Images new to the table are scored
+     * against every row, which also offers them to the lists of the old
+     * rows; old rows keep their lists unless a neighbor was removed or the
+     * list is short, and only those are computed again. An image whose
+     * features changed under the same name needs a build.
+     *
+     * @param table Newer table with the same width.
+     * @param num_threads Worker threads, 0 uses every core.
+     * @param stats Optional counters of the work done.
+     * @return non-zero failure.
+     */
+    int update(const FeatureTable &table, int num_threads, KnnGraphStats *stats = nullptr);
+
+    // Writes the graph to a file, non-zero failure
+    int save(const char *filename) const;
+
+    // Reads a whole graph, for update, non-zero failure
+    int load(const char *filename);
+
+    size_t size() const { return names_.size(); }
+    int K() const { return K_; }
+    const std::string &metric() const { return metric_; }
+
+private:
+    int compute(const FeatureTable &table, const std::vector<int> &sources, bool dedup, int num_threads,
+                KnnGraphStats &stats);
+
+    std::string metric_;
+    int K_ = 0;
+    int dim_ = 0;
+    bool normalized_ = false;                    // cosine scores of unit rows, 1 - dot
+    uint64_t fingerprint_ = 0;                   // feature_table_fingerprint of the table
+    std::vector<std::string> names_;             // row names
+    std::vector<std::pair<float, int>> lists_;   // K per row, best first, row -1 past the end
+};
+
+/**
+ * @brief Answers neighbor queries from a graph file without loading it.
+ *
+ * Opened without a table, the reader looks up the target and names the
+ * neighbors from the file itself: a binary search of the sorted names and
+ * one read per neighbor, so a query never parses the feature file.
+ */
+class KnnGraphReader {
+public:
+    KnnGraphReader() = default;
+    KnnGraphReader(const KnnGraphReader &) = delete;
+    KnnGraphReader &operator=(const KnnGraphReader &) = delete;
+    ~KnnGraphReader();
+
+    /**
+     * @brief Opens a graph built on a table.
+     *
+     * @param filename Graph file.
+     * @param table Table the graph was built on; its rows are the graph's rows.
+     * @param metric Metric the caller searches with, must be the graph's.
+     * @return non-zero if the file is not a graph of this table and metric.
+     */
+    int open(const char *filename, const FeatureTable &table, const std::string &metric);
+
+    /**
+     * @brief Opens a graph on its own; rows are looked up and named with find_row and name.
+     *
+     * @param filename Graph file.
+     * @param metric Metric the caller searches with, must be the graph's.
+     * @return non-zero if the file is not a graph of this metric.
+     */
+    int open(const char *filename, const std::string &metric);
+
+    // Row of an image, matched by canonical name as find_table_row does, -1 if the graph does not have it; O(log rows)
+    int find_row(const char *image_filename) const;
+
+    // Name of a row as the feature file stores it, non-zero if the row is out of range or the file is corrupt
+    int name(int row, std::string &name) const;
+
+    /**
+     * @brief Reads the N best neighbors of a row, O(K).
+     *
+     * @param row Table row of the target.
+     * @param N Number of neighbors, at most K().
+     * @param neighbors Output (score, row) pairs, best first.
+     * @return non-zero if N is larger than K or the read fails.
+     */
+    int neighbors(int row, int N, std::vector<std::pair<float, int>> &neighbors) const;
+
+    int K() const { return K_; }
+
+private:
+    int open(const char *filename, const std::string &metric, KnnGraphFileHeader &header);
+    int lookup(std::string_view canonical) const;
+
+    int fd_ = -1;
+    int K_ = 0;
+    size_t rows_ = 0;
+    uint64_t names_offset_ = 0; // where the names start in the file
+    uint64_t name_bytes_ = 0;
+    bool bare_names_ = false;   // no row name has a directory
+};
+
+// True if a knn graph can be built for a metric
+bool knn_graph_supports_metric(const std::string &metric);
+
+#endif //PROJ2_KNN_GRAPH_H
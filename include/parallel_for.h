@@ -0,0 +1,47 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 14, 2025
+ * Purpose: Minimal parallel loop over independent work items
+ */
+
+#ifndef PROJ2_PARALLEL_FOR_H
+#define PROJ2_PARALLEL_FOR_H
+
+#include "parallel_topn.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Calls fn(item, thread) for every item in [0, count) on a pool of threads.
+ *
+ * Items are claimed one at a time, so uneven items balance out. The thread
+ * argument is in [0, threads) and lets fn keep per-thread scratch space.
+ *
+ * @param count Number of work items.
+ * @param num_threads Worker threads, 0 uses every core.
+ * @param fn Callable void(size_t item, int thread).
+ * @return int Number of threads that were started.
+ */
+template <typename Fn>
+int parallel_for(size_t count, int num_threads, Fn fn) {
+    int threads = static_cast<int>(std::min<size_t>(resolve_thread_count(num_threads), std::max<size_t>(count, 1)));
+    std::atomic<size_t> next(0);
+    auto worker = [&](int t) {
+        for (size_t item = next.fetch_add(1); item < count; item = next.fetch_add(1)) {
+            fn(item, t);
+        }
+    };
+    if (threads == 1) {
+        worker(0);
+    } else {
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; t++) pool.emplace_back(worker, t);
+        for (std::thread &th : pool) th.join();
+    }
+    return threads;
+}
+
+#endif //PROJ2_PARALLEL_FOR_H
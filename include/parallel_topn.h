@@ -0,0 +1,173 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 10, 2025
+ * Purpose: Parallel exact top-N selection over the rows of a feature table
+ */
+
+#ifndef PROJ2_PARALLEL_TOPN_H
+#define PROJ2_PARALLEL_TOPN_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Rows handed to a worker at a time are sized to stay inside a typical L2 cache
+#define TOPN_BLOCK_BYTES (256 * 1024)
+
+/**
+ * @brief Resolves a requested thread count, 0 or negative means "use every core".
+ *
+ * @param num_threads Requested thread count.
+ * @return int Number of worker threads to start (at least 1).
+ */
+inline int resolve_thread_count(int num_threads) {
+    if (num_threads > 0) return num_threads;
+    unsigned int hw = std::thread::hardware_concurrency();
+    return hw == 0 ? 1 : static_cast<int>(hw);
+}
+
+/**
+ * @brief Orders (score, index) pairs from best to worst.
+ *
+ * Ascending metrics (distances) prefer smaller scores, descending metrics
+ * (similarities) prefer larger ones. Equal scores always prefer the smaller
+ * index so the result does not depend on how rows were split across threads.
+ */
+struct TopNOrder {
+    bool ascending;
+    bool operator()(const std::pair<float, int> &a, const std::pair<float, int> &b) const {
+        if (a.first != b.first) return ascending ? a.first < b.first : a.first > b.first;
+        return a.second < b.second;
+    }
+};
+
+/**
+ * @brief Bounded heap holding the N best (score, index) pairs seen so far.
+ */
+class TopNHeap {
+public:
+    TopNHeap(int N, bool ascending) : N_(N), better_{ascending}, heap_(better_) {}
+
+    void push(float score, int index) {
+        std::pair<float, int> candidate(score, index);
+        if (static_cast<int>(heap_.size()) < N_) {
+            heap_.push(candidate);
+        } else if (N_ > 0 && better_(candidate, heap_.top())) {
+            heap_.pop();
+            heap_.push(candidate);
+        }
+    }
+
+    size_t size() const { return heap_.size(); }
+    bool full() const { return static_cast<int>(heap_.size()) >= N_; }
+    // Worst kept pair, the one a better candidate would replace
+    const std::pair<float, int> &worst() const { return heap_.top(); }
+
+    // Moves the kept pairs to out, leaving the heap empty
+    void drain(std::vector<std::pair<float, int>> &out) {
+        while (!heap_.empty()) {
+            out.push_back(heap_.top());
+            heap_.pop();
+        }
+    }
+
+    // Kept pairs best first, leaving the heap empty
+    std::vector<std::pair<float, int>> sorted() {
+        std::vector<std::pair<float, int>> out;
+        drain(out);
+        std::reverse(out.begin(), out.end());
+        return out;
+    }
+
+private:
+    int N_;
+    TopNOrder better_;
+    // better_ as the heap comparator keeps the worst kept match on top
+    std::priority_queue<std::pair<float, int>, std::vector<std::pair<float, int>>, TopNOrder> heap_;
+};
+
+/**
+ * @brief Runs fn over [0, count) in chunks on a pool of threads, each thread filling its own heap.
+ *
+ * Workers claim chunks of chunk_size items one at a time. Each worker keeps
+ * a bounded heap of its N best matches, and the heaps are merged at the end.
+ *
+ * @param count Number of work items.
+ * @param chunk_size Items claimed at a time.
+ * @param N Number of matches to keep.
+ * @param ascending True if smaller scores are better.
+ * @param num_threads Worker threads, 0 uses every core.
+ * @param fn Callable void(size_t begin, size_t end, TopNHeap &heap) scoring items [begin, end).
+ * @return The best (score, index) pairs, best first.
+ */
+template <typename RangeFn>
+std::vector<std::pair<float, int>> parallel_topN_ranges(size_t count, size_t chunk_size, int N, bool ascending,
+                                                        int num_threads, RangeFn fn) {
+    std::vector<std::pair<float, int>> result;
+    if (N <= 0 || count == 0) return result;
+
+    chunk_size = std::max<size_t>(chunk_size, 1);
+    size_t num_chunks = (count + chunk_size - 1) / chunk_size;
+    int threads = static_cast<int>(std::min<size_t>(resolve_thread_count(num_threads), num_chunks));
+
+    std::vector<TopNHeap> heaps(threads, TopNHeap(N, ascending));
+    std::atomic<size_t> next_chunk(0);
+
+    auto worker = [&](int t) {
+        for (;;) {
+            size_t chunk = next_chunk.fetch_add(1);
+            if (chunk >= num_chunks) break;
+            fn(chunk * chunk_size, std::min(count, (chunk + 1) * chunk_size), heaps[t]);
+        }
+    };
+
+    if (threads == 1) {
+        worker(0);
+    } else {
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; t++) pool.emplace_back(worker, t);
+        for (std::thread &th : pool) th.join();
+    }
+
+    // Merge the per-thread heaps and keep the global best N
+    for (TopNHeap &heap : heaps) {
+        heap.drain(result);
+    }
+    std::sort(result.begin(), result.end(), TopNOrder{ascending});
+    if (static_cast<int>(result.size()) > N) result.resize(N);
+    return result;
+}
+
+/**
+ * @brief Finds the N best rows of a table with a pool of threads.
+ *
+ * The candidate rows are cut into blocks of roughly TOPN_BLOCK_BYTES which the
+ * workers claim one at a time, see parallel_topN_ranges.
+ *
+ * @param count Number of candidate rows.
+ * @param N Number of matches to keep.
+ * @param ascending True if smaller scores are better.
+ * @param row_bytes Bytes read per candidate, used to size the blocks.
+ * @param num_threads Worker threads, 0 uses every core.
+ * @param score Callable bool(size_t i, float &out); returns false to skip row i.
+ * @return The best (score, index) pairs, best first.
+ */
+template <typename ScoreFn>
+std::vector<std::pair<float, int>> parallel_topN(size_t count, int N, bool ascending, size_t row_bytes,
+                                                 int num_threads, ScoreFn score) {
+    size_t block_rows = std::max<size_t>(64, TOPN_BLOCK_BYTES / std::max<size_t>(row_bytes, 1));
+    return parallel_topN_ranges(count, block_rows, N, ascending, num_threads,
+        [&](size_t begin, size_t end, TopNHeap &heap) {
+            for (size_t i = begin; i < end; i++) {
+                float dist;
+                if (!score(i, dist)) continue;
+                heap.push(dist, static_cast<int>(i));
+            }
+        });
+}
+
+#endif //PROJ2_PARALLEL_TOPN_H
@@ -0,0 +1,157 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Per-image attributes stored as bitmaps, and filter expressions evaluated on them
+ */
+
+#ifndef PROJ2_PREDICATE_BITMAP_H
+#define PROJ2_PREDICATE_BITMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct FeatureTable;
+
+// Suffix of the predicate file written next to a feature file
+#define PREDICATE_FILE_SUFFIX ".pred"
+
+/**
+ * @brief One bit per row, 64 rows per word.
+ *
+ * Bits past size() are always zero, so counts and word-wise operations
+ * never see them.
+ */
+class RowBitmap {
+public:
+    explicit RowBitmap(size_t rows = 0, bool value = false) { assign(rows, value); }
+
+    void assign(size_t rows, bool value) {
+        rows_ = rows;
+        words_.assign((rows + 63) / 64, value ? ~uint64_t(0) : 0);
+        trim();
+    }
+
+    size_t size() const { return rows_; }
+    void set(size_t row) { words_[row >> 6] |= uint64_t(1) << (row & 63); }
+    bool test(size_t row) const { return (words_[row >> 6] >> (row & 63)) & 1; }
+
+    // Bits [first, first + count) as the low bits of a word, count <= 64 and a power of two dividing first
+    uint64_t bits(size_t first, int count) const {
+        uint64_t word = words_[first >> 6] >> (first & 63);
+        return count == 64 ? word : word & ((uint64_t(1) << count) - 1);
+    }
+
+    size_t count() const {
+        size_t total = 0;
+        for (uint64_t word : words_) total += __builtin_popcountll(word);
+        return total;
+    }
+
+    RowBitmap &operator&=(const RowBitmap &other) {
+        for (size_t w = 0; w < words_.size(); w++) words_[w] &= other.words_[w];
+        return *this;
+    }
+    RowBitmap &operator|=(const RowBitmap &other) {
+        for (size_t w = 0; w < words_.size(); w++) words_[w] |= other.words_[w];
+        return *this;
+    }
+    void flip() {
+        for (uint64_t &word : words_) word = ~word;
+        trim();
+    }
+
+    // Calls fn(row) for every set row in increasing order
+    template <typename Fn>
+    void for_each(Fn fn) const {
+        for (size_t w = 0; w < words_.size(); w++) {
+            for (uint64_t word = words_[w]; word != 0; word &= word - 1) {
+                fn(w * 64 + __builtin_ctzll(word));
+            }
+        }
+    }
+
+    // The set rows in increasing order
+    std::vector<int> set_rows() const {
+        std::vector<int> rows;
+        rows.reserve(count());
+        for_each([&](size_t row) { rows.push_back(static_cast<int>(row)); });
+        return rows;
+    }
+
+    std::vector<uint64_t> &words() { return words_; }
+    const std::vector<uint64_t> &words() const { return words_; }
+
+private:
+    void trim() {
+        if (rows_ % 64 != 0) words_.back() &= (uint64_t(1) << (rows_ % 64)) - 1;
+    }
+
+    size_t rows_ = 0;
+    std::vector<uint64_t> words_;
+};
+
+/**
+ * @brief Named bitmaps over the images of a feature file.
+ *
+ * Bit r of every bitmap describes the image ids[r]. The predicates are
+ * "has_face" (face rows, the flag is set), "has_blobs" (banana rows, the
+ * blob count is not zero) and "dir:<name>" for each directory the images
+ * come from.
+ */
+struct PredicateSet {
+    std::vector<int> ids;             // image_registry() ID of each row
+    std::vector<std::string> names;   // predicate names, sorted
+    std::vector<RowBitmap> bitmaps;   // one per name, ids.size() bits each
+
+    // Bitmap of a predicate, nullptr if the set does not have it
+    const RowBitmap *find(const std::string &name) const;
+};
+
+/**
+ * @brief Computes the predicates of every row of a table.
+ *
+ * @param table Table as read from its feature file.
+ * @param layout Feature layout, see column_layout: face rows give has_face, banana rows has_blobs.
+ * @param predicates Output predicates.
+ * @return non-zero if the rows are too short for the layout.
+ */
+int build_feature_predicates(const FeatureTable &table, const std::string &layout, PredicateSet &predicates);
+
+// The predicate file of a feature file: its path, without a column selector, plus PREDICATE_FILE_SUFFIX
+std::string predicate_file_name(const char *feature_file);
+
+/**
+ * @brief Writes the image names and bitmaps of a predicate set.
+ *
+ * @return non-zero failure.
+ */
+int write_feature_predicates(const char *filename, const PredicateSet &predicates);
+
+/**
+ * @brief Reads a predicate file, interning its image names.
+ *
+ * @return non-zero failure.
+ */
+int read_feature_predicates(const char *filename, PredicateSet &predicates);
+
+/**
+ * @brief Evaluates a filter expression into a bitmap over the rows of a table.
+ *
+ * The expression combines predicate names with ! (not), & (and), | (or)
+ * and parentheses, & binding tighter than |, e.g.
+ * "has_face & !dir:junk". It is evaluated word by word on the bitmaps of
+ * the set, then mapped to the rows of the table by image ID; rows the set
+ * does not describe never qualify.
+ *
+ * @param predicates Predicate set.
+ * @param expression Filter expression.
+ * @param table Table whose rows the result describes, indexed.
+ * @param rows Output bitmap, table.rows() bits.
+ * @return non-zero if the expression does not parse or names an unknown predicate.
+ */
+int evaluate_filter(const PredicateSet &predicates, const std::string &expression, const FeatureTable &table,
+                    RowBitmap &rows);
+
+#endif //PROJ2_PREDICATE_BITMAP_H
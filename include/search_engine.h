@@ -0,0 +1,299 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 12, 2025
+ * Purpose: Top-N search engine templated on the distance metric
+ */
+
+#ifndef PROJ2_SEARCH_ENGINE_H
+#define PROJ2_SEARCH_ENGINE_H
+
+#include "distance_calculate.h"
+#include "feature_table.h"
+#include "parallel_topn.h"
+#include "predicate_bitmap.h"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+/*
+  Metric policies. Each one scores a candidate row against the target row
+  in place and says at compile time whether smaller scores are better.
+  distance_lanes scores a whole block of the transposed layout at once.
+ */
+struct SsdMetric {
+    static constexpr bool ascending = true;
+    static float distance(const float *a, const float *b, int n) { return calculate_ssd(a, b, n); }
+    template <int LANES>
+    static void distance_lanes(const float *block, const float *next, const float *target, int n, float *out) {
+        lanes_ssd<LANES>(block, next, target, n, out);
+    }
+};
+
+struct HistIntersectionMetric {
+    static constexpr bool ascending = false; // intersection is a similarity
+    static float distance(const float *a, const float *b, int n) { return calculate_histogramIntersection(a, b, n); }
+    template <int LANES>
+    static void distance_lanes(const float *block, const float *next, const float *target, int n, float *out) {
+        lanes_intersection<LANES>(block, next, target, 0, n, out);
+    }
+};
+
+struct MultiHistMetric {
+    static constexpr bool ascending = true;
+    static float distance(const float *a, const float *b, int n) { return calculate_multiHist_distance(a, b, n); }
+    template <int LANES>
+    static void distance_lanes(const float *block, const float *next, const float *target, int n, float *out) {
+        lanes_two_halves<LANES>(block, next, target, n, out);
+    }
+};
+
+struct TextureColorMetric {
+    static constexpr bool ascending = true;
+    static float distance(const float *a, const float *b, int n) { return calculate_textureColor_distance(a, b, n); }
+    template <int LANES>
+    static void distance_lanes(const float *block, const float *next, const float *target, int n, float *out) {
+        lanes_two_halves<LANES>(block, next, target, n, out);
+    }
+};
+
+struct CosineMetric {
+    static constexpr bool ascending = true;
+    static float distance(const float *a, const float *b, int n) { return calculate_cosine_distance(a, b, n); }
+    template <int LANES>
+    static void distance_lanes(const float *block, const float *next, const float *target, int n, float *out) {
+        lanes_cosine<LANES>(block, next, target, n, out);
+    }
+};
+
+// Cosine distance on rows already normalized to unit length, a plain dot product
+struct UnitCosineMetric {
+    static constexpr bool ascending = true;
+    static float distance(const float *a, const float *b, int n) { return 1.0f - calculate_dot_product(a, b, n); }
+    template <int LANES>
+    static void distance_lanes(const float *block, const float *next, const float *target, int n, float *out) {
+        lanes_dot<LANES>(block, next, target, n, out);
+        for (int l = 0; l < LANES; l++) out[l] = 1.0f - out[l];
+    }
+};
+
+struct FaceCosineMetric {
+    static constexpr bool ascending = true;
+    static float distance(const float *a, const float *b, int n) { return calculate_face_distance(a, b, n); }
+    template <int LANES>
+    static void distance_lanes(const float *block, const float *next, const float *target, int n, float *out) {
+        lanes_face<LANES>(block, next, target, n, out);
+    }
+};
+
+/*
+  Candidate filters, applied to the candidate row before any distance is computed.
+ */
+struct AcceptAll {
+    static bool accept(const float *, int) { return true; }
+    template <int LANES>
+    static bool accept_lane(const float *, int, int) { return true; }
+};
+
+// Banana rows end with the number of valid blob pixels, skip images without blobs
+struct HasBlobs {
+    static bool accept(const float *row, int dim) { return row[dim - 1] != 0; }
+    template <int LANES>
+    static bool accept_lane(const float *block, int dim, int lane) { return block[(dim - 1) * LANES + lane] != 0; }
+};
+
+/*
+  Fusion of two tables: score = FirstWeight * First(first rows) + SecondWeight * Second(second rows).
+  The filter looks at the second table's row.
+ */
+template <typename First, typename Second, typename Weights, typename Filter = AcceptAll>
+struct FusedMetric {
+    typedef First first_metric;
+    typedef Second second_metric;
+    typedef Filter filter;
+    static constexpr bool ascending = true;
+    static constexpr double first_weight = Weights::first;
+    static constexpr double second_weight = Weights::second;
+};
+
+// Candidate blocks claimed by a worker at a time
+inline size_t blocks_per_chunk(size_t block_bytes) {
+    return std::max<size_t>(1, TOPN_BLOCK_BYTES / std::max<size_t>(block_bytes, 1));
+}
+
+// search_topN on the transposed layout, LANES candidates per kernel call
+template <typename Metric, typename Filter, int LANES>
+std::vector<std::pair<float, int>> search_topN_lanes(const FeatureTable &table, const float *target, int exclude,
+                                                     int N, int num_threads, const RowBitmap *allowed) {
+    const int dim = table.dim;
+    const size_t rows = table.rows();
+    const BlockedFeatures &blocked = table.blocked;
+    return parallel_topN_ranges(blocked.num_blocks, blocks_per_chunk(dim * LANES * sizeof(float)), N,
+                                Metric::ascending, num_threads,
+        [&](size_t begin, size_t end, TopNHeap &heap) {
+            float scores[LANES];
+            for (size_t b = begin; b < end; b++) {
+                // A block without a qualifying row is never scored
+                uint64_t lanes = allowed ? allowed->bits(b * LANES, LANES) : ~uint64_t(0);
+                if (lanes == 0) continue;
+                const float *next = b + 1 < blocked.num_blocks ? blocked.block(b + 1, dim) : nullptr;
+                const float *block = blocked.block(b, dim);
+                Metric::template distance_lanes<LANES>(block, next, target, dim, scores);
+                for (int l = 0; l < LANES; l++) {
+                    size_t i = b * LANES + l;
+                    if (i >= rows || static_cast<int>(i) == exclude || !((lanes >> l) & 1)) continue;
+                    if (!Filter::template accept_lane<LANES>(block, dim, l)) continue;
+                    heap.push(scores[l], static_cast<int>(i));
+                }
+            }
+        });
+}
+
+/**
+ * @brief Finds the N best rows of a table for a target row.
+ *
+ * Tables with a transposed block layout (build_blocked_layout) are scored a
+ * block at a time, other tables a row at a time. Both give the same scores.
+ * With an allowed bitmap only its rows are scored: blocks whose bits are
+ * all clear are skipped, and without the block layout the set rows are
+ * listed first and only those are read.
+ *
+ * @param table Candidate rows.
+ * @param target Target row, table.dim floats.
+ * @param exclude Row index to leave out (the target itself), -1 for none.
+ * @param N Number of matches to keep.
+ * @param num_threads Worker threads, 0 uses every core.
+ * @param allowed Rows that may match, table.rows() bits; nullptr allows every row.
+ * @return The best (score, row index) pairs, best first.
+ */
+template <typename Metric, typename Filter = AcceptAll>
+std::vector<std::pair<float, int>> search_topN(const FeatureTable &table, const float *target, int exclude,
+                                               int N, int num_threads, const RowBitmap *allowed = nullptr) {
+    if (table.blocked.lanes == 16) {
+        return search_topN_lanes<Metric, Filter, 16>(table, target, exclude, N, num_threads, allowed);
+    } else if (table.blocked.lanes == 8) {
+        return search_topN_lanes<Metric, Filter, 8>(table, target, exclude, N, num_threads, allowed);
+    }
+    const int dim = table.dim;
+    if (allowed != nullptr) {
+        std::vector<int> rows = allowed->set_rows();
+        std::vector<std::pair<float, int>> best = parallel_topN(rows.size(), N, Metric::ascending,
+                                                                dim * sizeof(float), num_threads,
+            [&](size_t k, float &dist) {
+                if (rows[k] == exclude) return false;
+                const float *row = table.row(rows[k]);
+                if (!Filter::accept(row, dim)) return false;
+                dist = Metric::distance(row, target, dim);
+                return true;
+            });
+        for (std::pair<float, int> &match : best) match.second = rows[match.second];
+        return best;
+    }
+    return parallel_topN(table.rows(), N, Metric::ascending, dim * sizeof(float), num_threads,
+        [&](size_t i, float &dist) {
+            if (static_cast<int>(i) == exclude) return false;
+            const float *row = table.row(i);
+            if (!Filter::accept(row, dim)) return false;
+            dist = Metric::distance(row, target, dim);
+            return true;
+        });
+}
+
+// search_topN_fused on two tables laid out with the same LANES
+template <typename Fusion, int LANES>
+std::vector<std::pair<float, int>> search_topN_fused_lanes(const FeatureTable &first, const float *first_target,
+                                                           const FeatureTable &second, const float *second_target,
+                                                           int exclude, int N, int num_threads,
+                                                           const RowBitmap *allowed) {
+    typedef typename Fusion::first_metric First;
+    typedef typename Fusion::second_metric Second;
+    typedef typename Fusion::filter Filter;
+    const int dim1 = first.dim;
+    const int dim2 = second.dim;
+    const size_t rows = std::min(first.rows(), second.rows());
+    const size_t num_blocks = std::min(first.blocked.num_blocks, second.blocked.num_blocks);
+    return parallel_topN_ranges(num_blocks, blocks_per_chunk((dim1 + dim2) * LANES * sizeof(float)), N,
+                                Fusion::ascending, num_threads,
+        [&](size_t begin, size_t end, TopNHeap &heap) {
+            float scores1[LANES], scores2[LANES];
+            for (size_t b = begin; b < end; b++) {
+                uint64_t lanes = allowed ? allowed->bits(b * LANES, LANES) : ~uint64_t(0);
+                if (lanes == 0) continue;
+                bool last = b + 1 >= num_blocks;
+                First::template distance_lanes<LANES>(first.blocked.block(b, dim1),
+                                                      last ? nullptr : first.blocked.block(b + 1, dim1),
+                                                      first_target, dim1, scores1);
+                Second::template distance_lanes<LANES>(second.blocked.block(b, dim2),
+                                                       last ? nullptr : second.blocked.block(b + 1, dim2),
+                                                       second_target, dim2, scores2);
+                for (int l = 0; l < LANES; l++) {
+                    size_t i = b * LANES + l;
+                    if (i >= rows || static_cast<int>(i) == exclude || !((lanes >> l) & 1)) continue;
+                    if (!Filter::template accept_lane<LANES>(second.blocked.block(b, dim2), dim2, l)) continue;
+                    float dist1 = scores1[l] * Fusion::first_weight;
+                    float dist2 = scores2[l] * Fusion::second_weight;
+                    heap.push(dist1 + dist2, static_cast<int>(i));
+                }
+            }
+        });
+}
+
+/**
+ * @brief Finds the N best rows for a target described in two row-aligned tables.
+ *
+ * Uses the transposed layout when both tables have it with the same width.
+ * An allowed bitmap restricts the rows scored as in search_topN.
+ *
+ * @param first First table, e.g. the ResNet18 embeddings.
+ * @param first_target Target row in the first table.
+ * @param second Second table, same row order as the first.
+ * @param second_target Target row in the second table.
+ * @param exclude Row index to leave out (the target itself), -1 for none.
+ * @param N Number of matches to keep.
+ * @param num_threads Worker threads, 0 uses every core.
+ * @param allowed Rows that may match, first.rows() bits; nullptr allows every row.
+ * @return The best (score, row index) pairs, best first.
+ */
+template <typename Fusion>
+std::vector<std::pair<float, int>> search_topN_fused(const FeatureTable &first, const float *first_target,
+                                                     const FeatureTable &second, const float *second_target,
+                                                     int exclude, int N, int num_threads,
+                                                     const RowBitmap *allowed = nullptr) {
+    if (first.blocked.lanes != 0 && first.blocked.lanes == second.blocked.lanes) {
+        if (first.blocked.lanes == 16) {
+            return search_topN_fused_lanes<Fusion, 16>(first, first_target, second, second_target, exclude, N,
+                                                       num_threads, allowed);
+        }
+        return search_topN_fused_lanes<Fusion, 8>(first, first_target, second, second_target, exclude, N,
+                                                  num_threads, allowed);
+    }
+    typedef typename Fusion::first_metric First;
+    typedef typename Fusion::second_metric Second;
+    typedef typename Fusion::filter Filter;
+    const int dim1 = first.dim;
+    const int dim2 = second.dim;
+    size_t count = std::min(first.rows(), second.rows());
+    std::vector<int> rows;
+    if (allowed != nullptr) {
+        rows = allowed->set_rows();
+        while (!rows.empty() && static_cast<size_t>(rows.back()) >= count) rows.pop_back();
+        count = rows.size();
+    }
+    std::vector<std::pair<float, int>> best = parallel_topN(count, N, Fusion::ascending, (dim1 + dim2) * sizeof(float),
+                                                            num_threads,
+        [&](size_t k, float &dist) {
+            int i = allowed ? rows[k] : static_cast<int>(k);
+            if (i == exclude) return false;
+            const float *row2 = second.row(i);
+            if (!Filter::accept(row2, dim2)) return false;
+            float dist1 = First::distance(first.row(i), first_target, dim1) * Fusion::first_weight;
+            float dist2 = Second::distance(row2, second_target, dim2) * Fusion::second_weight;
+            dist = dist1 + dist2;
+            return true;
+        });
+    if (allowed != nullptr) {
+        for (std::pair<float, int> &match : best) match.second = rows[match.second];
+    }
+    return best;
+}
+
+#endif //PROJ2_SEARCH_ENGINE_H
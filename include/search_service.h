@@ -0,0 +1,176 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 20, 2025
+ * Purpose: Feature tables loaded once and shared by every query of a long-running process
+ */
+
+#ifndef PROJ2_SEARCH_SERVICE_H
+#define PROJ2_SEARCH_SERVICE_H
+
+#include "feature_table.h"
+#include "image_search.h"
+#include <cstddef>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Default ResNet18 embeddings of the fused metrics
+#define DEFAULT_RESNET_FILE "../olympus/ResNet18_olym.csv"
+// Quiet time after the last change to a watched file before the tables are reloaded
+#define RELOAD_SETTLE_MS 300
+// How often the retire thread checks whether the queries still reading a replaced version are done
+#define RELOAD_RETIRE_POLL_MS 50
+// Fraction of a table's rows a reload must keep, fewer means the file was caught truncated
+#define RELOAD_MIN_ROWS_KEPT 0.9
+// Nice value of the reload thread and the loader threads it starts, so queries keep their cores
+#define RELOAD_NICE 10
+
+/*
+  Every table a query may need, read once at start-up. The tables are not
+  changed after loading, so any number of threads can query them at once.
+ */
+struct SearchService {
+    std::map<std::string, FeatureTable> tables; // feature table of each configured metric
+    FeatureTable resnet;                        // normalized ResNet18 embeddings for depth and banana
+    FeatureTable resnet_raw;                    // raw ResNet18 embeddings for face, which reads the face flag
+    int num_threads = 0;                        // search threads per query, 0 uses every core
+};
+
+/**
+ * @brief Loads the tables listed in a config file.
+ *
+ * Each line of the config holds a metric and the feature file it searches,
+ * e.g. "texture-color ../data/feature_vector_4.csv". A "resnet <file>" line
+ * sets the ResNet18 embeddings of the fused metrics (default DEFAULT_RESNET_FILE).
+ * Empty lines and lines starting with '#' are skipped.
+ *
+ * @param config_file Path of the config file.
+ * @param service Output service.
+ * @param lanes 0, 8 or 16, see build_blocked_layout.
+ * @return non-zero on failure.
+ */
+int load_search_service(char *config_file, SearchService &service, int lanes);
+
+/**
+ * @brief Loads a feature file per metric, plus the ResNet18 embeddings if a fused metric needs them.
+ *
+ * The fused tables are joined to the embeddings by image ID (see align_feature_table).
+ *
+ * @param files Feature file of each metric.
+ * @param resnet_file ResNet18 embeddings of depth, banana and face.
+ * @param service Output service.
+ * @param lanes 0, 8 or 16, see build_blocked_layout.
+ * @param strict If true, a malformed row in any file fails the load, see read_feature_table.
+ * @return non-zero on failure.
+ */
+int load_search_tables(const std::map<std::string, std::string> &files, const std::string &resnet_file,
+                       SearchService &service, int lanes, bool strict = false);
+
+/**
+ * @brief Finds the N best matches of a target image with a configured metric.
+ *
+ * @return non-zero if the metric is not configured or the target is not found.
+ */
+int search_service_query(SearchService &service, const std::string &metric, char *target_image_filename, int N,
+                         std::vector<Match> &matches);
+
+// True if the metric reports filenames without the image directory, as the ResNet18 table stores them
+bool metric_uses_bare_names(const std::string &metric);
+
+// Versions published by a ServiceReloader
+struct ReloadStats {
+    uint64_t version = 0;      // 1 after the first load, +1 per reload
+    size_t reloads = 0;        // reloads published
+    size_t failures = 0;       // reloads that kept the previous version
+    double last_reload_ms = 0.0;
+};
+
+/**
+ * @brief A SearchService that is rebuilt when its config or feature files
+ * change, without stopping the queries.
+ *
+ * Queries call snapshot() and search the service it returns; the pointer
+ * keeps that version alive until the query drops it. A reload builds a
+ * complete new service on the watcher thread, from the config as it is
+ * now, and publishes it by swapping one pointer, so queries that started
+ * before the swap finish on the old version and later ones see the new
+ * one. The old version is freed on a retire thread once the last query
+ * using it is done, not by whichever query happens to hold it last, so no
+ * query pays for unmapping a table; this happens for reloads requested by
+ * a client as well as for watched ones.
+ *
+ * A reload is stricter than the first load: a malformed row in any file,
+ * or a table that keeps fewer than RELOAD_MIN_ROWS_KEPT of its rows, is
+ * taken for a file caught half written, and the current version is kept.
+ *
+ * The watcher uses inotify on the directories of the files, so writing a
+ * file in place or renaming a new one over it both trigger a reload, once
+ * the files have been quiet for RELOAD_SETTLE_MS; a feature store is
+ * watched through its MANIFEST. Memory holds two versions while a reload
+ * runs.
+ */
+class ServiceReloader {
+public:
+    ServiceReloader() = default;
+    ServiceReloader(const ServiceReloader &) = delete;
+    ServiceReloader &operator=(const ServiceReloader &) = delete;
+    ~ServiceReloader();
+
+    /**
+     * @brief Loads the first version, see load_search_service.
+     *
+     * @param config_file Path of the config file, read again by every reload.
+     * @param lanes 0, 8 or 16, see build_blocked_layout.
+     * @param num_threads Search threads per query of every version, 0 uses every core.
+     * @return non-zero on failure.
+     */
+    int load(const std::string &config_file, int lanes, int num_threads);
+
+    // Rebuilds the service from the config now and publishes it, non-zero if the current version is kept
+    int reload();
+
+    // Reloads on a background thread whenever a watched file changes, non-zero if inotify is unavailable
+    int start_watching();
+
+    // Stops the watcher, waiting for a running reload
+    void stop_watching();
+
+    // The current version, kept alive by the caller for as long as it is queried
+    std::shared_ptr<SearchService> snapshot() const;
+
+    ReloadStats stats() const;
+
+private:
+    int build(std::shared_ptr<SearchService> &service, std::vector<std::string> &files, bool strict);
+    void release_retired();
+    void retire_loop();
+    int watch_files(const std::vector<std::string> &files);
+    void watch_loop();
+
+    std::string config_file_;
+    int lanes_ = 0;
+    int num_threads_ = 0;
+    std::mutex reload_mutex_;           // one reload at a time
+    mutable std::mutex snapshot_mutex_; // guards snapshot_ and stats_
+    std::shared_ptr<SearchService> snapshot_;
+    ReloadStats stats_;
+
+    std::mutex retire_mutex_; // guards retired_ and stopping_
+    std::condition_variable retire_cv_;
+    std::vector<std::shared_ptr<SearchService>> retired_; // replaced versions that queries may still read
+    std::thread retirer_;
+    bool stopping_ = false;
+
+    std::vector<std::string> files_;                      // config and feature files of the current version
+    std::map<int, std::vector<std::string>> watched_;     // inotify watch of a directory -> filenames in it
+    std::thread watcher_;
+    int inotify_fd_ = -1;
+    int wake_pipe_[2] = {-1, -1};
+};
+
+#endif //PROJ2_SEARCH_SERVICE_H
@@ -0,0 +1,63 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Out-of-core search streaming a feature file in fixed-size chunks
+ */
+
+#ifndef PROJ2_STREAM_SEARCH_H
+#define PROJ2_STREAM_SEARCH_H
+
+#include "feature_arena.h"
+#include "image_search.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Bytes read per chunk by default
+#define STREAM_CHUNK_BYTES (16 << 20)
+
+// Work done by one streamed search
+struct StreamStats {
+    size_t rows = 0;          // rows scored
+    size_t malformed = 0;     // rows skipped, see parse_feature_row
+    size_t chunks = 0;        // chunks of the scoring pass
+    size_t bytes = 0;         // bytes read by both passes
+    double find_ms = 0.0;     // first pass, up to the target row
+    double scan_ms = 0.0;     // second pass
+    double read_wait_ms = 0.0; // time the second pass waited for a chunk to arrive
+};
+
+// Metrics a streamed search can score with
+bool stream_supports_metric(const std::string &metric);
+
+/**
+ * @brief Finds the top N matches of a target by streaming a feature file
+ * instead of loading it.
+ *
+ * A first pass reads up to the target's row. The scoring pass then reads
+ * the file in chunks of chunk_bytes into two buffers: while the rows of one
+ * chunk are scored on a pool of threads, the next chunk is read into the
+ * other. The kernel is also told the file is read sequentially. Each thread
+ * keeps a bounded heap of its best rows and the names of the rows in it, so
+ * memory stays at two chunks and a few N names however large the file is.
+ *
+ * Rows are numbered in file order. Scores match the in-memory search of the
+ * metric; only the order of equal scores may differ, since a loaded table
+ * is sorted by filename.
+ *
+ * @param metric ssd, rgb-hist, multi-hist, texture-color or cosine.
+ * @param feature_file Feature CSV file.
+ * @param target_image_filename Target image, must be in the file.
+ * @param N Number of matches.
+ * @param names Arena the filenames of the matches are stored in.
+ * @param matches Output matches, best first; row is the row in file order.
+ * @param num_threads Scoring threads, 0 uses every core.
+ * @param chunk_bytes Bytes per chunk.
+ * @param stats Optional counters, overwritten.
+ * @return non-zero failure.
+ */
+int stream_topN_matches(const std::string &metric, const char *feature_file, const char *target_image_filename, int N,
+                        NameArena &names, std::vector<Match> &matches, int num_threads,
+                        size_t chunk_bytes = STREAM_CHUNK_BYTES, StreamStats *stats = nullptr);
+
+#endif //PROJ2_STREAM_SEARCH_H
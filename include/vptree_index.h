@@ -0,0 +1,115 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Vantage-point tree for exact nearest neighbor and range search with the ssd distance
+ */
+
+#ifndef PROJ2_VPTREE_INDEX_H
+#define PROJ2_VPTREE_INDEX_H
+
+#include "feature_table.h"
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Rows kept in a leaf, scanned linearly
+#define VPTREE_LEAF_SIZE 16
+
+// Work done by one search, for comparing against a linear scan
+struct VpTreeStats {
+    size_t distance_evaluations = 0;
+    size_t nodes_visited = 0;
+};
+
+/**
+ * @brief Vantage-point tree over the rows of a FeatureTable for the calculate_ssd distance.
+ *
+ * calculate_ssd is the Euclidean distance, a true metric, so the triangle
+ * inequality bounds the distance of every row in a subtree from the query's
+ * distance to the subtree's vantage point. Each inner node splits its rows
+ * at the median distance to its vantage point and keeps the distance range
+ * of both halves; a search skips a half whose range can not hold anything
+ * closer than the current k-th match (or the radius). Results are exact.
+ *
+ * The tree shape depends only on the number of rows, so nodes are stored in
+ * preorder in one array at positions known before the build, and subtrees
+ * are built in parallel without locks. The table must stay alive and have
+ * the same rows when the index is loaded again; a fingerprint of the row
+ * names and values is saved to check that.
+ */
+class VpTreeIndex {
+public:
+    /**
+     * @brief Builds the tree over every row of a table.
+     *
+     * @param table Feature table.
+     * @param num_threads Threads building subtrees at once, 0 uses every core.
+     * @return non-zero failure.
+     */
+    int build(const FeatureTable &table, int num_threads);
+
+    // Writes the tree to a file, non-zero failure
+    int save(const char *filename) const;
+
+    // Reads a tree written by save for the table it was built on, non-zero failure
+    int load(const char *filename, const FeatureTable &table);
+
+    /**
+     * @brief Finds the exact N nearest rows of a query.
+     *
+     * @param query Query of table.dim floats.
+     * @param N Number of matches.
+     * @param exclude Row to leave out (the query itself), -1 for none.
+     * @param stats Optional counters of the work done, added to.
+     * @return (calculate_ssd distance, row) pairs, best first, ties by row like search_topN.
+     */
+    std::vector<std::pair<float, int>> knn_search(const float *query, int N, int exclude,
+                                                  VpTreeStats *stats = nullptr) const;
+
+    /**
+     * @brief Finds every row within a distance of a query.
+     *
+     * @param query Query of table.dim floats.
+     * @param radius Largest calculate_ssd distance to return.
+     * @param exclude Row to leave out (the query itself), -1 for none.
+     * @param stats Optional counters of the work done, added to.
+     * @return (calculate_ssd distance, row) pairs, closest first.
+     */
+    std::vector<std::pair<float, int>> radius_search(const float *query, float radius, int exclude,
+                                                     VpTreeStats *stats = nullptr) const;
+
+    size_t size() const { return n_; }
+    size_t node_count() const { return nodes_.size(); }
+
+private:
+    /*
+      A leaf scans order_[begin, end). An inner node's vantage point is
+      order_[begin]; its inside child (the next node) holds the rows closer
+      than the median in order_[begin + 1, middle), its outside child the rest.
+     */
+    struct Node {
+        int32_t begin;
+        int32_t end;
+        int32_t outside; // index of the outside child, -1 for a leaf
+        int32_t middle;
+        float inside_min, inside_max;   // distance range of the inside rows to the vantage point
+        float outside_min, outside_max; // distance range of the outside rows
+    };
+
+    // Depth-first search calling results.add on every row not pruned by results.bound()
+    template <typename Results>
+    void traverse(const float *query, int exclude, Results &results, VpTreeStats &stats) const;
+    void build_node(int node, int begin, int end, int spare_threads, std::vector<float> &dist);
+    int choose_vantage_point(int begin, int end, unsigned int seed) const;
+    float distance(const float *query, int row) const;
+
+    size_t n_ = 0;
+    int dim_ = 0;
+    uint64_t fingerprint_ = 0;       // feature_table_fingerprint of the table
+    const float *vectors_ = nullptr; // rows of the table, row-major
+    std::vector<Node> nodes_;        // preorder
+    std::vector<int32_t> order_;     // table rows permuted into subtree ranges
+};
+
+#endif //PROJ2_VPTREE_INDEX_H
@@ -0,0 +1,227 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 23, 2025
+ * Purpose: Top N matches of many targets against tables loaded once, streamed to a CSV or JSONL file
+ */
+#include "../include/batch_search.h"
+#include "../include/json_util.h"
+#include "../include/parallel_for.h"
+#include "../include/search_service.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Targets searched between two writes of the output and the progress line
+#define BATCH_CHUNK 256
+
+// Result of one target, error is empty on success
+struct TargetResult {
+    vector<Match> matches;
+    string error;
+};
+
+// Reads one target path per line, or every image of the table for "all"
+static int read_targets(const char *targets_file, const FeatureTable &table, vector<string> &targets) {
+    if (strcmp(targets_file, "all") == 0) {
+        for (char *filename : table.filenames) targets.push_back(filename);
+        return 0;
+    }
+    FILE *fp = fopen(targets_file, "r");
+    if (!fp) {
+        cerr << "Unable to open targets file: " << targets_file << endl;
+        return -1;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        targets.push_back(line);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/*
+  ssd and cosine go through the cache-blocked batch API, which scores a
+  tile of targets per pass over the table. Targets missing from the table
+  are reported and skipped.
+ */
+static void run_chunk_batch(SearchService &service, const string &metric, const vector<string> &targets,
+                            size_t begin, size_t end, int N, int num_threads, vector<TargetResult> &results) {
+    FeatureTable &table = service.tables[metric];
+    vector<int> rows;
+    vector<size_t> slots;
+    for (size_t i = begin; i < end; i++) {
+        int row = find_table_row(table, targets[i].c_str());
+        if (row == -1) {
+            results[i - begin].error = "target image not found";
+            continue;
+        }
+        rows.push_back(row);
+        slots.push_back(i - begin);
+    }
+    vector<vector<pair<float, int>>> found;
+    BatchMetric batch_metric = metric == "cosine" ? BatchMetric::COSINE : BatchMetric::SSD;
+    if (batch_topN_rows(table, rows, N, batch_metric, num_threads, found) != 0) {
+        for (size_t slot : slots) results[slot].error = "search failed";
+        return;
+    }
+    for (size_t q = 0; q < slots.size(); q++) {
+        for (const pair<float, int> &match : found[q]) {
+            results[slots[q]].matches.push_back({table.filenames[match.second], match.first, match.second});
+        }
+    }
+}
+
+// Every other metric runs one single-threaded search per target, targets in parallel
+static void run_chunk_single(SearchService &service, const string &metric, const vector<string> &targets,
+                             size_t begin, size_t end, int N, int num_threads, vector<TargetResult> &results) {
+    parallel_for(end - begin, num_threads, [&](size_t i, int) {
+        TargetResult &result = results[i];
+        if (search_service_query(service, metric, const_cast<char *>(targets[begin + i].c_str()), N,
+                                 result.matches) != 0) {
+            result.error = "target image not found";
+        }
+    });
+}
+
+// Writes the results of targets [begin, end) in input order
+static void write_results(FILE *out, bool jsonl, const string &prefix, const vector<string> &targets, size_t begin,
+                          const vector<TargetResult> &results, size_t &failed) {
+    for (size_t i = 0; i < results.size(); i++) {
+        const string &target = targets[begin + i];
+        const TargetResult &result = results[i];
+        if (!result.error.empty()) failed++;
+        if (jsonl) {
+            string line = "{\"target\":" + json_string(target);
+            if (!result.error.empty()) {
+                line += ",\"error\":" + json_string(result.error) + "}";
+            } else {
+                line += ",\"results\":[";
+                for (size_t m = 0; m < result.matches.size(); m++) {
+                    char score[32];
+                    snprintf(score, sizeof(score), "%.6g", result.matches[m].score);
+                    if (m > 0) line += ",";
+                    line += "{\"file\":" + json_string(prefix + result.matches[m].filename) + ",\"score\":" + score + "}";
+                }
+                line += "]}";
+            }
+            fprintf(out, "%s\n", line.c_str());
+        } else {
+            for (size_t m = 0; m < result.matches.size(); m++) {
+                fprintf(out, "%s,%zu,%s%s,%.6g\n", target.c_str(), m + 1, prefix.c_str(), result.matches[m].filename,
+                        result.matches[m].score);
+            }
+        }
+    }
+}
+
+/**
+ * Finds the top N matches of every target in a list with the tables loaded once,
+ * and streams them to a CSV (target,rank,match,score) or JSONL file.
+ *
+ * @param argv argv[1] - targets file, one image path per line, or "all" for every image of the feature file
+ *             argv[2] - feature file
+ *             argv[3] - N
+ *             argv[4] - distance metric, same as image_matcher
+ *             argv[5] - output file, ".jsonl" writes JSON lines, anything else CSV
+ *             Optional flags after argv[5]:
+ *             --threads <n> - targets searched at once, 0 (default) uses every core
+ *             --lanes <8|16> - score candidates in the transposed block layout
+ *             --resnet <file> - ResNet18 embeddings for depth, banana and face
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 6) {
+        printf("usage: %s <targets_file|all> <feature_file> <N> <distance_metric> <output.csv|output.jsonl> "
+               "[--threads <n>] [--lanes <8|16>] [--resnet <file>]\n", argv[0]);
+        printf("distance_metric options: %s\n", metric_names().c_str());
+        exit(-1);
+    }
+    int N = atoi(argv[3]);
+    string metric = argv[4];
+    const char *output_file = argv[5];
+    int num_threads = 0;
+    int lanes = 0;
+    string resnet_file = DEFAULT_RESNET_FILE;
+    for (int i = 6; i < argc; i++) {
+        if ((strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-t") == 0) && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lanes") == 0 && i + 1 < argc) {
+            lanes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--resnet") == 0 && i + 1 < argc) {
+            resnet_file = argv[++i];
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+    if (N <= 0) {
+        printf("Invalid value for N: %d. N must be a positive integer.\n", N);
+        exit(-1);
+    }
+    if (!is_valid_metric(metric)) {
+        printf("Invalid distance metric: %s. Must be one of %s\n", metric.c_str(), metric_names().c_str());
+        exit(-1);
+    }
+
+    // Each target is searched on one thread, the threads work on different targets
+    SearchService service;
+    service.num_threads = 1;
+    map<string, string> files;
+    files[metric] = argv[2];
+    auto load_start = chrono::steady_clock::now();
+    if (load_search_tables(files, resnet_file, service, lanes) != 0) {
+        exit(-1);
+    }
+    double load_s = chrono::duration<double>(chrono::steady_clock::now() - load_start).count();
+
+    vector<string> targets;
+    if (read_targets(argv[1], service.tables[metric], targets) != 0) {
+        exit(-1);
+    }
+
+    size_t name_len = strlen(output_file);
+    bool jsonl = name_len >= 6 && strcmp(output_file + name_len - 6, ".jsonl") == 0;
+    FILE *out = fopen(output_file, "w");
+    if (!out) {
+        printf("Unable to open output file %s\n", output_file);
+        exit(-1);
+    }
+    if (!jsonl) fprintf(out, "target,rank,match,score\n");
+
+    bool use_batch_api = metric == "ssd" || metric == "cosine";
+    string prefix = metric_uses_bare_names(metric) ? "../olympus/" : "";
+    int threads = resolve_thread_count(num_threads);
+    fprintf(stderr, "Loaded tables in %.2f s, searching %zu targets with %d threads\n", load_s, targets.size(),
+            threads);
+
+    size_t failed = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t begin = 0; begin < targets.size(); begin += BATCH_CHUNK) {
+        size_t end = std::min(targets.size(), begin + BATCH_CHUNK);
+        vector<TargetResult> results(end - begin);
+        if (use_batch_api) {
+            run_chunk_batch(service, metric, targets, begin, end, N, threads, results);
+        } else {
+            run_chunk_single(service, metric, targets, begin, end, N, threads, results);
+        }
+        write_results(out, jsonl, prefix, targets, begin, results, failed);
+        fflush(out);
+
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        fprintf(stderr, "\r%zu/%zu targets, %.1f queries/s", end, targets.size(),
+                elapsed > 0 ? end / elapsed : 0.0);
+    }
+    fclose(out);
+
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "\nSearched %zu targets in %.2f s (%.1f queries/s), %zu not found, results in %s\n",
+            targets.size(), elapsed, elapsed > 0 ? targets.size() / elapsed : 0.0, failed, output_file);
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 14, 2025
+ * Purpose: Cache-blocked multi-query distance computation for cosine and SSD
+ */
+#include "../include/batch_search.h"
+#include "../include/parallel_for.h"
+#include "../include/parallel_topn.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+
+// Queries handled together by one worker, a multiple of the 4x4 micro-kernel
+#define BATCH_QUERY_TILE 16
+// Table rows scored per pass, sized so one tile of rows stays in L2
+#define BATCH_ROW_TILE_BYTES (128 * 1024)
+
+// Squared L2 norm of a row
+static float squared_norm(const float *row, int dim) {
+    float sum = 0.0f;
+    for (int d = 0; d < dim; d++) sum += row[d] * row[d];
+    return sum;
+}
+
+// Copies rows scaled to unit L2 norm, zero rows stay zero
+static void normalize_rows(const float *src, size_t rows, int dim, vector<float> &dst) {
+    dst.resize(rows * dim);
+    for (size_t i = 0; i < rows; i++) {
+        const float *in = src + i * dim;
+        float *out = dst.data() + i * dim;
+        float norm = std::sqrt(squared_norm(in, dim));
+        float scale = norm > 0.0f ? 1.0f / norm : 0.0f;
+        for (int d = 0; d < dim; d++) out[d] = in[d] * scale;
+    }
+}
+
+/*
+  4 queries x 4 rows of dot products. Every loaded value is used four times
+  and the sixteen sums are independent, which keeps the FPU busy.
+ */
+static void dot_kernel_4x4(const float *a, const float *b, int dim, float *out, int ldo) {
+    const float *a0 = a, *a1 = a + dim, *a2 = a + 2 * dim, *a3 = a + 3 * dim;
+    const float *b0 = b, *b1 = b + dim, *b2 = b + 2 * dim, *b3 = b + 3 * dim;
+    float c00 = 0, c01 = 0, c02 = 0, c03 = 0;
+    float c10 = 0, c11 = 0, c12 = 0, c13 = 0;
+    float c20 = 0, c21 = 0, c22 = 0, c23 = 0;
+    float c30 = 0, c31 = 0, c32 = 0, c33 = 0;
+    for (int d = 0; d < dim; d++) {
+        float x0 = a0[d], x1 = a1[d], x2 = a2[d], x3 = a3[d];
+        float y0 = b0[d], y1 = b1[d], y2 = b2[d], y3 = b3[d];
+        c00 += x0 * y0; c01 += x0 * y1; c02 += x0 * y2; c03 += x0 * y3;
+        c10 += x1 * y0; c11 += x1 * y1; c12 += x1 * y2; c13 += x1 * y3;
+        c20 += x2 * y0; c21 += x2 * y1; c22 += x2 * y2; c23 += x2 * y3;
+        c30 += x3 * y0; c31 += x3 * y1; c32 += x3 * y2; c33 += x3 * y3;
+    }
+    out[0] = c00; out[1] = c01; out[2] = c02; out[3] = c03; out += ldo;
+    out[0] = c10; out[1] = c11; out[2] = c12; out[3] = c13; out += ldo;
+    out[0] = c20; out[1] = c21; out[2] = c22; out[3] = c23; out += ldo;
+    out[0] = c30; out[1] = c31; out[2] = c32; out[3] = c33;
+}
+
+// Dot products of a queries x rows tile into out, row-major with leading dimension ldo
+static void dot_tile(const float *a, int num_a, const float *b, int num_b, int dim, float *out, int ldo) {
+    int full_a = num_a - num_a % 4;
+    int full_b = num_b - num_b % 4;
+    for (int i = 0; i < full_a; i += 4) {
+        for (int j = 0; j < full_b; j += 4) {
+            dot_kernel_4x4(a + i * dim, b + j * dim, dim, out + i * ldo + j, ldo);
+        }
+    }
+    // Edges of the tile that do not fill a 4x4 block
+    for (int i = 0; i < num_a; i++) {
+        int j_start = i < full_a ? full_b : 0;
+        for (int j = j_start; j < num_b; j++) {
+            const float *x = a + i * dim;
+            const float *y = b + j * dim;
+            float sum = 0.0f;
+            for (int d = 0; d < dim; d++) sum += x[d] * y[d];
+            out[i * ldo + j] = sum;
+        }
+    }
+}
+
+int batch_topN(const FeatureTable &table, const float *queries, size_t num_queries, const int *exclude,
+               int N, BatchMetric metric, int num_threads,
+               std::vector<std::vector<std::pair<float, int>>> &results) {
+    const int dim = table.dim;
+    const size_t rows = table.rows();
+    results.assign(num_queries, vector<pair<float, int>>());
+    if (num_queries == 0 || rows == 0 || N <= 0) return 0;
+    if (dim <= 0) {
+        cerr << "Feature table has no columns" << endl;
+        return -1;
+    }
+
+    // Prepare both sides once: unit rows for cosine, squared norms for SSD.
+    // Tables from read_feature_table carry their norms and may already be normalized.
+    const float *b = table.values.data();
+    const float *a = queries;
+    vector<float> unit_table, unit_queries, table_norms, query_norms;
+    if (metric == BatchMetric::COSINE) {
+        if (!table.normalized) {
+            normalize_rows(table.values.data(), rows, dim, unit_table);
+            b = unit_table.data();
+        }
+        normalize_rows(queries, num_queries, dim, unit_queries);
+        a = unit_queries.data();
+    } else {
+        table_norms.resize(rows);
+        query_norms.resize(num_queries);
+        bool have_norms = table.norms.size() == rows;
+        for (size_t i = 0; i < rows; i++) {
+            table_norms[i] = have_norms ? table.norms[i] * table.norms[i] : squared_norm(table.row(i), dim);
+        }
+        for (size_t q = 0; q < num_queries; q++) query_norms[q] = squared_norm(queries + q * dim, dim);
+    }
+
+    const int row_tile = std::max(16, static_cast<int>(BATCH_ROW_TILE_BYTES / (dim * sizeof(float))) / 4 * 4);
+    const size_t num_query_tiles = (num_queries + BATCH_QUERY_TILE - 1) / BATCH_QUERY_TILE;
+    int threads = static_cast<int>(std::min<size_t>(resolve_thread_count(num_threads), num_query_tiles));
+    vector<vector<float>> scratch(threads, vector<float>(static_cast<size_t>(BATCH_QUERY_TILE) * row_tile));
+
+    parallel_for(num_query_tiles, threads, [&](size_t tile, int t) {
+        size_t q0 = tile * BATCH_QUERY_TILE;
+        int nq = static_cast<int>(std::min<size_t>(BATCH_QUERY_TILE, num_queries - q0));
+        float *scores = scratch[t].data();
+        vector<TopNHeap> heaps(nq, TopNHeap(N, true));
+
+        for (size_t r0 = 0; r0 < rows; r0 += row_tile) {
+            int nr = static_cast<int>(std::min<size_t>(row_tile, rows - r0));
+            dot_tile(a + q0 * dim, nq, b + r0 * dim, nr, dim, scores, row_tile);
+
+            for (int i = 0; i < nq; i++) {
+                size_t q = q0 + i;
+                int skip = exclude != nullptr ? exclude[q] : -1;
+                const float *dots = scores + i * row_tile;
+                for (int j = 0; j < nr; j++) {
+                    int r = static_cast<int>(r0 + j);
+                    if (r == skip) continue;
+                    float dist;
+                    if (metric == BatchMetric::COSINE) {
+                        dist = 1.0f - dots[j];
+                    } else {
+                        dist = std::sqrt(std::max(0.0f, query_norms[q] + table_norms[r] - 2.0f * dots[j]));
+                    }
+                    heaps[i].push(dist, r);
+                }
+            }
+        }
+        for (int i = 0; i < nq; i++) results[q0 + i] = heaps[i].sorted();
+    });
+    return 0;
+}
+
+int batch_topN_rows(const FeatureTable &table, const std::vector<int> &query_rows, int N, BatchMetric metric,
+                    int num_threads, std::vector<std::vector<std::pair<float, int>>> &results) {
+    vector<float> queries;
+    queries.reserve(query_rows.size() * table.dim);
+    for (int r : query_rows) {
+        if (r < 0 || static_cast<size_t>(r) >= table.rows()) {
+            cerr << "Query row " << r << " is not in the table" << endl;
+            return -1;
+        }
+        queries.insert(queries.end(), table.row(r), table.row(r) + table.dim);
+    }
+    return batch_topN(table, queries.data(), query_rows.size(), query_rows.data(), N, metric, num_threads, results);
+}
@@ -0,0 +1,169 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Loading and running cascade query plans
+ */
+#include "../include/cascade_plan.h"
+#include "../include/search_engine.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+// Metrics a stage can score with, the distance of the search engine policy
+struct StageMetric {
+    const char *name;
+    float (*distance)(const float *, const float *, int);
+    bool ascending;
+};
+
+// cosine tables are normalized on load, so cosine is a dot product
+static const StageMetric stage_metrics[] = {
+    {"ssd", SsdMetric::distance, true},
+    {"rgb-hist", HistIntersectionMetric::distance, false},
+    {"multi-hist", MultiHistMetric::distance, true},
+    {"texture-color", TextureColorMetric::distance, true},
+    {"cosine", UnitCosineMetric::distance, true},
+    {"face", FaceCosineMetric::distance, true},
+};
+
+static const StageMetric *find_stage_metric(const std::string &name) {
+    for (const StageMetric &metric : stage_metrics) {
+        if (name == metric.name) return &metric;
+    }
+    return nullptr;
+}
+
+int load_cascade_plan(const char *plan_file, CascadePlan &plan) {
+    FILE *fp = fopen(plan_file, "r");
+    if (!fp) {
+        cerr << "Unable to open plan file: " << plan_file << endl;
+        return -1;
+    }
+    plan.stages.clear();
+    plan.tables.clear();
+    char line[1024];
+    int line_number = 0;
+    bool open_ended = false; // a stage without a count must be the last
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_number++;
+        istringstream fields(line);
+        CascadeStage stage;
+        if (!(fields >> stage.metric) || stage.metric[0] == '#') continue;
+        if (open_ended) {
+            cerr << plan_file << ":" << line_number << ": only the last stage may leave out its count" << endl;
+            fclose(fp);
+            return -1;
+        }
+        if (find_stage_metric(stage.metric) == nullptr) {
+            cerr << plan_file << ":" << line_number << ": invalid stage metric " << stage.metric << endl;
+            fclose(fp);
+            return -1;
+        }
+        if (!(fields >> stage.feature_file)) {
+            cerr << plan_file << ":" << line_number << ": missing feature file for " << stage.metric << endl;
+            fclose(fp);
+            return -1;
+        }
+        if (!(fields >> stage.keep)) {
+            stage.keep = 0;
+            open_ended = true;
+        } else if (stage.keep <= 0) {
+            cerr << plan_file << ":" << line_number << ": the count must be positive" << endl;
+            fclose(fp);
+            return -1;
+        }
+        plan.stages.push_back(stage);
+    }
+    fclose(fp);
+    if (plan.stages.empty()) {
+        cerr << "No stage in " << plan_file << endl;
+        return -1;
+    }
+    return 0;
+}
+
+int run_cascade(CascadePlan &plan, char *target_image_filename, int N, std::vector<Match> &matches,
+                std::vector<CascadeStageReport> &report, int num_threads) {
+    matches.clear();
+    report.assign(plan.stages.size(), CascadeStageReport());
+    plan.tables.clear();
+    plan.tables.resize(plan.stages.size());
+    vector<int> candidates; // image IDs that reached the stage, as named by the stage before
+    int target_id = -1;     // image ID of the target in the stage before
+    vector<pair<float, int>> kept;
+    for (size_t s = 0; s < plan.stages.size(); s++) {
+        const CascadeStage &stage = plan.stages[s];
+        const StageMetric *metric = find_stage_metric(stage.metric);
+        FeatureTable &table = plan.tables[s];
+        CascadeStageReport &stats = report[s];
+        char *file = const_cast<char *>(stage.feature_file.c_str());
+        const bool cosine = stage.metric == "cosine";
+
+        // The first stage reads the collection, the others the candidates and the target
+        auto t0 = chrono::steady_clock::now();
+        int loaded;
+        if (s == 0) {
+            loaded = read_feature_table(file, table, cosine);
+        } else {
+            // Stages may name an image by path or by bare file name, the rows are matched as in a join
+            vector<int> wanted(candidates);
+            wanted.push_back(target_id);
+            loaded = read_feature_table_rows(file, wanted, table, cosine);
+        }
+        if (loaded != 0) {
+            cerr << "Can not read the image csv file: " << stage.feature_file << endl;
+            return -1;
+        }
+        auto t1 = chrono::steady_clock::now();
+        stats.load_ms = chrono::duration<double, milli>(t1 - t0).count();
+        stats.rows_loaded = table.rows();
+
+        int target_index = find_table_row(table, target_image_filename);
+        if (target_index == -1) {
+            cerr << "Target image not found in " << stage.feature_file << endl;
+            return -1;
+        }
+        target_id = table.ids[target_index];
+        const float *target = table.row(target_index);
+        const int dim = table.dim;
+        const bool last = s + 1 == plan.stages.size();
+        int keep = last ? (stage.keep > 0 ? std::min(stage.keep, N) : N) : stage.keep;
+
+        if (s == 0) {
+            stats.candidates_in = table.rows() - 1;
+            kept = parallel_topN(table.rows(), keep, metric->ascending, dim * sizeof(float), num_threads,
+                [&](size_t i, float &dist) {
+                    if (static_cast<int>(i) == target_index) return false;
+                    dist = metric->distance(table.row(i), target, dim);
+                    return true;
+                });
+        } else {
+            // Candidates missing from this table are dropped
+            stats.candidates_in = candidates.size();
+            ImageNameIndex index(table.row_of_id, table.bare_names);
+            vector<int> rows(candidates.size());
+            for (size_t i = 0; i < candidates.size(); i++) rows[i] = index.find(candidates[i]);
+            kept = parallel_topN(candidates.size(), keep, metric->ascending, dim * sizeof(float), num_threads,
+                [&](size_t i, float &dist) {
+                    if (rows[i] < 0 || rows[i] == target_index) return false;
+                    dist = metric->distance(table.row(rows[i]), target, dim);
+                    return true;
+                });
+            for (pair<float, int> &match : kept) match.second = rows[match.second];
+        }
+        candidates.clear();
+        for (const pair<float, int> &match : kept) candidates.push_back(table.ids[match.second]);
+        stats.candidates_out = kept.size();
+        stats.search_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t1).count();
+    }
+
+    FeatureTable &names = plan.tables.back();
+    for (const pair<float, int> &match : kept) {
+        matches.push_back({names.filenames[match.second], match.first, match.second});
+    }
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Parallel reader of feature CSV files mapped into memory
+ */
+#include "../include/csv_loader.h"
+#include "../include/parallel_for.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Bytes of the file one thread scans for row starts at a time
+#define CSV_CHUNK_BYTES (4 << 20)
+// Rows one thread parses at a time
+#define CSV_ROW_BLOCK 512
+
+// Where a row starts in the file and how long its filename is
+struct RowSpan {
+    size_t start;
+    size_t name_length;
+};
+
+// A row left out, located by its offset until the line numbers are counted
+struct PendingError {
+    size_t offset;
+    std::string message;
+};
+
+// Read-only mapping of a whole file, unmapped when it goes out of scope
+struct MappedFile {
+    const char *data = nullptr;
+    size_t size = 0;
+
+    ~MappedFile() {
+        if (data != nullptr) munmap(const_cast<char *>(data), size);
+    }
+
+    int open(const char *filename) {
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0) return -1;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return -1;
+        }
+        size = static_cast<size_t>(st.st_size);
+        if (size > 0) {
+            void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                close(fd);
+                return -1;
+            }
+            madvise(mapped, size, MADV_SEQUENTIAL);
+            data = static_cast<const char *>(mapped);
+        }
+        close(fd);
+        return 0;
+    }
+};
+
+// End of the line starting at p: its '\n' or the end of the file
+static const char *line_end(const char *p, const char *end) {
+    const char *newline = static_cast<const char *>(memchr(p, '\n', end - p));
+    return newline ? newline : end;
+}
+
+std::string parse_feature_row(const char *p, const char *end, int dim, float *out) {
+    if (end > p && end[-1] == '\r') end--;
+    for (int d = 0; d < dim; d++) {
+        if (p == end) {
+            return "has " + to_string(d) + " values, expected " + to_string(dim);
+        }
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        from_chars_result parsed = from_chars(p, end, out[d]);
+        if (parsed.ec != errc() || parsed.ptr == p) {
+            return "value " + to_string(d + 1) + " is not a number";
+        }
+        p = parsed.ptr;
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p < end) {
+            if (*p != ',') return "value " + to_string(d + 1) + " is not a number";
+            p++;
+            if (d == dim - 1) return "has more than " + to_string(dim) + " values";
+        }
+    }
+    return std::string();
+}
+
+int load_feature_csv(const char *filename, FeatureTable &table, int num_threads, std::vector<CsvRowError> *errors) {
+    MappedFile file;
+    if (file.open(filename) != 0) {
+        cerr << "Unable to open feature file " << filename << endl;
+        return -1;
+    }
+    table = FeatureTable();
+    if (errors) errors->clear();
+    const char *begin = file.data;
+    const char *end = file.data + file.size;
+
+    // Metadata lines at the top
+    const char *body = begin;
+    while (body < end && *body == '#') {
+        const char *eol = line_end(body, end);
+        size_t tag = strlen(NORMALIZED_TAG);
+        if (static_cast<size_t>(eol - body) >= tag && memcmp(body, NORMALIZED_TAG, tag) == 0) {
+            table.normalized = true;
+        }
+        body = eol == end ? end : eol + 1;
+    }
+
+    // Newline-aligned chunks
+    vector<const char *> bounds(1, body);
+    while (bounds.back() < end) {
+        const char *next = bounds.back() + std::min<size_t>(CSV_CHUNK_BYTES, end - bounds.back());
+        if (next < end) {
+            next = line_end(next, end);
+            if (next < end) next++;
+        }
+        bounds.push_back(next);
+    }
+
+    // First pass: where every row starts and how long its name is
+    const size_t chunks = bounds.size() - 1;
+    vector<vector<RowSpan>> chunk_rows(chunks);
+    parallel_for(chunks, num_threads, [&](size_t c, int) {
+        const char *p = bounds[c];
+        const char *stop = bounds[c + 1];
+        while (p < stop) {
+            const char *eol = line_end(p, stop);
+            // empty lines and metadata lines are not rows
+            if (p < eol && *p != '#' && *p != '\r') {
+                const char *comma = static_cast<const char *>(memchr(p, ',', eol - p));
+                chunk_rows[c].push_back({static_cast<size_t>(p - begin), static_cast<size_t>((comma ? comma : eol) - p)});
+            }
+            p = eol + 1;
+        }
+    });
+    vector<RowSpan> rows;
+    size_t total = 0;
+    for (const vector<RowSpan> &spans : chunk_rows) total += spans.size();
+    rows.reserve(total);
+    for (vector<RowSpan> &spans : chunk_rows) {
+        rows.insert(rows.end(), spans.begin(), spans.end());
+        vector<RowSpan>().swap(spans);
+    }
+    if (rows.empty()) return index_feature_table(table);
+
+    // The first row sets the width
+    const char *first = begin + rows[0].start;
+    table.dim = static_cast<int>(std::count(first, line_end(first, end), ','));
+    const int dim = table.dim;
+
+    // Rows sorted by filename, so each row is parsed into its final place
+    auto name = [&](size_t r) { return string_view(begin + rows[r].start, rows[r].name_length); };
+    vector<size_t> order(rows.size());
+    for (size_t r = 0; r < rows.size(); r++) order[r] = r;
+    if (!std::is_sorted(order.begin(), order.end(), [&](size_t a, size_t b) { return name(a) < name(b); })) {
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return name(a) < name(b); });
+    }
+    vector<size_t> slot(rows.size());
+    for (size_t s = 0; s < order.size(); s++) slot[order[s]] = s;
+
+    // One piece of the arena holds every name, in table order
+    vector<size_t> name_offset(rows.size());
+    size_t name_bytes = 0;
+    for (size_t s = 0; s < order.size(); s++) {
+        name_offset[s] = name_bytes;
+        name_bytes += rows[order[s]].name_length + 1;
+    }
+    vector<size_t>().swap(order);
+    char *name_pool = table.names.allocate(name_bytes);
+
+    // Second pass, in file order: names and values of every row
+    table.values.resize(rows.size() * dim);
+    table.filenames.assign(rows.size(), nullptr);
+    const size_t blocks = (rows.size() + CSV_ROW_BLOCK - 1) / CSV_ROW_BLOCK;
+    vector<vector<PendingError>> block_errors(blocks);
+    parallel_for(blocks, num_threads, [&](size_t b, int) {
+        size_t stop = std::min(rows.size(), (b + 1) * CSV_ROW_BLOCK);
+        for (size_t r = b * CSV_ROW_BLOCK; r < stop; r++) {
+            const char *p = begin + rows[r].start;
+            const char *eol = line_end(p, end);
+            const char *values = p + rows[r].name_length;
+            std::string message = values == eol ? std::string("has no values")
+                                                : parse_feature_row(values + 1, eol, dim, table.row(slot[r]));
+            if (!message.empty()) {
+                block_errors[b].push_back({rows[r].start, message});
+                continue;
+            }
+            char *filename_copy = name_pool + name_offset[slot[r]];
+            memcpy(filename_copy, p, rows[r].name_length);
+            filename_copy[rows[r].name_length] = '\0';
+            table.filenames[slot[r]] = filename_copy;
+        }
+    });
+
+    // Close the gaps left by malformed rows
+    vector<PendingError> pending;
+    for (vector<PendingError> &found : block_errors) {
+        pending.insert(pending.end(), found.begin(), found.end());
+    }
+    if (!pending.empty()) {
+        size_t kept = 0;
+        for (size_t s = 0; s < table.filenames.size(); s++) {
+            if (table.filenames[s] == nullptr) continue;
+            if (kept != s) {
+                table.filenames[kept] = table.filenames[s];
+                memmove(table.row(kept), table.row(s), dim * sizeof(float));
+            }
+            kept++;
+        }
+        table.filenames.resize(kept);
+        table.values.resize(kept * dim);
+        table.values.shrink_to_fit();
+
+        if (errors) {
+            // Line numbers in one scan, the errors are in file order
+            const char *p = begin;
+            size_t line = 1;
+            for (const PendingError &error : pending) {
+                line += std::count(p, begin + error.offset, '\n');
+                p = begin + error.offset;
+                errors->push_back({line, error.message});
+            }
+        }
+    }
+    return index_feature_table(table);
+}
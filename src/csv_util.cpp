@@ -177,6 +177,15 @@ int read_image_data_csv(char *filename, std::vector<char *> &filenames, std::vec
     for (;;) {
         std::vector<float> dvec;
 
+        // Skip metadata lines, they start with '#'
+        int first = fgetc(fp);
+        if (first == '#') {
+            while (first != '\n' && first != EOF) first = fgetc(fp);
+            if (first == EOF) break;
+            continue;
+        }
+        if (first != EOF) ungetc(first, fp);
+
         // Read the filename
         if (getstring(fp, img_file)) {
             break;
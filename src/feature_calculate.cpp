@@ -7,8 +7,11 @@
 #include "../include/feature_calculate.h"
 #include "../include/filters.h"
 #include "../include/DA2Network.hpp"
+#include "../include/ResNetNetwork.hpp"
 #include <opencv2/opencv.hpp>
 #include "../include/faceDetect.h"
+#include <memory>
+#include <mutex>
 
 using namespace cv;
 using namespace std;
@@ -30,6 +33,32 @@ FeatureFunction getFeatureFunction(FeatureType type) {
             return getBananaFeature;
         case FeatureType::FACE:
             return getTextureColorFeatureWithFaceMask;
+        case FeatureType::RESNET:
+            return getResNetEmbedding;
+        default:
+            return nullptr;
+    }
+}
+
+// Helper function to get the in-memory version of a feature function
+ImageFeatureFunction getImageFeatureFunction(FeatureType type) {
+    switch (type) {
+        case FeatureType::SQUARE_7X7:
+            return get7x7square;
+        case FeatureType::RGB_HISTOGRAM:
+            return calculateRGBHistogram;
+        case FeatureType::MULTI_HISTOGRAM:
+            return getMultiHistogramFeature;
+        case FeatureType::TEXTURE_COLOR:
+            return getTextureColorFeature;
+        case FeatureType::DEPTH:
+            return getTextureColorFeatureWithDepth;
+        case FeatureType::BANANA:
+            return getBananaFeature;
+        case FeatureType::FACE:
+            return getTextureColorFeatureWithFaceMask;
+        case FeatureType::RESNET:
+            return getResNetEmbedding;
         default:
             return nullptr;
     }
@@ -40,6 +69,10 @@ static DA2Network& initializeDA2() {
     return da_net;  // Return reference to the same object
 }
 
+// One network for the process, created on first use; its batch slots and buffers hold one batch at a time
+static std::mutex resnet_mutex;
+static std::unique_ptr<ResNetNetwork> resnet_network;
+
 int get7x7square(char *image_filename, std::vector<float> &image_data) {
     // Step 1: read the image
     Mat image = imread(image_filename);
@@ -48,6 +81,10 @@ int get7x7square(char *image_filename, std::vector<float> &image_data) {
         cerr <<  "Error loading image!" << endl;
         return -1; // Return non-zero in case of error
     }
+    return get7x7square(image, image_data);
+}
+
+int get7x7square(const cv::Mat &image, std::vector<float> &image_data) {
     // Step 2: calculate the center
     int center_x = image.cols / 2;
     int center_y = image.rows / 2;
@@ -81,14 +118,18 @@ int get7x7square(char *image_filename, std::vector<float> &image_data) {
  * @return non-zero failure.
  */
 int calculateRGBHistogram(char *image_filename, std::vector<float>& hist) {
-    int bins = 8;
-    const int BIN_SIZE = 256 / bins;
     // Step 1: read the image
     Mat img = imread(image_filename);
     if (img.empty()) {
         cerr << "can not open image: " << image_filename << endl;
         return -1;
     }
+    return calculateRGBHistogram(img, hist);
+}
+
+int calculateRGBHistogram(const cv::Mat &img, std::vector<float> &hist) {
+    int bins = 8;
+    const int BIN_SIZE = 256 / bins;
     // Initiate the 3D histogram -> flatten 1D histogram for R, G, B bins
     hist.clear();
     hist.resize(bins * bins * bins, 0.0f);
@@ -148,14 +189,17 @@ int computeMultiHistogram(const cv::Mat& image, std::vector<float>& hist, int bi
 // Function to get multi-histogram feature
 
 int getMultiHistogramFeature(char *image_filename, std::vector<float> &image_data) {
-    int bins = 8;
     // Read the image
     cv::Mat image = cv::imread(image_filename);
     if (image.empty()) {
         std::cerr << "Error loading image: " << image_filename << std::endl;
         return -1;
     }
+    return getMultiHistogramFeature(image, image_data);
+}
 
+int getMultiHistogramFeature(const cv::Mat &image, std::vector<float> &image_data) {
+    int bins = 8;
     // Split image into top/bottom halves
     cv::Mat top_half = image(cv::Rect(0, 0, image.cols, image.rows/2));
     cv::Mat bottom_half = image(cv::Rect(0, image.rows/2, image.cols, image.rows/2));
@@ -219,15 +263,18 @@ int computeTextureFeature(const cv::Mat& image, std::vector<float>& tex_hist, in
 // Function to get texture-color feature by combining color and texture histograms
 
 int getTextureColorFeature(char* image_filename, std::vector<float>& feature) {
-    int bins = 16;
-
     // Read image
     cv::Mat image = cv::imread(image_filename);
     if (image.empty()) return -1;
+    return getTextureColorFeature(image, feature);
+}
+
+int getTextureColorFeature(const cv::Mat &image, std::vector<float> &feature) {
+    int bins = 16;
 
     // Get color histogram
     std::vector<float> color_hist;
-    calculateRGBHistogram(image_filename, color_hist);
+    calculateRGBHistogram(image, color_hist);
     // Get texture histogram
     std::vector<float> tex_hist;
     computeTextureFeature(image, tex_hist, bins);
@@ -370,6 +417,12 @@ int getTextureColorFeatureWithDepth(char* image_filename, std::vector<float>& fe
     // Load RGB image
     cv::Mat image = cv::imread(image_filename);
     if (image.empty()) return -1;
+    return getTextureColorFeatureWithDepth(image, feature);
+}
+
+int getTextureColorFeatureWithDepth(const cv::Mat &source, std::vector<float> &feature) {
+    // The network and the masked histograms take a non-const image, the header is shared
+    cv::Mat image = source;
 
     // Load DA2 depth map
     cv::Mat depth;
@@ -398,7 +451,10 @@ int getBananaFeature(char *image_filename, std::vector<float>& hist) {
         std::cerr << "Error loading image: " << image_filename << std::endl;
         return -1;
     }
+    return getBananaFeature(image, hist);
+}
 
+int getBananaFeature(const cv::Mat &image, std::vector<float> &hist) {
     // HSV conversion and mask creation
     cv::Mat hsv, mask;
     cv::cvtColor(image, hsv, cv::COLOR_BGR2HSV);
@@ -460,12 +516,18 @@ int getBananaFeature(char *image_filename, std::vector<float>& hist) {
     }
     hist.push_back(total);
 //     clog << "The valid total blobs are " << total << endl;
+    return 0;
 }
 //Texture color with a mask based on face detection
 
 int getTextureColorFeatureWithFaceMask(char* image_filename, std::vector<float>& feature) {
     cv::Mat image = cv::imread(image_filename);
     if (image.empty()) return -1;
+    return getTextureColorFeatureWithFaceMask(image, feature);
+}
+
+int getTextureColorFeatureWithFaceMask(const cv::Mat &source, std::vector<float> &feature) {
+    cv::Mat image = source;
 
     std::vector<cv::Rect> faces;
     cv::Mat grey;
@@ -490,4 +552,56 @@ int getTextureColorFeatureWithFaceMask(char* image_filename, std::vector<float>&
     feature.insert(feature.end(), tex_hist.begin(), tex_hist.end());
   
     return 0;
-}
\ No newline at end of file
+}
+
+int getResNetEmbedding(char *image_filename, std::vector<float> &embedding) {
+    cv::Mat image = cv::imread(image_filename);
+    if (image.empty()) {
+        cerr << "Error: Unable to read image " << image_filename << endl;
+        return -1;
+    }
+    return getResNetEmbedding(image, embedding);
+}
+
+int getResNetEmbedding(const cv::Mat &image, std::vector<float> &embedding) {
+    std::vector<std::vector<float>> embeddings;
+    if (getResNetEmbeddings(std::vector<cv::Mat>(1, image), embeddings) != 0) {
+        return -1;
+    }
+    embedding.swap(embeddings[0]);
+    return 0;
+}
+
+int getResNetEmbeddings(const std::vector<cv::Mat> &images, std::vector<std::vector<float>> &embeddings) {
+    // Concurrent callers, e.g. the clients of the query server, take turns on the network
+    std::lock_guard<std::mutex> lock(resnet_mutex);
+    try {
+        if (!resnet_network) {
+            resnet_network.reset(new ResNetNetwork("../include/resnet18.onnx"));
+        }
+        ResNetNetwork &resnet = *resnet_network;
+        std::vector<std::vector<float>> batch;
+        embeddings.resize(images.size());
+        // Fill the network's batch slots, run them, and move the results out
+        for (size_t first = 0; first < images.size(); first += resnet.max_batch()) {
+            size_t last = std::min(images.size(), first + resnet.max_batch());
+            for (size_t i = first; i < last; i++) {
+                if (resnet.add_input(images[i]) != 0) {
+                    cerr << "Error: Image " << i << " is not a color image" << endl;
+                    resnet.clear();
+                    return -1;
+                }
+            }
+            if (resnet.run_batch(batch) != 0) {
+                return -1;
+            }
+            for (size_t i = first; i < last; i++) embeddings[i].swap(batch[i - first]);
+        }
+    } catch (const Ort::Exception &e) {
+        // A missing or broken model file throws from the constructor, a failed run from run_batch
+        cerr << "Error: ResNet18 failed: " << e.what() << endl;
+        if (resnet_network) resnet_network->clear();
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Writing column files and loading only the column groups a search reads
+ */
+#include "../include/feature_columns.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define COLUMN_MAGIC "P2FCOL01"
+// Group blocks start on a page so each one is mapped on its own
+#define COLUMN_BLOCK_ALIGN 4096
+
+// Fixed-size header at the start of a column file, the group directory and the names follow
+struct ColumnFileHeader {
+    char magic[8];
+    char layout[COLUMN_NAME_BYTES];
+    uint64_t rows;
+    uint64_t name_bytes; // NUL-terminated names, in row order
+    uint32_t dim;
+    uint32_t groups;
+    uint32_t normalized;
+    uint32_t reserved;
+};
+
+struct ColumnGroupEntry {
+    char name[COLUMN_NAME_BYTES];
+    uint32_t first;
+    uint32_t width;
+    uint64_t offset; // start of the rows * width floats of the group
+};
+
+static size_t align_block(size_t bytes) {
+    return (bytes + COLUMN_BLOCK_ALIGN - 1) & ~static_cast<size_t>(COLUMN_BLOCK_ALIGN - 1);
+}
+
+int column_layout(const std::string &layout, int dim, std::vector<ColumnGroup> &groups) {
+    groups.clear();
+    if (layout == "texture-color" && dim > COLOR_GROUP_WIDTH) {
+        groups = {{"color", 0, COLOR_GROUP_WIDTH}, {"texture", COLOR_GROUP_WIDTH, dim - COLOR_GROUP_WIDTH}};
+    } else if (layout == "face" && dim > COLOR_GROUP_WIDTH + 1) {
+        groups = {{"face_flag", 0, 1},
+                  {"color", 1, COLOR_GROUP_WIDTH},
+                  {"texture", COLOR_GROUP_WIDTH + 1, dim - COLOR_GROUP_WIDTH - 1}};
+    } else if (layout == "banana" && dim > 1) {
+        groups = {{"blob_hist", 0, dim - 1}, {"blob_total", dim - 1, 1}};
+    } else if (layout == "plain" && dim > 0) {
+        groups = {{"values", 0, dim}};
+    } else {
+        cerr << "Layout " << layout << " does not fit rows of " << dim << " floats" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+std::string column_layout_names() { return "texture-color, face, banana, plain"; }
+
+// Splits "<file>.fcol:<g1>,<g2>" into the file and the group names
+static bool split_column_path(const char *path, string &file, vector<string> &selected) {
+    const size_t suffix = strlen(COLUMN_FILE_SUFFIX);
+    string spec(path);
+    size_t at = spec.rfind(COLUMN_FILE_SUFFIX);
+    if (at == string::npos || (at + suffix != spec.size() && spec[at + suffix] != ':')) return false;
+    file = spec.substr(0, at + suffix);
+    selected.clear();
+    if (at + suffix == spec.size()) return true;
+    istringstream names(spec.substr(at + suffix + 1));
+    string name;
+    while (getline(names, name, ',')) {
+        if (!name.empty()) selected.push_back(name);
+    }
+    return true;
+}
+
+bool is_column_file(const char *path) {
+    string file;
+    vector<string> selected;
+    return split_column_path(path, file, selected);
+}
+
+int write_feature_columns(const char *filename, const FeatureTable &table, const std::string &layout) {
+    vector<ColumnGroup> groups;
+    if (column_layout(layout, table.dim, groups) != 0) {
+        return -1;
+    }
+    if (layout.size() >= COLUMN_NAME_BYTES) {
+        cerr << "Layout name too long: " << layout << endl;
+        return -1;
+    }
+    const size_t rows = table.rows();
+    vector<size_t> order(rows);
+    for (size_t i = 0; i < rows; i++) order[i] = i;
+    std::sort(order.begin(), order.end(),
+              [&](size_t a, size_t b) { return strcmp(table.filenames[a], table.filenames[b]) < 0; });
+
+    ColumnFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COLUMN_MAGIC, sizeof(header.magic));
+    strcpy(header.layout, layout.c_str());
+    header.rows = rows;
+    header.dim = table.dim;
+    header.groups = groups.size();
+    header.normalized = table.normalized ? 1 : 0;
+    for (size_t i = 0; i < rows; i++) header.name_bytes += strlen(table.filenames[i]) + 1;
+
+    vector<ColumnGroupEntry> entries(groups.size());
+    size_t offset = align_block(sizeof(header) + entries.size() * sizeof(ColumnGroupEntry) + header.name_bytes);
+    for (size_t g = 0; g < groups.size(); g++) {
+        memset(&entries[g], 0, sizeof(ColumnGroupEntry));
+        strcpy(entries[g].name, groups[g].name.c_str());
+        entries[g].first = groups[g].first;
+        entries[g].width = groups[g].width;
+        entries[g].offset = offset;
+        offset = align_block(offset + rows * groups[g].width * sizeof(float));
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        cerr << "Unable to open column file " << filename << endl;
+        return -1;
+    }
+    static const char padding[COLUMN_BLOCK_ALIGN] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(entries.data(), sizeof(ColumnGroupEntry), entries.size(), fp) == entries.size();
+    for (size_t i = 0; i < rows && ok; i++) {
+        ok = fputs(table.filenames[order[i]], fp) >= 0 && fputc('\0', fp) != EOF;
+    }
+    // Each group block, row by row in name order
+    for (size_t g = 0; g < groups.size() && ok; g++) {
+        long pad = static_cast<long>(entries[g].offset) - ftell(fp);
+        ok = pad >= 0 && fwrite(padding, 1, pad, fp) == static_cast<size_t>(pad);
+        for (size_t i = 0; i < rows && ok; i++) {
+            const float *values = table.row(order[i]) + groups[g].first;
+            ok = fwrite(values, sizeof(float), groups[g].width, fp) == static_cast<size_t>(groups[g].width);
+        }
+    }
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) {
+        cerr << "Failed to write column file " << filename << endl;
+        return -1;
+    }
+    return 0;
+}
+
+// Reads and checks the header, the group directory and the names of a column file
+static int read_column_header(int fd, const char *filename, ColumnFileHeader &header,
+                              vector<ColumnGroupEntry> &entries, string &names) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+        memcmp(header.magic, COLUMN_MAGIC, sizeof(header.magic)) != 0) {
+        cerr << filename << " is not a column file" << endl;
+        return -1;
+    }
+    header.layout[COLUMN_NAME_BYTES - 1] = '\0';
+    if (header.name_bytes + header.groups * sizeof(ColumnGroupEntry) > static_cast<uint64_t>(st.st_size)) {
+        cerr << "Column file " << filename << " is truncated or corrupt" << endl;
+        return -1;
+    }
+    entries.resize(header.groups);
+    size_t directory_bytes = entries.size() * sizeof(ColumnGroupEntry);
+    names.resize(header.name_bytes);
+    bool ok = pread(fd, entries.data(), directory_bytes, sizeof(header)) == static_cast<ssize_t>(directory_bytes) &&
+              pread(fd, &names[0], names.size(), sizeof(header) + directory_bytes) ==
+                  static_cast<ssize_t>(names.size());
+    for (ColumnGroupEntry &entry : entries) {
+        entry.name[COLUMN_NAME_BYTES - 1] = '\0';
+        ok = ok && entry.first + static_cast<uint64_t>(entry.width) <= header.dim &&
+             entry.offset % COLUMN_BLOCK_ALIGN == 0 &&
+             entry.offset + header.rows * entry.width * sizeof(float) <= static_cast<uint64_t>(st.st_size);
+    }
+    if (!ok || (header.rows > 0 && (names.empty() || names.back() != '\0'))) {
+        cerr << "Column file " << filename << " is truncated or corrupt" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+int list_feature_columns(const char *filename, std::vector<ColumnGroup> &groups, size_t &rows, std::string &layout) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return -1;
+    }
+    ColumnFileHeader header;
+    vector<ColumnGroupEntry> entries;
+    string names;
+    int result = read_column_header(fd, filename, header, entries, names);
+    close(fd);
+    if (result != 0) return -1;
+    groups.clear();
+    for (const ColumnGroupEntry &entry : entries) {
+        groups.push_back({entry.name, static_cast<int>(entry.first), static_cast<int>(entry.width)});
+    }
+    rows = header.rows;
+    layout = header.layout;
+    return 0;
+}
+
+int read_feature_columns(const char *path, const std::vector<int> *wanted, FeatureTable &table, int l2_normalize) {
+    string filename;
+    vector<string> selected;
+    if (!split_column_path(path, filename, selected)) {
+        cerr << path << " does not name a column file" << endl;
+        return -1;
+    }
+    printf("Reading %s\n", path);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror(filename.c_str());
+        return -1;
+    }
+    ColumnFileHeader header;
+    vector<ColumnGroupEntry> entries;
+    string names;
+    if (read_column_header(fd, filename.c_str(), header, entries, names) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Groups to load, in the order given; none given loads every group
+    vector<const ColumnGroupEntry *> groups;
+    for (const ColumnGroupEntry &entry : entries) {
+        if (selected.empty()) groups.push_back(&entry);
+    }
+    for (const string &name : selected) {
+        const ColumnGroupEntry *found = nullptr;
+        for (const ColumnGroupEntry &entry : entries) {
+            if (name == entry.name) found = &entry;
+        }
+        if (found == nullptr) {
+            cerr << filename << " has no column group " << name << endl;
+            close(fd);
+            return -1;
+        }
+        groups.push_back(found);
+    }
+
+    // Rows to keep, in file order
+    ImageNameIndex keep(wanted != nullptr ? *wanted : vector<int>());
+    table = FeatureTable();
+    vector<size_t> source_rows;
+    const char *name = names.data();
+    for (size_t r = 0; r < header.rows; r++) {
+        size_t length = strlen(name);
+        if (wanted == nullptr || keep.find(name) >= 0) {
+            table.filenames.push_back(table.names.store(name, length));
+            source_rows.push_back(r);
+        }
+        name += length + 1;
+    }
+    table.dim = 0;
+    for (const ColumnGroupEntry *group : groups) table.dim += group->width;
+    table.values.resize(source_rows.size() * table.dim);
+
+    // Map each selected block alone and copy its columns of the kept rows
+    int column = 0;
+    bool ok = true;
+    for (const ColumnGroupEntry *group : groups) {
+        size_t bytes = header.rows * group->width * sizeof(float);
+        if (bytes == 0 || source_rows.empty()) continue;
+        void *mapping = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, group->offset);
+        if (mapping == MAP_FAILED) {
+            perror(filename.c_str());
+            ok = false;
+            break;
+        }
+        madvise(mapping, bytes, wanted == nullptr ? MADV_SEQUENTIAL : MADV_RANDOM);
+        const float *block = static_cast<const float *>(mapping);
+        for (size_t i = 0; i < source_rows.size(); i++) {
+            std::copy(block + source_rows[i] * group->width, block + (source_rows[i] + 1) * group->width,
+                      table.row(i) + column);
+        }
+        munmap(mapping, bytes);
+        column += group->width;
+    }
+    close(fd);
+    if (!ok || index_feature_table(table) != 0) {
+        return -1;
+    }
+    printf("Loaded %zu of %llu rows, %d of %u columns\n", table.rows(), static_cast<unsigned long long>(header.rows),
+           table.dim, header.dim);
+
+    compute_row_norms(table);
+    table.normalized = header.normalized != 0 && table.dim == static_cast<int>(header.dim);
+    if (l2_normalize && !table.normalized) {
+        normalize_feature_table(table);
+    }
+    return 0;
+}
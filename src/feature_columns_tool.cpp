@@ -0,0 +1,81 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Convert feature files to column files and compare loading whole rows with loading column groups
+ */
+#include "../include/feature_columns.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Loads a feature file or column file selection and reports the time and size
+static int time_load(char *path) {
+    FeatureTable table;
+    auto start = chrono::steady_clock::now();
+    if (read_feature_table(path, table) != 0) {
+        return -1;
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    printf("%s: %zu rows x %d floats (%.1f MB) in %.2f ms\n", path, table.rows(), table.dim,
+           table.values.size() * sizeof(float) / 1e6, ms);
+    return 0;
+}
+
+/**
+ * Writes a feature file as a column file whose column groups are stored
+ * and loaded separately, lists the groups of a column file, or times
+ * loading whole rows against loading some groups.
+ *
+ * @param argv argv[1] - convert, info or load
+ *             convert: argv[2] - feature file, argv[3] - output column file, argv[4] - layout
+ *             info: argv[2] - column file
+ *             load: argv[2...] - feature files or column files with a ":group,group" selector
+ */
+int main(int argc, char *argv[]) {
+    const char *mode = argc > 1 ? argv[1] : "";
+    int positional = strcmp(mode, "convert") == 0 ? 5 : strcmp(mode, "info") == 0 || strcmp(mode, "load") == 0 ? 3 : 0;
+    if (positional == 0 || argc < positional) {
+        printf("usage: %s convert <feature_file> <output.fcol> <layout>\n", argv[0]);
+        printf("       %s info <file.fcol>\n", argv[0]);
+        printf("       %s load <file.csv|file.fcol[:group,...]> [...]\n", argv[0]);
+        printf("layout options: %s\n", column_layout_names().c_str());
+        exit(-1);
+    }
+
+    if (strcmp(mode, "convert") == 0) {
+        FeatureTable table;
+        if (read_feature_table(argv[2], table) != 0) {
+            printf("Can not read the image csv file: %s\n", argv[2]);
+            exit(-1);
+        }
+        if (write_feature_columns(argv[3], table, argv[4]) != 0) {
+            exit(-1);
+        }
+        printf("Wrote %zu rows of %d values to %s\n", table.rows(), table.dim, argv[3]);
+    } else if (strcmp(mode, "info") == 0) {
+        vector<ColumnGroup> groups;
+        size_t rows;
+        string layout;
+        if (list_feature_columns(argv[2], groups, rows, layout) != 0) {
+            exit(-1);
+        }
+        printf("%s: %zu rows, layout %s\n", argv[2], rows, layout.c_str());
+        for (const ColumnGroup &group : groups) {
+            printf("  %-12s columns %d-%d (%d floats)\n", group.name.c_str(), group.first,
+                   group.first + group.width - 1, group.width);
+        }
+    } else {
+        for (int i = 2; i < argc; i++) {
+            if (time_load(argv[i]) != 0) {
+                printf("Can not read %s\n", argv[i]);
+                exit(-1);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 16, 2025
+ * Purpose: Normalize the rows of an embedding feature file once, at index build time
+ */
+#include "../include/feature_table.h"
+#include <cstdio>
+#include <cstdlib>
+
+/**
+ * @brief Reads a feature file, scales every row to unit L2 norm and writes it
+ * back out with the "#normalized=l2" metadata line, so later loads skip the work.
+ *
+ * @param argc Number of command-line arguments.
+ * @param argv argv[1] - input feature file, argv[2] - output feature file.
+ * @return int Returns 0 on success, or -1 on failure.
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("usage: %s <input feature file> <output feature file>\n", argv[0]);
+        exit(-1);
+    }
+
+    FeatureTable table;
+    if (read_feature_table(argv[1], table, 1) != 0) {
+        printf("Can not read the image csv file: %s\n", argv[1]);
+        exit(-1);
+    }
+    if (write_feature_table_csv(argv[2], table) != 0) {
+        exit(-1);
+    }
+    printf("Wrote %zu normalized rows of %d values to %s\n", table.rows(), table.dim, argv[2]);
+    return 0;
+}
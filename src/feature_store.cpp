@@ -0,0 +1,445 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Append-only feature store of immutable segments with tombstones and compaction
+ */
+#include "../include/feature_store.h"
+#include "../include/parallel_topn.h"
+#include "../include/search_engine.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define STORE_SEGMENT_MAGIC "P2FSEG01"
+#define STORE_MANIFEST_HEADER "P2FSTORE 1"
+
+// Fixed-size header at the start of a segment file, then the names and the rows
+struct SegmentFileHeader {
+    char magic[8];
+    uint64_t sequence;
+    uint64_t rows;
+    uint64_t tombstones;
+    uint64_t name_bytes; // NUL-terminated row names, then tombstone names
+    int32_t dim;
+    int32_t base;
+};
+
+// Metrics a store search scores with, the distance of the search engine policy
+struct StoreMetric {
+    const char *name;
+    float (*distance)(const float *, const float *, int);
+    bool ascending;
+};
+
+// Segment rows are not normalized, so cosine computes the norms
+static const StoreMetric store_metrics[] = {
+    {"ssd", SsdMetric::distance, true},
+    {"rgb-hist", HistIntersectionMetric::distance, false},
+    {"multi-hist", MultiHistMetric::distance, true},
+    {"texture-color", TextureColorMetric::distance, true},
+    {"cosine", CosineMetric::distance, true},
+};
+
+bool StoreSnapshot::find(const char *image_filename, size_t &segment, int &row) const {
+    int id = image_registry().find(image_filename);
+    if (id < 0 || static_cast<size_t>(id) >= owner.size() || owner[id] < 0) return false;
+    segment = owner[id];
+    row = segments[segment]->table.row_of_id[id];
+    return true;
+}
+
+// Writes a file under a temporary name and renames it over path once it is on disk
+static int write_file_atomically(const string &path, const vector<pair<const void *, size_t>> &parts) {
+    string temporary = path + ".tmp";
+    FILE *fp = fopen(temporary.c_str(), "wb");
+    if (!fp) {
+        cerr << "Unable to open output file " << temporary << endl;
+        return -1;
+    }
+    bool ok = true;
+    for (const pair<const void *, size_t> &part : parts) {
+        ok = ok && (part.second == 0 || fwrite(part.first, 1, part.second, fp) == part.second);
+    }
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0) ok = false;
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        cerr << "Failed to write " << path << endl;
+        remove(temporary.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+static int read_segment(const string &path, const string &file, StoreSegment &segment) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        cerr << "Unable to open segment " << path << endl;
+        return -1;
+    }
+    SegmentFileHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, STORE_SEGMENT_MAGIC, 8) != 0) {
+        cerr << path << " is not a feature store segment" << endl;
+        fclose(fp);
+        return -1;
+    }
+    vector<char> names(header.name_bytes);
+    FeatureTable &table = segment.table;
+    table.dim = header.dim;
+    table.values.resize(header.rows * header.dim);
+    bool ok = header.name_bytes == 0 || fread(names.data(), 1, names.size(), fp) == names.size();
+    ok = ok && (table.values.empty() || fread(table.values.data(), sizeof(float), table.values.size(), fp) == table.values.size());
+    fclose(fp);
+    if (!ok || (!names.empty() && names.back() != '\0')) {
+        cerr << "Segment " << path << " is truncated" << endl;
+        return -1;
+    }
+
+    segment.file = file;
+    segment.sequence = header.sequence;
+    segment.base = header.base != 0;
+    const char *name = names.data();
+    for (uint64_t i = 0; i < header.rows + header.tombstones; i++) {
+        if (name >= names.data() + names.size()) {
+            cerr << "Segment " << path << " is truncated" << endl;
+            return -1;
+        }
+        if (i < header.rows) table.filenames.push_back(table.names.store(name));
+        else segment.tombstones.push_back(image_registry().intern(name));
+        name += strlen(name) + 1;
+    }
+    return index_feature_table(table);
+}
+
+// Owner of every image ID after applying one more segment
+static void apply_segment(const StoreSegment &segment, int s, vector<int> &owner, size_t &live_rows) {
+    owner.resize(image_registry().size(), -1);
+    for (int id : segment.tombstones) {
+        if (owner[id] >= 0) live_rows--;
+        owner[id] = -1;
+    }
+    for (int id : segment.table.ids) {
+        if (owner[id] < 0) live_rows++;
+        owner[id] = s;
+    }
+}
+
+FeatureStore::~FeatureStore() { stop_background_compaction(); }
+
+int FeatureStore::open(const std::string &directory) {
+    directory_ = directory;
+    vector<shared_ptr<const StoreSegment>> segments;
+    uint64_t next_sequence = 1;
+    string manifest = directory_ + "/" + STORE_MANIFEST;
+    FILE *fp = fopen(manifest.c_str(), "r");
+    if (fp) {
+        char line[1024];
+        if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, STORE_MANIFEST_HEADER, strlen(STORE_MANIFEST_HEADER)) != 0) {
+            cerr << manifest << " is not a feature store manifest" << endl;
+            fclose(fp);
+            return -1;
+        }
+        unsigned long long next = 0;
+        if (fgets(line, sizeof(line), fp) == NULL || sscanf(line, "next %llu", &next) != 1) {
+            cerr << manifest << " has no sequence number" << endl;
+            fclose(fp);
+            return -1;
+        }
+        next_sequence = next;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0') continue;
+            shared_ptr<StoreSegment> segment = make_shared<StoreSegment>();
+            if (read_segment(directory_ + "/" + line, line, *segment) != 0) {
+                fclose(fp);
+                return -1;
+            }
+            segments.push_back(segment);
+        }
+        fclose(fp);
+    }
+    // Opening an existing store only reads it, a new one gets its first manifest
+    lock_guard<mutex> lock(write_mutex_);
+    return publish(segments, next_sequence, fp == NULL);
+}
+
+int FeatureStore::write_segment(StoreSegment &segment) {
+    char file[64];
+    snprintf(file, sizeof(file), "%s-%06llu.seg", segment.base ? "base" : "append",
+             static_cast<unsigned long long>(segment.sequence));
+    segment.file = file;
+
+    string names;
+    for (char *filename : segment.table.filenames) names.append(filename, strlen(filename) + 1);
+    for (int id : segment.tombstones) names.append(image_registry().name(id), strlen(image_registry().name(id)) + 1);
+    SegmentFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STORE_SEGMENT_MAGIC, 8);
+    header.sequence = segment.sequence;
+    header.rows = segment.table.rows();
+    header.tombstones = segment.tombstones.size();
+    header.name_bytes = names.size();
+    header.dim = segment.table.dim;
+    header.base = segment.base ? 1 : 0;
+    return write_file_atomically(directory_ + "/" + file,
+                                 {{&header, sizeof(header)},
+                                  {names.data(), names.size()},
+                                  {segment.table.values.data(), segment.table.values.size() * sizeof(float)}});
+}
+
+int FeatureStore::write_manifest(const std::vector<std::shared_ptr<const StoreSegment>> &segments,
+                                 uint64_t next_sequence) {
+    string text = string(STORE_MANIFEST_HEADER) + "\nnext " + to_string(next_sequence) + "\n";
+    for (const shared_ptr<const StoreSegment> &segment : segments) text += segment->file + "\n";
+    return write_file_atomically(directory_ + "/" + STORE_MANIFEST, {{text.data(), text.size()}});
+}
+
+// Builds and swaps in the snapshot of a segment list; the caller holds write_mutex_
+int FeatureStore::publish(std::vector<std::shared_ptr<const StoreSegment>> segments, uint64_t next_sequence,
+                          bool write) {
+    if (write && write_manifest(segments, next_sequence) != 0) return -1;
+    shared_ptr<StoreSnapshot> next = make_shared<StoreSnapshot>();
+    shared_ptr<const StoreSnapshot> current = snapshot();
+    // A write appends one segment to the current list, its owners are patched instead of rebuilt
+    bool appended = current && segments.size() == current->segments.size() + 1 &&
+                    std::equal(current->segments.begin(), current->segments.end(), segments.begin());
+    if (appended) {
+        next->owner = current->owner;
+        next->live_rows = current->live_rows;
+        apply_segment(*segments.back(), static_cast<int>(segments.size()) - 1, next->owner, next->live_rows);
+    } else {
+        for (size_t s = 0; s < segments.size(); s++) {
+            apply_segment(*segments[s], static_cast<int>(s), next->owner, next->live_rows);
+        }
+    }
+    for (const shared_ptr<const StoreSegment> &segment : segments) {
+        if (segment->table.dim != 0) next->dim = segment->table.dim;
+    }
+    next->segments = std::move(segments);
+    next_sequence_ = next_sequence;
+    {
+        lock_guard<mutex> lock(snapshot_mutex_);
+        snapshot_ = next;
+    }
+    // Taking the lock orders the swap before the compaction thread's next check
+    { lock_guard<mutex> lock(wake_mutex_); }
+    wake_.notify_one();
+    return 0;
+}
+
+std::shared_ptr<const StoreSnapshot> FeatureStore::snapshot() const {
+    lock_guard<mutex> lock(snapshot_mutex_);
+    return snapshot_;
+}
+
+int FeatureStore::add(const FeatureTable &rows) {
+    if (rows.rows() == 0) return 0;
+    lock_guard<mutex> lock(write_mutex_);
+    shared_ptr<const StoreSnapshot> current = snapshot();
+    if (current->dim != 0 && rows.dim != current->dim) {
+        cerr << "Rows have " << rows.dim << " values, the store " << current->dim << endl;
+        return -1;
+    }
+    shared_ptr<StoreSegment> segment = make_shared<StoreSegment>();
+    segment->sequence = next_sequence_;
+    FeatureTable &table = segment->table;
+    table.dim = rows.dim;
+    table.values.assign(rows.values.begin(), rows.values.end());
+    for (char *filename : rows.filenames) table.filenames.push_back(table.names.store(filename));
+    if (index_feature_table(table) != 0 || write_segment(*segment) != 0) return -1;
+
+    vector<shared_ptr<const StoreSegment>> segments = current->segments;
+    segments.push_back(segment);
+    return publish(segments, next_sequence_ + 1);
+}
+
+int FeatureStore::remove(const std::vector<std::string> &images) {
+    lock_guard<mutex> lock(write_mutex_);
+    shared_ptr<const StoreSnapshot> current = snapshot();
+    shared_ptr<StoreSegment> segment = make_shared<StoreSegment>();
+    segment->sequence = next_sequence_;
+    segment->table.dim = current->dim;
+    for (const string &image : images) {
+        size_t s;
+        int row;
+        if (!current->find(image.c_str(), s, row)) {
+            cerr << "Image " << image << " is not in the store" << endl;
+            continue;
+        }
+        segment->tombstones.push_back(current->segments[s]->table.ids[row]);
+    }
+    if (segment->tombstones.empty()) return 0;
+    if (write_segment(*segment) != 0) return -1;
+
+    vector<shared_ptr<const StoreSegment>> segments = current->segments;
+    segments.push_back(segment);
+    return publish(segments, next_sequence_ + 1);
+}
+
+int FeatureStore::compact() {
+    lock_guard<mutex> compacting(compact_mutex_);
+    shared_ptr<const StoreSnapshot> from = snapshot();
+    if (from->segments.empty() || (from->segments.size() == 1 && from->segments[0]->base)) return 0;
+
+    // Merged off the write lock; writes meanwhile append after the compacted segments
+    shared_ptr<StoreSegment> base = make_shared<StoreSegment>();
+    base->base = true;
+    base->sequence = from->segments.back()->sequence;
+    if (snapshot_feature_table(*from, base->table) != 0 || write_segment(*base) != 0) return -1;
+
+    vector<shared_ptr<const StoreSegment>> merged;
+    {
+        lock_guard<mutex> lock(write_mutex_);
+        shared_ptr<const StoreSnapshot> current = snapshot();
+        vector<shared_ptr<const StoreSegment>> segments(1, base);
+        segments.insert(segments.end(), current->segments.begin() + from->segments.size(), current->segments.end());
+        if (publish(segments, next_sequence_) != 0) return -1;
+        merged = from->segments;
+    }
+    // Readers of older snapshots hold the segments in memory, the files can go
+    for (const shared_ptr<const StoreSegment> &segment : merged) {
+        if (segment->file != base->file) ::remove((directory_ + "/" + segment->file).c_str());
+    }
+    return 0;
+}
+
+// Append segments of a snapshot, the ones a compaction would merge
+static size_t appended_segments(const StoreSnapshot &snapshot) {
+    size_t count = 0;
+    for (const shared_ptr<const StoreSegment> &segment : snapshot.segments) {
+        if (!segment->base) count++;
+    }
+    return count;
+}
+
+void FeatureStore::start_background_compaction(size_t max_segments) {
+    if (compactor_.joinable()) return;
+    {
+        lock_guard<mutex> lock(wake_mutex_);
+        stopping_ = false;
+    }
+    compactor_ = thread(&FeatureStore::compaction_loop, this, std::max<size_t>(max_segments, 1));
+}
+
+void FeatureStore::stop_background_compaction() {
+    if (!compactor_.joinable()) return;
+    {
+        lock_guard<mutex> lock(wake_mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    compactor_.join();
+}
+
+void FeatureStore::compaction_loop(size_t max_segments) {
+    for (;;) {
+        {
+            unique_lock<mutex> lock(wake_mutex_);
+            wake_.wait(lock, [&]() { return stopping_ || appended_segments(*snapshot()) >= max_segments; });
+            if (stopping_) return;
+        }
+        if (compact() != 0) {
+            cerr << "Background compaction failed, retrying after the next write" << endl;
+            unique_lock<mutex> lock(wake_mutex_);
+            size_t failed_at = snapshot()->segments.size();
+            wake_.wait(lock, [&]() { return stopping_ || snapshot()->segments.size() != failed_at; });
+        }
+    }
+}
+
+StoreStats FeatureStore::stats() const {
+    shared_ptr<const StoreSnapshot> current = snapshot();
+    StoreStats stats;
+    stats.segments = current->segments.size();
+    stats.live_rows = current->live_rows;
+    for (const shared_ptr<const StoreSegment> &segment : current->segments) {
+        stats.rows += segment->table.rows();
+        stats.tombstones += segment->tombstones.size();
+    }
+    return stats;
+}
+
+int snapshot_feature_table(const StoreSnapshot &snapshot, FeatureTable &table) {
+    table = FeatureTable();
+    table.dim = snapshot.dim;
+    table.values.resize(snapshot.live_rows * static_cast<size_t>(snapshot.dim));
+    size_t next = 0;
+    for (size_t s = 0; s < snapshot.segments.size(); s++) {
+        const FeatureTable &rows = snapshot.segments[s]->table;
+        for (size_t i = 0; i < rows.rows(); i++) {
+            if (!snapshot.live(s, i)) continue;
+            std::copy(rows.row(i), rows.row(i) + rows.dim, table.row(next++));
+            table.filenames.push_back(table.names.store(rows.filenames[i]));
+        }
+    }
+    if (sort_feature_table(table) != 0) return -1;
+    compute_row_norms(table);
+    return 0;
+}
+
+bool is_feature_store(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode) &&
+           stat((string(path) + "/" + STORE_MANIFEST).c_str(), &st) == 0;
+}
+
+int read_feature_store(const char *directory, FeatureTable &table, int l2_normalize) {
+    printf("Reading feature store %s\n", directory);
+    FeatureStore store;
+    if (store.open(directory) != 0 || snapshot_feature_table(*store.snapshot(), table) != 0) {
+        return -1;
+    }
+    if (l2_normalize && !table.normalized) {
+        normalize_feature_table(table);
+    }
+    return 0;
+}
+
+int store_topN_matches(const StoreSnapshot &snapshot, const std::string &metric, const char *target_image_filename,
+                       int N, std::vector<Match> &matches, int num_threads) {
+    matches.clear();
+    const StoreMetric *scorer = nullptr;
+    for (const StoreMetric &candidate : store_metrics) {
+        if (metric == candidate.name) scorer = &candidate;
+    }
+    if (scorer == nullptr) {
+        cerr << "The feature store does not support the " << metric << " metric" << endl;
+        return -1;
+    }
+    size_t target_segment;
+    int target_row;
+    if (!snapshot.find(target_image_filename, target_segment, target_row)) {
+        cerr << "Target image not found!" << endl;
+        return -1;
+    }
+    const float *target = snapshot.segments[target_segment]->table.row(target_row);
+    const int dim = snapshot.dim;
+
+    // Best N of every segment, then the best N of those
+    vector<pair<float, pair<size_t, int>>> best;
+    for (size_t s = 0; s < snapshot.segments.size(); s++) {
+        const FeatureTable &rows = snapshot.segments[s]->table;
+        vector<pair<float, int>> found = parallel_topN(rows.rows(), N, scorer->ascending, dim * sizeof(float),
+            num_threads, [&](size_t i, float &dist) {
+                if (!snapshot.live(s, i) || (s == target_segment && static_cast<int>(i) == target_row)) return false;
+                dist = scorer->distance(rows.row(i), target, dim);
+                return true;
+            });
+        for (const pair<float, int> &match : found) best.push_back(make_pair(match.first, make_pair(s, match.second)));
+    }
+    const bool ascending = scorer->ascending;
+    std::sort(best.begin(), best.end(), [ascending](const pair<float, pair<size_t, int>> &a,
+                                                    const pair<float, pair<size_t, int>> &b) {
+        if (a.first != b.first) return ascending ? a.first < b.first : a.first > b.first;
+        return a.second < b.second;
+    });
+    for (size_t i = 0; i < best.size() && i < static_cast<size_t>(N); i++) {
+        const FeatureTable &rows = snapshot.segments[best[i].second.first]->table;
+        matches.push_back({rows.filenames[best[i].second.second], best[i].first, best[i].second.second});
+    }
+    return 0;
+}
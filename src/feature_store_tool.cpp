@@ -0,0 +1,225 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Add, remove, compact and query the images of a segment-based feature store
+ */
+#include "../include/feature_store.h"
+#include "../include/parallel_topn.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static void print_stats(const FeatureStore &store) {
+    StoreStats stats = store.stats();
+    printf("%zu segments, %zu live images, %zu rows, %zu tombstones\n", stats.segments, stats.live_rows, stats.rows,
+           stats.tombstones);
+}
+
+// Deletes a directory and the files in it
+static void remove_directory(const string &directory) {
+    DIR *dirp = opendir(directory.c_str());
+    if (dirp != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dirp)) != NULL) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                unlink((directory + "/" + entry->d_name).c_str());
+            }
+        }
+        closedir(dirp);
+    }
+    rmdir(directory.c_str());
+}
+
+/*
+  Rewrites random images of a store on one thread while the main thread
+  queries snapshots, with compaction in the background, and reports the
+  query latency seen during the writes. rows are the images of the store.
+ */
+static int run_churn(FeatureStore &store, const FeatureTable &rows, const string &metric, int writes, int batch,
+                     int N, int num_threads) {
+    store.start_background_compaction();
+    atomic<bool> done(false);
+    thread writer([&]() {
+        mt19937 rng(5330);
+        for (int w = 0; w < writes; w++) {
+            shared_ptr<const StoreSnapshot> snapshot = store.snapshot();
+            vector<size_t> picked;
+            for (int b = 0; b < batch; b++) picked.push_back(rng() % rows.rows());
+            sort(picked.begin(), picked.end());
+            picked.erase(unique(picked.begin(), picked.end()), picked.end());
+            // Even writes delete live images, odd writes add or replace images
+            FeatureTable changed;
+            changed.dim = rows.dim;
+            vector<string> removed;
+            for (size_t i : picked) {
+                size_t segment;
+                int row;
+                if (w % 2 == 1) {
+                    changed.filenames.push_back(changed.names.store(rows.filenames[i]));
+                    changed.values.insert(changed.values.end(), rows.row(i), rows.row(i) + rows.dim);
+                } else if (snapshot->find(rows.filenames[i], segment, row)) {
+                    removed.push_back(rows.filenames[i]);
+                }
+            }
+            int written = w % 2 == 1 ? store.add(changed) : store.remove(removed);
+            if (written != 0) break;
+        }
+        done = true;
+    });
+
+    vector<double> latencies;
+    size_t q = 0;
+    while (!done) {
+        shared_ptr<const StoreSnapshot> snapshot = store.snapshot();
+        const char *target = rows.filenames[(q++ * 7919) % rows.rows()];
+        size_t segment;
+        int row;
+        if (!snapshot->find(target, segment, row)) continue;
+        vector<Match> matches;
+        auto t0 = chrono::steady_clock::now();
+        if (store_topN_matches(*snapshot, metric, target, N, matches, num_threads) != 0) break;
+        latencies.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count());
+    }
+    writer.join();
+    store.stop_background_compaction();
+    if (latencies.empty()) {
+        printf("No query finished during the writes\n");
+        return 0;
+    }
+    sort(latencies.begin(), latencies.end());
+    printf("%d writes of %d images, %zu queries during them: median %.3f ms, p99 %.3f ms, max %.3f ms\n", writes, batch,
+           latencies.size(), latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back());
+    return 0;
+}
+
+/*
+  Runs run_churn on a scratch store next to the store, holding a copy of
+  its live images, and deletes the scratch store afterwards: the writes
+  delete and replace images, so the store itself is never written.
+ */
+static int churn(FeatureStore &store, string directory, const string &metric, int writes, int batch, int N,
+                 int num_threads) {
+    FeatureTable rows;
+    if (snapshot_feature_table(*store.snapshot(), rows) != 0 || rows.rows() == 0) {
+        printf("The store is empty\n");
+        return -1;
+    }
+    while (directory.size() > 1 && directory.back() == '/') directory.pop_back();
+    string scratch_directory = directory + ".churn-XXXXXX";
+    if (mkdtemp(&scratch_directory[0]) == NULL) {
+        perror(scratch_directory.c_str());
+        return -1;
+    }
+    printf("Churning a copy of the store in %s\n", scratch_directory.c_str());
+    int result = -1;
+    {
+        FeatureStore scratch;
+        if (scratch.open(scratch_directory) == 0 && scratch.add(rows) == 0) {
+            result = run_churn(scratch, rows, metric, writes, batch, N, num_threads);
+        }
+    }
+    remove_directory(scratch_directory);
+    return result;
+}
+
+/**
+ * Maintains a feature store directory: appends the rows of a feature file
+ * as a segment, deletes images with tombstones, merges the segments into a
+ * sorted base, searches the store, or exports it as a feature file. churn
+ * measures query latency under writes on a scratch copy of the store.
+ *
+ * @param argv argv[1] - add, remove, compact, query, stats, export or churn, argv[2] - store directory,
+ *             add: argv[3] - feature file whose rows are added or replaced
+ *             remove: argv[3...] - images to delete
+ *             query: argv[3] - target image, argv[4] - N, argv[5] - metric
+ *             export: argv[3] - output feature file
+ *             churn: argv[3] - metric
+ *             Optional flags:
+ *             --threads <n> - search threads, 0 uses every core
+ *             --writes <w> - writes of churn (default 200), --batch <b> - images per write (default 16)
+ */
+int main(int argc, char *argv[]) {
+    const char *mode = argc > 1 ? argv[1] : "";
+    int positional = strcmp(mode, "add") == 0 || strcmp(mode, "remove") == 0 || strcmp(mode, "export") == 0 ||
+                             strcmp(mode, "churn") == 0 ? 4
+                     : strcmp(mode, "query") == 0 ? 6
+                     : strcmp(mode, "compact") == 0 || strcmp(mode, "stats") == 0 ? 3 : 0;
+    if (positional == 0 || argc < positional) {
+        printf("usage: %s add <store_dir> <feature_file>\n", argv[0]);
+        printf("       %s remove <store_dir> <image> [<image> ...]\n", argv[0]);
+        printf("       %s compact <store_dir>\n", argv[0]);
+        printf("       %s query <store_dir> <target_image> <N> <metric> [--threads n]\n", argv[0]);
+        printf("       %s stats <store_dir>\n", argv[0]);
+        printf("       %s export <store_dir> <feature_file>\n", argv[0]);
+        printf("       %s churn <store_dir> <metric> [--writes w] [--batch b] [--threads n]\n", argv[0]);
+        printf("metric options: ssd, rgb-hist, multi-hist, texture-color, cosine\n");
+        exit(-1);
+    }
+    if (strcmp(mode, "remove") == 0) positional = argc; // every argument is an image
+    int num_threads = 0;
+    int writes = 200;
+    int batch = 16;
+    for (int i = positional; i < argc; i++) {
+        if (i + 1 >= argc) {
+            printf("Missing value for %s\n", argv[i]);
+            exit(-1);
+        }
+        if (strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-t") == 0) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--writes") == 0) {
+            writes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch = atoi(argv[++i]);
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+
+    FeatureStore store;
+    if (store.open(argv[2]) != 0) {
+        printf("Can not open the feature store %s\n", argv[2]);
+        exit(-1);
+    }
+    int result = 0;
+    if (strcmp(mode, "add") == 0) {
+        FeatureTable rows;
+        result = read_feature_table(argv[3], rows);
+        if (result == 0) result = store.add(rows);
+        if (result == 0) printf("Added %zu images\n", rows.rows());
+    } else if (strcmp(mode, "remove") == 0) {
+        result = store.remove(vector<string>(argv + 3, argv + argc));
+    } else if (strcmp(mode, "compact") == 0) {
+        auto start = chrono::steady_clock::now();
+        result = store.compact();
+        printf("Compacted in %.3f ms\n", chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    } else if (strcmp(mode, "query") == 0) {
+        shared_ptr<const StoreSnapshot> snapshot = store.snapshot();
+        vector<Match> matches;
+        result = store_topN_matches(*snapshot, argv[5], argv[3], atoi(argv[4]), matches, num_threads);
+        for (const Match &match : matches) printf("%s %f\n", match.filename, match.score);
+    } else if (strcmp(mode, "export") == 0) {
+        FeatureTable table;
+        result = snapshot_feature_table(*store.snapshot(), table);
+        if (result == 0) result = write_feature_table_csv(argv[3], table);
+    } else if (strcmp(mode, "churn") == 0) {
+        result = churn(store, argv[2], argv[3], std::max(writes, 1), std::max(batch, 1), 10, num_threads);
+    }
+    if (result != 0) {
+        printf("The %s command failed\n", mode);
+        exit(-1);
+    }
+    print_stats(store);
+    return 0;
+}
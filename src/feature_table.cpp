@@ -0,0 +1,467 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 12, 2025
+ * Purpose: Building the contiguous in-memory feature table
+ */
+
+#include "../include/feature_table.h"
+#include "../include/csv_loader.h"
+#include "../include/csv_util.h"
+#include "../include/feature_columns.h"
+#include "../include/feature_store.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+// Bytes per block of a table's name arena, names longer than this get their own block
+#define NAME_BLOCK_BYTES (64 * 1024)
+
+char *NameArena::allocate(size_t bytes) {
+    if (blocks_.empty() || block_used_ + bytes > block_size_) {
+        block_size_ = std::max<size_t>(bytes, NAME_BLOCK_BYTES);
+        blocks_.emplace_back(new char[block_size_]);
+        block_used_ = 0;
+        capacity_ += block_size_;
+    }
+    char *p = blocks_.back().get() + block_used_;
+    block_used_ += bytes;
+    return p;
+}
+
+char *NameArena::store(const char *name, size_t length) {
+    char *copy = allocate(length + 1);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+char *NameArena::store(const char *name) { return store(name, strlen(name)); }
+
+void NameArena::clear() {
+    blocks_.clear();
+    block_used_ = 0;
+    block_size_ = 0;
+    capacity_ = 0;
+}
+
+/**
+ * @brief Packs rows read by read_image_data_csv into a FeatureTable.
+ *
+ * @param filenames Image filenames, copied into the table; the caller keeps its strings.
+ * @param data Feature rows, all of the same length.
+ * @param table Output table, rows in the order given.
+ * @return non-zero if the rows do not all have the same length.
+ */
+int pack_feature_table(const std::vector<char *> &filenames, const std::vector<std::vector<float>> &data,
+                       FeatureTable &table) {
+    table = FeatureTable();
+    table.dim = data.empty() ? 0 : static_cast<int>(data[0].size());
+
+    table.values.resize(data.size() * table.dim);
+    for (size_t i = 0; i < data.size(); i++) {
+        if (static_cast<int>(data[i].size()) != table.dim) {
+            cerr << "Row " << filenames[i] << " has " << data[i].size() << " values, expected " << table.dim << endl;
+            table = FeatureTable();
+            return -1;
+        }
+        std::copy(data[i].begin(), data[i].end(), table.row(i));
+        table.filenames.push_back(table.names.store(filenames[i]));
+    }
+    return index_feature_table(table);
+}
+
+int sort_feature_table(FeatureTable &table) {
+    const size_t n = table.rows();
+    vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) order[i] = i;
+    auto by_name = [&](size_t a, size_t b) { return strcmp(table.filenames[a], table.filenames[b]) < 0; };
+    if (!std::is_sorted(order.begin(), order.end(), by_name)) {
+        std::sort(order.begin(), order.end(), by_name);
+
+        // Row order[i] moves to row i; follow each cycle with one row of scratch
+        const size_t dim = table.dim;
+        const bool have_norms = table.norms.size() == n;
+        vector<float> scratch(dim);
+        vector<bool> placed(n, false);
+        for (size_t start = 0; start < n; start++) {
+            if (placed[start] || order[start] == start) continue;
+            char *filename = table.filenames[start];
+            float norm = have_norms ? table.norms[start] : 0.0f;
+            std::copy(table.row(start), table.row(start) + dim, scratch.begin());
+            size_t i = start;
+            while (order[i] != start) {
+                size_t from = order[i];
+                table.filenames[i] = table.filenames[from];
+                if (have_norms) table.norms[i] = table.norms[from];
+                std::copy(table.row(from), table.row(from) + dim, table.row(i));
+                placed[i] = true;
+                i = from;
+            }
+            table.filenames[i] = filename;
+            if (have_norms) table.norms[i] = norm;
+            std::copy(scratch.begin(), scratch.end(), table.row(i));
+            placed[i] = true;
+        }
+    }
+    build_blocked_layout(table, 0);
+    return index_feature_table(table);
+}
+
+/**
+ * @brief Interns the filenames of a table and builds its ID to row index.
+ *
+ * @return non-zero if two rows name the same image.
+ */
+int index_feature_table(FeatureTable &table) {
+    ImageRegistry &registry = image_registry();
+    table.ids.resize(table.rows());
+    table.bare_names = table.rows() > 0;
+    for (size_t i = 0; i < table.rows(); i++) {
+        table.ids[i] = registry.intern(table.filenames[i]);
+        if (has_image_directory(table.filenames[i])) table.bare_names = false;
+    }
+    table.row_of_id.assign(registry.size(), -1);
+    for (size_t i = 0; i < table.rows(); i++) {
+        int &row = table.row_of_id[table.ids[i]];
+        if (row != -1) {
+            cerr << "Image " << table.filenames[i] << " appears twice in the table" << endl;
+            return -1;
+        }
+        row = static_cast<int>(i);
+    }
+    return 0;
+}
+
+int find_table_row(const FeatureTable &table, const char *image_filename) {
+    return ImageNameIndex(table.row_of_id, table.bare_names).find(image_filename);
+}
+
+bool feature_tables_aligned(const FeatureTable &a, const FeatureTable &b) {
+    return a.rows() == b.rows() && a.ids == b.ids;
+}
+
+// FNV-1a over the width, the row names and the bits of every value, so a saved index is only
+// used with the table it was built on and not with a rewrite of the file under the same names
+uint64_t feature_table_fingerprint(const FeatureTable &table) {
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](unsigned char byte) {
+        hash ^= byte;
+        hash *= 1099511628211ULL;
+    };
+    for (int shift = 0; shift < 32; shift += 8) mix(static_cast<unsigned char>(table.dim >> shift));
+    for (char *filename : table.filenames) {
+        for (char c : canonical_image_name(filename)) mix(static_cast<unsigned char>(c));
+        mix(0);
+    }
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(table.values.data());
+    size_t count = table.rows() * table.dim * sizeof(float);
+    for (size_t i = 0; i < count; i++) mix(bytes[i]);
+    return hash;
+}
+
+/*
+  Gathers the rows of table in the row order of reference into the output
+  arrays. Names of images missing from the table are stored in names, and
+  so are the names of the gathered rows if copy_names is set; otherwise the
+  output points at the names of table.
+ */
+static int gather_aligned(const FeatureTable &table, const FeatureTable &reference, NameArena &names, bool copy_names,
+                          vector<char *> &filenames, FeatureValues &values, vector<float> &norms) {
+    if (table.ids.size() != table.rows() || reference.ids.size() != reference.rows()) {
+        cerr << "Feature tables must be indexed before they are aligned" << endl;
+        return -1;
+    }
+
+    ImageNameIndex index(table.row_of_id, table.bare_names);
+    size_t missing = 0;
+    filenames.assign(reference.rows(), nullptr);
+    values.assign(reference.rows() * table.dim, 0.0f);
+    norms.assign(reference.rows(), 0.0f);
+    vector<bool> used(table.rows(), false);
+    bool have_norms = table.norms.size() == table.rows();
+    for (size_t i = 0; i < reference.rows(); i++) {
+        int row = index.find(reference.ids[i]);
+        if (row == -1) {
+            missing++;
+            filenames[i] = names.store(reference.filenames[i]);
+            continue;
+        }
+        used[row] = true;
+        filenames[i] = copy_names ? names.store(table.filenames[row]) : table.filenames[row];
+        std::copy(table.row(row), table.row(row) + table.dim, values.begin() + i * table.dim);
+        if (have_norms) norms[i] = table.norms[row];
+    }
+    if (!have_norms) norms.clear();
+    size_t dropped = std::count(used.begin(), used.end(), false);
+    if (missing > 0 || dropped > 0) {
+        cerr << "Joining feature tables by image: " << missing << " images have no features, " << dropped
+             << " rows are not in the reference table" << endl;
+    }
+    // Rows of zeros would rank every image the same and still look like an answer
+    size_t matched = reference.rows() - missing;
+    size_t smaller = std::min(table.rows(), reference.rows());
+    if (smaller > 0 && (matched == 0 || matched < ALIGN_MIN_MATCHED * smaller)) {
+        cerr << "Only " << matched << " of " << smaller << " images are in both feature tables, "
+             << "their image names do not match" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reorders the rows of a table to the rows of a reference table, joined by image ID.
+ *
+ * @param table Table to reorder.
+ * @param reference Table whose row order is kept.
+ * @return non-zero failure.
+ */
+int align_feature_table(FeatureTable &table, const FeatureTable &reference) {
+    if (feature_tables_aligned(table, reference)) {
+        return 0;
+    }
+    // Dropped rows keep their names in the arena, earlier results may still use them
+    vector<char *> filenames;
+    FeatureValues values;
+    vector<float> norms;
+    if (gather_aligned(table, reference, table.names, false, filenames, values, norms) != 0) {
+        return -1;
+    }
+    table.filenames.swap(filenames);
+    table.values.swap(values);
+    table.norms.swap(norms);
+    table.ids = reference.ids;
+    table.row_of_id = reference.row_of_id;
+    table.bare_names = reference.bare_names;
+    if (table.blocked.lanes != 0) {
+        build_blocked_layout(table, table.blocked.lanes);
+    }
+    return 0;
+}
+
+int align_feature_table(const FeatureTable &table, const FeatureTable &reference, FeatureTable &aligned) {
+    aligned = FeatureTable();
+    aligned.dim = table.dim;
+    aligned.normalized = table.normalized;
+    if (gather_aligned(table, reference, aligned.names, true, aligned.filenames, aligned.values, aligned.norms) != 0) {
+        return -1;
+    }
+    aligned.ids = reference.ids;
+    aligned.row_of_id = reference.row_of_id;
+    aligned.bare_names = reference.bare_names;
+    if (table.blocked.lanes != 0) {
+        build_blocked_layout(aligned, table.blocked.lanes);
+    }
+    return 0;
+}
+
+// Reads the '#' metadata lines at the top of a feature file
+static int read_normalized_flag(char *filename, bool &normalized) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        return -1;
+    }
+    char line[256];
+    normalized = false;
+    while (fgets(line, sizeof(line), fp) != NULL && line[0] == '#') {
+        if (strncmp(line, NORMALIZED_TAG, strlen(NORMALIZED_TAG)) == 0) {
+            normalized = true;
+        }
+        // finish a metadata line longer than the buffer
+        while (strchr(line, '\n') == NULL && fgets(line, sizeof(line), fp) != NULL) {}
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Computes the L2 norm of every row into table.norms
+void compute_row_norms(FeatureTable &table) {
+    table.norms.resize(table.rows());
+    for (size_t i = 0; i < table.rows(); i++) {
+        const float *row = table.row(i);
+        float sum = 0.0f;
+        for (int d = 0; d < table.dim; d++) {
+            sum += row[d] * row[d];
+        }
+        table.norms[i] = std::sqrt(sum);
+    }
+}
+
+/**
+ * @brief Builds the transposed block layout of a table next to its rows.
+ *
+ * @param table Table to lay out.
+ * @param lanes Candidates per block, 8 or 16; 0 drops the layout.
+ * @return non-zero if lanes is not supported.
+ */
+int build_blocked_layout(FeatureTable &table, int lanes) {
+    BlockedFeatures &blocked = table.blocked;
+    blocked.values.clear();
+    blocked.values.shrink_to_fit();
+    blocked.num_blocks = 0;
+    blocked.lanes = 0;
+    if (lanes == 0) {
+        return 0;
+    }
+    if (lanes != 8 && lanes != 16) {
+        cerr << "Unsupported block width " << lanes << ", use 8 or 16" << endl;
+        return -1;
+    }
+
+    blocked.lanes = lanes;
+    blocked.num_blocks = (table.rows() + lanes - 1) / lanes;
+    blocked.values.assign(blocked.num_blocks * table.dim * lanes, 0.0f);
+    for (size_t i = 0; i < table.rows(); i++) {
+        float *block = blocked.values.data() + (i / lanes) * table.dim * lanes;
+        const float *row = table.row(i);
+        size_t lane = i % lanes;
+        for (int d = 0; d < table.dim; d++) {
+            block[d * lanes + lane] = row[d];
+        }
+    }
+    return 0;
+}
+
+// Scales every row to unit L2 norm (zero rows stay zero) and marks the table normalized
+void normalize_feature_table(FeatureTable &table) {
+    if (table.norms.size() != table.rows()) {
+        compute_row_norms(table);
+    }
+    for (size_t i = 0; i < table.rows(); i++) {
+        float *row = table.row(i);
+        float scale = table.norms[i] > 0.0f ? 1.0f / table.norms[i] : 0.0f;
+        for (int d = 0; d < table.dim; d++) {
+            row[d] *= scale;
+        }
+        table.norms[i] = table.norms[i] > 0.0f ? 1.0f : 0.0f;
+    }
+    table.normalized = true;
+    if (table.blocked.lanes != 0) {
+        build_blocked_layout(table, table.blocked.lanes);
+    }
+}
+
+/**
+ * @brief Reads a feature CSV file straight into a FeatureTable.
+ *
+ * @param filename CSV file written by append_image_data_csv or write_feature_table_csv.
+ * @param table Output table, rows sorted by filename.
+ * @param l2_normalize If true, rows of a file that is not normalized yet are scaled to unit length.
+ * @param strict If true, a single malformed row fails the read.
+ * @return non-zero failure.
+ */
+int read_feature_table(char *filename, FeatureTable &table, int l2_normalize, bool strict) {
+    if (is_column_file(filename)) {
+        return read_feature_columns(filename, nullptr, table, l2_normalize);
+    }
+    if (is_feature_store(filename)) {
+        return read_feature_store(filename, table, l2_normalize);
+    }
+    printf("Reading %s\n", filename);
+    std::vector<CsvRowError> errors;
+    if (load_feature_csv(filename, table, 0, &errors) != 0) {
+        return -1;
+    }
+    if (!errors.empty()) {
+        cerr << errors.size() << " malformed rows left out of " << filename << endl;
+        for (size_t i = 0; i < errors.size() && i < 10; i++) {
+            cerr << filename << ":" << errors[i].line << ": row " << errors[i].message << endl;
+        }
+        if (strict) {
+            return -1;
+        }
+    }
+    printf("Finished reading CSV file\n");
+
+    compute_row_norms(table);
+    if (l2_normalize && !table.normalized) {
+        normalize_feature_table(table);
+    }
+    return 0;
+}
+
+int read_feature_table_rows(char *filename, const std::vector<int> &wanted, FeatureTable &table, int l2_normalize) {
+    if (is_column_file(filename)) {
+        return read_feature_columns(filename, &wanted, table, l2_normalize);
+    }
+    bool normalized = false;
+    FILE *fp = fopen(filename, "r");
+    if (!fp || read_normalized_flag(filename, normalized) != 0) {
+        printf("Unable to open feature file\n");
+        if (fp) fclose(fp);
+        return -1;
+    }
+    ImageNameIndex keep(wanted);
+
+    NameArena names;
+    std::vector<char *> filenames;
+    std::vector<std::vector<float>> data;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, fp)) > 0) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        char *comma = strchr(line, ',');
+        if (comma == NULL) continue;
+        *comma = '\0';
+        if (keep.find(line) < 0) continue;
+
+        std::vector<float> row;
+        char *field = comma + 1;
+        for (;;) {
+            char *end;
+            float value = strtof(field, &end);
+            if (end == field) break;
+            row.push_back(value);
+            if (*end != ',') break;
+            field = end + 1;
+        }
+        filenames.push_back(names.store(line));
+        data.push_back(row);
+    }
+    free(line);
+    fclose(fp);
+
+    if (pack_feature_table(filenames, data, table) != 0 || sort_feature_table(table) != 0) {
+        return -1;
+    }
+    compute_row_norms(table);
+    table.normalized = normalized;
+    if (l2_normalize && !table.normalized) {
+        normalize_feature_table(table);
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a FeatureTable as a feature CSV file, metadata line first.
+ *
+ * @param filename Output CSV file, overwritten.
+ * @param table Table to write.
+ * @return non-zero failure.
+ */
+int write_feature_table_csv(char *filename, FeatureTable &table) {
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        printf("Unable to open output file %s\n", filename);
+        return -1;
+    }
+    if (table.normalized) {
+        fprintf(fp, "%s\n", NORMALIZED_TAG);
+    }
+    for (size_t i = 0; i < table.rows(); i++) {
+        fputs(table.filenames[i], fp);
+        const float *row = table.row(i);
+        // max_digits10 digits read back as the same float, so the fingerprint of the table survives the file
+        for (int d = 0; d < table.dim; d++) {
+            fprintf(fp, ",%.9g", row[d]);
+        }
+        fputc('\n', fp);
+    }
+    fclose(fp);
+    return 0;
+}
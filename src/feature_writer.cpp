@@ -8,49 +8,82 @@
 #include <opencv2/opencv.hpp>
 #include "../include/feature_calculate.h"
 #include "../include/csv_util.h"
+#include "../include/feature_table.h"
+#include "../include/predicate_bitmap.h"
+#include "../include/ResNetNetwork.hpp"
 #include <vector>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <string>
 #include <dirent.h>
 
 using namespace cv;
 using namespace std;
 
+// An output CSV file, emptied before its first row is written
+struct FeatureOutput {
+    char *filename;
+    bool started;
+};
+
+// Appends one row to an output file
+static int save_features(FeatureOutput &output, char *image_filename, std::vector<float> &features) {
+    int result = append_image_data_csv(output.filename, image_filename, features, output.started ? 0 : 1);
+    output.started = true;
+    if (result != 0) {
+        fprintf(stderr, "Error: Failed to save features to '%s'\n", output.filename);
+        return -1;
+    }
+    return 0;
+}
+
 /**
-* @brief Extracts features from an image file and appends them to a CSV file.
+* @brief Extracts features from a decoded image and appends them to a CSV file.
 *
-* @param image_filename Path to the image file.
+* @param image_filename Path to the image file, written as the row name.
+* @param image The image, decoded once for every feature computed from it.
 * @param feature_function Pointer to a function that extracts features from the image.
-*                         The function takes an image filename and a reference to a
+*                         The function takes a decoded image and a reference to a
 *                         vector of floats and returns 0 on success.
-* @param output_filename Path to the output CSV file where features will be saved.
+* @param output Output CSV file where features will be saved.
 * @return int Returns 0 on success, or -1 on failure.
 */
-int extract_and_save_features(char* image_filename,
-                              int (*feature_function)(char *, std::vector<float> &),
-                              char* output_filename) {
-
-    
+int extract_and_save_features(char* image_filename, const cv::Mat &image,
+                              int (*feature_function)(const cv::Mat &, std::vector<float> &),
+                              FeatureOutput &output) {
     std::vector<float> features;
     // Try to extract features
-    int result = feature_function(image_filename, features);
+    int result = feature_function(image, features);
     if (result != 0) {
         fprintf(stderr, "Error: Failed to extract features from '%s'\n", image_filename);
         return -1;
     }
-    // If this is the first file, reset the output file
-    static bool first_file = true;
-    int reset = first_file ? 1 : 0;
-    first_file = false;
+    return save_features(output, image_filename, features);
+}
 
-    result = append_image_data_csv(output_filename, image_filename, features, reset);
+/**
+* @brief Runs the ResNet on the images waiting for it in one batch and appends their embeddings.
+*
+* Rows are named by the bare image filename, the layout of ResNet18_olym.csv.
+*
+* @param names Image filenames, emptied.
+* @param images Decoded images, emptied.
+* @param output Output CSV file of the embeddings.
+* @return int Returns 0 on success, or -1 on failure.
+*/
+static int flush_embeddings(std::vector<std::string> &names, std::vector<cv::Mat> &images, FeatureOutput &output) {
+    std::vector<std::vector<float>> embeddings;
+    int result = getResNetEmbeddings(images, embeddings);
+    for (size_t i = 0; result == 0 && i < names.size(); i++) {
+        result = save_features(output, const_cast<char *>(names[i].c_str()), embeddings[i]);
+    }
     if (result != 0) {
-        fprintf(stderr, "Error: Failed to save features to '%s'\n", output_filename);
-        return -1;
+        fprintf(stderr, "Error: Failed to save the embeddings of %zu images\n", names.size());
     }
-
-    return 0;
+    names.clear();
+    images.clear();
+    return result;
 }
 
 
@@ -64,6 +97,10 @@ int extract_and_save_features(char* image_filename,
  * @param argv Command-line arguments.
  *             argv[1] should be the directory path,
  *             argv[2] should be the output CSV file path.
+ *             argv[3] should be the feature type.
+ *             --embeddings <file> - also write the ResNet18 embedding of every image to file,
+ *                                   from the same decoded image; not with feature type 10
+ *             Also writes the predicate bitmaps of the images to the output path plus ".pred".
  * @return int Returns 0 on success, or -1 on failure.
  */
 int main(int argc, char *argv[]) {
@@ -75,7 +112,7 @@ int main(int argc, char *argv[]) {
 
     // check for sufficient arguments
     if (argc < 4) {
-        printf("usage: %s <directory path> <output filename> <feature type>\n", argv[0]);
+        printf("usage: %s <directory path> <output filename> <feature type> [--embeddings <filename>]\n", argv[0]);
         printf("Feature types:\n");
         printf("1: 7x7 square\n");
         printf("2: RGB histogram\n");
@@ -84,6 +121,8 @@ int main(int argc, char *argv[]) {
         printf("8: Face value from DA2\n");
         printf("7: Depth value from DA2\n");
         printf("9: Banana\n");
+        printf("10: ResNet18 embedding (../include/resnet18.onnx)\n");
+        printf("--embeddings: also write ResNet18 embeddings to a second file from the same decoded images, not with type 10\n");
         exit(-1);
     }
 
@@ -112,15 +151,30 @@ int main(int argc, char *argv[]) {
         case 8:
             feature_type = FeatureType::FACE;
             printf("Using Face vector feature\n");
+            break;
         case 9:
             feature_type = FeatureType::BANANA;
             printf("Using Banana feature\n");
             break;
+        case 10:
+            feature_type = FeatureType::RESNET;
+            printf("Using ResNet18 embedding feature\n");
+            break;
         default:
-            printf("Invalid feature type. Please select 1, 2, 3 or 4, 7, 8, 9\n");
+            printf("Invalid feature type. Please select 1, 2, 3 or 4, 7, 8, 9, 10\n");
             exit(-1);
     }
-
+    char *embeddings_file = NULL;
+    if (argc >= 6 && strcmp(argv[4], "--embeddings") == 0) {
+        embeddings_file = argv[5];
+    } else if (argc > 4) {
+        printf("Unknown option: %s\n", argv[4]);
+        exit(-1);
+    }
+    if (embeddings_file != NULL && feature_type == FeatureType::RESNET) {
+        printf("--embeddings can not be used with feature type 10, which already writes the embeddings\n");
+        exit(-1);
+    }
 
     // get the directory path
     strcpy(dirname, argv[1]);
@@ -138,6 +192,11 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error: Output CSV file name is invalid.\n");
         return -1;
     }
+    FeatureOutput output = {output_file, false};
+    // The embeddings go to their own file, or are the feature itself
+    FeatureOutput embeddings = {feature_type == FeatureType::RESNET ? output_file : embeddings_file, false};
+    std::vector<std::string> pending_names;
+    std::vector<cv::Mat> pending_images;
 
     // loop over all the files in the image file listing
     while( (dp = readdir(dirp)) != NULL ) {
@@ -155,9 +214,41 @@ int main(int argc, char *argv[]) {
             strcat(buffer, dp->d_name);
 
             printf("full path name: %s\n", buffer);
-            extract_and_save_features(buffer, getFeatureFunction(feature_type), output_file);
+            // Decode once, every feature of the image is computed from this copy
+            cv::Mat image = imread(buffer);
+            if (image.empty()) {
+                fprintf(stderr, "Error: Failed to read '%s'\n", buffer);
+                continue;
+            }
+            if (feature_type != FeatureType::RESNET) {
+                extract_and_save_features(buffer, image, getImageFeatureFunction(feature_type), output);
+            }
+            if (embeddings.filename != NULL) {
+                pending_names.push_back(dp->d_name);
+                pending_images.push_back(image);
+                if (pending_images.size() >= RESNET_MAX_BATCH) {
+                    flush_embeddings(pending_names, pending_images, embeddings);
+                }
+            }
         }
     }
+    if (!pending_images.empty()) {
+        flush_embeddings(pending_names, pending_images, embeddings);
+    }
+
+    // Record the per-image predicates once, so filtered searches never recompute them
+    FeatureTable table;
+    PredicateSet predicates;
+    const char *layout = feature_type == FeatureType::FACE ? "face" :
+                         feature_type == FeatureType::BANANA ? "banana" : "plain";
+    string predicate_file = predicate_file_name(output_file);
+    if (read_feature_table(output_file, table) != 0 ||
+        build_feature_predicates(table, layout, predicates) != 0 ||
+        write_feature_predicates(predicate_file.c_str(), predicates) != 0) {
+        printf("Could not write the predicates to %s\n", predicate_file.c_str());
+    } else {
+        printf("Wrote %zu predicates to %s\n", predicates.names.size(), predicate_file.c_str());
+    }
 
     printf("Terminating\n");
 
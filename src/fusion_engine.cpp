@@ -0,0 +1,63 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Fagin's threshold algorithm over weighted modalities
+ */
+#include "../include/fusion_engine.h"
+#include <cfloat>
+
+using namespace std;
+
+std::vector<std::pair<float, int>> threshold_topN(const std::vector<FusionTerm> &terms, size_t rows, int N,
+                                                  int exclude, FusionStats *stats) {
+    FusionStats local;
+    FusionStats &counters = stats ? *stats : local;
+    counters.rows += rows;
+    TopNHeap heap(N, true);
+    if (N <= 0 || rows == 0 || terms.empty()) return heap.sorted();
+
+    // Last distance read from each modality, its lower bound until then or if it has no sorted access
+    vector<float> last(terms.size());
+    vector<bool> exhausted(terms.size());
+    for (size_t t = 0; t < terms.size(); t++) {
+        last[t] = terms[t].modality->lower_bound();
+        exhausted[t] = !terms[t].modality->sorted_access();
+    }
+    vector<bool> seen(rows, false);
+    for (;;) {
+        bool progress = false;
+        for (size_t t = 0; t < terms.size(); t++) {
+            if (exhausted[t]) continue;
+            int row;
+            float dist;
+            if (!terms[t].modality->next_sorted(row, dist)) {
+                exhausted[t] = true;
+                continue;
+            }
+            progress = true;
+            counters.sorted_accesses++;
+            last[t] = dist;
+            if (seen[row] || row == exclude) continue;
+            seen[row] = true;
+            counters.rows_seen++;
+
+            // Full score of the new row, random access into the other modalities
+            bool accepted = true;
+            float score = terms[t].weight * dist;
+            for (size_t o = 0; o < terms.size() && accepted; o++) {
+                if (!terms[o].modality->accept(row)) accepted = false;
+                if (o == t || !accepted) continue;
+                score += terms[o].weight * terms[o].modality->distance(row);
+                counters.random_accesses++;
+            }
+            if (accepted) heap.push(score, row);
+        }
+        if (!progress) break;
+
+        // No unseen row can score below the threshold
+        float threshold = 0.0f;
+        for (size_t t = 0; t < terms.size(); t++) threshold += terms[t].weight * last[t];
+        if (heap.full() && heap.worst().first < threshold) break;
+    }
+    return heap.sorted();
+}
@@ -0,0 +1,462 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 24, 2025
+ * Purpose: Building, saving, memory-mapping and searching the HNSW graph
+ */
+#include "../include/hnsw_index.h"
+#include "../include/distance_calculate.h"
+#include "../include/parallel_for.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define HNSW_MAGIC "P2HNSW01"
+
+// Fixed-size header at the start of an index file, the arrays follow at 8-byte aligned offsets
+struct HnswFileHeader {
+    char magic[8];
+    uint64_t n;
+    uint64_t upper_size;  // ints in the upper layer lists
+    uint64_t fingerprint; // feature_table_fingerprint of the table
+    int32_t dim;
+    int32_t M;
+    int32_t ef_construction;
+    int32_t ef_search;
+    int32_t max_level;
+    int32_t entry_point;
+};
+
+static size_t align8(size_t bytes) { return (bytes + 7) & ~static_cast<size_t>(7); }
+
+/*
+  Marks the nodes a search has seen. Each thread keeps one list for the
+  largest index it searched, and a new search only bumps the epoch instead
+  of clearing n flags.
+ */
+struct VisitedList {
+    vector<uint32_t> marks;
+    uint32_t epoch = 0;
+
+    void reset(size_t n) {
+        if (marks.size() < n) {
+            marks.assign(n, 0);
+            epoch = 0;
+        }
+        if (++epoch == 0) {
+            std::fill(marks.begin(), marks.end(), 0);
+            epoch = 1;
+        }
+    }
+    // True the first time node is seen since reset
+    bool visit(int node) {
+        if (marks[node] == epoch) return false;
+        marks[node] = epoch;
+        return true;
+    }
+};
+
+static thread_local VisitedList visited;
+
+HnswIndex::~HnswIndex() {
+    release();
+}
+
+void HnswIndex::release() {
+    if (mapping_ != nullptr) {
+        munmap(mapping_, mapping_bytes_);
+        mapping_ = nullptr;
+        mapping_bytes_ = 0;
+    }
+    level_store_.clear();
+    offset_store_.clear();
+    links0_store_.clear();
+    upper_store_.clear();
+    levels_ = nullptr;
+    upper_offset_ = nullptr;
+    links0_ = nullptr;
+    upper_ = nullptr;
+    n_ = 0;
+    max_level_ = -1;
+    entry_point_ = -1;
+}
+
+int *HnswIndex::links(int node, int layer) const {
+    if (layer == 0) {
+        return links0_ + static_cast<size_t>(node) * (2 * params_.M + 1);
+    }
+    return upper_ + upper_offset_[node] + static_cast<size_t>(layer - 1) * (params_.M + 1);
+}
+
+float HnswIndex::distance(const float *query, int node) const {
+    return 1.0f - calculate_dot_product(query, vectors_ + static_cast<size_t>(node) * dim_, dim_);
+}
+
+// Copies the links of node at layer, under the node lock while the graph is being built
+static void copy_links(const int *list, vector<int> &out) {
+    out.assign(list + 1, list + 1 + list[0]);
+}
+
+// Walks from node towards the query on every layer from from_layer down to to_layer
+int HnswIndex::greedy_closest(const float *query, int node, int from_layer, int to_layer, bool locked) const {
+    float best = distance(query, node);
+    vector<int> neighbors;
+    for (int layer = from_layer; layer >= to_layer; layer--) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            if (locked) {
+                lock_guard<mutex> lock(node_locks_[node]);
+                copy_links(links(node, layer), neighbors);
+            } else {
+                copy_links(links(node, layer), neighbors);
+            }
+            for (int next : neighbors) {
+                float d = distance(query, next);
+                if (d < best) {
+                    best = d;
+                    node = next;
+                    changed = true;
+                }
+            }
+        }
+    }
+    return node;
+}
+
+// Best-first search of one layer keeping the ef closest nodes seen
+HnswIndex::Candidates HnswIndex::search_layer(const float *query, int entry, int ef, int layer, bool locked) const {
+    typedef pair<float, int> Entry;
+    priority_queue<Entry, vector<Entry>, greater<Entry>> frontier; // closest on top
+    priority_queue<Entry> found;                                   // farthest on top
+
+    visited.reset(n_);
+    visited.visit(entry);
+    float d = distance(query, entry);
+    frontier.push(Entry(d, entry));
+    found.push(Entry(d, entry));
+
+    vector<int> neighbors;
+    while (!frontier.empty()) {
+        Entry current = frontier.top();
+        if (current.first > found.top().first && static_cast<int>(found.size()) >= ef) break;
+        frontier.pop();
+
+        if (locked) {
+            lock_guard<mutex> lock(node_locks_[current.second]);
+            copy_links(links(current.second, layer), neighbors);
+        } else {
+            copy_links(links(current.second, layer), neighbors);
+        }
+        for (int next : neighbors) {
+            if (!visited.visit(next)) continue;
+            float dist = distance(query, next);
+            if (static_cast<int>(found.size()) < ef || dist < found.top().first) {
+                frontier.push(Entry(dist, next));
+                found.push(Entry(dist, next));
+                if (static_cast<int>(found.size()) > ef) found.pop();
+            }
+        }
+    }
+
+    Candidates result;
+    result.reserve(found.size());
+    while (!found.empty()) {
+        result.push_back(found.top());
+        found.pop();
+    }
+    return result;
+}
+
+/*
+  Keeps at most M candidates, closest first, skipping any candidate that is
+  closer to an already kept one than to the query. This keeps links pointing
+  in different directions, which is what makes the graph navigable.
+ */
+void HnswIndex::select_neighbors(Candidates &candidates, int M) const {
+    std::sort(candidates.begin(), candidates.end());
+    if (static_cast<int>(candidates.size()) <= M) return;
+    Candidates kept;
+    for (const pair<float, int> &candidate : candidates) {
+        if (static_cast<int>(kept.size()) >= M) break;
+        const float *vec = vectors_ + static_cast<size_t>(candidate.second) * dim_;
+        bool diverse = true;
+        for (const pair<float, int> &other : kept) {
+            if (distance(vec, other.second) < candidate.first) {
+                diverse = false;
+                break;
+            }
+        }
+        if (diverse) kept.push_back(candidate);
+    }
+    candidates.swap(kept);
+}
+
+void HnswIndex::insert(int node) {
+    const int level = levels_[node];
+    const float *query = vectors_ + static_cast<size_t>(node) * dim_;
+
+    // A node that raises the top layer keeps the entry lock until it is the new entry point
+    unique_lock<mutex> entry(entry_lock_);
+    const int top = max_level_;
+    int current = entry_point_;
+    if (current == -1) {
+        entry_point_ = node;
+        max_level_ = level;
+        return;
+    }
+    if (level <= top) entry.unlock();
+
+    if (level < top) {
+        current = greedy_closest(query, current, top, level + 1, true);
+    }
+    for (int layer = std::min(level, top); layer >= 0; layer--) {
+        Candidates neighbors = search_layer(query, current, params_.ef_construction, layer, true);
+        neighbors.erase(std::remove_if(neighbors.begin(), neighbors.end(),
+                                       [node](const pair<float, int> &match) { return match.second == node; }),
+                        neighbors.end());
+        if (neighbors.empty()) continue;
+        select_neighbors(neighbors, params_.M);
+        current = neighbors.front().second;
+        {
+            lock_guard<mutex> lock(node_locks_[node]);
+            int *list = links(node, layer);
+            list[0] = static_cast<int>(neighbors.size());
+            for (size_t i = 0; i < neighbors.size(); i++) list[1 + i] = neighbors[i].second;
+        }
+
+        // Link back, pruning a full list with the same heuristic
+        const int limit = max_links(layer);
+        for (const pair<float, int> &neighbor : neighbors) {
+            lock_guard<mutex> lock(node_locks_[neighbor.second]);
+            int *list = links(neighbor.second, layer);
+            if (list[0] < limit) {
+                list[1 + list[0]] = node;
+                list[0]++;
+                continue;
+            }
+            const float *vec = vectors_ + static_cast<size_t>(neighbor.second) * dim_;
+            Candidates pool;
+            pool.push_back(make_pair(neighbor.first, node));
+            for (int i = 1; i <= list[0]; i++) pool.push_back(make_pair(distance(vec, list[i]), list[i]));
+            select_neighbors(pool, limit);
+            list[0] = static_cast<int>(pool.size());
+            for (size_t i = 0; i < pool.size(); i++) list[1 + i] = pool[i].second;
+        }
+    }
+
+    if (level > top) {
+        entry_point_ = node;
+        max_level_ = level;
+    }
+}
+
+int HnswIndex::build(const FeatureTable &table, const HnswParams &params, int num_threads) {
+    if (!table.normalized) {
+        cerr << "The HNSW index needs an L2-normalized table" << endl;
+        return -1;
+    }
+    if (params.M < 2 || params.ef_construction < 1) {
+        cerr << "Invalid HNSW parameters: M " << params.M << ", efConstruction " << params.ef_construction << endl;
+        return -1;
+    }
+    release();
+    params_ = params;
+    n_ = table.rows();
+    dim_ = table.dim;
+    fingerprint_ = feature_table_fingerprint(table);
+    vectors_ = table.values.data();
+
+    // Node levels follow an exponential distribution with scale 1 / ln(M)
+    mt19937 rng(params_.seed);
+    uniform_real_distribution<double> uniform(0.0, 1.0);
+    const double scale = 1.0 / std::log(static_cast<double>(params_.M));
+    level_store_.resize(n_);
+    offset_store_.resize(n_ + 1);
+    offset_store_[0] = 0;
+    for (size_t i = 0; i < n_; i++) {
+        level_store_[i] = static_cast<int>(-std::log(1.0 - uniform(rng)) * scale);
+        offset_store_[i + 1] = offset_store_[i] + static_cast<uint64_t>(level_store_[i]) * (params_.M + 1);
+    }
+    links0_store_.assign(n_ * (2 * params_.M + 1), 0);
+    upper_store_.assign(offset_store_[n_], 0);
+    levels_ = level_store_.data();
+    upper_offset_ = offset_store_.data();
+    links0_ = links0_store_.data();
+    upper_ = upper_store_.data();
+
+    if (n_ == 0) return 0;
+    vector<mutex>(n_).swap(node_locks_);
+    insert(0);
+    parallel_for(n_ - 1, num_threads, [this](size_t i, int) { insert(static_cast<int>(i + 1)); });
+    vector<mutex>().swap(node_locks_);
+    return 0;
+}
+
+std::vector<std::pair<float, int>> HnswIndex::search(const float *query, int N, int ef_search, int exclude) const {
+    vector<pair<float, int>> result;
+    if (n_ == 0 || N <= 0) return result;
+    int ef = ef_search > 0 ? ef_search : params_.ef_search;
+    ef = std::max(ef, N + (exclude >= 0 ? 1 : 0));
+
+    int entry = entry_point_;
+    if (max_level_ > 0) entry = greedy_closest(query, entry, max_level_, 1, false);
+    result = search_layer(query, entry, ef, 0, false);
+    std::sort(result.begin(), result.end());
+    result.erase(std::remove_if(result.begin(), result.end(),
+                                [exclude](const pair<float, int> &match) { return match.second == exclude; }),
+                 result.end());
+    if (static_cast<int>(result.size()) > N) result.resize(N);
+    return result;
+}
+
+int HnswIndex::save(const char *filename) const {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        cerr << "Unable to open index file " << filename << endl;
+        return -1;
+    }
+    HnswFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HNSW_MAGIC, sizeof(header.magic));
+    header.n = n_;
+    header.upper_size = n_ > 0 ? upper_offset_[n_] : 0;
+    header.fingerprint = fingerprint_;
+    header.dim = dim_;
+    header.M = params_.M;
+    header.ef_construction = params_.ef_construction;
+    header.ef_search = params_.ef_search;
+    header.max_level = max_level_;
+    header.entry_point = entry_point_;
+
+    // Sections in file order, each padded to 8 bytes
+    const void *sections[] = {levels_, upper_offset_, links0_, upper_};
+    const size_t bytes[] = {n_ * sizeof(int), (n_ + 1) * sizeof(uint64_t),
+                            n_ * (2 * params_.M + 1) * sizeof(int), header.upper_size * sizeof(int)};
+    static const char padding[8] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (int s = 0; s < 4 && ok; s++) {
+        if (bytes[s] > 0) ok = fwrite(sections[s], 1, bytes[s], fp) == bytes[s];
+        size_t pad = align8(bytes[s]) - bytes[s];
+        if (ok && pad > 0) ok = fwrite(padding, 1, pad, fp) == pad;
+    }
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) {
+        cerr << "Failed to write index file " << filename << endl;
+        return -1;
+    }
+    return 0;
+}
+
+// True if a link list holds at most max_links nodes, all below n
+static bool valid_links(const int *list, int max_links, size_t n) {
+    if (list[0] < 0 || list[0] > max_links) return false;
+    for (int i = 1; i <= list[0]; i++) {
+        if (list[i] < 0 || static_cast<size_t>(list[i]) >= n) return false;
+    }
+    return true;
+}
+
+/*
+  Checks a mapped graph before any search follows it: the entry point and
+  levels are in range, the upper layer offsets match the levels and end at
+  the size of the upper section, and every link names a node.
+ */
+static bool valid_graph(const HnswFileHeader &header, const int *levels, const uint64_t *upper_offset,
+                        const int *links0, const int *upper) {
+    const size_t n = header.n;
+    const int M = header.M;
+    if (n == 0) return header.entry_point == -1 && header.upper_size == 0;
+    if (header.max_level < 0 || header.entry_point < 0 || static_cast<size_t>(header.entry_point) >= n ||
+        levels[header.entry_point] != header.max_level || upper_offset[0] != 0 ||
+        upper_offset[n] != header.upper_size) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (levels[i] < 0 || levels[i] > header.max_level || upper_offset[i + 1] < upper_offset[i] ||
+            upper_offset[i + 1] - upper_offset[i] != static_cast<uint64_t>(levels[i]) * (M + 1) ||
+            !valid_links(links0 + i * (2 * M + 1), 2 * M, n)) {
+            return false;
+        }
+        for (int layer = 0; layer < levels[i]; layer++) {
+            if (!valid_links(upper + upper_offset[i] + static_cast<size_t>(layer) * (M + 1), M, n)) return false;
+        }
+    }
+    return true;
+}
+
+int HnswIndex::load(const char *filename, const FeatureTable &table) {
+    release();
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(HnswFileHeader)) {
+        close(fd);
+        cerr << "Index file " << filename << " is too short" << endl;
+        return -1;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror(filename);
+        return -1;
+    }
+    mapping_ = mapping;
+    mapping_bytes_ = st.st_size;
+
+    const HnswFileHeader *header = static_cast<const HnswFileHeader *>(mapping);
+    size_t M = header->M > 0 ? header->M : 0;
+    size_t expected = sizeof(HnswFileHeader) + align8(header->n * sizeof(int)) +
+                      align8((header->n + 1) * sizeof(uint64_t)) + align8(header->n * (2 * M + 1) * sizeof(int)) +
+                      align8(header->upper_size * sizeof(int));
+    if (memcmp(header->magic, HNSW_MAGIC, sizeof(header->magic)) != 0 || header->M < 2 ||
+        expected != mapping_bytes_) {
+        cerr << "Index file " << filename << " is not an HNSW index" << endl;
+        release();
+        return -1;
+    }
+    if (header->n != table.rows() || header->dim != table.dim ||
+        header->fingerprint != feature_table_fingerprint(table)) {
+        cerr << "Index file " << filename << " was built on another feature table" << endl;
+        release();
+        return -1;
+    }
+
+    params_.M = header->M;
+    params_.ef_construction = header->ef_construction;
+    params_.ef_search = header->ef_search;
+    n_ = header->n;
+    dim_ = header->dim;
+    max_level_ = header->max_level;
+    entry_point_ = header->entry_point;
+    fingerprint_ = header->fingerprint;
+    vectors_ = table.values.data();
+
+    // The graph is only read after loading, the casts drop const for the shared accessors
+    char *base = static_cast<char *>(mapping) + sizeof(HnswFileHeader);
+    levels_ = reinterpret_cast<const int *>(base);
+    base += align8(n_ * sizeof(int));
+    upper_offset_ = reinterpret_cast<const uint64_t *>(base);
+    base += align8((n_ + 1) * sizeof(uint64_t));
+    links0_ = reinterpret_cast<int *>(base);
+    base += align8(n_ * (2 * M + 1) * sizeof(int));
+    upper_ = reinterpret_cast<int *>(base);
+    if (!valid_graph(*header, levels_, upper_offset_, links0_, upper_)) {
+        cerr << "Index file " << filename << " is corrupt" << endl;
+        release();
+        return -1;
+    }
+    return 0;
+}
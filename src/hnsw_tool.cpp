@@ -0,0 +1,157 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 24, 2025
+ * Purpose: Build an HNSW index over an embedding file and report its recall against the exact cosine search
+ */
+#include "../include/feature_table.h"
+#include "../include/hnsw_index.h"
+#include "../include/image_search.h"
+#include "../include/parallel_topn.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Parses "16,32,64" into a list of ef values
+static vector<int> parse_list(const char *text) {
+    vector<int> values;
+    stringstream fields(text);
+    string field;
+    while (getline(fields, field, ',')) {
+        int value = atoi(field.c_str());
+        if (value > 0) values.push_back(value);
+    }
+    return values;
+}
+
+static int build_index(FeatureTable &table, const char *index_file, const HnswParams &params, int num_threads) {
+    HnswIndex index;
+    auto start = chrono::steady_clock::now();
+    if (index.build(table, params, num_threads) != 0) return -1;
+    double build_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (index.save(index_file) != 0) return -1;
+    printf("Built %zu nodes with M = %d, efConstruction = %d on %d threads in %.2f s, saved to %s\n", index.size(),
+           params.M, params.ef_construction, resolve_thread_count(num_threads), build_s, index_file);
+    return 0;
+}
+
+/*
+  For each ef, searches num_queries targets with the index and with the exact
+  find_topN_matches_cosine and reports the fraction of exact matches the
+  index found (recall@N) and the time per query of both.
+ */
+static int report_recall(FeatureTable &table, const char *index_file, int N, int num_queries,
+                         const vector<int> &ef_values, int num_threads) {
+    HnswIndex index;
+    if (index.load(index_file, table) != 0) {
+        printf("Can not load the index %s\n", index_file);
+        return -1;
+    }
+    vector<int> targets;
+    for (int q = 0; q < num_queries; q++) {
+        targets.push_back(static_cast<int>((static_cast<size_t>(q) * 7919) % table.rows()));
+    }
+
+    // Exact matches once, the cosine matcher prints the target path it expects
+    vector<vector<char *>> exact(targets.size());
+    auto start = chrono::steady_clock::now();
+    for (size_t q = 0; q < targets.size(); q++) {
+        if (find_topN_matches_cosine(table.filenames[targets[q]], table, N, exact[q], num_threads) != 0) return -1;
+    }
+    double exact_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / targets.size();
+
+    printf("%zu rows, %zu queries, N = %d, M = %d\n", table.rows(), targets.size(), N, index.params().M);
+    printf("%8s %12s %12s %10s\n", "ef", "recall@N", "ms/query", "speedup");
+    printf("%8s %12s %12.3f %10s\n", "exact", "1.0000", exact_ms, "1.00x");
+    for (int ef : ef_values) {
+        size_t hits = 0, total = 0;
+        double ann_ms = 0.0;
+        for (size_t q = 0; q < targets.size(); q++) {
+            vector<char *> approx;
+            auto t0 = chrono::steady_clock::now();
+            find_topN_matches_cosine_ann(table.filenames[targets[q]], table, index, N, approx, ef);
+            ann_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+            for (char *name : exact[q]) {
+                total++;
+                if (std::find(approx.begin(), approx.end(), name) != approx.end()) hits++;
+            }
+        }
+        ann_ms /= targets.size();
+        printf("%8d %12.4f %12.3f %9.2fx\n", ef, total > 0 ? static_cast<double>(hits) / total : 1.0, ann_ms,
+               ann_ms > 0 ? exact_ms / ann_ms : 0.0);
+    }
+    return 0;
+}
+
+/**
+ * Builds an HNSW index over an embedding file, or reports the recall@N of a
+ * saved index against the exact cosine search for several efSearch values.
+ *
+ * @param argv argv[1] - build or recall, argv[2] - embedding feature file, argv[3] - index file
+ *             Optional flags:
+ *             --M <m> - links per node (build, default 16)
+ *             --ef-construction <n> - candidate list size while building (default 200)
+ *             --ef <n[,n...]> - efSearch saved with the index (build) or values to report (recall)
+ *             --N <n> - matches per query (recall, default 10)
+ *             --queries <q> - number of queries (recall, default 200)
+ *             --threads <n> - build threads, or exact search threads for recall; 0 uses every core
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 4 || (strcmp(argv[1], "build") != 0 && strcmp(argv[1], "recall") != 0)) {
+        printf("usage: %s build <feature_file> <index_file> [--M m] [--ef-construction n] [--ef n] [--threads n]\n",
+               argv[0]);
+        printf("       %s recall <feature_file> <index_file> [--N n] [--queries q] [--ef n,n,...] [--threads n]\n",
+               argv[0]);
+        exit(-1);
+    }
+    bool build = strcmp(argv[1], "build") == 0;
+    HnswParams params;
+    vector<int> ef_values = {16, 32, 64, 128, 256};
+    int N = 10;
+    int num_queries = 200;
+    int num_threads = 0;
+    for (int i = 4; i < argc; i++) {
+        if (i + 1 >= argc) {
+            printf("Missing value for %s\n", argv[i]);
+            exit(-1);
+        }
+        if (strcmp(argv[i], "--M") == 0) {
+            params.M = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ef-construction") == 0) {
+            params.ef_construction = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ef") == 0) {
+            ef_values = parse_list(argv[++i]);
+            if (!ef_values.empty()) params.ef_search = ef_values[0];
+        } else if (strcmp(argv[i], "--N") == 0) {
+            N = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--queries") == 0) {
+            num_queries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-t") == 0) {
+            num_threads = atoi(argv[++i]);
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+    if (N <= 0 || num_queries <= 0 || ef_values.empty()) {
+        printf("N, the number of queries and ef must be positive\n");
+        exit(-1);
+    }
+
+    // The index scores 1 - dot product, so the embeddings are normalized on load
+    FeatureTable table;
+    if (read_feature_table(argv[2], table, 1) != 0 || table.rows() == 0) {
+        printf("Can not read the image csv file: %s\n", argv[2]);
+        exit(-1);
+    }
+    if (build) {
+        return build_index(table, argv[3], params, num_threads);
+    }
+    return report_recall(table, argv[3], N, num_queries, ef_values, num_threads);
+}
@@ -3,347 +3,74 @@
  * Date: January 26, 2025
  * Purpose: Find and display the top N matching images based on feature vectors
  */
-#include "../include/csv_util.h"
-#include "../include/distance_calculate.h"
+#include "../include/cascade_plan.h"
+#include "../include/feature_table.h"
+#include "../include/fusion_engine.h"
+#include "../include/hnsw_index.h"
 #include "../include/image_display_util.h"
+#include "../include/image_query.h"
+#include "../include/image_search.h"
+#include "../include/knn_graph.h"
+#include "../include/inverted_hist_index.h"
+#include "../include/parallel_topn.h"
+#include "../include/predicate_bitmap.h"
+#include "../include/stream_search.h"
+#include <algorithm>
 #include <iostream>
 #include <cstdlib> // for atoi
 #include <cstdio>
 #include <cstring>
+#include <sstream>
+#include <string>
 #include <vector>
 
 using namespace cv;
 using namespace std;
 
-
-// Function to find the index of the target image in the list of filenames
-int find_target_index(const char *target_image_filename, vector<char *> &filenames) {
-    int target_index = -1;
-    for (size_t i = 0; i < filenames.size(); i++) {
-        if (strcmp(filenames[i], target_image_filename) == 0) {
-            target_index = i;
-            break;
-        }
-    }
-    return target_index;
+// Parses "0.6,0.4" into fusion weights
+static vector<float> parse_weights(const char *text) {
+    vector<float> weights;
+    stringstream fields(text);
+    string field;
+    while (getline(fields, field, ',')) weights.push_back(static_cast<float>(atof(field.c_str())));
+    return weights;
 }
 
-//Since cosine function is paired with ResNet18.csv, the file directory is hard-coded
-int find_target_index_cosine(const char *target_image_filename, std::vector<char *> &filenames) 
-{  
-    int target_index = -1;    
-    for (size_t i = 0; i < filenames.size(); i++) 
-    {        
-        string dirname = "../olympus/";
-        size_t len = dirname.length() + strlen(filenames[i]) + 1;
-        char *fullpath = new char[len];
-        strcpy(fullpath, dirname.c_str());
-        strcat(fullpath, filenames[i]);
-
-        if (strcmp(fullpath, target_image_filename) == 0)
-        {      
-            target_index = i;            
-        break;        
-        }    
-    }    
-        return target_index;
-}
-
-/**
- * Function to find top N matches using SSD distance
- * @return non-zero failure
- */
-int find_topN_matches_ssd(char *target_image_filename, std::vector<char *> &filenames,
-                          std::vector<std::vector<float>> &data, int N, std::vector<char *> &output) {
-    // data format is
-    //  The image filename is written to the first position in the row of data.
-    //  The values in image_data are all written to the file as floats.
-    // Step1: find the target
-    int target_index = find_target_index(target_image_filename, filenames);
-    // If the target image is not found, return an error
-    if (target_index == -1) {
-        std::cerr << "Target image not found!" << std::endl;
-        return -1;
-    }
-
-    // Step2: calculate the corresponding distance
-    std::vector<float> &target_vector = data[target_index];
-    vector<pair<float, int>> distances; // Pair of distance and index
-
-    for (size_t i = 0; i < data.size(); i++) {
-        if (i == target_index) {
-            continue;
-        }
-        float dist = calculate_ssd(data[i], target_vector);
-        distances.push_back({dist, static_cast<int>(i)});
-    }
-
-    // Step 3: Sort the pair
-    sort(distances.begin(), distances.end());
-
-    // Step 4: get N of them and return
-    for (int i = 0; i < N && i < distances.size(); i++) {
-        int match_index = distances[i].second;
-        output.push_back(filenames[match_index]);
-    }
-    return 0;
-}
-
-/**
- * Function to find top N matches using RGB histogram intersection
- * @return non-zero failure
+/*
+  Parses "metric:weight[:feature_file],..." into fusion modalities. A
+  modality without a file reads the feature file given on the command line
+  (table nullptr here); the others are loaded into tables.
  */
-int find_topN_matches_hist(char *target_image_filename, std::vector<char *> &filenames,
-                               std::vector<std::vector<float>> &data, int N, std::vector<char *> &output) {
-    // Step1: find the target
-    int target_index = find_target_index(target_image_filename, filenames);
-    // If the target image is not found, return an error
-    if (target_index == -1) {
-        std::cerr << "Target image not found!" << std::endl;
-        return -1;
-    }
-
-    // Step2: calculate the corresponding distance
-    std::vector<float> &target_vector = data[target_index];
-    vector<pair<float, int>> distances; // Pair of distance and index
-
-    for (size_t i = 0; i < data.size(); i++) {
-        if (i == target_index) {
-            continue;
+static int parse_fusion(const char *text, vector<FusionSpec> &specs, vector<FeatureTable> &tables) {
+    vector<string> modalities;
+    stringstream fields(text);
+    string field;
+    while (getline(fields, field, ',')) modalities.push_back(field);
+    tables.resize(modalities.size()); // reserved up front, the specs point into it
+    for (size_t m = 0; m < modalities.size(); m++) {
+        stringstream parts(modalities[m]);
+        string metric, weight, file;
+        getline(parts, metric, ':');
+        getline(parts, weight, ':');
+        getline(parts, file);
+        if (metric.empty() || weight.empty()) {
+            printf("Fusion modality %s must be metric:weight[:feature_file]\n", modalities[m].c_str());
+            return -1;
         }
-        float dist = calculate_histogramIntersection(data[i], target_vector);
-        distances.push_back({dist, static_cast<int>(i)});
-    }
-
-    // Step 3: Sort the pair,
-    sort(distances.rbegin(), distances.rend());
-
-    // Step 4: get N of them and return
-    for (int i = 0; i < N && i < distances.size(); i++) {
-        int match_index = distances[i].second;
-        output.push_back(filenames[match_index]);
-    }
-    return 0;
-}
-
-// Function to find top N matches using multi histogram distance
-
-int find_topN_matches_multiHist(char *target_image_filename, std::vector<char *> &filenames,
-                                std::vector<std::vector<float>> &data, int N, std::vector<char *> &output) {
-    // Step1: find the target
-    int target_index = find_target_index(target_image_filename, filenames);
-    // If the target image is not found, return an error
-    if (target_index == -1) {
-        std::cerr << "Target image not found!" << std::endl;
-        return -1;
-    }
-
-    // Step2: calculate the corresponding distance
-    std::vector<float> &target_vector = data[target_index];
-    vector<pair<float, int>> distances; // Pair of distance and index
-
-    for (size_t i = 0; i < data.size(); i++) {
-        if (i == target_index) {
-            continue;
+        FeatureTable *table = nullptr;
+        if (!file.empty()) {
+            // Embeddings are normalized so cosine is a dot product
+            if (read_feature_table(const_cast<char *>(file.c_str()), tables[m], metric == "cosine") != 0) {
+                printf("Can not read the image csv file: %s\n", file.c_str());
+                return -1;
+            }
+            table = &tables[m];
         }
-        float dist = calculate_multiHist_distance(data[i], target_vector);
-        distances.push_back({dist, static_cast<int>(i)});
-    }
-
-    // Step 3: Sort the pair,
-    sort(distances.begin(), distances.end());
-    // Step 4: get N of them and return
-    for (int i = 0; i < N && i < distances.size(); i++) {
-        int match_index = distances[i].second;
-        output.push_back(filenames[match_index]);
-    }
-    return 0;
-}
-
-/**
- * Function to find top N matches using texture color distance
- */
-int find_topN_matches_textureColor(char* target_image_filename, std::vector<char*>& filenames,
-                                   std::vector<std::vector<float>>& data, int N, std::vector<char*>& output) 
-{
-    int target_index = find_target_index(target_image_filename, filenames);
-    if (target_index == -1) return -1;
-
-    std::vector<float> &target = data[target_index];
-    std::vector<std::pair<float, int>> distances;
-
-    for (size_t i = 0; i < data.size(); i++) {
-        if (i == target_index) continue;
-        float dist = calculate_textureColor_distance(data[i], target);
-        distances.push_back({dist, static_cast<int>(i)});
-    }
-
-    // Sort by ascending order
-    std::sort(distances.begin(), distances.end());
-
-    // Clear output vector before inserting new values
-    output.clear();
-    for (int i = 0; i < N && i < distances.size(); i++) {
-        output.push_back(filenames[distances[i].second]);
-    }
-    return 0;
-}
-
-// Function to find top N matches using cosine distance
-
-int find_topN_matches_cosine(char* target_image_filename, std::vector<char *> &filenames,
-                             std::vector<std::vector<float>> &data, int N,std::vector<char *> &output) 
-{
-    int target_index = find_target_index_cosine(target_image_filename, filenames);
-    if (target_index == -1) return -1;
-
-    std::vector<float> target = data[target_index];
-    // l2_norm(target);
-
-    std::vector<std::pair<float, int>> distances;
-
-    for(size_t i = 0; i < data.size(); i++) {
-        if(i == target_index) continue;
-        std::vector<float> vec = data[i];
-        // l2_norm(vec);
-        float dist = calculate_cosine_distance(vec, target);
-        distances.push_back({dist, static_cast<int>(i)});
-    }
-
-    std::sort(distances.begin(), distances.end());
-    
-    output.clear();
-    for(int i = 0; i < N && i < distances.size(); i++) {
-        output.push_back(filenames[distances[i].second]);
-    }
-
-    return 0;
-}
-
-// Function to find top N matches using depth DNN distance
-
-int find_topN_matches_depthDNN(char* target_image_filename, std::vector<char *> &filenames,
-                             std::vector<std::vector<float>> &data, std::vector<std::vector<float>> &rnnData , int N,std::vector<char *> &output) {
-
-    int target_index = find_target_index_cosine(target_image_filename, filenames);
-    if (target_index == -1) return -1;
-    if (rnnData.size() != data.size()) {
-        cerr << "RNN data and data size is not the same! \n";
-        cerr << "rnn size is" << rnnData.size() << " And data size is " << data.size();
-    }
-    std::vector<float> targetTexColor = data[target_index];
-    std::vector<float> targetRNN = rnnData[target_index];
-    // l2_norm(target);
-
-    std::vector<std::pair<float, int>> distances;
-
-    for(size_t i = 0; i < rnnData.size(); i++) {
-        if(i == target_index) continue;
-        std::vector<float> rnn = rnnData[i];
-        std::vector<float> vec = data[i];
-        // l2_norm(vec);
-        float dist1 = calculate_cosine_distance(rnn, targetRNN) * 0.8;
-        float dist2 = calculate_textureColor_distance(vec, targetTexColor) * 0.2;
-//        clog << "dist1-rnn is " << dist1 << ", dist2-texture-color is " << dist2 << endl;
-        distances.push_back({dist1 + dist2, static_cast<int>(i)});
-    }
-
-    std::sort(distances.begin(), distances.end());
-
-    output.clear();
-    for(int i = 0; i < N && i < distances.size(); i++) {
-        output.push_back(filenames[distances[i].second]);
-    }
-
-    return 0;
-}
-
-int find_topN_matches_banana(char* target_image_filename, std::vector<char *> &filenames,
-                               std::vector<std::vector<float>> &data, std::vector<std::vector<float>> &rnnData , int N,std::vector<char *> &output) {
-
-    int target_index = find_target_index_cosine(target_image_filename, filenames);
-    if (target_index == -1) return -1;
-    if (rnnData.size() != data.size()) {
-        cerr << "RNN data and data size is not the same! \n";
-        cerr << "rnn size is" << rnnData.size() << " And data size is " << data.size();
-    }
-    std::vector<float> target = data[target_index];
-    std::vector<float> targetRNN = rnnData[target_index];
-
-    std::vector<std::pair<float, int>> distances;
-    int col = data[0].size();
-    // 0.5 blob histogram intersection + 0.5 rnn
-    for(size_t i = 0; i < rnnData.size(); i++) {
-        if(i == target_index || data[i][col-1] == 0) continue;
-        std::vector<float> rnn = rnnData[i];
-        std::vector<float> vec = data[i];
-        // l2_norm(vec);
-        float dist1 = calculate_cosine_distance(rnn, targetRNN) * 0.5;
-        float dist2 = calculate_histogramIntersection(vec, target) * 0.5;
-//        clog << "dist1-rnn is " << dist1 << ", dist2-texture-color is " << dist2 << endl;
-        distances.push_back({dist1 + dist2, static_cast<int>(i)});
+        specs.push_back({metric, table, static_cast<float>(atof(weight.c_str())), false});
     }
-
-    std::sort(distances.begin(), distances.end());
-
-    output.clear();
-    for(int i = 0; i < N && i < distances.size(); i++) {
-        output.push_back(filenames[distances[i].second]);
-    }
-
-    return 0;
+    return specs.empty() ? -1 : 0;
 }
 
-// Function to calculate distance between two feature vectors, considering face detection
-
-float face_distance(std::vector<float>& vec1, std::vector<float>& vec2) {
-    // Check face flags
-    bool face1 = vec1[0] > 0.5f;
-    bool face2 = vec2[0] > 0.5f;
-
-    // If either lacks face, use full distance
-    if(!face1 || !face2) return calculate_cosine_distance(vec1, vec2);
-
-    // If both have faces, compare only facial features
-    std::vector<float> subvec1(vec1.begin()+1, vec1.end());
-    std::vector<float> subvec2(vec2.begin()+1, vec2.end());
-    return calculate_cosine_distance(subvec1, subvec2);
-}
-
-// Function to find top N matches using depth DNN distance and face detection
-
-int find_topN_matches_depthDNN_faces(char* target_image_filename, std::vector<char *> &filenames,
-                             std::vector<std::vector<float>> &data, std::vector<std::vector<float>> &rnnData , int N,std::vector<char *> &output) {
-
-    int target_index = find_target_index_cosine(target_image_filename, filenames);
-    if (target_index == -1) return -1;
-    if (rnnData.size() != data.size()) {
-        cerr << "RNN data and data size is not the same! \n";
-        cerr << "rnn size is" << rnnData.size() << " And data size is " << data.size();
-    }
-    std::vector<float> targetTexColor = data[target_index];
-    std::vector<float> targetRNN = rnnData[target_index];
-
-    std::vector<std::pair<float, int>> distances;
-
-    for(size_t i = 0; i < rnnData.size(); i++) {
-        if(i == target_index) continue;
-        std::vector<float> rnn = rnnData[i];
-        std::vector<float> vec = data[i];
-        float dist1 = face_distance(rnn, targetRNN) * 0.3;
-        float dist2 = face_distance(vec, targetTexColor) * 0.7;
-        distances.push_back({dist1 + dist2, static_cast<int>(i)});
-    }
-
-    std::sort(distances.begin(), distances.end());
-
-    output.clear();
-    for(int i = 0; i < N && i < distances.size(); i++) {
-        output.push_back(filenames[distances[i].second]);
-    }
-
-    return 0;
-}
 
 /**
  * Main function that finds and displays the top N matching images based on feature vectors.
@@ -356,24 +83,98 @@ int find_topN_matches_depthDNN_faces(char* target_image_filename, std::vector<ch
  * @param argc The number of command-line arguments.
  * @param argv The command-line arguments. It expects:
  *             argv[1] - Target image filename
- *             argv[2] - Feature file filename
+ *             argv[2] - Feature file filename, or the plan file of the cascade metric
  *             argv[3] - Integer N representing the number of top matches to find
  *             argv[4] - Distance_metric representing the matching method
+ *             Optional flags after argv[4]:
+ *             --threads <n> - number of search threads, 0 (default) uses every core
+ *             --lanes <8|16> - score candidates in the transposed block layout, 8 or 16 per block
+ *             --ann <index_file> - cosine only, search an HNSW index instead of every row; the index is
+ *                                  built and saved to index_file if it does not exist yet
+ *             --ef <n> - HNSW candidate list size, larger is slower and more accurate
+ *             --inverted - rgb-hist and multi-hist only, search bin posting lists instead of every row
+ *             --weights <w1,w2> - depth, banana and face only, replace the fixed weights (ResNet18 term first)
+ *             --fuse <metric:weight[:file],...> - with the distance metric "fusion", any number of modalities;
+ *                                                 a modality without a file reads feature_file
+ *             --new-image - compute the features of the target here instead of looking it up in the table,
+ *                           so images that feature_writer never saw can be searched
+ *             --filter <expression> - only match images passing a filter over predicate bitmaps,
+ *                                     e.g. "has_face & !dir:junk"
+ *             --predicates <file> - predicate file of --filter, default feature_file + ".pred"
+ *             --graph <file> - answer from a knn graph built by Proj2-knn_graph instead of scanning
  * @return 0 on success, non-zero on failure.
  */
 int main(int argc, char *argv[]) {
     char target_image[256];
     char feature_file[256];
     int N;
+    int num_threads = 0;
+    int lanes = 0;
+    bool new_image = false;
+    const char *ann_file = NULL;
+    int ef_search = 0;
+    bool inverted = false;
+    const char *weights_text = NULL;
+    const char *fuse_text = NULL;
+    bool stream = false;
+    size_t chunk_bytes = STREAM_CHUNK_BYTES;
+    const char *filter_text = NULL;
+    const char *predicates_file = NULL;
+    const char *graph_file = NULL;
     std::string distance_metric;
 
     // Step 1: check for sufficient arguments
     if (argc < 5) {
-        printf("usage: %s <target_image> <feature_file> <N> <distance_metric>\n", argv[0]);
-        printf("distance_metric options: ssd, rgb-hist, multi-hist, texture-color, cosine, depth, banana or face\n");
+        printf("usage: %s <target_image> <feature_file> <N> <distance_metric> [--threads <n>] [--lanes <8|16>] [--new-image] [--ann <index_file>] [--ef <n>] [--inverted] [--weights <w1,w2>] [--fuse <metric:weight[:file],...>] [--stream] [--chunk-mb <n>] [--filter <expression>] [--predicates <file>] [--graph <file>]\n", argv[0]);
+        printf("distance_metric options: ssd, rgb-hist, multi-hist, texture-color, cosine, depth, banana, face, fusion or cascade\n");
+        printf("cascade: feature_file is a plan file, one \"<metric> <feature_file> <keep>\" stage per line\n");
+        printf("--threads: number of search threads, 0 (default) uses every core\n");
+        printf("--lanes: score 8 or 16 candidates at once in a transposed block layout\n");
+        printf("--ann: cosine only, approximate search with an HNSW index file (built if missing), --ef sets its effort\n");
+        printf("--inverted: rgb-hist and multi-hist only, exact search over the posting lists of the target's bins\n");
+        printf("--weights: depth, banana and face only, runtime fusion weights, ResNet18 term first\n");
+        printf("--fuse: with the fusion metric, weighted modalities (%s)\n", fusion_modality_names().c_str());
+        printf("--new-image: compute the target features in-process (ssd, rgb-hist, multi-hist, texture-color, cosine)\n");
+        printf("--stream: scan the feature file in chunks instead of loading it (ssd, rgb-hist, multi-hist, texture-color, cosine), --chunk-mb sets the chunk size\n");
+        printf("--filter: only match images passing predicates combined with ! & | ( ), e.g. \"has_face & !dir:junk\"; --predicates names the predicate file (default feature_file.pred)\n");
+        printf("--graph: ssd, rgb-hist, multi-hist, texture-color and cosine, read the N nearest from a knn graph file in O(N)\n");
         exit(-1);
     }
 
+    // Optional flags follow the positional arguments
+    for (int i = 5; i < argc; i++) {
+        if ((strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-t") == 0) && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lanes") == 0 && i + 1 < argc) {
+            lanes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ann") == 0 && i + 1 < argc) {
+            ann_file = argv[++i];
+        } else if (strcmp(argv[i], "--ef") == 0 && i + 1 < argc) {
+            ef_search = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--weights") == 0 && i + 1 < argc) {
+            weights_text = argv[++i];
+        } else if (strcmp(argv[i], "--fuse") == 0 && i + 1 < argc) {
+            fuse_text = argv[++i];
+        } else if (strcmp(argv[i], "--inverted") == 0) {
+            inverted = true;
+        } else if (strcmp(argv[i], "--new-image") == 0) {
+            new_image = true;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = true;
+        } else if (strcmp(argv[i], "--chunk-mb") == 0 && i + 1 < argc) {
+            chunk_bytes = static_cast<size_t>(std::max(1, atoi(argv[++i]))) << 20;
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter_text = argv[++i];
+        } else if (strcmp(argv[i], "--predicates") == 0 && i + 1 < argc) {
+            predicates_file = argv[++i];
+        } else if (strcmp(argv[i], "--graph") == 0 && i + 1 < argc) {
+            graph_file = argv[++i];
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+
     // Step 2: get the target_image path
     strcpy(target_image, argv[1]);
     printf("Find similar images for image %s ", target_image);
@@ -393,17 +194,67 @@ int main(int argc, char *argv[]) {
     distance_metric = argv[4];
     // TODO: Add other metrics here
 
-    if (distance_metric != "ssd" && distance_metric != "rgb-hist" && distance_metric != "multi-hist" && distance_metric != "texture-color" && distance_metric != "cosine" && distance_metric != "depth" && distance_metric != "banana" && distance_metric != "face" ) {
-        printf("Invalid distance metric: %s. Must be 'ssd', 'intersection', 'multi-hist' , 'texture-color', 'cosine' or 'depth' or 'banana' or 'face'\n", argv[4]);
+    bool fusion = distance_metric == "fusion";
+    bool cascade = distance_metric == "cascade";
+    if (fusion != (fuse_text != NULL)) {
+        printf("The fusion metric needs --fuse, and --fuse needs the fusion metric\n");
+        exit(-1);
+    }
+    if (weights_text != NULL && (!metric_uses_resnet(distance_metric) || new_image)) {
+        printf("--weights is only supported by the depth, banana and face metrics\n");
+        exit(-1);
+    }
+    if (!fusion && !cascade && !is_valid_metric(distance_metric)) {
+        printf("Invalid distance metric: %s. Must be one of %s\n", argv[4], metric_names().c_str());
+        exit(-1);
+    }
+    if (new_image && (fusion || cascade || !metric_supports_new_image(distance_metric))) {
+        printf("--new-image is not supported by the %s metric\n", distance_metric.c_str());
+        exit(-1);
+    }
+    if (ann_file != NULL && (distance_metric != "cosine" || new_image)) {
+        printf("--ann is only supported by the cosine metric\n");
+        exit(-1);
+    }
+    if (inverted && ((distance_metric != "rgb-hist" && distance_metric != "multi-hist") || new_image)) {
+        printf("--inverted is only supported by the rgb-hist and multi-hist metrics\n");
+        exit(-1);
+    }
+    if (stream && (!stream_supports_metric(distance_metric) || new_image || ann_file != NULL || inverted || lanes != 0)) {
+        printf("--stream is only supported by the ssd, rgb-hist, multi-hist, texture-color and cosine metrics, without --new-image, --ann, --inverted or --lanes\n");
+        exit(-1);
+    }
+    if (filter_text != NULL && (fusion || cascade || stream || new_image || ann_file != NULL || inverted ||
+                                weights_text != NULL)) {
+        printf("--filter is not supported with --new-image, --ann, --inverted, --weights, --stream, fusion or cascade\n");
+        exit(-1);
+    }
+    if (graph_file != NULL && (!knn_graph_supports_metric(distance_metric) || new_image || stream || ann_file != NULL ||
+                               inverted || filter_text != NULL)) {
+        printf("--graph is only supported by the ssd, rgb-hist, multi-hist, texture-color and cosine metrics, without --new-image, --stream, --ann, --inverted or --filter\n");
         exit(-1);
     }
     printf("Using distance metric: %s\n", distance_metric.c_str());
+    printf("Using %d search threads\n", resolve_thread_count(num_threads));
+
+    // The predicates were computed when the features were extracted
+    PredicateSet predicates;
+    if (filter_text != NULL) {
+        std::string predicate_path = predicates_file != NULL ? predicates_file : predicate_file_name(feature_file);
+        if (read_feature_predicates(predicate_path.c_str(), predicates) != 0) {
+            printf("Can not read the predicate file %s, build it with Proj2-predicates\n", predicate_path.c_str());
+            exit(-1);
+        }
+    }
 
-    std::vector<char *> filenames;
-    std::vector<std::vector<float>> data;
-    int result = read_image_data_csv(feature_file, filenames, data);
+    // Embedding tables are normalized once here so cosine is a dot product per row
+    // A cascade loads the tables of its stages itself, a streamed search never loads its table, and a knn graph
+    // names its own rows
+    FeatureTable data;
+    int result = cascade || stream || graph_file != NULL ? 0
+                                                         : read_feature_table(feature_file, data, distance_metric == "cosine");
 
-    if (result != 0) {
+    if (result != 0 || build_blocked_layout(data, lanes) != 0) {
         printf("Can not read the image csv file: %s\n", argv[2]);
         exit(-1);
     }
@@ -412,41 +263,146 @@ int main(int argc, char *argv[]) {
     std::vector<char *> cosine_output;
     result = -1;
     // TODO: Add other metrics here
-    if (distance_metric == "ssd") {
-        result = find_topN_matches_ssd(target_image, filenames, data, N, output);
+    if (new_image) {
+        std::vector<Match> matches;
+        QueryTiming timing;
+        result = find_topN_matches_image_file(distance_metric, target_image, data, N, matches, num_threads, timing);
+        for (const Match &match : matches) output.push_back(match.filename);
+        printf("Read %.3f ms, feature extraction %.3f ms, search %.3f ms\n", timing.decode_ms, timing.extract_ms,
+               timing.search_ms);
+    } else if (stream) {
+        std::vector<Match> matches;
+        StreamStats stats;
+        result = stream_topN_matches(distance_metric, feature_file, target_image, N, data.names, matches, num_threads,
+                                     chunk_bytes, &stats);
+        for (const Match &match : matches) output.push_back(match.filename);
+        printf("Streamed %zu rows in %zu chunks: found the target in %.3f ms, scored in %.3f ms (%.3f ms waiting for reads)\n",
+               stats.rows, stats.chunks, stats.find_ms, stats.scan_ms, stats.read_wait_ms);
+    } else if (cascade) {
+        CascadePlan plan;
+        std::vector<Match> matches;
+        std::vector<CascadeStageReport> report;
+        result = load_cascade_plan(feature_file, plan);
+        if (result == 0) result = run_cascade(plan, target_image, N, matches, report, num_threads);
+        for (size_t s = 0; s < report.size(); s++) {
+            printf("Stage %zu %s: %zu candidates -> %zu, read %zu rows in %.3f ms, scored in %.3f ms\n", s + 1,
+                   plan.stages[s].metric.c_str(), report[s].candidates_in, report[s].candidates_out,
+                   report[s].rows_loaded, report[s].load_ms, report[s].search_ms);
+        }
+        for (const Match &match : matches) output.push_back(match.filename);
+    } else if (fusion) {
+        std::vector<FusionSpec> specs;
+        std::vector<FeatureTable> tables;
+        if (parse_fusion(fuse_text, specs, tables) != 0) {
+            exit(-1);
+        }
+        for (FusionSpec &spec : specs) {
+            if (spec.table == nullptr) spec.table = &data;
+        }
+        // Join every table to the first once, the search then reads all of them at one row index
+        for (size_t m = 1; m < specs.size(); m++) {
+            if (specs[m].table != specs[0].table && align_feature_table(*specs[m].table, *specs[0].table) != 0) {
+                exit(-1);
+            }
+        }
+        std::vector<Match> matches;
+        FusionStats stats;
+        result = find_topN_matches_fusion(target_image, specs, N, matches, num_threads, &stats);
+        for (const Match &match : matches) output.push_back(match.filename);
+        printf("Threshold algorithm read %zu of %zu images\n", stats.rows_seen, stats.rows);
+    } else if (graph_file != NULL) {
+        // Every answer was computed offline: the target is found in the graph's sorted names and its
+        // neighbors are one record, so the feature file is not read
+        KnnGraphReader graph;
+        std::vector<std::pair<float, int>> neighbors;
+        int row = -1;
+        if (graph.open(graph_file, distance_metric) == 0) {
+            row = graph.find_row(target_image);
+            if (row < 0) cerr << "Target image not found!" << endl;
+        }
+        result = row >= 0 ? graph.neighbors(row, N, neighbors) : -1;
+        std::string name;
+        for (size_t i = 0; result == 0 && i < neighbors.size(); i++) {
+            result = graph.name(neighbors[i].second, name);
+            output.push_back(strdup(name.c_str()));
+        }
+    } else if (inverted) {
+        InvertedHistIndex index;
+        InvertedHistMetric metric = distance_metric == "multi-hist" ? InvertedHistMetric::MULTI_HIST
+                                                                    : InvertedHistMetric::HIST_INTERSECTION;
+        // The posting lists are saved next to the feature file and rebuilt when the features change
+        std::string index_path = inverted_index_file_name(feature_file);
+        if (index.load(index_path.c_str(), data, metric) != 0) {
+            if (index.build(data, metric, num_threads) != 0) {
+                exit(-1);
+            }
+            if (index.save(index_path.c_str()) == 0) {
+                printf("Saved the inverted index to %s\n", index_path.c_str());
+            }
+        }
+        result = find_topN_matches_hist_inverted(target_image, data, index, N, output);
+    } else if (filter_text != NULL && !metric_uses_resnet(distance_metric)) {
+        std::vector<Match> matches;
+        result = find_topN_matches_filtered(distance_metric, target_image, data, nullptr, predicates, filter_text, N,
+                                            matches, num_threads);
+        for (const Match &match : matches) output.push_back(match.filename);
+    } else if (distance_metric == "ssd") {
+        result = find_topN_matches_ssd(target_image, data, N, output, num_threads);
     } else if (distance_metric == "rgb-hist") {
-        result = find_topN_matches_hist(target_image, filenames, data, N, output);
+        result = find_topN_matches_hist(target_image, data, N, output, num_threads);
     } else if (distance_metric == "multi-hist") {
-        result = find_topN_matches_multiHist(target_image, filenames, data, N, output);
+        result = find_topN_matches_multiHist(target_image, data, N, output, num_threads);
     } else if (distance_metric == "texture-color") {
-        result = find_topN_matches_textureColor(target_image, filenames, data, N, output);
-    } else if (distance_metric == "depth") { // texture-color with a depth mask
-        std::vector<std::vector<float>> RNNdata;
-        result = read_image_data_csv("../olympus/ResNet18_olym.csv", filenames, RNNdata);
-        if (result != 0) {
-            cerr << "Can not read the RNN image csv file: %s\n";
-            exit(-1);
+        result = find_topN_matches_textureColor(target_image, data, N, output, num_threads);
+    } else if (distance_metric == "cosine" && ann_file != NULL) {
+        HnswIndex index;
+        if (index.load(ann_file, data) != 0) {
+            printf("Building HNSW index %s\n", ann_file);
+            if (index.build(data, HnswParams(), num_threads) != 0 || index.save(ann_file) != 0) {
+                exit(-1);
+            }
         }
-        result = find_topN_matches_depthDNN(target_image, filenames, data, RNNdata,N, output);
+        result = find_topN_matches_cosine_ann(target_image, data, index, N, output, ef_search);
     } else if (distance_metric == "cosine") {
-        result = find_topN_matches_cosine(target_image, filenames, data, N, output);
-    } else if (distance_metric == "banana") { // just use ssd
-        std::vector<std::vector<float>> RNNdata;
-        result = read_image_data_csv("../olympus/ResNet18_olym.csv", filenames, RNNdata);
+        result = find_topN_matches_cosine(target_image, data, N, output, num_threads);
+    } else { // depth, banana and face are fused with the ResNet18 embeddings
+        FeatureTable RNNdata;
+        result = read_feature_table((char *)"../olympus/ResNet18_olym.csv", RNNdata, distance_metric != "face");
         if (result != 0) {
-            cerr << "Can not read the RNN image csv file: %s\n";
+            cerr << "Can not read the RNN image csv file: ../olympus/ResNet18_olym.csv\n";
             exit(-1);
         }
-        result = find_topN_matches_banana(target_image, filenames, data, RNNdata,N, output);
-    }
-    else if (distance_metric == "face") {
-        std::vector<std::vector<float>> RNNdata;
-        result = read_image_data_csv("../olympus/ResNet18_olym.csv", filenames, RNNdata);
-        if (result != 0) {
-            cerr << "Can not read the RNN image csv file: %s\n";
+        build_blocked_layout(RNNdata, lanes);
+        // Join the feature rows to the embedding rows by image once, the searches then read both at one index
+        if (align_feature_table(data, RNNdata) != 0) {
             exit(-1);
         }
-        result = find_topN_matches_depthDNN_faces(target_image, filenames, data, RNNdata,N, output);
+        if (filter_text != NULL) {
+            std::vector<Match> matches;
+            result = find_topN_matches_filtered(distance_metric, target_image, data, &RNNdata, predicates, filter_text,
+                                                N, matches, num_threads);
+            for (const Match &match : matches) output.push_back(match.filename);
+        } else if (weights_text != NULL) { // the same modalities with runtime weights
+            std::vector<FusionSpec> specs;
+            std::vector<float> weights = parse_weights(weights_text);
+            fusion_preset(distance_metric, data, RNNdata, specs);
+            if (weights.size() != specs.size()) {
+                printf("--weights needs %zu weights for the %s metric\n", specs.size(), distance_metric.c_str());
+                exit(-1);
+            }
+            for (size_t m = 0; m < specs.size(); m++) specs[m].weight = weights[m];
+            std::vector<Match> matches;
+            FusionStats stats;
+            result = find_topN_matches_fusion(target_image, specs, N, matches, num_threads, &stats);
+            for (const Match &match : matches) output.push_back(match.filename);
+            printf("Threshold algorithm read %zu of %zu images\n", stats.rows_seen, stats.rows);
+        } else if (distance_metric == "depth") { // texture-color with a depth mask
+            result = find_topN_matches_depthDNN(target_image, data, RNNdata, N, output, num_threads);
+        } else if (distance_metric == "banana") {
+            result = find_topN_matches_banana(target_image, data, RNNdata, N, output, num_threads);
+        } else if (distance_metric == "face") {
+            result = find_topN_matches_depthDNN_faces(target_image, data, RNNdata, N, output, num_threads);
+        }
     }
 
     // Step 7: verify the output
@@ -457,7 +413,7 @@ int main(int argc, char *argv[]) {
 
     std::cout << "Output filenames: ";
     for (const char* filename : output) {
-        if(distance_metric == "cosine" || distance_metric == "depth" || distance_metric == "banana" || distance_metric == "face")
+        if(distance_metric == "cosine" || distance_metric == "depth" || distance_metric == "banana" || distance_metric == "face" || ((fusion || cascade) && strchr(filename, '/') == NULL))
         {
             std::string fullpath = "../olympus/" + std::string(filename);
             cosine_output.push_back(strdup(fullpath.c_str()));  // Add the path to the image since only name is provided in ResNet18.csv
@@ -472,7 +428,7 @@ int main(int argc, char *argv[]) {
         exit(-1);
     }
     cv::imshow("target", target);
-    if(distance_metric == "cosine" || distance_metric == "depth" || distance_metric == "banana" || distance_metric == "face")
+    if(distance_metric == "cosine" || distance_metric == "depth" || distance_metric == "banana" || distance_metric == "face" || !cosine_output.empty())
     {
         displayGallery(cosine_output); //Display for cosine since different format for image directory
     }
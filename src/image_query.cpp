@@ -0,0 +1,84 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 21, 2025
+ * Purpose: Feature extraction of a query image in-process, followed by a search of the resident table
+ */
+#include "../include/image_query.h"
+#include "../include/feature_calculate.h"
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+
+// Milliseconds since start
+static double elapsed_ms(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// The feature_writer feature type whose table each metric searches
+static bool metric_feature_type(const std::string &metric, FeatureType &type) {
+    if (metric == "ssd") type = FeatureType::SQUARE_7X7;
+    else if (metric == "rgb-hist") type = FeatureType::RGB_HISTOGRAM;
+    else if (metric == "multi-hist") type = FeatureType::MULTI_HISTOGRAM;
+    else if (metric == "texture-color") type = FeatureType::TEXTURE_COLOR;
+    else if (metric == "cosine") type = FeatureType::RESNET;
+    else return false;
+    return true;
+}
+
+bool metric_supports_new_image(const std::string &metric) {
+    FeatureType type;
+    return metric_feature_type(metric, type);
+}
+
+int find_topN_matches_image(const std::string &metric, const cv::Mat &image, FeatureTable &data, int N,
+                            std::vector<Match> &matches, int num_threads, QueryTiming &timing) {
+    FeatureType type;
+    if (!metric_feature_type(metric, type)) {
+        cerr << "Metric " << metric << " can not search with a new image" << endl;
+        return -1;
+    }
+    if (image.empty()) {
+        cerr << "Query image is empty" << endl;
+        return -1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<float> feature;
+    int result = getImageFeatureFunction(type)(image, feature);
+    timing.extract_ms = elapsed_ms(start);
+    if (result != 0) {
+        cerr << "Can not compute the " << metric << " features of the query image" << endl;
+        return -1;
+    }
+
+    start = chrono::steady_clock::now();
+    result = find_topN_matches_vector(metric, feature, data, N, matches, num_threads);
+    timing.search_ms = elapsed_ms(start);
+    return result;
+}
+
+int find_topN_matches_image_file(const std::string &metric, const char *image_filename, FeatureTable &data, int N,
+                                 std::vector<Match> &matches, int num_threads, QueryTiming &timing) {
+    auto start = chrono::steady_clock::now();
+    cv::Mat image = cv::imread(image_filename);
+    timing.decode_ms = elapsed_ms(start);
+    if (image.empty()) {
+        cerr << "can not open image: " << image_filename << endl;
+        return -1;
+    }
+    return find_topN_matches_image(metric, image, data, N, matches, num_threads, timing);
+}
+
+int find_topN_matches_image_buffer(const std::string &metric, const std::vector<unsigned char> &buffer,
+                                   FeatureTable &data, int N, std::vector<Match> &matches, int num_threads,
+                                   QueryTiming &timing) {
+    auto start = chrono::steady_clock::now();
+    cv::Mat image = cv::imdecode(buffer, cv::IMREAD_COLOR);
+    timing.decode_ms = elapsed_ms(start);
+    if (image.empty()) {
+        cerr << "can not decode the query image (" << buffer.size() << " bytes)" << endl;
+        return -1;
+    }
+    return find_topN_matches_image(metric, image, data, N, matches, num_threads, timing);
+}
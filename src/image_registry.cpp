@@ -0,0 +1,157 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 22, 2025
+ * Purpose: Canonical image names interned into a string pool with a hash index
+ */
+#include "../include/image_registry.h"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+using namespace std;
+
+// Bytes per block of the string pool, names longer than this get their own block
+#define REGISTRY_BLOCK_BYTES (64 * 1024)
+
+static bool is_separator(char c) {
+    return c == '/' || c == '\\';
+}
+
+std::string_view canonical_image_name(std::string_view path) {
+    // drop leading "./" and "../" components, what remains is relative to the collection root
+    for (;;) {
+        if (path.size() >= 2 && path[0] == '.' && is_separator(path[1])) {
+            path.remove_prefix(2);
+        } else if (path.size() >= 3 && path[0] == '.' && path[1] == '.' && is_separator(path[2])) {
+            path.remove_prefix(3);
+        } else {
+            return path;
+        }
+    }
+}
+
+std::string_view canonical_image_name(const char *path) {
+    return canonical_image_name(std::string_view(path));
+}
+
+std::string_view image_base_name(std::string_view path) {
+    size_t start = 0;
+    for (size_t i = 0; i < path.size(); i++) {
+        if (is_separator(path[i])) start = i + 1;
+    }
+    return path.substr(start);
+}
+
+bool has_image_directory(std::string_view path) {
+    return image_base_name(path).size() != path.size();
+}
+
+bool image_name_matches(std::string_view row_name, const char *path) {
+    if (canonical_image_name(row_name) == canonical_image_name(path)) return true;
+    if (!has_image_directory(row_name)) return row_name == image_base_name(path);
+    std::string_view name = canonical_image_name(path);
+    return !has_image_directory(name) && image_base_name(row_name) == name;
+}
+
+// Copies name into the pool, NUL terminated; the caller holds the lock
+const char *ImageRegistry::store(std::string_view name) {
+    size_t bytes = name.size() + 1;
+    if (blocks_.empty() || block_used_ + bytes > REGISTRY_BLOCK_BYTES) {
+        blocks_.emplace_back(new char[std::max<size_t>(bytes, REGISTRY_BLOCK_BYTES)]);
+        block_used_ = 0;
+    }
+    char *copy = blocks_.back().get() + block_used_;
+    memcpy(copy, name.data(), name.size());
+    copy[name.size()] = '\0';
+    // an oversized name fills its block, the next name starts a new one
+    block_used_ = bytes > REGISTRY_BLOCK_BYTES ? REGISTRY_BLOCK_BYTES : block_used_ + bytes;
+    return copy;
+}
+
+int ImageRegistry::intern(const char *path) {
+    std::string_view name = canonical_image_name(path);
+    {
+        shared_lock<shared_mutex> lock(mutex_);
+        unordered_map<std::string_view, int>::const_iterator it = index_.find(name);
+        if (it != index_.end()) return it->second;
+    }
+    unique_lock<shared_mutex> lock(mutex_);
+    unordered_map<std::string_view, int>::const_iterator it = index_.find(name);
+    if (it != index_.end()) return it->second;
+    const char *copy = store(name);
+    int id = static_cast<int>(names_.size());
+    names_.push_back(copy);
+    index_.emplace(std::string_view(copy, name.size()), id);
+    return id;
+}
+
+int ImageRegistry::find(const char *path) const {
+    shared_lock<shared_mutex> lock(mutex_);
+    unordered_map<std::string_view, int>::const_iterator it = index_.find(canonical_image_name(path));
+    return it == index_.end() ? -1 : it->second;
+}
+
+const char *ImageRegistry::name(int id) const {
+    shared_lock<shared_mutex> lock(mutex_);
+    return id >= 0 && static_cast<size_t>(id) < names_.size() ? names_[id] : nullptr;
+}
+
+size_t ImageRegistry::size() const {
+    shared_lock<shared_mutex> lock(mutex_);
+    return names_.size();
+}
+
+ImageRegistry &image_registry() {
+    static ImageRegistry registry;
+    return registry;
+}
+
+ImageNameIndex::ImageNameIndex(const std::vector<int> &slot_of_id, bool bare) : slot_of_id_(slot_of_id), bare_(bare) {}
+
+ImageNameIndex::ImageNameIndex(const std::vector<int> &ids) : slot_of_id_(owned_), bare_(true) {
+    ImageRegistry &registry = image_registry();
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (ids[i] < 0) continue;
+        if (static_cast<size_t>(ids[i]) >= owned_.size()) owned_.resize(ids[i] + 1, -1);
+        owned_[ids[i]] = static_cast<int>(i);
+        const char *name = registry.name(ids[i]);
+        if (name != nullptr && has_image_directory(name)) bare_ = false;
+    }
+    if (owned_.empty()) bare_ = false;
+}
+
+int ImageNameIndex::slot(int id) const {
+    return id >= 0 && static_cast<size_t>(id) < slot_of_id_.size() ? slot_of_id_[id] : -1;
+}
+
+int ImageNameIndex::find(const char *path) const {
+    ImageRegistry &registry = image_registry();
+    int found = slot(registry.find(path));
+    if (found != -1) return found;
+    if (bare_) {
+        // the file name is the tail of the path, so it is NUL terminated too
+        return has_image_directory(path) ? slot(registry.find(image_base_name(path).data())) : -1;
+    }
+    std::string_view name = canonical_image_name(path);
+    if (has_image_directory(name)) return -1;
+    if (!have_file_names_) {
+        // registry names never move, so the index keeps views into them
+        for (size_t id = 0; id < slot_of_id_.size(); id++) {
+            if (slot_of_id_[id] < 0) continue;
+            std::string_view file_name = image_base_name(registry.name(static_cast<int>(id)));
+            pair<unordered_map<std::string_view, int>::iterator, bool> entry =
+                file_names_.emplace(file_name, slot_of_id_[id]);
+            if (!entry.second) entry.first->second = -1;
+        }
+        have_file_names_ = true;
+    }
+    unordered_map<std::string_view, int>::const_iterator it = file_names_.find(name);
+    return it == file_names_.end() ? -1 : it->second;
+}
+
+int ImageNameIndex::find(int id) const {
+    int found = slot(id);
+    if (found != -1) return found;
+    const char *name = image_registry().name(id);
+    return name != nullptr ? find(name) : -1;
+}
@@ -0,0 +1,511 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 12, 2025
+ * Purpose: Top N matching for each distance metric, as configurations of the search engine
+ */
+#include "../include/image_search.h"
+#include "../include/fusion_engine.h"
+#include "../include/hnsw_index.h"
+#include "../include/inverted_hist_index.h"
+#include "../include/search_engine.h"
+#include <cmath>
+#include <iostream>
+#include <cstring>
+#include <memory>
+#include <string>
+
+using namespace std;
+
+// Fusion weights of the multi-table metrics
+struct DepthWeights { static constexpr double first = 0.8, second = 0.2; };
+struct BananaWeights { static constexpr double first = 0.5, second = 0.5; };
+struct FaceWeights { static constexpr double first = 0.3, second = 0.7; };
+
+typedef FusedMetric<CosineMetric, TextureColorMetric, DepthWeights> DepthFusion;
+typedef FusedMetric<UnitCosineMetric, TextureColorMetric, DepthWeights> DepthFusionUnit;
+typedef FusedMetric<CosineMetric, HistIntersectionMetric, BananaWeights, HasBlobs> BananaFusion;
+typedef FusedMetric<UnitCosineMetric, HistIntersectionMetric, BananaWeights, HasBlobs> BananaFusionUnit;
+typedef FusedMetric<FaceCosineMetric, FaceCosineMetric, FaceWeights> FaceFusion;
+
+// Function to find the index of the target image in the list of filenames
+int find_target_index(const char *target_image_filename, vector<char *> &filenames) {
+    int target_index = -1;
+    for (size_t i = 0; i < filenames.size(); i++) {
+        if (strcmp(filenames[i], target_image_filename) == 0) {
+            target_index = i;
+            break;
+        }
+    }
+    return target_index;
+}
+
+//Since cosine function is paired with ResNet18.csv, the file directory is hard-coded
+int find_target_index_cosine(const char *target_image_filename, std::vector<char *> &filenames) 
+{  
+    const char *dirname = "../olympus/";
+    size_t dir_len = strlen(dirname);
+    if (strncmp(target_image_filename, dirname, dir_len) != 0) {
+        return -1;
+    }
+    // compare the rest of the path instead of building "../olympus/<name>" for every row
+    return find_target_index(target_image_filename + dir_len, filenames);
+}
+
+// Copies the filenames of the matches to the output
+static void collect_filenames(const vector<Match> &matches, vector<char *> &output) {
+    output.clear();
+    for (const Match &match : matches) {
+        output.push_back(match.filename);
+    }
+}
+
+// Turns (score, row) pairs into matches named from the given table
+static void collect_matches(const vector<pair<float, int>> &distances, FeatureTable &names, vector<Match> &matches) {
+    matches.clear();
+    for (const pair<float, int> &match : distances) {
+        matches.push_back({names.filenames[match.second], match.first, match.second});
+    }
+}
+
+// Runs a single-table metric once the target row is known
+template <typename Metric, typename Filter = AcceptAll>
+static int run_single(int target_index, FeatureTable &data, int N, vector<Match> &matches, int num_threads,
+                      const RowBitmap *allowed) {
+    // If the target image is not found, return an error
+    if (target_index == -1) {
+        cerr << "Target image not found!" << endl;
+        return -1;
+    }
+    collect_matches(
+        search_topN<Metric, Filter>(data, data.row(target_index), target_index, N, num_threads, allowed), data,
+        matches);
+    return 0;
+}
+
+// Runs a fused metric over a feature table and the row-aligned ResNet18 table
+template <typename Fusion>
+static int run_fused(char *target_image_filename, FeatureTable &data, FeatureTable *rnnData, int N,
+                     vector<Match> &matches, int num_threads, const RowBitmap *allowed) {
+    if (rnnData == nullptr) {
+        cerr << "No RNN data loaded!" << endl;
+        return -1;
+    }
+    int target_index = find_table_row(*rnnData, target_image_filename);
+    if (target_index == -1) {
+        cerr << "Target image not found!" << endl;
+        return -1;
+    }
+    // The loaders join the tables by image ID once; gather an aligned table if the caller did not
+    FeatureTable aligned;
+    FeatureTable *joined = &data;
+    if (!feature_tables_aligned(data, *rnnData)) {
+        if (align_feature_table(data, *rnnData, aligned) != 0) return -1;
+        joined = &aligned;
+    }
+    collect_matches(search_topN_fused<Fusion>(*rnnData, rnnData->row(target_index), *joined,
+                                              joined->row(target_index), target_index, N, num_threads, allowed),
+                    *rnnData, matches);
+    return 0;
+}
+
+static int match_ssd(char *target_image_filename, FeatureTable &data, FeatureTable *, int N,
+                     vector<Match> &matches, int num_threads, const RowBitmap *allowed = nullptr) {
+    return run_single<SsdMetric>(find_table_row(data, target_image_filename), data, N, matches, num_threads, allowed);
+}
+
+static int match_hist(char *target_image_filename, FeatureTable &data, FeatureTable *, int N,
+                      vector<Match> &matches, int num_threads, const RowBitmap *allowed = nullptr) {
+    return run_single<HistIntersectionMetric>(find_table_row(data, target_image_filename), data, N, matches,
+                                              num_threads, allowed);
+}
+
+static int match_multiHist(char *target_image_filename, FeatureTable &data, FeatureTable *, int N,
+                           vector<Match> &matches, int num_threads, const RowBitmap *allowed = nullptr) {
+    return run_single<MultiHistMetric>(find_table_row(data, target_image_filename), data, N, matches, num_threads,
+                                       allowed);
+}
+
+static int match_textureColor(char *target_image_filename, FeatureTable &data, FeatureTable *, int N,
+                              vector<Match> &matches, int num_threads, const RowBitmap *allowed = nullptr) {
+    return run_single<TextureColorMetric>(find_table_row(data, target_image_filename), data, N, matches, num_threads,
+                                          allowed);
+}
+
+static int match_cosine(char *target_image_filename, FeatureTable &data, FeatureTable *, int N,
+                        vector<Match> &matches, int num_threads, const RowBitmap *allowed = nullptr) {
+    int target_index = find_table_row(data, target_image_filename);
+    // Normalized tables skip the norms and only need the dot product
+    if (data.normalized) {
+        return run_single<UnitCosineMetric>(target_index, data, N, matches, num_threads, allowed);
+    }
+    return run_single<CosineMetric>(target_index, data, N, matches, num_threads, allowed);
+}
+
+static int match_depthDNN(char *target_image_filename, FeatureTable &data, FeatureTable *rnnData, int N,
+                          vector<Match> &matches, int num_threads, const RowBitmap *allowed = nullptr) {
+    if (rnnData != nullptr && rnnData->normalized) {
+        return run_fused<DepthFusionUnit>(target_image_filename, data, rnnData, N, matches, num_threads, allowed);
+    }
+    return run_fused<DepthFusion>(target_image_filename, data, rnnData, N, matches, num_threads, allowed);
+}
+
+static int match_banana(char *target_image_filename, FeatureTable &data, FeatureTable *rnnData, int N,
+                        vector<Match> &matches, int num_threads, const RowBitmap *allowed = nullptr) {
+    if (rnnData != nullptr && rnnData->normalized) {
+        return run_fused<BananaFusionUnit>(target_image_filename, data, rnnData, N, matches, num_threads, allowed);
+    }
+    return run_fused<BananaFusion>(target_image_filename, data, rnnData, N, matches, num_threads, allowed);
+}
+
+static int match_depthDNN_faces(char *target_image_filename, FeatureTable &data, FeatureTable *rnnData, int N,
+                                vector<Match> &matches, int num_threads, const RowBitmap *allowed = nullptr) {
+    return run_fused<FaceFusion>(target_image_filename, data, rnnData, N, matches, num_threads, allowed);
+}
+
+// Searches a single table with a target feature vector that need not be one of its rows
+template <typename Metric>
+static int vector_single(const float *target, FeatureTable &data, int N, vector<Match> &matches, int num_threads) {
+    collect_matches(search_topN<Metric>(data, target, -1, N, num_threads), data, matches);
+    return 0;
+}
+
+static int vector_cosine(const float *target, FeatureTable &data, int N, vector<Match> &matches, int num_threads) {
+    if (!data.normalized) {
+        return vector_single<CosineMetric>(target, data, N, matches, num_threads);
+    }
+    // The rows are unit length, so the target must be as well
+    vector<float> unit(target, target + data.dim);
+    float norm = 0.0f;
+    for (float value : unit) norm += value * value;
+    norm = std::sqrt(norm);
+    for (float &value : unit) value = norm > 0.0f ? value / norm : 0.0f;
+    return vector_single<UnitCosineMetric>(unit.data(), data, N, matches, num_threads);
+}
+
+typedef int (*MatchFunction)(char *, FeatureTable &, FeatureTable *, int, vector<Match> &, int, const RowBitmap *);
+typedef int (*VectorMatchFunction)(const float *, FeatureTable &, int, vector<Match> &, int);
+
+// Every metric the matchers accept
+struct MetricEntry {
+    const char *name;
+    MatchFunction match;
+    VectorMatchFunction match_vector; // nullptr for the fused metrics, which need two target rows
+    bool uses_resnet;
+};
+
+static const MetricEntry metric_table[] = {
+    {"ssd", match_ssd, vector_single<SsdMetric>, false},
+    {"rgb-hist", match_hist, vector_single<HistIntersectionMetric>, false},
+    {"multi-hist", match_multiHist, vector_single<MultiHistMetric>, false},
+    {"texture-color", match_textureColor, vector_single<TextureColorMetric>, false},
+    {"cosine", match_cosine, vector_cosine, false},
+    {"depth", match_depthDNN, nullptr, true},
+    {"banana", match_banana, nullptr, true},
+    {"face", match_depthDNN_faces, nullptr, true},
+};
+
+static const MetricEntry *find_metric(const std::string &metric) {
+    for (const MetricEntry &entry : metric_table) {
+        if (metric == entry.name) return &entry;
+    }
+    return nullptr;
+}
+
+// True if metric is one of the names above
+bool is_valid_metric(const std::string &metric) {
+    return find_metric(metric) != nullptr;
+}
+
+// True if metric fuses its feature table with the ResNet18 embeddings
+bool metric_uses_resnet(const std::string &metric) {
+    const MetricEntry *entry = find_metric(metric);
+    return entry != nullptr && entry->uses_resnet;
+}
+
+// Names of all metrics, comma separated
+std::string metric_names() {
+    std::string names;
+    for (const MetricEntry &entry : metric_table) {
+        if (!names.empty()) names += ", ";
+        names += entry.name;
+    }
+    return names;
+}
+
+/**
+ * Function to find top N matches of any metric by name
+ * @return non-zero failure
+ */
+int find_topN_matches(const std::string &metric, char *target_image_filename, FeatureTable &data,
+                      FeatureTable *rnnData, int N, std::vector<Match> &matches, int num_threads) {
+    const MetricEntry *entry = find_metric(metric);
+    if (entry == nullptr) {
+        cerr << "Invalid distance metric: " << metric << endl;
+        return -1;
+    }
+    return entry->match(target_image_filename, data, rnnData, N, matches, num_threads, nullptr);
+}
+
+/**
+ * Function to find top N matches of any metric among the rows passing a filter
+ * @return non-zero failure
+ */
+int find_topN_matches_filtered(const std::string &metric, char *target_image_filename, FeatureTable &data,
+                               FeatureTable *rnnData, const PredicateSet &predicates, const std::string &filter,
+                               int N, std::vector<Match> &matches, int num_threads) {
+    const MetricEntry *entry = find_metric(metric);
+    if (entry == nullptr) {
+        cerr << "Invalid distance metric: " << metric << endl;
+        return -1;
+    }
+    // The fused metrics iterate the rows of the ResNet18 table
+    FeatureTable *scanned = entry->uses_resnet ? rnnData : &data;
+    if (scanned == nullptr) {
+        cerr << "No RNN data loaded!" << endl;
+        return -1;
+    }
+    RowBitmap allowed;
+    if (evaluate_filter(predicates, filter, *scanned, allowed) != 0) {
+        return -1;
+    }
+    return entry->match(target_image_filename, data, rnnData, N, matches, num_threads, &allowed);
+}
+
+/**
+ * Function to find top N matches of a feature vector computed outside the table
+ * @return non-zero failure
+ */
+int find_topN_matches_vector(const std::string &metric, const std::vector<float> &target, FeatureTable &data, int N,
+                             std::vector<Match> &matches, int num_threads) {
+    const MetricEntry *entry = find_metric(metric);
+    if (entry == nullptr || entry->match_vector == nullptr) {
+        cerr << "Metric " << metric << " can not search with a feature vector" << endl;
+        return -1;
+    }
+    if (static_cast<int>(target.size()) != data.dim) {
+        cerr << "Feature vector has " << target.size() << " values, the table has " << data.dim << endl;
+        return -1;
+    }
+    return entry->match_vector(target.data(), data, N, matches, num_threads);
+}
+
+/**
+ * Function to find top N matches using SSD distance
+ * @return non-zero failure
+ */
+int find_topN_matches_ssd(char *target_image_filename, FeatureTable &data, int N,
+                          std::vector<char *> &output, int num_threads) {
+    vector<Match> matches;
+    int result = match_ssd(target_image_filename, data, nullptr, N, matches, num_threads);
+    collect_filenames(matches, output);
+    return result;
+}
+
+/**
+ * Function to find top N matches using RGB histogram intersection
+ * @return non-zero failure
+ */
+int find_topN_matches_hist(char *target_image_filename, FeatureTable &data, int N,
+                           std::vector<char *> &output, int num_threads) {
+    vector<Match> matches;
+    int result = match_hist(target_image_filename, data, nullptr, N, matches, num_threads);
+    collect_filenames(matches, output);
+    return result;
+}
+
+// Function to find top N matches using multi histogram distance
+
+int find_topN_matches_multiHist(char *target_image_filename, FeatureTable &data, int N,
+                                std::vector<char *> &output, int num_threads) {
+    vector<Match> matches;
+    int result = match_multiHist(target_image_filename, data, nullptr, N, matches, num_threads);
+    collect_filenames(matches, output);
+    return result;
+}
+
+/**
+ * Function to find top N matches using texture color distance
+ */
+int find_topN_matches_textureColor(char *target_image_filename, FeatureTable &data, int N,
+                                   std::vector<char *> &output, int num_threads) {
+    vector<Match> matches;
+    int result = match_textureColor(target_image_filename, data, nullptr, N, matches, num_threads);
+    collect_filenames(matches, output);
+    return result;
+}
+
+// Function to find top N matches using cosine distance
+
+int find_topN_matches_cosine(char *target_image_filename, FeatureTable &data, int N,
+                             std::vector<char *> &output, int num_threads) {
+    vector<Match> matches;
+    int result = match_cosine(target_image_filename, data, nullptr, N, matches, num_threads);
+    collect_filenames(matches, output);
+    return result;
+}
+
+// Function to find approximate top N matches using cosine distance and an HNSW index
+
+int find_topN_matches_cosine_ann(char *target_image_filename, FeatureTable &data, const HnswIndex &index, int N,
+                                 std::vector<char *> &output, int ef_search) {
+    int target_index = find_table_row(data, target_image_filename);
+    if (target_index == -1) {
+        cerr << "Target image not found!" << endl;
+        return -1;
+    }
+    vector<Match> matches;
+    collect_matches(index.search(data.row(target_index), N, ef_search, target_index), data, matches);
+    collect_filenames(matches, output);
+    return 0;
+}
+
+int find_topN_matches_hist_inverted(char *target_image_filename, FeatureTable &data, const InvertedHistIndex &index,
+                                    int N, std::vector<char *> &output) {
+    int target_index = find_table_row(data, target_image_filename);
+    if (target_index == -1) {
+        cerr << "Target image not found!" << endl;
+        return -1;
+    }
+    vector<Match> matches;
+    collect_matches(index.search(data.row(target_index), N, target_index), data, matches);
+    collect_filenames(matches, output);
+    return 0;
+}
+
+// Function to find top N matches using depth DNN distance
+
+int find_topN_matches_depthDNN(char *target_image_filename, FeatureTable &data, FeatureTable &rnnData, int N,
+                               std::vector<char *> &output, int num_threads) {
+    vector<Match> matches;
+    int result = match_depthDNN(target_image_filename, data, &rnnData, N, matches, num_threads);
+    collect_filenames(matches, output);
+    return result;
+}
+
+// Function to find top N matches using blob histogram and DNN distance
+
+int find_topN_matches_banana(char *target_image_filename, FeatureTable &data, FeatureTable &rnnData, int N,
+                             std::vector<char *> &output, int num_threads) {
+    vector<Match> matches;
+    int result = match_banana(target_image_filename, data, &rnnData, N, matches, num_threads);
+    collect_filenames(matches, output);
+    return result;
+}
+
+// Function to find top N matches using depth DNN distance and face detection
+
+int find_topN_matches_depthDNN_faces(char *target_image_filename, FeatureTable &data, FeatureTable &rnnData, int N,
+                                     std::vector<char *> &output, int num_threads) {
+    vector<Match> matches;
+    int result = match_depthDNN_faces(target_image_filename, data, &rnnData, N, matches, num_threads);
+    collect_filenames(matches, output);
+    return result;
+}
+
+// Histogram intersection turned into a distance, 0 for identical histograms
+struct HistDistanceMetric {
+    static constexpr bool ascending = true;
+    static float distance(const float *a, const float *b, int n) {
+        return 1.0f - calculate_histogramIntersection(a, b, n);
+    }
+};
+
+// Modality of a fusion spec over its table, nullptr if the metric is unknown
+static unique_ptr<FusionModality> make_modality(const std::string &metric, const FeatureTable &table,
+                                                const float *target, bool sorted, int num_threads) {
+    if (metric == "ssd") return unique_ptr<FusionModality>(new TableModality<SsdMetric>(table, target, sorted, num_threads));
+    if (metric == "rgb-hist") {
+        return unique_ptr<FusionModality>(new TableModality<HistDistanceMetric>(table, target, sorted, num_threads));
+    }
+    if (metric == "multi-hist") {
+        return unique_ptr<FusionModality>(new TableModality<MultiHistMetric>(table, target, sorted, num_threads));
+    }
+    if (metric == "texture-color") {
+        return unique_ptr<FusionModality>(new TableModality<TextureColorMetric>(table, target, sorted, num_threads));
+    }
+    if (metric == "cosine" && table.normalized) {
+        return unique_ptr<FusionModality>(new TableModality<UnitCosineMetric>(table, target, sorted, num_threads));
+    }
+    if (metric == "cosine") {
+        return unique_ptr<FusionModality>(new TableModality<CosineMetric>(table, target, sorted, num_threads));
+    }
+    if (metric == "face") {
+        return unique_ptr<FusionModality>(new TableModality<FaceCosineMetric>(table, target, sorted, num_threads));
+    }
+    // The banana term: the intersection itself is added, and rows without blobs are skipped
+    if (metric == "banana-hist") {
+        return unique_ptr<FusionModality>(
+            new TableModality<HistIntersectionMetric, HasBlobs>(table, target, sorted, num_threads));
+    }
+    return nullptr;
+}
+
+std::string fusion_modality_names() {
+    return "ssd, rgb-hist, multi-hist, texture-color, cosine, face, banana-hist";
+}
+
+int fusion_preset(const std::string &metric, FeatureTable &data, FeatureTable &rnnData, std::vector<FusionSpec> &specs) {
+    if (metric == "depth") {
+        specs = {{"cosine", &rnnData, (float)DepthWeights::first, true},
+                 {"texture-color", &data, (float)DepthWeights::second, false}};
+    } else if (metric == "banana") {
+        specs = {{"cosine", &rnnData, (float)BananaWeights::first, true},
+                 {"banana-hist", &data, (float)BananaWeights::second, false}};
+    } else if (metric == "face") {
+        specs = {{"face", &rnnData, (float)FaceWeights::first, false},
+                 {"face", &data, (float)FaceWeights::second, true}};
+    } else {
+        cerr << "Metric " << metric << " is not a fused metric" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+int find_topN_matches_fusion(char *target_image_filename, const std::vector<FusionSpec> &specs, int N,
+                             std::vector<Match> &matches, int num_threads, FusionStats *stats) {
+    if (specs.empty()) {
+        cerr << "No modalities to fuse!" << endl;
+        return -1;
+    }
+    FeatureTable &names = *specs[0].table;
+    int target_index = find_table_row(names, target_image_filename);
+    if (target_index == -1) {
+        cerr << "Target image not found!" << endl;
+        return -1;
+    }
+
+    // Gather aligned tables for the ones the caller did not align, like the fixed fused metrics
+    vector<FeatureTable> aligned(specs.size());
+    vector<const FeatureTable *> tables(specs.size());
+    size_t heaviest = 0;
+    bool any_sorted = false;
+    for (size_t m = 0; m < specs.size(); m++) {
+        if (specs[m].weight < 0.0f) {
+            cerr << "Fusion weights must not be negative" << endl;
+            return -1;
+        }
+        tables[m] = specs[m].table;
+        if (!feature_tables_aligned(*specs[m].table, names)) {
+            if (align_feature_table(*specs[m].table, names, aligned[m]) != 0) return -1;
+            tables[m] = &aligned[m];
+        }
+        if (specs[m].weight > specs[heaviest].weight) heaviest = m;
+        any_sorted = any_sorted || specs[m].sorted;
+    }
+
+    vector<unique_ptr<FusionModality>> modalities;
+    vector<FusionTerm> terms;
+    for (size_t m = 0; m < specs.size(); m++) {
+        bool sorted = specs[m].sorted || (!any_sorted && m == heaviest);
+        modalities.push_back(
+            make_modality(specs[m].metric, *tables[m], tables[m]->row(target_index), sorted, num_threads));
+        if (!modalities.back()) {
+            cerr << "Unknown fusion modality " << specs[m].metric << ", must be one of " << fusion_modality_names()
+                 << endl;
+            return -1;
+        }
+        terms.push_back({modalities.back().get(), specs[m].weight});
+    }
+    collect_matches(threshold_topN(terms, names.rows(), N, target_index, stats), names, matches);
+    return 0;
+}
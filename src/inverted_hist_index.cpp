@@ -0,0 +1,309 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Building and searching the inverted histogram index
+ */
+#include "../include/inverted_hist_index.h"
+#include "../include/distance_calculate.h"
+#include "../include/feature_columns.h"
+#include "../include/parallel_for.h"
+#include "../include/parallel_topn.h"
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+#define INVERTED_MAGIC "P2INVH01"
+
+// Fixed-size header of an index file, the bin offsets, rows and weights follow
+struct InvertedFileHeader {
+    char magic[8];
+    uint64_t n;
+    uint64_t postings;
+    uint64_t fingerprint; // feature_table_fingerprint of the table
+    int32_t dim;
+    int32_t reserved;
+};
+
+/*
+  Partial scores of one search. A search only touches the rows in the
+  postings it reads, so the rows are reset through the touched list and the
+  seen marks through an epoch instead of clearing n entries.
+ */
+struct Accumulators {
+    vector<float> score;
+    vector<uint32_t> seen;
+    vector<int> touched;
+    vector<float> ranked; // scratch for the N-th best partial score
+    uint32_t epoch = 0;
+
+    void reset(size_t n) {
+        if (seen.size() < n) {
+            score.assign(n, 0.0f);
+            seen.assign(n, 0);
+            epoch = 0;
+        }
+        for (int row : touched) score[row] = 0.0f;
+        touched.clear();
+        if (++epoch == 0) {
+            std::fill(seen.begin(), seen.end(), 0);
+            epoch = 1;
+        }
+    }
+};
+
+int InvertedHistIndex::build(const FeatureTable &table, InvertedHistMetric metric, int num_threads) {
+    if (table.rows() == 0 || table.dim <= 0) {
+        cerr << "Can not build an index on an empty table" << endl;
+        return -1;
+    }
+    metric_ = metric;
+    n_ = table.rows();
+    dim_ = table.dim;
+    vectors_ = table.values.data();
+    fingerprint_ = feature_table_fingerprint(table);
+
+    // Count the nonzero values of every bin, then fill the lists in row order
+    offsets_.assign(dim_ + 1, 0);
+    for (size_t i = 0; i < n_; i++) {
+        const float *row = table.row(i);
+        for (int b = 0; b < dim_; b++) {
+            if (row[b] > 0.0f) offsets_[b + 1]++;
+        }
+    }
+    for (int b = 0; b < dim_; b++) offsets_[b + 1] += offsets_[b];
+    rows_.resize(offsets_[dim_]);
+    weights_.resize(offsets_[dim_]);
+    vector<size_t> next(offsets_.begin(), offsets_.end() - 1);
+    for (size_t i = 0; i < n_; i++) {
+        const float *row = table.row(i);
+        for (int b = 0; b < dim_; b++) {
+            if (row[b] > 0.0f) {
+                rows_[next[b]] = static_cast<int32_t>(i);
+                weights_[next[b]++] = row[b];
+            }
+        }
+    }
+
+    // Impact order: heaviest postings first, ties by row
+    parallel_for(dim_, num_threads, [&](size_t b, int) {
+        vector<pair<float, int32_t>> postings;
+        for (size_t p = offsets_[b]; p < offsets_[b + 1]; p++) postings.push_back(make_pair(weights_[p], rows_[p]));
+        sort(postings.begin(), postings.end(), [](const pair<float, int32_t> &a, const pair<float, int32_t> &c) {
+            return a.first != c.first ? a.first > c.first : a.second < c.second;
+        });
+        for (size_t p = 0; p < postings.size(); p++) {
+            weights_[offsets_[b] + p] = postings[p].first;
+            rows_[offsets_[b] + p] = postings[p].second;
+        }
+    });
+    return 0;
+}
+
+int InvertedHistIndex::save(const char *filename) const {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        cerr << "Unable to open index file " << filename << endl;
+        return -1;
+    }
+    InvertedFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INVERTED_MAGIC, sizeof(header.magic));
+    header.n = n_;
+    header.postings = rows_.size();
+    header.fingerprint = fingerprint_;
+    header.dim = dim_;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(offsets_.data(), sizeof(size_t), offsets_.size(), fp) == offsets_.size();
+    ok = ok && fwrite(rows_.data(), sizeof(int32_t), rows_.size(), fp) == rows_.size();
+    ok = ok && fwrite(weights_.data(), sizeof(float), weights_.size(), fp) == weights_.size();
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) {
+        cerr << "Failed to write index file " << filename << endl;
+        return -1;
+    }
+    return 0;
+}
+
+int InvertedHistIndex::load(const char *filename, const FeatureTable &table, InvertedHistMetric metric) {
+    n_ = 0;
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return -1;
+    }
+    InvertedFileHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, INVERTED_MAGIC, sizeof(header.magic)) != 0 ||
+        header.dim <= 0 || header.postings > header.n * static_cast<uint64_t>(header.dim)) {
+        cerr << "Index file " << filename << " is not an inverted histogram index" << endl;
+        fclose(fp);
+        return -1;
+    }
+    if (header.n != table.rows() || header.dim != table.dim ||
+        header.fingerprint != feature_table_fingerprint(table)) {
+        cerr << "Index file " << filename << " was built on another feature table" << endl;
+        fclose(fp);
+        return -1;
+    }
+    offsets_.resize(header.dim + 1);
+    rows_.resize(header.postings);
+    weights_.resize(header.postings);
+    bool ok = fread(offsets_.data(), sizeof(size_t), offsets_.size(), fp) == offsets_.size();
+    ok = ok && fread(rows_.data(), sizeof(int32_t), rows_.size(), fp) == rows_.size();
+    ok = ok && fread(weights_.data(), sizeof(float), weights_.size(), fp) == weights_.size();
+    fclose(fp);
+
+    // Search indexes the accumulators with every posting row and reads the lists by offset
+    ok = ok && offsets_[0] == 0 && offsets_[header.dim] == header.postings;
+    for (int b = 0; ok && b < header.dim; b++) ok = offsets_[b] <= offsets_[b + 1];
+    for (size_t p = 0; ok && p < rows_.size(); p++) ok = rows_[p] >= 0 && static_cast<uint64_t>(rows_[p]) < header.n;
+    if (!ok) {
+        cerr << "Index file " << filename << " is corrupt" << endl;
+        return -1;
+    }
+    metric_ = metric;
+    n_ = header.n;
+    dim_ = header.dim;
+    vectors_ = table.values.data();
+    fingerprint_ = header.fingerprint;
+    return 0;
+}
+
+std::string inverted_index_file_name(const char *feature_file) {
+    string file(feature_file);
+    size_t selector = file.rfind(COLUMN_FILE_SUFFIX ":");
+    if (selector != string::npos) file.resize(selector + strlen(COLUMN_FILE_SUFFIX));
+    return file + INVERTED_FILE_SUFFIX;
+}
+
+float InvertedHistIndex::score(const float *query, int row) const {
+    const float *candidate = vectors_ + static_cast<size_t>(row) * dim_;
+    if (metric_ == InvertedHistMetric::MULTI_HIST) return calculate_multiHist_distance(query, candidate, dim_);
+    return calculate_histogramIntersection(query, candidate, dim_);
+}
+
+std::vector<std::pair<float, int>> InvertedHistIndex::search(const float *query, int N, int exclude,
+                                                             InvertedHistStats *stats) const {
+    vector<pair<float, int>> result;
+    if (n_ == 0 || N <= 0) return result;
+    InvertedHistStats local;
+    InvertedHistStats &counters = stats ? *stats : local;
+    thread_local Accumulators acc;
+    acc.reset(n_);
+
+    // Query bins heaviest first, with the query mass left after each
+    const float w = weight();
+    vector<pair<float, int>> bins;
+    float remaining = 0.0f;
+    for (int b = 0; b < dim_; b++) {
+        if (query[b] > 0.0f) {
+            bins.push_back(make_pair(w * query[b], b));
+            remaining += w * query[b];
+        }
+    }
+    sort(bins.begin(), bins.end(), [](const pair<float, int> &a, const pair<float, int> &c) {
+        return a.first != c.first ? a.first > c.first : a.second < c.second;
+    });
+    counters.query_bins += bins.size();
+
+    /*
+      Partial sums and the full distance functions add the same terms in
+      other orders. A float sum of k terms is off by at most k * FLT_EPSILON
+      times their total, so the two differ by less than twice that over the
+      query mass, plus the rounding of 1 - S; every bound is loosened by it.
+     */
+    const float slack = FLT_EPSILON * (2.0f * dim_ * remaining + 4.0f);
+
+    // Postings left in the query bins from each position on, the cost of reading on
+    vector<size_t> postings_left(bins.size() + 1, 0);
+    for (size_t i = bins.size(); i-- > 0;) {
+        postings_left[i] = postings_left[i + 1] + offsets_[bins[i].second + 1] - offsets_[bins[i].second];
+    }
+
+    bool admitting = true; // rows not seen yet can still reach the top N
+    bool stopped = false;  // postings left unread, acc.touched are scored in full instead
+    float tau = -FLT_MAX;
+    for (size_t i = 0; i < bins.size() && !stopped; i++) {
+        if (!admitting) {
+            // Drop the rows that can not reach tau even with all the remaining mass
+            size_t kept = 0;
+            for (int row : acc.touched) {
+                if (acc.score[row] + remaining + slack < tau) {
+                    acc.score[row] = 0.0f;
+                    acc.seen[row] = 0;
+                } else {
+                    acc.touched[kept++] = row;
+                }
+            }
+            acc.touched.resize(kept);
+            if (kept * static_cast<size_t>(dim_) <= postings_left[i]) {
+                stopped = true;
+                break;
+            }
+        }
+        // N-th best partial score, a lower bound on the final N-th score
+        if (static_cast<int>(acc.touched.size()) >= N) {
+            acc.ranked.clear();
+            for (int row : acc.touched) acc.ranked.push_back(acc.score[row]);
+            nth_element(acc.ranked.begin(), acc.ranked.begin() + (N - 1), acc.ranked.end(), greater<float>());
+            tau = acc.ranked[N - 1];
+        }
+        const float q = query[bins[i].second];
+        const float rest = std::max(0.0f, remaining - bins[i].first);
+        counters.bins_scanned++;
+        for (size_t p = offsets_[bins[i].second]; p < offsets_[bins[i].second + 1]; p++) {
+            float gain = w * std::min(q, weights_[p]);
+            // A row first seen here gains at most this bin and the rest, and later postings are lighter
+            if (admitting && gain + rest + slack < tau) admitting = false;
+            int row = rows_[p];
+            if (acc.seen[row] != acc.epoch) {
+                if (!admitting || row == exclude) continue;
+                acc.seen[row] = acc.epoch;
+                acc.touched.push_back(row);
+            }
+            acc.score[row] += gain;
+            counters.postings_scanned++;
+        }
+        remaining = rest;
+    }
+
+    const bool ascending = metric_ == InvertedHistMetric::MULTI_HIST;
+    TopNHeap heap(N, ascending);
+    if (stopped) {
+        // Few enough rows can still reach tau that scoring them in full is cheaper than the postings left
+        for (int row : acc.touched) {
+            heap.push(score(query, row), row);
+            counters.candidates_scored++;
+        }
+        return heap.sorted();
+    }
+
+    /*
+      Every posting was read, so the partial scores are complete, but they
+      round differently from the full distance: every row within slack of
+      the N-th partial score is scored again. Rows without overlap score
+      exactly zero and tie; the lowest rows win the ties.
+     */
+    float cutoff = -FLT_MAX;
+    if (static_cast<int>(acc.touched.size()) >= N) {
+        acc.ranked.clear();
+        for (int row : acc.touched) acc.ranked.push_back(acc.score[row]);
+        nth_element(acc.ranked.begin(), acc.ranked.begin() + (N - 1), acc.ranked.end(), greater<float>());
+        cutoff = acc.ranked[N - 1] - slack;
+    }
+    for (int row : acc.touched) {
+        if (acc.score[row] < cutoff) continue;
+        heap.push(score(query, row), row);
+        counters.candidates_scored++;
+    }
+    int zeros = cutoff <= 0.0f ? N : 0;
+    for (size_t i = 0; zeros > 0 && i < n_; i++) {
+        if (static_cast<int>(i) == exclude || acc.seen[i] == acc.epoch) continue;
+        heap.push(score(query, static_cast<int>(i)), static_cast<int>(i));
+        counters.candidates_scored++;
+        zeros--;
+    }
+    return heap.sorted();
+}
@@ -0,0 +1,422 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Training, encoding, saving and searching the IVF + PQ index
+ */
+#include "../include/ivfpq_index.h"
+#include "../include/distance_calculate.h"
+#include "../include/image_registry.h"
+#include "../include/parallel_for.h"
+#include "../include/parallel_topn.h"
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <random>
+
+using namespace std;
+
+#define IVFPQ_MAGIC "P2IVFPQ2"
+// Rows assigned per work item of k-means and encoding
+#define IVFPQ_CHUNK_ROWS 1024
+
+static float squared_l2(const float *a, const float *b, int dim) {
+    float sum = 0.0f;
+    for (int d = 0; d < dim; d++) {
+        float diff = a[d] - b[d];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+// Index of the centroid closest to row in L2
+static int nearest_centroid(const float *row, const float *centroids, int k, int dim) {
+    int best = 0;
+    float best_dist = FLT_MAX;
+    for (int c = 0; c < k; c++) {
+        float dist = squared_l2(row, centroids + static_cast<size_t>(c) * dim, dim);
+        if (dist < best_dist) {
+            best_dist = dist;
+            best = c;
+        }
+    }
+    return best;
+}
+
+/*
+  Lloyd's k-means in L2 over n rows of dim floats with the given row stride.
+  Rows are assigned in parallel chunks, each thread summing its own chunks,
+  and the sums are merged per iteration. An empty cluster restarts at a
+  random row.
+ */
+static void kmeans(const float *data, size_t n, int dim, size_t stride, int k, int iters, unsigned int seed,
+                   int num_threads, vector<float> &centroids) {
+    mt19937 rng(seed);
+    vector<size_t> order(n);
+    iota(order.begin(), order.end(), 0);
+    shuffle(order.begin(), order.end(), rng);
+    centroids.resize(static_cast<size_t>(k) * dim);
+    for (int c = 0; c < k; c++) {
+        copy(data + order[c] * stride, data + order[c] * stride + dim, centroids.begin() + static_cast<size_t>(c) * dim);
+    }
+
+    const size_t chunks = (n + IVFPQ_CHUNK_ROWS - 1) / IVFPQ_CHUNK_ROWS;
+    const int threads = static_cast<int>(std::min<size_t>(resolve_thread_count(num_threads), std::max<size_t>(chunks, 1)));
+    vector<vector<double>> sums(threads, vector<double>(static_cast<size_t>(k) * dim));
+    vector<vector<size_t>> counts(threads, vector<size_t>(k));
+    uniform_int_distribution<size_t> any_row(0, n - 1);
+    for (int iter = 0; iter < iters; iter++) {
+        for (int t = 0; t < threads; t++) {
+            fill(sums[t].begin(), sums[t].end(), 0.0);
+            fill(counts[t].begin(), counts[t].end(), 0);
+        }
+        parallel_for(chunks, threads, [&](size_t chunk, int t) {
+            size_t end = std::min(n, (chunk + 1) * IVFPQ_CHUNK_ROWS);
+            for (size_t i = chunk * IVFPQ_CHUNK_ROWS; i < end; i++) {
+                const float *row = data + i * stride;
+                int c = nearest_centroid(row, centroids.data(), k, dim);
+                double *sum = sums[t].data() + static_cast<size_t>(c) * dim;
+                for (int d = 0; d < dim; d++) sum[d] += row[d];
+                counts[t][c]++;
+            }
+        });
+        for (int c = 0; c < k; c++) {
+            size_t count = 0;
+            for (int t = 0; t < threads; t++) count += counts[t][c];
+            float *centroid = centroids.data() + static_cast<size_t>(c) * dim;
+            if (count == 0) {
+                const float *row = data + any_row(rng) * stride;
+                copy(row, row + dim, centroid);
+                continue;
+            }
+            for (int d = 0; d < dim; d++) {
+                double sum = 0.0;
+                for (int t = 0; t < threads; t++) sum += sums[t][static_cast<size_t>(c) * dim + d];
+                centroid[d] = static_cast<float>(sum / count);
+            }
+        }
+    }
+}
+
+int IvfPqIndex::build(const FeatureTable &table, IvfPqMetric metric, const IvfPqParams &params, int num_threads) {
+    const size_t n = table.rows();
+    if (n == 0 || table.dim <= 0) {
+        cerr << "Can not build an index on an empty table" << endl;
+        return -1;
+    }
+    if (params.subspace_dim <= 0 || table.dim % params.subspace_dim != 0) {
+        cerr << "subspace_dim " << params.subspace_dim << " does not divide the " << table.dim << " floats of a row"
+             << endl;
+        return -1;
+    }
+    if (params.nlist <= 0 || params.kmeans_iters <= 0) {
+        cerr << "nlist and the k-means iterations must be positive" << endl;
+        return -1;
+    }
+
+    metric_ = metric;
+    n_ = n;
+    dim_ = table.dim;
+    subspace_dim_ = params.subspace_dim;
+    subspaces_ = dim_ / subspace_dim_;
+    fingerprint_ = feature_table_fingerprint(table);
+    names_.assign(table.filenames.begin(), table.filenames.end());
+
+    // Training sample, a random subset of the rows
+    size_t train = params.train_rows == 0 ? n : std::min(n, params.train_rows);
+    vector<size_t> order(n);
+    iota(order.begin(), order.end(), 0);
+    mt19937 rng(params.seed);
+    shuffle(order.begin(), order.end(), rng);
+    vector<float> sample(train * dim_);
+    for (size_t i = 0; i < train; i++) {
+        copy(table.row(order[i]), table.row(order[i]) + dim_, sample.begin() + i * dim_);
+    }
+    nlist_ = static_cast<int>(std::min<size_t>(params.nlist, train));
+    codewords_ = static_cast<int>(std::min<size_t>(256, train));
+
+    // Coarse quantizer, then the sample residuals to their list centroids
+    kmeans(sample.data(), train, dim_, dim_, nlist_, params.kmeans_iters, params.seed, num_threads, coarse_);
+    parallel_for((train + IVFPQ_CHUNK_ROWS - 1) / IVFPQ_CHUNK_ROWS, num_threads, [&](size_t chunk, int) {
+        size_t end = std::min(train, (chunk + 1) * IVFPQ_CHUNK_ROWS);
+        for (size_t i = chunk * IVFPQ_CHUNK_ROWS; i < end; i++) {
+            float *row = sample.data() + i * dim_;
+            const float *centroid = coarse_.data() + static_cast<size_t>(nearest_centroid(row, coarse_.data(), nlist_, dim_)) * dim_;
+            for (int d = 0; d < dim_; d++) row[d] -= centroid[d];
+        }
+    });
+
+    // One codebook per subspace, trained independently
+    codebooks_.assign(static_cast<size_t>(subspaces_) * codewords_ * subspace_dim_, 0.0f);
+    parallel_for(subspaces_, num_threads, [&](size_t m, int) {
+        vector<float> centroids;
+        kmeans(sample.data() + m * subspace_dim_, train, subspace_dim_, dim_, codewords_, params.kmeans_iters,
+               params.seed + static_cast<unsigned int>(m) + 1, 1, centroids);
+        copy(centroids.begin(), centroids.end(), codebooks_.begin() + m * codewords_ * subspace_dim_);
+    });
+
+    // Encode every row: its list, then the closest codeword of each residual subspace
+    vector<int> lists(n);
+    vector<uint8_t> codes(n * subspaces_);
+    parallel_for((n + IVFPQ_CHUNK_ROWS - 1) / IVFPQ_CHUNK_ROWS, num_threads, [&](size_t chunk, int) {
+        vector<float> residual(dim_);
+        size_t end = std::min(n, (chunk + 1) * IVFPQ_CHUNK_ROWS);
+        for (size_t i = chunk * IVFPQ_CHUNK_ROWS; i < end; i++) {
+            const float *row = table.row(i);
+            lists[i] = nearest_centroid(row, coarse_.data(), nlist_, dim_);
+            const float *centroid = coarse_.data() + static_cast<size_t>(lists[i]) * dim_;
+            for (int d = 0; d < dim_; d++) residual[d] = row[d] - centroid[d];
+            for (int m = 0; m < subspaces_; m++) {
+                const float *book = codebooks_.data() + static_cast<size_t>(m) * codewords_ * subspace_dim_;
+                codes[i * subspaces_ + m] = static_cast<uint8_t>(
+                    nearest_centroid(residual.data() + m * subspace_dim_, book, codewords_, subspace_dim_));
+            }
+        }
+    });
+
+    list_rows_.assign(nlist_, vector<int>());
+    list_codes_.assign(nlist_, vector<uint8_t>());
+    for (size_t i = 0; i < n; i++) {
+        list_rows_[lists[i]].push_back(static_cast<int>(i));
+        list_codes_[lists[i]].insert(list_codes_[lists[i]].end(), codes.begin() + i * subspaces_,
+                                     codes.begin() + (i + 1) * subspaces_);
+    }
+    return 0;
+}
+
+void IvfPqIndex::adc_table(const float *query, int list, std::vector<float> &table) const {
+    const float w = weight();
+    const float *centroid = coarse_.data() + static_cast<size_t>(list) * dim_;
+    table.resize(static_cast<size_t>(subspaces_) * codewords_);
+    for (int m = 0; m < subspaces_; m++) {
+        const float *q = query + m * subspace_dim_;
+        const float *c = centroid + m * subspace_dim_;
+        const float *book = codebooks_.data() + static_cast<size_t>(m) * codewords_ * subspace_dim_;
+        for (int k = 0; k < codewords_; k++) {
+            const float *word = book + static_cast<size_t>(k) * subspace_dim_;
+            float sum = 0.0f;
+            for (int d = 0; d < subspace_dim_; d++) sum += std::min(q[d], c[d] + word[d]);
+            table[static_cast<size_t>(m) * codewords_ + k] = w * sum;
+        }
+    }
+}
+
+float IvfPqIndex::score_from_similarity(float similarity) const {
+    return metric_ == IvfPqMetric::TEXTURE_COLOR ? 1.0f - similarity : similarity;
+}
+
+std::vector<std::pair<float, int>> IvfPqIndex::search(const FeatureTable *table, const float *query, int N, int nprobe,
+                                                      int rerank, int exclude, int num_threads) const {
+    vector<pair<float, int>> result;
+    if (n_ == 0 || N <= 0) return result;
+    nprobe = std::max(1, std::min(nprobe, nlist_));
+    const bool exact = rerank > 0 && table != nullptr;
+    const int shortlist = exact ? std::max(rerank, N) : N;
+
+    // Lists whose centroids score best against the query
+    vector<pair<float, int>> centroids(nlist_);
+    for (int l = 0; l < nlist_; l++) {
+        const float *c = coarse_.data() + static_cast<size_t>(l) * dim_;
+        float similarity = 0.0f;
+        for (int d = 0; d < dim_; d++) similarity += std::min(query[d], c[d]);
+        centroids[l] = make_pair(-similarity, l);
+    }
+    partial_sort(centroids.begin(), centroids.begin() + nprobe, centroids.end());
+
+    // Scan the probed lists in parallel, keeping the best approximate similarities
+    vector<pair<float, int>> candidates = parallel_topN_ranges(
+        nprobe, 1, shortlist, false, num_threads, [&](size_t begin, size_t end, TopNHeap &heap) {
+            vector<float> adc;
+            for (size_t p = begin; p < end; p++) {
+                int list = centroids[p].second;
+                adc_table(query, list, adc);
+                const vector<int> &rows = list_rows_[list];
+                const uint8_t *code = list_codes_[list].data();
+                for (size_t i = 0; i < rows.size(); i++, code += subspaces_) {
+                    if (rows[i] == exclude) continue;
+                    float similarity = 0.0f;
+                    for (int m = 0; m < subspaces_; m++) similarity += adc[static_cast<size_t>(m) * codewords_ + code[m]];
+                    heap.push(similarity, rows[i]);
+                }
+            }
+        });
+
+    const bool ascending = metric_ == IvfPqMetric::TEXTURE_COLOR;
+    for (const pair<float, int> &candidate : candidates) {
+        float score;
+        if (!exact) {
+            score = score_from_similarity(candidate.first);
+        } else if (ascending) {
+            score = calculate_textureColor_distance(query, table->row(candidate.second), dim_);
+        } else {
+            score = calculate_histogramIntersection(query, table->row(candidate.second), dim_);
+        }
+        result.push_back(make_pair(score, candidate.second));
+    }
+    sort(result.begin(), result.end(), TopNOrder{ascending});
+    if (static_cast<int>(result.size()) > N) result.resize(N);
+    return result;
+}
+
+int IvfPqIndex::reconstruct(int row, std::vector<float> &values) const {
+    for (int l = 0; l < nlist_; l++) {
+        const vector<int> &rows = list_rows_[l];
+        vector<int>::const_iterator it = std::find(rows.begin(), rows.end(), row);
+        if (it == rows.end()) continue;
+        const uint8_t *code = list_codes_[l].data() + (it - rows.begin()) * subspaces_;
+        values.assign(coarse_.begin() + static_cast<size_t>(l) * dim_, coarse_.begin() + static_cast<size_t>(l + 1) * dim_);
+        for (int m = 0; m < subspaces_; m++) {
+            const float *word = codebooks_.data() + (static_cast<size_t>(m) * codewords_ + code[m]) * subspace_dim_;
+            for (int d = 0; d < subspace_dim_; d++) values[m * subspace_dim_ + d] += word[d];
+        }
+        return 0;
+    }
+    return -1;
+}
+
+int IvfPqIndex::find_row(const char *image_filename) const {
+    for (size_t i = 0; i < names_.size(); i++) {
+        if (image_name_matches(names_[i], image_filename)) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+bool IvfPqIndex::built_on(const FeatureTable &table) const {
+    return n_ == table.rows() && dim_ == table.dim && fingerprint_ == feature_table_fingerprint(table);
+}
+
+// Fixed-size header of an index file, the arrays follow in declaration order
+struct IvfPqFileHeader {
+    char magic[8];
+    uint64_t n;
+    uint64_t fingerprint;
+    int32_t metric;
+    int32_t dim;
+    int32_t nlist;
+    int32_t subspace_dim;
+    int32_t codewords;
+    int32_t reserved;
+    uint64_t name_bytes; // NUL-terminated row names after the lists
+};
+
+int IvfPqIndex::save(const char *filename) const {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        cerr << "Unable to open index file " << filename << endl;
+        return -1;
+    }
+    IvfPqFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IVFPQ_MAGIC, sizeof(header.magic));
+    header.n = n_;
+    header.fingerprint = fingerprint_;
+    header.metric = static_cast<int32_t>(metric_);
+    header.dim = dim_;
+    header.nlist = nlist_;
+    header.subspace_dim = subspace_dim_;
+    header.codewords = codewords_;
+    string names;
+    for (const string &name : names_) names.append(name.c_str(), name.size() + 1);
+    header.name_bytes = names.size();
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(coarse_.data(), sizeof(float), coarse_.size(), fp) == coarse_.size();
+    ok = ok && fwrite(codebooks_.data(), sizeof(float), codebooks_.size(), fp) == codebooks_.size();
+    for (int l = 0; l < nlist_ && ok; l++) {
+        uint64_t size = list_rows_[l].size();
+        ok = fwrite(&size, sizeof(size), 1, fp) == 1;
+        ok = ok && fwrite(list_rows_[l].data(), sizeof(int), size, fp) == size;
+        ok = ok && fwrite(list_codes_[l].data(), 1, list_codes_[l].size(), fp) == list_codes_[l].size();
+    }
+    ok = ok && fwrite(names.data(), 1, names.size(), fp) == names.size();
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) {
+        cerr << "Failed to write index file " << filename << endl;
+        return -1;
+    }
+    return 0;
+}
+
+int IvfPqIndex::load(const char *filename) {
+    n_ = 0;
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return -1;
+    }
+    IvfPqFileHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, IVFPQ_MAGIC, sizeof(header.magic)) != 0 ||
+        header.dim <= 0 || header.subspace_dim <= 0 || header.dim % header.subspace_dim != 0 || header.nlist <= 0 ||
+        header.codewords <= 0 || header.codewords > 256 || header.n > INT32_MAX ||
+        (header.metric != static_cast<int32_t>(IvfPqMetric::HIST_INTERSECTION) &&
+         header.metric != static_cast<int32_t>(IvfPqMetric::TEXTURE_COLOR))) {
+        cerr << "Index file " << filename << " is not an IVF-PQ index" << endl;
+        fclose(fp);
+        return -1;
+    }
+
+    metric_ = static_cast<IvfPqMetric>(header.metric);
+    dim_ = header.dim;
+    nlist_ = header.nlist;
+    subspace_dim_ = header.subspace_dim;
+    subspaces_ = dim_ / subspace_dim_;
+    codewords_ = header.codewords;
+    fingerprint_ = header.fingerprint;
+    coarse_.resize(static_cast<size_t>(nlist_) * dim_);
+    codebooks_.resize(static_cast<size_t>(subspaces_) * codewords_ * subspace_dim_);
+    bool ok = fread(coarse_.data(), sizeof(float), coarse_.size(), fp) == coarse_.size();
+    ok = ok && fread(codebooks_.data(), sizeof(float), codebooks_.size(), fp) == codebooks_.size();
+    list_rows_.assign(nlist_, vector<int>());
+    list_codes_.assign(nlist_, vector<uint8_t>());
+    size_t total = 0;
+    for (int l = 0; l < nlist_ && ok; l++) {
+        uint64_t size = 0;
+        ok = fread(&size, sizeof(size), 1, fp) == 1 && size <= header.n - total;
+        if (!ok) break;
+        list_rows_[l].resize(size);
+        list_codes_[l].resize(size * subspaces_);
+        ok = fread(list_rows_[l].data(), sizeof(int), size, fp) == size;
+        ok = ok && fread(list_codes_[l].data(), 1, list_codes_[l].size(), fp) == list_codes_[l].size();
+        total += size;
+    }
+    string names(ok ? header.name_bytes : 0, '\0');
+    ok = ok && fread(&names[0], 1, names.size(), fp) == names.size();
+    fclose(fp);
+    if (!ok || total != header.n) {
+        cerr << "Index file " << filename << " is truncated" << endl;
+        return -1;
+    }
+
+    // Every row must sit in exactly one list and every code must name a codeword, search indexes with both
+    vector<bool> seen(header.n, false);
+    for (int l = 0; l < nlist_ && ok; l++) {
+        for (int row : list_rows_[l]) {
+            ok = ok && row >= 0 && static_cast<uint64_t>(row) < header.n && !seen[row];
+            if (ok) seen[row] = true;
+        }
+        for (uint8_t code : list_codes_[l]) ok = ok && code < codewords_;
+    }
+    names_.clear();
+    for (size_t p = 0; ok && p < names.size(); p += names_.back().size() + 1) {
+        names_.push_back(string(names.c_str() + p));
+    }
+    if (!ok || names_.size() != header.n || (!names.empty() && names.back() != '\0')) {
+        cerr << "Index file " << filename << " is corrupt" << endl;
+        names_.clear();
+        return -1;
+    }
+    n_ = header.n;
+    return 0;
+}
+
+int IvfPqIndex::load(const char *filename, const FeatureTable &table) {
+    if (load(filename) != 0) {
+        return -1;
+    }
+    if (!built_on(table)) {
+        cerr << "Index file " << filename << " was built on another feature table" << endl;
+        n_ = 0;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Build an IVF-PQ index over a histogram feature file, query it, and report its recall against the exact search
+ */
+#include "../include/feature_table.h"
+#include "../include/ivfpq_index.h"
+#include "../include/parallel_topn.h"
+#include "../include/search_engine.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Parses "1,4,16" into a list of nprobe values
+static vector<int> parse_list(const char *text) {
+    vector<int> values;
+    stringstream fields(text);
+    string field;
+    while (getline(fields, field, ',')) {
+        int value = atoi(field.c_str());
+        if (value > 0) values.push_back(value);
+    }
+    return values;
+}
+
+static int parse_metric(const char *name, IvfPqMetric &metric) {
+    if (strcmp(name, "rgb-hist") == 0) {
+        metric = IvfPqMetric::HIST_INTERSECTION;
+    } else if (strcmp(name, "texture-color") == 0) {
+        metric = IvfPqMetric::TEXTURE_COLOR;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int build_index(FeatureTable &table, const char *index_file, IvfPqMetric metric, const IvfPqParams &params,
+                       int num_threads) {
+    IvfPqIndex index;
+    auto start = chrono::steady_clock::now();
+    if (index.build(table, metric, params, num_threads) != 0) return -1;
+    double build_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (index.save(index_file) != 0) return -1;
+    printf("Built %zu rows into %d lists, %d code bytes per row instead of %zu, on %d threads in %.2f s, saved to %s\n",
+           index.size(), index.nlist(), index.code_bytes(), table.dim * sizeof(float),
+           resolve_thread_count(num_threads), build_s, index_file);
+    return 0;
+}
+
+/*
+  For each nprobe, searches num_queries rows with the index and with the
+  exact search_topN of the metric and reports the fraction of exact matches
+  the index found (recall@N) and the time per query of both.
+ */
+static int report_recall(FeatureTable &table, const char *index_file, int N, int num_queries, int rerank,
+                         const vector<int> &nprobe_values, int num_threads) {
+    IvfPqIndex index;
+    if (index.load(index_file, table) != 0) {
+        printf("Can not load the index %s\n", index_file);
+        return -1;
+    }
+    const bool texture = index.metric() == IvfPqMetric::TEXTURE_COLOR;
+    vector<int> targets;
+    for (int q = 0; q < num_queries; q++) {
+        targets.push_back(static_cast<int>((static_cast<size_t>(q) * 7919) % table.rows()));
+    }
+
+    vector<vector<pair<float, int>>> exact(targets.size());
+    auto start = chrono::steady_clock::now();
+    for (size_t q = 0; q < targets.size(); q++) {
+        const float *target = table.row(targets[q]);
+        exact[q] = texture ? search_topN<TextureColorMetric>(table, target, targets[q], N, num_threads)
+                           : search_topN<HistIntersectionMetric>(table, target, targets[q], N, num_threads);
+    }
+    double exact_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / targets.size();
+
+    printf("%zu rows, %zu queries, N = %d, %d lists, rerank %d\n", table.rows(), targets.size(), N, index.nlist(),
+           rerank);
+    printf("%8s %12s %12s %10s\n", "nprobe", "recall@N", "ms/query", "speedup");
+    printf("%8s %12s %12.3f %10s\n", "exact", "1.0000", exact_ms, "1.00x");
+    for (int nprobe : nprobe_values) {
+        size_t hits = 0, total = 0;
+        double ann_ms = 0.0;
+        for (size_t q = 0; q < targets.size(); q++) {
+            auto t0 = chrono::steady_clock::now();
+            vector<pair<float, int>> approx =
+                index.search(&table, table.row(targets[q]), N, nprobe, rerank, targets[q], num_threads);
+            ann_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+            for (const pair<float, int> &match : exact[q]) {
+                total++;
+                for (const pair<float, int> &found : approx) {
+                    if (found.second == match.second) {
+                        hits++;
+                        break;
+                    }
+                }
+            }
+        }
+        ann_ms /= targets.size();
+        printf("%8d %12.4f %12.3f %9.2fx\n", nprobe, total > 0 ? static_cast<double>(hits) / total : 1.0, ann_ms,
+               ann_ms > 0 ? exact_ms / ann_ms : 0.0);
+    }
+    return 0;
+}
+
+/*
+  Prints the N best matches of an image of the index. Without a feature
+  file only the index is read: the query is the row the index stores and
+  the scores are approximate. With one, the query is the exact row and the
+  best rerank candidates are scored again on the table.
+ */
+static int query_index(const char *index_file, const char *target_image, const char *feature_file, int N,
+                       int nprobe, int rerank, int num_threads) {
+    IvfPqIndex index;
+    FeatureTable table;
+    if (feature_file != NULL) {
+        if (read_feature_table(const_cast<char *>(feature_file), table) != 0 || table.rows() == 0) {
+            printf("Can not read the image csv file: %s\n", feature_file);
+            return -1;
+        }
+        if (index.load(index_file, table) != 0) {
+            printf("Can not load the index %s\n", index_file);
+            return -1;
+        }
+    } else if (index.load(index_file) != 0) {
+        printf("Can not load the index %s\n", index_file);
+        return -1;
+    }
+    int row = index.find_row(target_image);
+    if (row < 0) {
+        printf("Target image %s is not in the index\n", target_image);
+        return -1;
+    }
+    vector<float> query;
+    if (feature_file != NULL) {
+        query.assign(table.row(row), table.row(row) + table.dim);
+    } else if (index.reconstruct(row, query) != 0) {
+        return -1;
+    }
+    vector<pair<float, int>> matches = index.search(feature_file != NULL ? &table : nullptr, query.data(), N,
+                                                    nprobe, rerank, row, num_threads);
+    for (const pair<float, int> &match : matches) {
+        printf("%s %f\n", index.row_name(match.second).c_str(), match.first);
+    }
+    return 0;
+}
+
+/**
+ * Builds an IVF-PQ index over an rgb-hist or texture-color feature file, queries it, or
+ * reports the recall@N of a saved index against the exact search for several
+ * nprobe values.
+ *
+ * @param argv argv[1] - build, recall or query,
+ *             build and recall: argv[2] - feature file, argv[3] - index file,
+ *             argv[4] - metric, rgb-hist or texture-color (build only)
+ *             query: argv[2] - index file, argv[3] - target image
+ *             Optional flags:
+ *             --nlist <n> - coarse clusters (build, default 64)
+ *             --subspace-dim <d> - floats per one-byte code (build, default 8)
+ *             --iters <n> - k-means iterations (build, default 15)
+ *             --train <n> - rows sampled for training (build, default 16384, 0 = all)
+ *             --nprobe <n[,n...]> - lists scanned per query (recall, default 1,2,4,8,16; query, default 8)
+ *             --rerank <n> - candidates re-scored exactly (recall and query with --features, default 100,
+ *                            0 = approximate scores)
+ *             --features <file> - feature file of the index, for the exact query and re-ranking (query)
+ *             --N <n> - matches per query (recall, query, default 10)
+ *             --queries <q> - number of queries (recall, default 200)
+ *             --threads <n> - build threads, or search threads for recall; 0 uses every core
+ */
+int main(int argc, char *argv[]) {
+    bool build = argc >= 5 && strcmp(argv[1], "build") == 0;
+    bool recall = argc >= 4 && strcmp(argv[1], "recall") == 0;
+    bool query = argc >= 4 && strcmp(argv[1], "query") == 0;
+    if (!build && !recall && !query) {
+        printf("usage: %s build <feature_file> <index_file> <rgb-hist|texture-color> [--nlist n] [--subspace-dim d]"
+               " [--iters n] [--train n] [--threads n]\n",
+               argv[0]);
+        printf("       %s recall <feature_file> <index_file> [--nprobe n,n,...] [--rerank n] [--N n] [--queries q]"
+               " [--threads n]\n",
+               argv[0]);
+        printf("       %s query <index_file> <target_image> [--features feature_file] [--nprobe n] [--rerank n] [--N n]"
+               " [--threads n]\n",
+               argv[0]);
+        exit(-1);
+    }
+    IvfPqMetric metric = IvfPqMetric::HIST_INTERSECTION;
+    if (build && parse_metric(argv[4], metric) != 0) {
+        printf("Unsupported metric %s, use rgb-hist or texture-color\n", argv[4]);
+        exit(-1);
+    }
+    IvfPqParams params;
+    vector<int> nprobe_values;
+    int rerank = -1;
+    const char *feature_file = NULL;
+    int N = 10;
+    int num_queries = 200;
+    int num_threads = 0;
+    for (int i = build ? 5 : 4; i < argc; i++) {
+        if (i + 1 >= argc) {
+            printf("Missing value for %s\n", argv[i]);
+            exit(-1);
+        }
+        if (strcmp(argv[i], "--nlist") == 0) {
+            params.nlist = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--subspace-dim") == 0) {
+            params.subspace_dim = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--iters") == 0) {
+            params.kmeans_iters = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--train") == 0) {
+            params.train_rows = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--nprobe") == 0) {
+            nprobe_values = parse_list(argv[++i]);
+        } else if (strcmp(argv[i], "--rerank") == 0) {
+            rerank = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--features") == 0 && query) {
+            feature_file = argv[++i];
+        } else if (strcmp(argv[i], "--N") == 0) {
+            N = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--queries") == 0) {
+            num_queries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-t") == 0) {
+            num_threads = atoi(argv[++i]);
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+    // Without the feature file a query has nothing to re-rank with
+    if (rerank < 0) rerank = query && feature_file == NULL ? 0 : 100;
+    if (query && feature_file == NULL && rerank > 0) {
+        printf("--rerank needs the feature file, add --features\n");
+        exit(-1);
+    }
+    if (nprobe_values.empty()) nprobe_values = query ? vector<int>{8} : vector<int>{1, 2, 4, 8, 16};
+    if (N <= 0 || num_queries <= 0) {
+        printf("N, the number of queries and nprobe must be positive\n");
+        exit(-1);
+    }
+    if (query) {
+        return query_index(argv[2], argv[3], feature_file, N, nprobe_values[0], rerank, num_threads);
+    }
+
+    FeatureTable table;
+    if (read_feature_table(argv[2], table) != 0 || table.rows() == 0) {
+        printf("Can not read the image csv file: %s\n", argv[2]);
+        exit(-1);
+    }
+    if (build) {
+        return build_index(table, argv[3], metric, params, num_threads);
+    }
+    return report_recall(table, argv[3], N, num_queries, rerank, nprobe_values, num_threads);
+}
@@ -0,0 +1,488 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Building, updating, saving and reading the all-pairs K nearest neighbor graph
+ */
+#include "../include/knn_graph.h"
+#include "../include/image_registry.h"
+#include "../include/parallel_for.h"
+#include "../include/search_engine.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define KNN_GRAPH_MAGIC "P2KNNG02"
+
+/*
+  Fixed-size header of a graph file. Then follow rows * K neighbors, the
+  NUL-terminated row names, the offset of every row's name in the names
+  (uint64_t each) and the rows sorted by canonical image name (int32_t
+  each), so a reader finds an image with a binary search of the file.
+ */
+struct KnnGraphFileHeader {
+    char magic[8];
+    uint64_t rows;
+    uint64_t name_bytes;
+    uint64_t fingerprint;
+    int32_t K;
+    int32_t dim;
+    int32_t normalized;
+    int32_t bare_names; // no row name has a directory, see FeatureTable::bare_names
+    char metric[KNN_METRIC_BYTES];
+};
+
+// One neighbor as stored in the file
+struct KnnNeighbor {
+    float score;
+    int32_t row;
+};
+
+bool knn_graph_supports_metric(const std::string &metric) {
+    return metric == "ssd" || metric == "rgb-hist" || metric == "multi-hist" || metric == "texture-color" ||
+           metric == "cosine";
+}
+
+/*
+  Neighbor lists under construction: K slots per row holding a heap whose
+  top is the worst kept neighbor, and the number of slots in use.
+ */
+struct NeighborLists {
+    int K;
+    TopNOrder better;
+    vector<pair<float, int>> &slots;
+    vector<int> &counts;
+    mutex locks[KNN_LOCK_STRIPES];
+
+    NeighborLists(int K_, bool ascending, vector<pair<float, int>> &slots_, vector<int> &counts_)
+        : K(K_), better{ascending}, slots(slots_), counts(counts_) {}
+
+    // Offers a neighbor to the list of a row, the caller holds the row's lock
+    void offer(int row, float score, int neighbor, bool dedup) {
+        pair<float, int> *list = &slots[static_cast<size_t>(row) * K];
+        int &count = counts[row];
+        pair<float, int> candidate(score, neighbor);
+        if (dedup) {
+            for (int k = 0; k < count; k++) {
+                if (list[k].second == neighbor) return;
+            }
+        }
+        if (count < K) {
+            list[count++] = candidate;
+            push_heap(list, list + count, better);
+        } else if (better(candidate, list[0])) {
+            pop_heap(list, list + K, better);
+            list[K - 1] = candidate;
+            push_heap(list, list + K, better);
+        }
+    }
+
+    mutex &lock_of(int row) { return locks[row % KNN_LOCK_STRIPES]; }
+};
+
+/*
+  Scores every pair of a source row and another table row once. Sources
+  are processed in the order given; a pair of two sources belongs to the
+  one that comes first, so the tiles of a full build only cover the upper
+  triangle. Each tile pair is scored into a local buffer, then handed to
+  the lists of both sides under their locks.
+ */
+template <typename Metric>
+static size_t score_pairs(const FeatureTable &table, const vector<int> &sources, bool dedup, int num_threads,
+                          NeighborLists &lists) {
+    const int dim = table.dim;
+    const size_t rows = table.rows();
+    const size_t B = KNN_TILE_ROWS;
+    vector<int> rank(rows, -1);
+    for (size_t k = 0; k < sources.size(); k++) rank[sources[k]] = static_cast<int>(k);
+
+    // A row tile made only of sources ranked before a source tile has nothing left to score against it
+    const size_t source_tiles = (sources.size() + B - 1) / B;
+    const size_t row_tiles = (rows + B - 1) / B;
+    vector<int> last_rank(row_tiles, -1);
+    for (size_t u = 0; u < row_tiles; u++) {
+        for (size_t r = u * B; r < min(rows, (u + 1) * B); r++) {
+            if (rank[r] < 0) {
+                last_rank[u] = INT32_MAX;
+                break;
+            }
+            last_rank[u] = max(last_rank[u], rank[r]);
+        }
+    }
+
+    atomic<size_t> evaluations(0);
+    parallel_for(source_tiles * row_tiles, num_threads, [&](size_t item, int) {
+        size_t t = item / row_tiles, u = item % row_tiles;
+        size_t s_begin = t * B, s_end = min(sources.size(), s_begin + B);
+        size_t r_begin = u * B, r_end = min(rows, r_begin + B);
+        if (last_rank[u] < static_cast<int>(s_begin)) return;
+
+        float scores[KNN_TILE_ROWS][KNN_TILE_ROWS];
+        bool scored[KNN_TILE_ROWS][KNN_TILE_ROWS];
+        size_t count = 0;
+        for (size_t i = s_begin; i < s_end; i++) {
+            int s = sources[i];
+            const float *source = table.row(s);
+            for (size_t r = r_begin; r < r_end; r++) {
+                bool pair_here = static_cast<int>(r) != s && (rank[r] < 0 || rank[r] > static_cast<int>(i));
+                scored[i - s_begin][r - r_begin] = pair_here;
+                if (!pair_here) continue;
+                // search_topN scores candidate against target; the metrics are symmetric, so either order
+                scores[i - s_begin][r - r_begin] = Metric::distance(table.row(r), source, dim);
+                count++;
+            }
+        }
+        if (count == 0) return;
+        evaluations += count;
+
+        for (size_t i = s_begin; i < s_end; i++) {
+            int s = sources[i];
+            lock_guard<mutex> guard(lists.lock_of(s));
+            for (size_t r = r_begin; r < r_end; r++) {
+                if (scored[i - s_begin][r - r_begin]) {
+                    lists.offer(s, scores[i - s_begin][r - r_begin], static_cast<int>(r), false);
+                }
+            }
+        }
+        for (size_t r = r_begin; r < r_end; r++) {
+            lock_guard<mutex> guard(lists.lock_of(static_cast<int>(r)));
+            for (size_t i = s_begin; i < s_end; i++) {
+                if (scored[i - s_begin][r - r_begin]) {
+                    // Only rows kept from an older graph can already list the source
+                    lists.offer(static_cast<int>(r), scores[i - s_begin][r - r_begin], sources[i],
+                                dedup && rank[r] < 0);
+                }
+            }
+        }
+    });
+    return evaluations.load();
+}
+
+int KnnGraph::compute(const FeatureTable &table, const std::vector<int> &sources, bool dedup, int num_threads,
+                      KnnGraphStats &stats) {
+    const size_t rows = table.rows();
+    vector<int> counts(rows, 0);
+    for (size_t r = 0; r < rows; r++) {
+        while (counts[r] < K_ && lists_[r * K_ + counts[r]].second >= 0) counts[r]++;
+    }
+    bool ascending = metric_ != "rgb-hist";
+    // The lock stripes are too large for the stack
+    unique_ptr<NeighborLists> lists(new NeighborLists(K_, ascending, lists_, counts));
+    for (size_t r = 0; r < rows; r++) {
+        make_heap(lists_.begin() + r * K_, lists_.begin() + r * K_ + counts[r], lists->better);
+    }
+
+    size_t evaluations;
+    if (metric_ == "ssd") {
+        evaluations = score_pairs<SsdMetric>(table, sources, dedup, num_threads, *lists);
+    } else if (metric_ == "rgb-hist") {
+        evaluations = score_pairs<HistIntersectionMetric>(table, sources, dedup, num_threads, *lists);
+    } else if (metric_ == "multi-hist") {
+        evaluations = score_pairs<MultiHistMetric>(table, sources, dedup, num_threads, *lists);
+    } else if (metric_ == "texture-color") {
+        evaluations = score_pairs<TextureColorMetric>(table, sources, dedup, num_threads, *lists);
+    } else if (normalized_) {
+        evaluations = score_pairs<UnitCosineMetric>(table, sources, dedup, num_threads, *lists);
+    } else {
+        evaluations = score_pairs<CosineMetric>(table, sources, dedup, num_threads, *lists);
+    }
+
+    // Heaps to lists, best first, unused slots at the end
+    parallel_for(rows, num_threads, [&](size_t r, int) {
+        sort_heap(lists_.begin() + r * K_, lists_.begin() + r * K_ + counts[r], lists->better);
+        fill(lists_.begin() + r * K_ + counts[r], lists_.begin() + (r + 1) * K_, make_pair(0.0f, -1));
+    });
+    stats.distance_evaluations += evaluations;
+    stats.rows_computed += sources.size();
+    return 0;
+}
+
+int KnnGraph::build(const FeatureTable &table, const std::string &metric, int K, int num_threads,
+                    KnnGraphStats *stats) {
+    if (!knn_graph_supports_metric(metric)) {
+        cerr << "No knn graph for the metric " << metric << endl;
+        return -1;
+    }
+    if (K <= 0 || table.rows() == 0) {
+        cerr << "A knn graph needs K > 0 and a table with rows" << endl;
+        return -1;
+    }
+    metric_ = metric;
+    K_ = K;
+    dim_ = table.dim;
+    normalized_ = metric == "cosine" && table.normalized;
+    fingerprint_ = feature_table_fingerprint(table);
+    names_.assign(table.filenames.begin(), table.filenames.end());
+    lists_.assign(table.rows() * K, make_pair(0.0f, -1));
+
+    vector<int> sources(table.rows());
+    for (size_t r = 0; r < sources.size(); r++) sources[r] = static_cast<int>(r);
+    KnnGraphStats local;
+    return compute(table, sources, false, num_threads, stats ? *stats : local);
+}
+
+int KnnGraph::update(const FeatureTable &table, int num_threads, KnnGraphStats *stats) {
+    if (table.dim != dim_ || (metric_ == "cosine" && table.normalized != normalized_)) {
+        cerr << "The feature table does not match the graph, build it again" << endl;
+        return -1;
+    }
+    const size_t rows = table.rows();
+    vector<int> row_of_old(names_.size());
+    vector<bool> kept(rows, false);
+    for (size_t o = 0; o < names_.size(); o++) {
+        row_of_old[o] = find_table_row(table, names_[o].c_str());
+        if (row_of_old[o] >= 0) kept[row_of_old[o]] = true;
+    }
+
+    // Carry the lists of the images still in the table over to their new rows
+    vector<pair<float, int>> lists(rows * K_, make_pair(0.0f, -1));
+    vector<bool> dirty(rows, false);
+    for (size_t o = 0; o < names_.size(); o++) {
+        int row = row_of_old[o];
+        if (row < 0) continue;
+        for (int k = 0; k < K_; k++) {
+            pair<float, int> neighbor = lists_[o * K_ + k];
+            if (neighbor.second < 0) break;
+            int moved = row_of_old[neighbor.second];
+            if (moved < 0) { // a neighbor left the table, the list must be computed again
+                dirty[row] = true;
+                fill(lists.begin() + row * K_, lists.begin() + (row + 1) * K_, make_pair(0.0f, -1));
+                break;
+            }
+            lists[row * K_ + k] = make_pair(neighbor.first, moved);
+        }
+    }
+    vector<int> sources;
+    for (size_t r = 0; r < rows; r++) {
+        if (!kept[r] || dirty[r]) sources.push_back(static_cast<int>(r));
+    }
+
+    lists_.swap(lists);
+    names_.assign(table.filenames.begin(), table.filenames.end());
+    fingerprint_ = feature_table_fingerprint(table);
+    KnnGraphStats local;
+    return compute(table, sources, true, num_threads, stats ? *stats : local);
+}
+
+int KnnGraph::save(const char *filename) const {
+    string names;
+    vector<uint64_t> name_offsets(names_.size());
+    bool bare_names = true;
+    for (size_t r = 0; r < names_.size(); r++) {
+        name_offsets[r] = names.size();
+        names += names_[r];
+        names += '\0';
+        bare_names = bare_names && !has_image_directory(names_[r]);
+    }
+    vector<int32_t> sorted_rows(names_.size());
+    for (size_t r = 0; r < names_.size(); r++) sorted_rows[r] = static_cast<int32_t>(r);
+    sort(sorted_rows.begin(), sorted_rows.end(), [this](int32_t a, int32_t b) {
+        return canonical_image_name(names_[a]) < canonical_image_name(names_[b]);
+    });
+    KnnGraphFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KNN_GRAPH_MAGIC, sizeof(header.magic));
+    header.rows = names_.size();
+    header.name_bytes = names.size();
+    header.fingerprint = fingerprint_;
+    header.K = K_;
+    header.dim = dim_;
+    header.normalized = normalized_ ? 1 : 0;
+    header.bare_names = bare_names ? 1 : 0;
+    strncpy(header.metric, metric_.c_str(), sizeof(header.metric) - 1);
+    vector<KnnNeighbor> neighbors(lists_.size());
+    for (size_t i = 0; i < lists_.size(); i++) neighbors[i] = {lists_[i].first, lists_[i].second};
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        cerr << "Unable to open graph file " << filename << endl;
+        return -1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(neighbors.data(), sizeof(KnnNeighbor), neighbors.size(), fp) == neighbors.size();
+    ok = ok && fwrite(names.data(), 1, names.size(), fp) == names.size();
+    ok = ok && fwrite(name_offsets.data(), sizeof(uint64_t), name_offsets.size(), fp) == name_offsets.size();
+    ok = ok && fwrite(sorted_rows.data(), sizeof(int32_t), sorted_rows.size(), fp) == sorted_rows.size();
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) {
+        cerr << "Failed to write graph file " << filename << endl;
+        return -1;
+    }
+    return 0;
+}
+
+// Reads and checks the header of a graph file, returns the file size or -1
+static long read_graph_header(int fd, const char *filename, KnnGraphFileHeader &header) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+        memcmp(header.magic, KNN_GRAPH_MAGIC, sizeof(header.magic)) != 0 || header.K <= 0 ||
+        header.metric[KNN_METRIC_BYTES - 1] != '\0') {
+        cerr << "File " << filename << " is not a knn graph" << endl;
+        return -1;
+    }
+    uint64_t expected = sizeof(header) + header.rows * header.K * sizeof(KnnNeighbor) + header.name_bytes +
+                        header.rows * (sizeof(uint64_t) + sizeof(int32_t));
+    if (static_cast<uint64_t>(st.st_size) != expected) {
+        cerr << "Graph file " << filename << " is truncated or corrupt" << endl;
+        return -1;
+    }
+    return static_cast<long>(st.st_size);
+}
+
+int KnnGraph::load(const char *filename) {
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        cerr << "Unable to open graph file " << filename << endl;
+        return -1;
+    }
+    KnnGraphFileHeader header;
+    if (read_graph_header(fd, filename, header) < 0) {
+        close(fd);
+        return -1;
+    }
+    vector<KnnNeighbor> neighbors(header.rows * header.K);
+    string names(header.name_bytes, '\0');
+    size_t neighbor_bytes = neighbors.size() * sizeof(KnnNeighbor);
+    bool ok = pread(fd, neighbors.data(), neighbor_bytes, sizeof(header)) == static_cast<ssize_t>(neighbor_bytes) &&
+              pread(fd, &names[0], names.size(), sizeof(header) + neighbor_bytes) ==
+                  static_cast<ssize_t>(names.size());
+    close(fd);
+
+    names_.clear();
+    for (size_t p = 0; ok && p < names.size(); p += strlen(names.c_str() + p) + 1) {
+        names_.push_back(names.c_str() + p);
+    }
+    if (!ok || names_.size() != header.rows) {
+        cerr << "Graph file " << filename << " is truncated or corrupt" << endl;
+        names_.clear();
+        return -1;
+    }
+    lists_.resize(neighbors.size());
+    for (size_t i = 0; i < neighbors.size(); i++) lists_[i] = make_pair(neighbors[i].score, neighbors[i].row);
+    metric_ = header.metric;
+    K_ = header.K;
+    dim_ = header.dim;
+    normalized_ = header.normalized != 0;
+    fingerprint_ = header.fingerprint;
+    return 0;
+}
+
+KnnGraphReader::~KnnGraphReader() {
+    if (fd_ >= 0) close(fd_);
+}
+
+int KnnGraphReader::open(const char *filename, const std::string &metric) {
+    KnnGraphFileHeader header;
+    return open(filename, metric, header);
+}
+
+int KnnGraphReader::open(const char *filename, const FeatureTable &table, const std::string &metric) {
+    KnnGraphFileHeader header;
+    if (open(filename, metric, header) != 0) return -1;
+    if (header.rows != table.rows() || header.dim != table.dim ||
+               header.fingerprint != feature_table_fingerprint(table) ||
+        (metric == "cosine" && (header.normalized != 0) != table.normalized)) {
+        cerr << "Graph file " << filename << " was built on another feature table" << endl;
+        close(fd_);
+        fd_ = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int KnnGraphReader::open(const char *filename, const std::string &metric, KnnGraphFileHeader &header) {
+    if (fd_ >= 0) close(fd_);
+    fd_ = ::open(filename, O_RDONLY);
+    if (fd_ < 0) {
+        cerr << "Unable to open graph file " << filename << endl;
+        return -1;
+    }
+    bool ok = read_graph_header(fd_, filename, header) >= 0;
+    if (ok && metric != header.metric) {
+        cerr << "Graph file " << filename << " was built for " << header.metric << ", not " << metric << endl;
+        ok = false;
+    }
+    if (!ok) {
+        close(fd_);
+        fd_ = -1;
+        return -1;
+    }
+    K_ = header.K;
+    rows_ = header.rows;
+    names_offset_ = sizeof(header) + header.rows * header.K * sizeof(KnnNeighbor);
+    name_bytes_ = header.name_bytes;
+    bare_names_ = header.bare_names != 0;
+    return 0;
+}
+
+int KnnGraphReader::name(int row, std::string &name) const {
+    name.clear();
+    if (fd_ < 0 || row < 0 || static_cast<size_t>(row) >= rows_) return -1;
+    uint64_t offset;
+    off_t at = static_cast<off_t>(names_offset_ + name_bytes_ + static_cast<uint64_t>(row) * sizeof(offset));
+    if (pread(fd_, &offset, sizeof(offset), at) != static_cast<ssize_t>(sizeof(offset)) || offset >= name_bytes_) {
+        return -1;
+    }
+    // The name ends at the first NUL, which must come before the end of the names
+    char buffer[KNN_NAME_READ_BYTES];
+    size_t length = min(sizeof(buffer), static_cast<size_t>(name_bytes_ - offset));
+    ssize_t n = pread(fd_, buffer, length, static_cast<off_t>(names_offset_ + offset));
+    const char *end = n == static_cast<ssize_t>(length) ? static_cast<const char *>(memchr(buffer, '\0', length)) : nullptr;
+    if (end == nullptr) return -1;
+    name.assign(buffer, static_cast<size_t>(end - buffer));
+    return 0;
+}
+
+// Binary search of the rows sorted by canonical name, -1 if no row has the name
+int KnnGraphReader::lookup(std::string_view canonical) const {
+    off_t sorted = static_cast<off_t>(names_offset_ + name_bytes_ + rows_ * sizeof(uint64_t));
+    size_t lo = 0, hi = rows_;
+    string name;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int32_t row;
+        off_t at = sorted + static_cast<off_t>(mid * sizeof(row));
+        if (pread(fd_, &row, sizeof(row), at) != static_cast<ssize_t>(sizeof(row)) || this->name(row, name) != 0) {
+            cerr << "Graph file is corrupt" << endl;
+            return -1;
+        }
+        int order = canonical_image_name(name).compare(canonical);
+        if (order == 0) return row;
+        if (order < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+int KnnGraphReader::find_row(const char *image_filename) const {
+    if (fd_ < 0) return -1;
+    int row = lookup(canonical_image_name(image_filename));
+    // Graphs of tables that keep bare names, like the ResNet18 embeddings, match on the name alone
+    if (row < 0 && bare_names_ && has_image_directory(image_filename)) {
+        row = lookup(canonical_image_name(image_base_name(image_filename)));
+    }
+    return row;
+}
+
+int KnnGraphReader::neighbors(int row, int N, std::vector<std::pair<float, int>> &neighbors) const {
+    neighbors.clear();
+    if (fd_ < 0 || row < 0 || static_cast<size_t>(row) >= rows_) return -1;
+    if (N > K_) {
+        cerr << "The graph keeps " << K_ << " neighbors per image, " << N << " were asked for" << endl;
+        return -1;
+    }
+    vector<KnnNeighbor> record(K_);
+    size_t bytes = record.size() * sizeof(KnnNeighbor);
+    off_t offset = sizeof(KnnGraphFileHeader) + static_cast<off_t>(row) * bytes;
+    if (pread(fd_, record.data(), bytes, offset) != static_cast<ssize_t>(bytes)) return -1;
+    for (int k = 0; k < N && record[k].row >= 0; k++) neighbors.emplace_back(record[k].score, record[k].row);
+    return 0;
+}
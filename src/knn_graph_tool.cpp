@@ -0,0 +1,151 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Build and update the K nearest neighbor graph of a feature file, query it, and check it against a scan
+ */
+#include "../include/feature_table.h"
+#include "../include/image_search.h"
+#include "../include/knn_graph.h"
+#include "../include/parallel_topn.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static void print_stats(const char *what, const KnnGraphStats &stats, size_t rows, double seconds) {
+    double all_pairs = static_cast<double>(rows) * (rows - 1) / 2;
+    printf("%s %zu rows in %.2f s: %zu lists computed, %zu distance evaluations (%.1f%% of all %.0f pairs)\n", what,
+           rows, seconds, stats.rows_computed, stats.distance_evaluations,
+           all_pairs > 0 ? 100.0 * stats.distance_evaluations / all_pairs : 0.0, all_pairs);
+}
+
+/*
+  Answers num_queries targets from the graph and with find_topN_matches,
+  and reports both times per query and whether the scores agree.
+ */
+static int verify(FeatureTable &table, const char *graph_file, const string &metric, int N, int num_queries) {
+    KnnGraphReader reader;
+    if (reader.open(graph_file, table, metric) != 0) return -1;
+    if (N > reader.K()) N = reader.K();
+    double graph_ms = 0.0, scan_ms = 0.0;
+    int mismatches = 0;
+    for (int q = 0; q < num_queries; q++) {
+        int row = static_cast<int>((static_cast<size_t>(q) * 7919) % table.rows());
+        vector<pair<float, int>> neighbors;
+        vector<Match> matches;
+        auto t0 = chrono::steady_clock::now();
+        if (reader.neighbors(row, N, neighbors) != 0) return -1;
+        auto t1 = chrono::steady_clock::now();
+        if (find_topN_matches(metric, table.filenames[row], table, nullptr, N, matches, 1) != 0) return -1;
+        auto t2 = chrono::steady_clock::now();
+        graph_ms += chrono::duration<double, milli>(t1 - t0).count();
+        scan_ms += chrono::duration<double, milli>(t2 - t1).count();
+        bool same = neighbors.size() == matches.size();
+        for (size_t i = 0; same && i < neighbors.size(); i++) same = neighbors[i].first == matches[i].score;
+        if (!same) mismatches++;
+    }
+    printf("%d queries, N = %d: graph %.4f ms, scan %.3f ms per query, %d mismatches\n", num_queries, N,
+           graph_ms / num_queries, scan_ms / num_queries, mismatches);
+    return mismatches == 0 ? 0 : -1;
+}
+
+/**
+ * Builds the K nearest neighbors of every image of a feature file, carries
+ * a graph over to a newer version of the file, prints the neighbors of an
+ * image, or checks a graph against the scan of find_topN_matches.
+ *
+ * @param argv argv[1] - build, update, query or verify, argv[2] - feature file, argv[3] - graph file,
+ *             argv[4] - distance metric (build, query, verify), argv[5] - target image (query)
+ *             Optional flags:
+ *             --K <k> - neighbors per image (build, default 50)
+ *             --N <n> - neighbors printed or checked (query, verify; default 10)
+ *             --queries <q> - targets checked (verify, default 200)
+ *             --threads <n> - build threads, 0 uses every core
+ */
+int main(int argc, char *argv[]) {
+    const char *mode = argc > 1 ? argv[1] : "";
+    int positional = strcmp(mode, "update") == 0 ? 4 :
+                     strcmp(mode, "build") == 0 || strcmp(mode, "verify") == 0 ? 5 :
+                     strcmp(mode, "query") == 0 ? 6 : 0;
+    if (positional == 0 || argc < positional) {
+        printf("usage: %s build <feature_file> <graph_file> <distance_metric> [--K k] [--threads n]\n", argv[0]);
+        printf("       %s update <feature_file> <graph_file> [--threads n]\n", argv[0]);
+        printf("       %s query <feature_file> <graph_file> <distance_metric> <target_image> [--N n]\n", argv[0]);
+        printf("       %s verify <feature_file> <graph_file> <distance_metric> [--N n] [--queries q]\n", argv[0]);
+        printf("distance metrics: ssd, rgb-hist, multi-hist, texture-color, cosine\n");
+        exit(-1);
+    }
+    int K = 50;
+    int N = 10;
+    int num_queries = 200;
+    int num_threads = 0;
+    for (int i = positional; i < argc; i++) {
+        if (i + 1 >= argc) {
+            printf("Missing value for %s\n", argv[i]);
+            exit(-1);
+        }
+        if (strcmp(argv[i], "--K") == 0) {
+            K = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--N") == 0) {
+            N = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--queries") == 0) {
+            num_queries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-t") == 0) {
+            num_threads = atoi(argv[++i]);
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+    if (K <= 0 || N <= 0 || num_queries <= 0) {
+        printf("K, N and the number of queries must be positive\n");
+        exit(-1);
+    }
+
+    // Cosine graphs are built on normalized rows, as the matchers load them
+    FeatureTable table;
+    string metric = strcmp(mode, "update") == 0 ? "" : argv[4];
+    KnnGraph graph;
+    if (strcmp(mode, "update") == 0) {
+        if (graph.load(argv[3]) != 0) exit(-1);
+        metric = graph.metric();
+    }
+    if (read_feature_table(argv[2], table, metric == "cosine") != 0 || table.rows() == 0) {
+        printf("Can not read the image csv file: %s\n", argv[2]);
+        exit(-1);
+    }
+
+    if (strcmp(mode, "build") == 0 || strcmp(mode, "update") == 0) {
+        KnnGraphStats stats;
+        auto start = chrono::steady_clock::now();
+        int result = strcmp(mode, "build") == 0 ? graph.build(table, metric, K, num_threads, &stats)
+                                                : graph.update(table, num_threads, &stats);
+        if (result != 0) exit(-1);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (graph.save(argv[3]) != 0) exit(-1);
+        print_stats(strcmp(mode, "build") == 0 ? "Built" : "Updated", stats, table.rows(), seconds);
+        printf("%s: K = %d, metric %s, %d threads\n", argv[3], graph.K(), metric.c_str(),
+               resolve_thread_count(num_threads));
+        return 0;
+    } else if (strcmp(mode, "verify") == 0) {
+        return verify(table, argv[3], metric, N, num_queries);
+    }
+
+    KnnGraphReader reader;
+    if (reader.open(argv[3], table, metric) != 0) exit(-1);
+    int row = find_table_row(table, argv[5]);
+    if (row < 0) {
+        printf("Target image %s is not in the feature file\n", argv[5]);
+        exit(-1);
+    }
+    vector<pair<float, int>> neighbors;
+    if (reader.neighbors(row, N, neighbors) != 0) exit(-1);
+    for (const pair<float, int> &neighbor : neighbors) {
+        printf("%s %f\n", table.filenames[neighbor.second], neighbor.first);
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 18, 2025
+ * Purpose: Microbenchmark of the row-major and transposed block layouts for every shipped feature type
+ */
+#include "../include/feature_table.h"
+#include "../include/search_engine.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// How the synthetic rows of a feature type look
+enum class RowShape {
+    PIXELS,     // 7x7 square, raw 0..255 values
+    HISTOGRAM,  // one normalized histogram over the whole row
+    TWO_HALVES, // two normalized histograms, e.g. color + texture
+    EMBEDDING,  // dense signed values like the ResNet18 output
+    FACE,       // leading face flag + two histograms
+    BANANA      // 64-bin blob histogram + blob total
+};
+
+// Fills one histogram over [begin, end) with a few nonzero bins that sum to 1
+static void fill_histogram(float *row, int begin, int end, mt19937 &rng) {
+    uniform_int_distribution<int> bin(begin, end - 1);
+    uniform_real_distribution<float> weight(0.0f, 1.0f);
+    float total = 0.0f;
+    int used = std::max(1, (end - begin) / 16);
+    for (int k = 0; k < used; k++) {
+        float w = weight(rng);
+        row[bin(rng)] += w;
+        total += w;
+    }
+    for (int d = begin; d < end; d++) row[d] /= total;
+}
+
+static void make_table(RowShape shape, int dim, size_t rows, FeatureTable &table) {
+    mt19937 rng(5330);
+    uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    normal_distribution<float> normal(0.0f, 1.0f);
+    vector<char *> filenames;
+    vector<vector<float>> data(rows, vector<float>(dim, 0.0f));
+    for (size_t i = 0; i < rows; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "pic.%06zu.jpg", i);
+        filenames.push_back(strdup(name));
+        float *row = data[i].data();
+        switch (shape) {
+            case RowShape::PIXELS:
+                for (int d = 0; d < dim; d++) row[d] = static_cast<float>(static_cast<int>(uniform(rng) * 256));
+                break;
+            case RowShape::HISTOGRAM:
+                fill_histogram(row, 0, dim, rng);
+                break;
+            case RowShape::TWO_HALVES:
+                fill_histogram(row, 0, dim / 2, rng);
+                fill_histogram(row, dim / 2, dim, rng);
+                break;
+            case RowShape::EMBEDDING:
+                for (int d = 0; d < dim; d++) row[d] = normal(rng);
+                break;
+            case RowShape::FACE:
+                row[0] = uniform(rng) < 0.3f ? 1.0f : 0.0f;
+                fill_histogram(row, 1, dim - 16, rng);
+                fill_histogram(row, dim - 16, dim, rng);
+                break;
+            case RowShape::BANANA:
+                if (uniform(rng) < 0.5f) {
+                    fill_histogram(row, 0, dim - 1, rng);
+                    row[dim - 1] = static_cast<float>(2000 + static_cast<int>(uniform(rng) * 8000));
+                }
+                break;
+        }
+    }
+    pack_feature_table(filenames, data, table);
+    for (char *filename : filenames) free(filename);
+}
+
+// Average ms per query of the current layout of table
+template <typename Metric, typename Filter>
+static double time_queries(FeatureTable &table, int num_queries, int N, vector<vector<pair<float, int>>> &results) {
+    results.clear();
+    auto start = chrono::steady_clock::now();
+    for (int q = 0; q < num_queries; q++) {
+        int target = static_cast<int>((static_cast<size_t>(q) * 7919) % table.rows());
+        results.push_back(search_topN<Metric, Filter>(table, table.row(target), target, N, 1));
+    }
+    auto stop = chrono::steady_clock::now();
+    return chrono::duration<double, milli>(stop - start).count() / num_queries;
+}
+
+/*
+  The layouts add the same terms in the same order, but with FMA enabled the
+  compiler may fuse them differently, so scores are compared to within 1e-5.
+ */
+static bool same_results(const vector<vector<pair<float, int>>> &a, const vector<vector<pair<float, int>>> &b) {
+    if (a.size() != b.size()) return false;
+    for (size_t q = 0; q < a.size(); q++) {
+        if (a[q].size() != b[q].size()) return false;
+        for (size_t i = 0; i < a[q].size(); i++) {
+            if (std::fabs(a[q][i].first - b[q][i].first) > 1e-5f) return false;
+        }
+    }
+    return true;
+}
+
+template <typename Metric, typename Filter = AcceptAll>
+static int bench_feature(const char *name, RowShape shape, int dim, size_t rows, int num_queries, int N) {
+    FeatureTable table;
+    make_table(shape, dim, rows, table);
+
+    vector<vector<pair<float, int>>> row_major, lanes8, lanes16;
+    double t_rows = time_queries<Metric, Filter>(table, num_queries, N, row_major);
+    build_blocked_layout(table, 8);
+    double t_8 = time_queries<Metric, Filter>(table, num_queries, N, lanes8);
+    build_blocked_layout(table, 16);
+    double t_16 = time_queries<Metric, Filter>(table, num_queries, N, lanes16);
+
+    bool same = same_results(row_major, lanes8) && same_results(row_major, lanes16);
+    printf("%-14s %5d %10.3f %10.3f %10.3f %8.2fx %s\n", name, dim, t_rows, t_8, t_16,
+           t_rows / std::min(t_8, t_16), same ? "same" : "DIFFERENT");
+    return same ? 0 : -1;
+}
+
+/**
+ * Scores synthetic tables shaped like each feature file the project writes,
+ * single-threaded, in the row-major layout and in 8- and 16-lane blocks.
+ *
+ * @param argv argv[1] - rows per table (default 20000), argv[2] - queries (default 50), argv[3] - N (default 10)
+ */
+int main(int argc, char *argv[]) {
+    size_t rows = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+    int num_queries = argc > 2 ? atoi(argv[2]) : 50;
+    int N = argc > 3 ? atoi(argv[3]) : 10;
+    if (rows == 0 || num_queries <= 0 || N <= 0) {
+        printf("usage: %s [rows] [num_queries] [N]\n", argv[0]);
+        exit(-1);
+    }
+
+    printf("%zu rows, %d queries, N = %d, ms per query\n", rows, num_queries, N);
+    printf("%-14s %5s %10s %10s %10s %9s\n", "feature", "dim", "rows", "8 lanes", "16 lanes", "speedup");
+    int failures = 0;
+    failures += bench_feature<SsdMetric>("7x7 square", RowShape::PIXELS, 27, rows, num_queries, N);
+    failures += bench_feature<HistIntersectionMetric>("rgb-hist", RowShape::HISTOGRAM, 512, rows, num_queries, N);
+    failures += bench_feature<MultiHistMetric>("multi-hist", RowShape::TWO_HALVES, 1024, rows, num_queries, N);
+    failures += bench_feature<TextureColorMetric>("texture-color", RowShape::TWO_HALVES, 528, rows, num_queries, N);
+    failures += bench_feature<TextureColorMetric>("depth", RowShape::TWO_HALVES, 520, rows, num_queries, N);
+    failures += bench_feature<HistIntersectionMetric, HasBlobs>("banana", RowShape::BANANA, 65, rows, num_queries, N);
+    failures += bench_feature<FaceCosineMetric>("face", RowShape::FACE, 529, rows, num_queries, N);
+    failures += bench_feature<CosineMetric>("resnet18", RowShape::EMBEDDING, 512, rows, num_queries, N);
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,279 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Building, storing and filtering with the predicate bitmaps of a feature file
+ */
+#include "../include/predicate_bitmap.h"
+#include "../include/feature_columns.h"
+#include "../include/feature_table.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+using namespace std;
+
+#define PREDICATE_MAGIC "P2PRED01"
+
+// Fixed-size header of a predicate file: image names, predicate names, then the bitmaps
+struct PredicateFileHeader {
+    char magic[8];
+    uint64_t rows;
+    uint64_t predicates;
+    uint64_t image_name_bytes;
+    uint64_t predicate_name_bytes;
+};
+
+const RowBitmap *PredicateSet::find(const std::string &name) const {
+    vector<string>::const_iterator it = lower_bound(names.begin(), names.end(), name);
+    if (it == names.end() || *it != name) return nullptr;
+    return &bitmaps[it - names.begin()];
+}
+
+// Name of the directory holding an image, empty for a bare filename
+static string image_directory(const char *filename) {
+    const char *end = strrchr(filename, '/');
+    if (end == nullptr) return "";
+    const char *begin = end;
+    while (begin > filename && begin[-1] != '/') begin--;
+    return string(begin, end - begin);
+}
+
+int build_feature_predicates(const FeatureTable &table, const std::string &layout, PredicateSet &predicates) {
+    const size_t rows = table.rows();
+    const int dim = table.dim;
+    if ((layout == "face" || layout == "banana") && dim < 1) {
+        cerr << "Rows of " << dim << " floats have no " << layout << " attribute" << endl;
+        return -1;
+    }
+    map<string, RowBitmap> bitmaps;
+    if (layout == "face") {
+        RowBitmap &has_face = bitmaps.emplace("has_face", RowBitmap(rows)).first->second;
+        for (size_t i = 0; i < rows; i++) {
+            if (table.row(i)[0] > 0.5f) has_face.set(i);
+        }
+    } else if (layout == "banana") {
+        RowBitmap &has_blobs = bitmaps.emplace("has_blobs", RowBitmap(rows)).first->second;
+        for (size_t i = 0; i < rows; i++) {
+            if (table.row(i)[dim - 1] != 0) has_blobs.set(i);
+        }
+    }
+    for (size_t i = 0; i < rows; i++) {
+        string directory = image_directory(table.filenames[i]);
+        if (directory.empty()) continue;
+        bitmaps.emplace("dir:" + directory, RowBitmap(rows)).first->second.set(i);
+    }
+
+    predicates = PredicateSet();
+    predicates.ids = table.ids;
+    for (pair<const string, RowBitmap> &entry : bitmaps) {
+        predicates.names.push_back(entry.first);
+        predicates.bitmaps.push_back(std::move(entry.second));
+    }
+    return 0;
+}
+
+std::string predicate_file_name(const char *feature_file) {
+    string file(feature_file);
+    size_t selector = file.rfind(COLUMN_FILE_SUFFIX ":");
+    if (selector != string::npos) file.resize(selector + strlen(COLUMN_FILE_SUFFIX));
+    return file + PREDICATE_FILE_SUFFIX;
+}
+
+int write_feature_predicates(const char *filename, const PredicateSet &predicates) {
+    string image_names, predicate_names;
+    for (int id : predicates.ids) {
+        image_names += image_registry().name(id);
+        image_names += '\0';
+    }
+    for (const string &name : predicates.names) {
+        predicate_names += name;
+        predicate_names += '\0';
+    }
+    PredicateFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PREDICATE_MAGIC, sizeof(header.magic));
+    header.rows = predicates.ids.size();
+    header.predicates = predicates.names.size();
+    header.image_name_bytes = image_names.size();
+    header.predicate_name_bytes = predicate_names.size();
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        cerr << "Unable to open predicate file " << filename << endl;
+        return -1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(image_names.data(), 1, image_names.size(), fp) == image_names.size();
+    ok = ok && fwrite(predicate_names.data(), 1, predicate_names.size(), fp) == predicate_names.size();
+    for (const RowBitmap &bitmap : predicates.bitmaps) {
+        const vector<uint64_t> &words = bitmap.words();
+        ok = ok && fwrite(words.data(), sizeof(uint64_t), words.size(), fp) == words.size();
+    }
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) {
+        cerr << "Failed to write predicate file " << filename << endl;
+        return -1;
+    }
+    return 0;
+}
+
+int read_feature_predicates(const char *filename, PredicateSet &predicates) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        cerr << "Unable to open predicate file " << filename << endl;
+        return -1;
+    }
+    PredicateFileHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, PREDICATE_MAGIC, 8) == 0;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, sizeof(header), SEEK_SET);
+    uint64_t words = (header.rows + 63) / 64;
+    ok = ok && sizeof(header) + header.image_name_bytes + header.predicate_name_bytes +
+                       header.predicates * words * sizeof(uint64_t) == static_cast<uint64_t>(size);
+    string image_names, predicate_names;
+    if (ok) {
+        image_names.resize(header.image_name_bytes);
+        predicate_names.resize(header.predicate_name_bytes);
+        ok = fread(&image_names[0], 1, image_names.size(), fp) == image_names.size() &&
+             fread(&predicate_names[0], 1, predicate_names.size(), fp) == predicate_names.size();
+    }
+
+    predicates = PredicateSet();
+    for (size_t p = 0; ok && p < image_names.size(); p += strlen(image_names.c_str() + p) + 1) {
+        predicates.ids.push_back(image_registry().intern(image_names.c_str() + p));
+    }
+    for (size_t p = 0; ok && p < predicate_names.size(); p += strlen(predicate_names.c_str() + p) + 1) {
+        predicates.names.push_back(predicate_names.c_str() + p);
+    }
+    ok = ok && predicates.ids.size() == header.rows && predicates.names.size() == header.predicates &&
+         std::is_sorted(predicates.names.begin(), predicates.names.end());
+    for (uint64_t p = 0; ok && p < header.predicates; p++) {
+        predicates.bitmaps.emplace_back(header.rows);
+        vector<uint64_t> &bits = predicates.bitmaps.back().words();
+        ok = fread(bits.data(), sizeof(uint64_t), bits.size(), fp) == bits.size();
+    }
+    fclose(fp);
+    if (!ok) {
+        cerr << "Predicate file " << filename << " is truncated or corrupt" << endl;
+        predicates = PredicateSet();
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Recursive descent over
+
+      or     := and ('|' and)*
+      and    := unary ('&' unary)*
+      unary  := '!' unary | '(' or ')' | name
+
+  Each rule returns a bitmap over the rows of the predicate set.
+ */
+class FilterParser {
+public:
+    FilterParser(const PredicateSet &predicates, const string &text) : predicates_(predicates), text_(text) {}
+
+    bool parse(RowBitmap &result) {
+        if (!parse_or(result)) return false;
+        skip_spaces();
+        if (pos_ != text_.size()) return fail("unexpected '" + text_.substr(pos_, 1) + "'");
+        return true;
+    }
+
+    const string &error() const { return error_; }
+
+private:
+    bool fail(const string &message) {
+        if (error_.empty()) error_ = message;
+        return false;
+    }
+
+    void skip_spaces() {
+        while (pos_ < text_.size() && isspace(static_cast<unsigned char>(text_[pos_]))) pos_++;
+    }
+
+    bool accept(char op) {
+        skip_spaces();
+        if (pos_ < text_.size() && text_[pos_] == op) {
+            pos_++;
+            return true;
+        }
+        return false;
+    }
+
+    bool parse_or(RowBitmap &result) {
+        if (!parse_and(result)) return false;
+        while (accept('|')) {
+            RowBitmap right;
+            if (!parse_and(right)) return false;
+            result |= right;
+        }
+        return true;
+    }
+
+    bool parse_and(RowBitmap &result) {
+        if (!parse_unary(result)) return false;
+        while (accept('&')) {
+            RowBitmap right;
+            if (!parse_unary(right)) return false;
+            result &= right;
+        }
+        return true;
+    }
+
+    bool parse_unary(RowBitmap &result) {
+        if (accept('!')) {
+            if (!parse_unary(result)) return false;
+            result.flip();
+            return true;
+        }
+        if (accept('(')) {
+            if (!parse_or(result)) return false;
+            return accept(')') || fail("missing ')'");
+        }
+        size_t begin = pos_;
+        while (pos_ < text_.size() && !isspace(static_cast<unsigned char>(text_[pos_])) &&
+               strchr("!&|()", text_[pos_]) == nullptr) {
+            pos_++;
+        }
+        if (pos_ == begin) return fail("expected a predicate name");
+        string name = text_.substr(begin, pos_ - begin);
+        const RowBitmap *bitmap = predicates_.find(name);
+        if (bitmap == nullptr) return fail("unknown predicate " + name);
+        result = *bitmap;
+        return true;
+    }
+
+    const PredicateSet &predicates_;
+    const string &text_;
+    size_t pos_ = 0;
+    string error_;
+};
+
+int evaluate_filter(const PredicateSet &predicates, const std::string &expression, const FeatureTable &table,
+                    RowBitmap &rows) {
+    RowBitmap selected;
+    FilterParser parser(predicates, expression);
+    if (!parser.parse(selected)) {
+        cerr << "Invalid filter \"" << expression << "\": " << parser.error() << endl;
+        return -1;
+    }
+    // The set usually comes from the same file as the table, with the same rows
+    if (predicates.ids == table.ids) {
+        rows = std::move(selected);
+        return 0;
+    }
+    rows.assign(table.rows(), false);
+    selected.for_each([&](size_t r) {
+        int id = predicates.ids[r];
+        if (id >= 0 && static_cast<size_t>(id) < table.row_of_id.size() && table.row_of_id[id] >= 0) {
+            rows.set(table.row_of_id[id]);
+        }
+    });
+    return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Build the predicate bitmaps of a feature file and count the images a filter selects
+ */
+#include "../include/feature_columns.h"
+#include "../include/predicate_bitmap.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+/**
+ * Writes the predicate file of a feature file, lists its predicates, or
+ * counts the images passing a filter expression.
+ *
+ * @param argv argv[1] - build, info or count
+ *             build: argv[2] - feature file, argv[3] - layout (face, banana or plain)
+ *             info: argv[2] - feature file
+ *             count: argv[2] - feature file, argv[3] - filter expression
+ */
+int main(int argc, char *argv[]) {
+    const char *mode = argc > 1 ? argv[1] : "";
+    int positional = strcmp(mode, "info") == 0 ? 3 : strcmp(mode, "build") == 0 || strcmp(mode, "count") == 0 ? 4 : 0;
+    if (positional == 0 || argc < positional) {
+        printf("usage: %s build <feature_file> <layout>\n", argv[0]);
+        printf("       %s info <feature_file>\n", argv[0]);
+        printf("       %s count <feature_file> <filter expression>\n", argv[0]);
+        printf("layout options: face, banana, plain\n");
+        printf("filters combine predicates with ! & | ( ), e.g. \"has_face & !dir:junk\"\n");
+        exit(-1);
+    }
+    string predicate_file = predicate_file_name(argv[2]);
+
+    if (strcmp(mode, "build") == 0) {
+        FeatureTable table;
+        PredicateSet predicates;
+        if (read_feature_table(argv[2], table) != 0) {
+            printf("Can not read the image csv file: %s\n", argv[2]);
+            exit(-1);
+        }
+        if (build_feature_predicates(table, argv[3], predicates) != 0 ||
+            write_feature_predicates(predicate_file.c_str(), predicates) != 0) {
+            exit(-1);
+        }
+        printf("Wrote %zu predicates over %zu images to %s\n", predicates.names.size(), predicates.ids.size(),
+               predicate_file.c_str());
+        return 0;
+    }
+
+    PredicateSet predicates;
+    if (read_feature_predicates(predicate_file.c_str(), predicates) != 0) {
+        exit(-1);
+    }
+    if (strcmp(mode, "info") == 0) {
+        printf("%s: %zu images\n", predicate_file.c_str(), predicates.ids.size());
+        for (size_t p = 0; p < predicates.names.size(); p++) {
+            printf("  %-24s %zu images\n", predicates.names[p].c_str(), predicates.bitmaps[p].count());
+        }
+        return 0;
+    }
+
+    // Only the names are needed to map the set onto the rows of the file
+    FeatureTable table;
+    if (read_feature_table(argv[2], table) != 0) {
+        printf("Can not read the image csv file: %s\n", argv[2]);
+        exit(-1);
+    }
+    RowBitmap rows;
+    auto start = chrono::steady_clock::now();
+    if (evaluate_filter(predicates, argv[3], table, rows) != 0) {
+        exit(-1);
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    printf("%zu of %zu images pass \"%s\" (%.3f ms)\n", rows.count(), table.rows(), argv[3], ms);
+    return 0;
+}
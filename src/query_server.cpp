@@ -0,0 +1,320 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 20, 2025
+ * Purpose: Headless query server that keeps the feature tables in memory and answers top N requests
+ */
+#include "../include/image_query.h"
+#include "../include/json_util.h"
+#include "../include/parallel_topn.h"
+#include "../include/search_service.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// Largest N a request may ask for
+#define MAX_REQUEST_N 10000
+// Largest image an upload request may send
+#define MAX_UPLOAD_BYTES (64 * 1024 * 1024)
+
+// Requests come from in_fd and answers go to out_fd: stdin/stdout, or a socket for both
+struct Connection {
+    int in_fd;
+    int out_fd;
+    string pending; // bytes read past the last request
+};
+
+// Reads up to the next newline, false at end of input
+static bool read_line(Connection &conn, string &line) {
+    char buffer[4096];
+    size_t newline;
+    while ((newline = conn.pending.find('\n')) == string::npos) {
+        ssize_t n = read(conn.in_fd, buffer, sizeof(buffer));
+        if (n <= 0) return false;
+        conn.pending.append(buffer, static_cast<size_t>(n));
+    }
+    line = conn.pending.substr(0, newline);
+    conn.pending.erase(0, newline + 1);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    return true;
+}
+
+// Reads exactly size bytes, false at end of input
+static bool read_bytes(Connection &conn, size_t size, vector<unsigned char> &bytes) {
+    size_t got = std::min(size, conn.pending.size());
+    bytes.assign(conn.pending.begin(), conn.pending.begin() + got);
+    conn.pending.erase(0, got);
+    bytes.resize(size);
+    while (got < size) {
+        ssize_t n = read(conn.in_fd, bytes.data() + got, size - got);
+        if (n <= 0) return false;
+        got += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Writes all of data
+static bool send_all(int fd, const string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = write(fd, data.data() + sent, data.size() - sent);
+        if (n <= 0) return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static string error_response(const string &message) {
+    return "{\"status\":\"error\",\"message\":" + json_string(message) + "}";
+}
+
+// Answer of a successful search, timing holds the fields before the results
+static string matches_response(const string &metric, const string &target, const string &timing,
+                               const vector<Match> &matches) {
+    // The ResNet18 table stores bare names, report paths like the other tables
+    string prefix = metric_uses_bare_names(metric) ? "../olympus/" : "";
+    ostringstream out;
+    out << "{\"status\":\"ok\",\"metric\":" << json_string(metric) << ",\"target\":" << json_string(target)
+        << "," << timing << ",\"results\":[";
+    for (size_t i = 0; i < matches.size(); i++) {
+        if (i > 0) out << ",";
+        out << "{\"file\":" << json_string(prefix + matches[i].filename) << ",\"score\":" << matches[i].score << "}";
+    }
+    out << "]}";
+    return out.str();
+}
+
+// Searches with an image that is not in the table, from a path or uploaded bytes
+static string image_request(SearchService &service, const string &metric, int N, const string &target,
+                            const vector<unsigned char> *upload) {
+    map<string, FeatureTable>::iterator table = service.tables.find(metric);
+    if (table == service.tables.end()) return error_response("metric not configured: " + metric);
+    if (!metric_supports_new_image(metric)) return error_response("metric can not search with a new image: " + metric);
+
+    vector<Match> matches;
+    QueryTiming timing;
+    int result = upload != nullptr
+        ? find_topN_matches_image_buffer(metric, *upload, table->second, N, matches, service.num_threads, timing)
+        : find_topN_matches_image_file(metric, target.c_str(), table->second, N, matches, service.num_threads, timing);
+    if (result != 0) return error_response("can not search with image: " + target);
+
+    ostringstream fields;
+    fields << "\"decode_ms\":" << timing.decode_ms << ",\"extract_ms\":" << timing.extract_ms
+           << ",\"search_ms\":" << timing.search_ms;
+    return matches_response(metric, target, fields.str(), matches);
+}
+
+/*
+  Answers one request. The requests are
+
+      <metric> <N> <target_image>          top N matches of an image in the table
+      image <metric> <N> <image_path>      top N matches of any image, features computed here
+      upload <metric> <N> <num_bytes>      same for the encoded image in the num_bytes after the line
+      ping                                 liveness check, with the version of the tables
+      reload                               reload the config and its tables now
+      quit                                 close the connection (stdin: stop the server)
+
+  and every answer is a single line of JSON. Each request searches the
+  version of the tables current when it starts, even if a reload publishes
+  a new one meanwhile.
+ */
+static string handle_request(ServiceReloader &reloader, Connection &conn, const string &line, bool &quit) {
+    istringstream fields(line);
+    string metric;
+    if (!(fields >> metric)) return "";
+    if (metric == "ping" || metric == "reload") {
+        if (metric == "reload" && reloader.reload() != 0) return error_response("reload failed, tables unchanged");
+        ReloadStats stats = reloader.stats();
+        ostringstream out;
+        out << "{\"status\":\"ok\",\"version\":" << stats.version << ",\"reloads\":" << stats.reloads
+            << ",\"failed_reloads\":" << stats.failures << "}";
+        return out.str();
+    }
+    if (metric == "quit") {
+        quit = true;
+        return "{\"status\":\"ok\"}";
+    }
+
+    string command;
+    if (metric == "image" || metric == "upload") {
+        command = metric;
+        fields >> metric;
+    }
+    int N = 0;
+    string target;
+    fields >> N;
+    getline(fields >> ws, target);
+    if (N <= 0 || N > MAX_REQUEST_N || target.empty()) {
+        return error_response("expected: [image|upload] <metric> <N> <target>");
+    }
+
+    shared_ptr<SearchService> service = reloader.snapshot();
+    if (command == "upload") {
+        long size = atol(target.c_str());
+        if (size <= 0 || size > MAX_UPLOAD_BYTES) {
+            quit = true; // the image bytes can not be skipped reliably
+            return error_response("invalid upload size: " + target);
+        }
+        vector<unsigned char> upload;
+        if (!read_bytes(conn, static_cast<size_t>(size), upload)) {
+            quit = true;
+            return error_response("upload ended early");
+        }
+        return image_request(*service, metric, N, "upload", &upload);
+    }
+    if (command == "image") {
+        return image_request(*service, metric, N, target, nullptr);
+    }
+
+    vector<Match> matches;
+    auto start = chrono::steady_clock::now();
+    int result = search_service_query(*service, metric, const_cast<char *>(target.c_str()), N, matches);
+    double search_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    if (result != 0) {
+        if (service->tables.count(metric) == 0) return error_response("metric not configured: " + metric);
+        return error_response("target image not found: " + target);
+    }
+    ostringstream timing;
+    timing << "\"search_ms\":" << search_ms;
+    return matches_response(metric, target, timing.str(), matches);
+}
+
+// Answers the requests of one connection until it quits or the input ends
+static void serve_connection(ServiceReloader &reloader, Connection conn) {
+    string line;
+    bool quit = false;
+    while (!quit && read_line(conn, line)) {
+        string response = handle_request(reloader, conn, line, quit);
+        if (response.empty()) continue;
+        if (!send_all(conn.out_fd, response + "\n")) break;
+    }
+}
+
+// Line protocol on stdin/stdout, one request at a time
+static int serve_stdio(ServiceReloader &reloader, int out_fd) {
+    serve_connection(reloader, Connection{STDIN_FILENO, out_fd, ""});
+    return 0;
+}
+
+// Answers the requests of one socket client
+static void serve_client(ServiceReloader &reloader, int fd) {
+    serve_connection(reloader, Connection{fd, fd, ""});
+    close(fd);
+}
+
+// Unix domain socket, one thread per connection so clients are served concurrently
+static int serve_socket(ServiceReloader &reloader, const char *path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        cerr << "Socket path too long: " << path << endl;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listen_fd, 64) != 0) {
+        perror(path);
+        close(listen_fd);
+        return -1;
+    }
+    cerr << "Listening on " << path << endl;
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        thread(serve_client, std::ref(reloader), fd).detach();
+    }
+    close(listen_fd);
+    unlink(path);
+    return -1;
+}
+
+/**
+ * Loads every table in the config once and answers top N requests until stopped.
+ *
+ * Nothing is displayed, each request is answered with a line of JSON. With
+ * --watch the tables are rebuilt in the background whenever the config or
+ * one of its files changes, and swapped in without pausing the requests.
+ *
+ * @param argv argv[1] - config file of "<metric> <feature_file>" lines
+ *             Optional flags after argv[1]:
+ *             --socket <path> - listen on a Unix domain socket instead of stdin/stdout
+ *             --threads <n> - search threads per request, 0 uses every core. Defaults to every core on
+ *                             stdin/stdout and to 1 on a socket, where concurrent clients already fill the cores
+ *             --lanes <8|16> - score candidates in the transposed block layout
+ *             --watch - reload the tables when the config or a feature file changes
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("usage: %s <config_file> [--socket <path>] [--threads <n>] [--lanes <8|16>] [--watch]\n", argv[0]);
+        printf("requests: <metric> <N> <target_image> | image <metric> <N> <path> | upload <metric> <N> <bytes> | ping | reload | quit\n");
+        exit(-1);
+    }
+
+    ServiceReloader reloader;
+    const char *socket_path = NULL;
+    int num_threads = -1;
+    int lanes = 0;
+    bool watch = false;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if ((strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-t") == 0) && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lanes") == 0 && i + 1 < argc) {
+            lanes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            watch = true;
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+
+    // Socket clients each run on their own thread, so their searches must not each take every core
+    if (num_threads < 0) {
+        num_threads = socket_path != NULL ? 1 : 0;
+    }
+
+    // The loaders log to stdout, also during reloads: send that to stderr and answer on a copy of stdout
+    fflush(stdout);
+    int response_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    if (reloader.load(argv[1], lanes, num_threads) != 0) {
+        exit(-1);
+    }
+    cerr << "Using " << resolve_thread_count(num_threads) << " search threads per request" << endl;
+    if (watch && reloader.start_watching() != 0) {
+        exit(-1);
+    }
+
+    if (socket_path != NULL) {
+        signal(SIGPIPE, SIG_IGN);
+        return serve_socket(reloader, socket_path);
+    }
+    return serve_stdio(reloader, response_fd);
+}
@@ -0,0 +1,337 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 12, 2025
+ * Purpose: Time the templated search engine against the original copy-and-sort top N search
+ */
+#include "../include/batch_search.h"
+#include "../include/cascade_plan.h"
+#include "../include/csv_util.h"
+#include "../include/distance_calculate.h"
+#include "../include/feature_table.h"
+#include "../include/inverted_hist_index.h"
+#include "../include/search_engine.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+typedef float (*VectorDistance)(std::vector<float> &, std::vector<float> &);
+
+/*
+  The search as image_matcher did it before the engine: every candidate
+  row is copied, every distance is kept and the whole list is sorted.
+ */
+static vector<pair<float, int>> legacy_topN(vector<vector<float>> &data, int target_index, int N,
+                                            VectorDistance distance, bool ascending) {
+    std::vector<float> target = data[target_index];
+    vector<pair<float, int>> distances;
+    for (size_t i = 0; i < data.size(); i++) {
+        if (static_cast<int>(i) == target_index) continue;
+        std::vector<float> vec = data[i];
+        distances.push_back({distance(vec, target), static_cast<int>(i)});
+    }
+    if (ascending) sort(distances.begin(), distances.end());
+    else sort(distances.rbegin(), distances.rend());
+    if (static_cast<int>(distances.size()) > N) distances.resize(N);
+    return distances;
+}
+
+/*
+  Times the batch API against one engine query per target and reports the
+  query throughput of both.
+ */
+template <typename Metric>
+static int run_batch_benchmark(FeatureTable &table, const std::vector<int> &targets, int N, BatchMetric metric,
+                               int num_threads) {
+    auto t0 = chrono::steady_clock::now();
+    std::vector<std::vector<pair<float, int>>> single;
+    for (int target : targets) {
+        single.push_back(search_topN<Metric>(table, table.row(target), target, N, num_threads));
+    }
+    auto t1 = chrono::steady_clock::now();
+    std::vector<std::vector<pair<float, int>>> batch;
+    if (batch_topN_rows(table, targets, N, metric, num_threads, batch) != 0) return -1;
+    auto t2 = chrono::steady_clock::now();
+
+    // The expanded forms round differently, so compare the matched rows loosely
+    size_t same = 0, total = 0;
+    for (size_t q = 0; q < targets.size(); q++) {
+        for (size_t i = 0; i < single[q].size(); i++) {
+            total++;
+            for (const pair<float, int> &match : batch[q]) {
+                if (match.second == single[q][i].second) {
+                    same++;
+                    break;
+                }
+            }
+        }
+    }
+
+    double single_s = chrono::duration<double>(t1 - t0).count();
+    double batch_s = chrono::duration<double>(t2 - t1).count();
+    printf("%zu rows x %d floats, %zu queries, N = %d, %d threads\n", table.rows(), table.dim, targets.size(), N,
+           resolve_thread_count(num_threads));
+    printf("one query at a time: %.1f queries/s\n", targets.size() / single_s);
+    printf("batch              : %.1f queries/s\n", targets.size() / batch_s);
+    printf("matches in common  : %.2f%%\n", total > 0 ? 100.0 * same / total : 100.0);
+    return 0;
+}
+
+/*
+  Times the inverted histogram index against the engine's scan and checks
+  that both return the same rows with the same scores for every target.
+ */
+template <typename Metric>
+static int run_inverted_benchmark(FeatureTable &table, const std::vector<int> &targets, int N,
+                                  InvertedHistMetric metric, int num_threads) {
+    InvertedHistIndex index;
+    auto t0 = chrono::steady_clock::now();
+    if (index.build(table, metric, num_threads) != 0) return -1;
+    double build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+    int mismatches = 0;
+    double index_ms = 0.0, engine_ms = 0.0;
+    InvertedHistStats stats;
+    for (int target : targets) {
+        auto t1 = chrono::steady_clock::now();
+        vector<pair<float, int>> found = index.search(table.row(target), N, target, &stats);
+        auto t2 = chrono::steady_clock::now();
+        vector<pair<float, int>> expected = search_topN<Metric>(table, table.row(target), target, N, num_threads);
+        auto t3 = chrono::steady_clock::now();
+        index_ms += chrono::duration<double, milli>(t2 - t1).count();
+        engine_ms += chrono::duration<double, milli>(t3 - t2).count();
+        if (found != expected) mismatches++;
+    }
+
+    size_t queries = targets.size();
+    printf("%zu rows x %d floats, %zu queries, N = %d, %zu postings built in %.1f ms\n", table.rows(), table.dim,
+           queries, N, index.postings(), build_ms);
+    printf("engine scan   : %.3f ms/query\n", engine_ms / queries);
+    printf("inverted index: %.3f ms/query, %.1f of %.1f bins, %.0f postings, %.1f rows scored per query\n",
+           index_ms / queries, static_cast<double>(stats.bins_scanned) / queries,
+           static_cast<double>(stats.query_bins) / queries, static_cast<double>(stats.postings_scanned) / queries,
+           static_cast<double>(stats.candidates_scored) / queries);
+    printf("speedup       : %.2fx\n", index_ms > 0 ? engine_ms / index_ms : 0.0);
+    if (mismatches > 0) {
+        printf("%d queries returned different matches\n", mismatches);
+        return -1;
+    }
+    return 0;
+}
+
+// Writes rows under new names, the values printed so they read back exactly
+static int write_named_csv(const string &filename, const vector<string> &names, vector<vector<float>> &data) {
+    FILE *fp = fopen(filename.c_str(), "w");
+    if (!fp) {
+        printf("Unable to open %s\n", filename.c_str());
+        return -1;
+    }
+    for (size_t i = 0; i < data.size(); i++) {
+        fputs(names[i].c_str(), fp);
+        for (float value : data[i]) fprintf(fp, ",%.9g", value);
+        fputc('\n', fp);
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+// Runs one cascade plan given as text, scores of the matches in order
+static int run_plan_text(const string &directory, const char *name, const string &text, const string &target, int N,
+                         vector<float> &scores) {
+    string plan_file = directory + "/" + name;
+    FILE *fp = fopen(plan_file.c_str(), "w");
+    if (!fp || fputs(text.c_str(), fp) < 0 || fclose(fp) != 0) return -1;
+    CascadePlan plan;
+    vector<Match> matches;
+    vector<CascadeStageReport> report;
+    if (load_cascade_plan(plan_file.c_str(), plan) != 0 ||
+        run_cascade(plan, const_cast<char *>(target.c_str()), N, matches, report, 1) != 0) {
+        return -1;
+    }
+    scores.clear();
+    for (const Match &match : matches) scores.push_back(match.score);
+    return 0;
+}
+
+/*
+  Checks that a cascade joins stages whose files name the images
+  differently: one copy of the feature file names them by path, one by
+  bare file name like ResNet18_olym.csv, and ssd cascades over both, in
+  both orders, must return the scores of a single ssd stage.
+ */
+static int run_cascade_names_check(vector<char *> &filenames, vector<vector<float>> &data,
+                                   const std::vector<int> &targets, int N) {
+    char directory[] = "/tmp/proj2-cascade-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
+    string dir = directory;
+    vector<string> bare, paths;
+    for (char *filename : filenames) {
+        bare.emplace_back(image_base_name(filename));
+        paths.push_back("cascade/" + bare.back());
+    }
+    string bare_file = dir + "/bare.csv", path_file = dir + "/path.csv";
+    int failures = 0;
+    if (write_named_csv(bare_file, bare, data) != 0 || write_named_csv(path_file, paths, data) != 0) failures++;
+
+    string keep = to_string(5 * N);
+    string single = "ssd " + path_file + "\n";
+    string path_then_bare = "ssd " + path_file + " " + keep + "\nssd " + bare_file + "\n";
+    string bare_then_path = "ssd " + bare_file + " " + keep + "\nssd " + path_file + "\n";
+    for (size_t q = 0; failures == 0 && q < targets.size(); q++) {
+        string target = "../" + paths[targets[q]];
+        vector<float> expected, first, second;
+        if (run_plan_text(dir, "single.plan", single, target, N, expected) != 0 ||
+            run_plan_text(dir, "path-bare.plan", path_then_bare, target, N, first) != 0 ||
+            run_plan_text(dir, "bare-path.plan", bare_then_path, target, N, second) != 0 || expected.empty() ||
+            first != expected || second != expected) {
+            printf("Mixed cascade for %s does not match the single stage\n", target.c_str());
+            failures++;
+        }
+    }
+    for (const char *name : {"bare.csv", "path.csv", "single.plan", "path-bare.plan", "bare-path.plan"}) {
+        unlink((dir + "/" + name).c_str());
+    }
+    rmdir(directory);
+    printf("%zu queries, N = %d: path and bare-name cascades %s\n", targets.size(), N,
+           failures == 0 ? "match the single stage" : "FAILED");
+    return failures == 0 ? 0 : -1;
+}
+
+template <typename Metric>
+static vector<pair<float, int>> engine_topN(FeatureTable &table, int target_index, int N, int num_threads) {
+    return search_topN<Metric>(table, table.row(target_index), target_index, N, num_threads);
+}
+
+/**
+ * Times Q queries of one metric with both implementations and prints the
+ * average per-query time.
+ *
+ * With the batch-cosine and batch-ssd metrics the batch API is timed
+ * against one engine query per target instead, and with inverted-rgb-hist
+ * and inverted-multi-hist the inverted histogram index, which must return
+ * exactly the engine's matches. cascade-names checks cascades over stages
+ * that name images by path and by bare file name instead of timing.
+ *
+ * @param argv argv[1] - feature file, argv[2] - metric (ssd, rgb-hist, multi-hist, texture-color, cosine,
+ *             batch-cosine, batch-ssd, inverted-rgb-hist, inverted-multi-hist, cascade-names),
+ *             argv[3] - number of queries (default 100, 0 queries every row), argv[4] - N (default 10),
+ *             argv[5] - search threads for the engine (default 1)
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("usage: %s <feature_file> <metric> [num_queries] [N] [threads]\n", argv[0]);
+        printf("metric options: ssd, rgb-hist, multi-hist, texture-color, cosine, batch-cosine, batch-ssd, "
+               "inverted-rgb-hist, inverted-multi-hist, cascade-names\n");
+        exit(-1);
+    }
+    std::string metric = argv[2];
+    int num_queries = argc > 3 ? atoi(argv[3]) : 100;
+    int N = argc > 4 ? atoi(argv[4]) : 10;
+    int num_threads = argc > 5 ? atoi(argv[5]) : 1;
+
+    VectorDistance distance = nullptr;
+    bool ascending = true;
+    bool batch = false;
+    bool inverted = false;
+    bool cascade = false;
+    vector<pair<float, int>> (*engine)(FeatureTable &, int, int, int) = nullptr;
+    if (metric == "ssd") {
+        distance = calculate_ssd;
+        engine = engine_topN<SsdMetric>;
+    } else if (metric == "rgb-hist") {
+        distance = calculate_histogramIntersection;
+        engine = engine_topN<HistIntersectionMetric>;
+        ascending = false;
+    } else if (metric == "multi-hist") {
+        distance = calculate_multiHist_distance;
+        engine = engine_topN<MultiHistMetric>;
+    } else if (metric == "texture-color") {
+        distance = calculate_textureColor_distance;
+        engine = engine_topN<TextureColorMetric>;
+    } else if (metric == "cosine") {
+        distance = calculate_cosine_distance;
+        engine = engine_topN<CosineMetric>;
+    } else if (metric == "batch-cosine" || metric == "batch-ssd") {
+        batch = true;
+    } else if (metric == "inverted-rgb-hist" || metric == "inverted-multi-hist") {
+        inverted = true;
+    } else if (metric == "cascade-names") {
+        cascade = true;
+    } else {
+        printf("Invalid metric: %s\n", metric.c_str());
+        exit(-1);
+    }
+
+    std::vector<char *> filenames;
+    std::vector<std::vector<float>> data;
+    if (read_image_data_csv(argv[1], filenames, data) != 0 || data.empty()) {
+        printf("Can not read the image csv file: %s\n", argv[1]);
+        exit(-1);
+    }
+    FeatureTable table;
+    if (pack_feature_table(filenames, data, table) != 0) {
+        exit(-1);
+    }
+
+    // Spread the targets evenly over the table
+    std::vector<int> targets;
+    for (int q = 0; q < num_queries; q++) {
+        targets.push_back(static_cast<int>((static_cast<size_t>(q) * 7919) % data.size()));
+    }
+    if (num_queries <= 0) {
+        num_queries = static_cast<int>(data.size());
+        for (int row = 0; row < num_queries; row++) targets.push_back(row);
+    }
+
+    if (cascade) {
+        return run_cascade_names_check(filenames, data, targets, N);
+    } else if (metric == "inverted-rgb-hist") {
+        return run_inverted_benchmark<HistIntersectionMetric>(table, targets, N, InvertedHistMetric::HIST_INTERSECTION,
+                                                              num_threads);
+    } else if (inverted) {
+        return run_inverted_benchmark<MultiHistMetric>(table, targets, N, InvertedHistMetric::MULTI_HIST, num_threads);
+    } else if (metric == "batch-cosine") {
+        return run_batch_benchmark<CosineMetric>(table, targets, N, BatchMetric::COSINE, num_threads);
+    } else if (batch) {
+        return run_batch_benchmark<SsdMetric>(table, targets, N, BatchMetric::SSD, num_threads);
+    }
+
+    int mismatches = 0;
+    double legacy_ms = 0.0, engine_ms = 0.0;
+    for (int target : targets) {
+        auto t0 = chrono::steady_clock::now();
+        vector<pair<float, int>> before = legacy_topN(data, target, N, distance, ascending);
+        auto t1 = chrono::steady_clock::now();
+        vector<pair<float, int>> after = engine(table, target, N, num_threads);
+        auto t2 = chrono::steady_clock::now();
+        legacy_ms += chrono::duration<double, milli>(t1 - t0).count();
+        engine_ms += chrono::duration<double, milli>(t2 - t1).count();
+
+        // Ties may be ordered differently, compare the scores
+        for (size_t i = 0; i < before.size() && i < after.size(); i++) {
+            if (before[i].first != after[i].first) {
+                mismatches++;
+                break;
+            }
+        }
+    }
+
+    printf("%zu rows x %d floats, %d queries, N = %d, %d engine threads\n", data.size(), table.dim,
+           num_queries, N, resolve_thread_count(num_threads));
+    printf("before (copy + sort): %.3f ms/query\n", legacy_ms / num_queries);
+    printf("after  (engine)     : %.3f ms/query\n", engine_ms / num_queries);
+    printf("speedup             : %.2fx\n", engine_ms > 0 ? legacy_ms / engine_ms : 0.0);
+    if (mismatches > 0) {
+        printf("%d queries returned different scores\n", mismatches);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 20, 2025
+ * Purpose: Loading and querying the resident feature tables of the query server
+ */
+#include "../include/search_service.h"
+#include "../include/feature_store.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+// Reads a table once, with the layout used by every query
+static int load_table(const string &filename, FeatureTable &table, bool l2_normalize, int lanes, bool strict) {
+    if (read_feature_table(const_cast<char *>(filename.c_str()), table, l2_normalize, strict) != 0) {
+        cerr << "Can not read the image csv file: " << filename << endl;
+        return -1;
+    }
+    if (build_blocked_layout(table, lanes) != 0) {
+        return -1;
+    }
+    cerr << "Loaded " << filename << ": " << table.rows() << " rows x " << table.dim << " floats" << endl;
+    return 0;
+}
+
+bool metric_uses_bare_names(const std::string &metric) {
+    return metric == "cosine" || metric_uses_resnet(metric);
+}
+
+// Reads the metric and feature file lines of a config
+static int read_search_config(const char *config_file, map<string, string> &files, string &resnet_file) {
+    FILE *fp = fopen(config_file, "r");
+    if (!fp) {
+        cerr << "Unable to open config file: " << config_file << endl;
+        return -1;
+    }
+
+    files.clear();
+    resnet_file = DEFAULT_RESNET_FILE;
+    char line[1024];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_number++;
+        istringstream fields(line);
+        string metric, filename;
+        if (!(fields >> metric) || metric[0] == '#') continue;
+        if (!(fields >> filename)) {
+            cerr << config_file << ":" << line_number << ": missing feature file for " << metric << endl;
+            fclose(fp);
+            return -1;
+        }
+        if (metric == "resnet") {
+            resnet_file = filename;
+        } else if (is_valid_metric(metric)) {
+            files[metric] = filename;
+        } else {
+            cerr << config_file << ":" << line_number << ": invalid distance metric " << metric << endl;
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    if (files.empty()) {
+        cerr << "No metric configured in " << config_file << endl;
+        return -1;
+    }
+    return 0;
+}
+
+int load_search_service(char *config_file, SearchService &service, int lanes) {
+    map<string, string> files;
+    string resnet_file;
+    if (read_search_config(config_file, files, resnet_file) != 0) {
+        return -1;
+    }
+    return load_search_tables(files, resnet_file, service, lanes);
+}
+
+int load_search_tables(const std::map<std::string, std::string> &files, const std::string &resnet_file,
+                       SearchService &service, int lanes, bool strict) {
+    bool need_resnet = false, need_resnet_raw = false;
+    for (const pair<const string, string> &entry : files) {
+        // Embedding tables are normalized once here so cosine is a dot product per row
+        if (load_table(entry.second, service.tables[entry.first], entry.first == "cosine", lanes, strict) != 0) {
+            return -1;
+        }
+        if (entry.first == "face") need_resnet_raw = true;
+        else if (metric_uses_resnet(entry.first)) need_resnet = true;
+    }
+    if (need_resnet && load_table(resnet_file, service.resnet, true, lanes, strict) != 0) {
+        return -1;
+    }
+    if (need_resnet_raw && load_table(resnet_file, service.resnet_raw, false, lanes, strict) != 0) {
+        return -1;
+    }
+
+    // Join every fused table to the embeddings by image, so queries read both at one row index
+    for (pair<const string, FeatureTable> &entry : service.tables) {
+        if (!metric_uses_resnet(entry.first)) continue;
+        FeatureTable &reference = entry.first == "face" ? service.resnet_raw : service.resnet;
+        if (align_feature_table(entry.second, reference) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int search_service_query(SearchService &service, const std::string &metric, char *target_image_filename, int N,
+                         std::vector<Match> &matches) {
+    map<string, FeatureTable>::iterator table = service.tables.find(metric);
+    if (table == service.tables.end()) {
+        cerr << "Metric not configured: " << metric << endl;
+        return -1;
+    }
+    FeatureTable *rnnData = nullptr;
+    if (metric == "face") rnnData = &service.resnet_raw;
+    else if (metric_uses_resnet(metric)) rnnData = &service.resnet;
+    return find_topN_matches(metric, target_image_filename, table->second, rnnData, N, matches,
+                             service.num_threads);
+}
+
+ServiceReloader::~ServiceReloader() {
+    stop_watching();
+    {
+        lock_guard<mutex> lock(retire_mutex_);
+        stopping_ = true;
+    }
+    retire_cv_.notify_one();
+    if (retirer_.joinable()) retirer_.join();
+}
+
+// A store changes by renaming a new MANIFEST into its directory, so that is the file to watch
+static string watched_file(const string &file) {
+    return is_feature_store(file.c_str()) ? file + "/" + STORE_MANIFEST : file;
+}
+
+// Loads a new service from the config, and lists the files it was read from
+int ServiceReloader::build(std::shared_ptr<SearchService> &service, std::vector<std::string> &files, bool strict) {
+    map<string, string> metric_files;
+    string resnet_file;
+    files.assign(1, config_file_);
+    if (read_search_config(config_file_.c_str(), metric_files, resnet_file) != 0) {
+        return -1;
+    }
+    bool need_resnet = false;
+    for (const pair<const string, string> &entry : metric_files) {
+        files.push_back(watched_file(entry.second));
+        need_resnet = need_resnet || metric_uses_resnet(entry.first);
+    }
+    if (need_resnet) files.push_back(watched_file(resnet_file));
+
+    service = make_shared<SearchService>();
+    service->num_threads = num_threads_;
+    return load_search_tables(metric_files, resnet_file, *service, lanes_, strict);
+}
+
+// True unless a table of the new version lost more rows than RELOAD_MIN_ROWS_KEPT allows
+static bool kept_rows(const string &what, const FeatureTable &current, const FeatureTable &next) {
+    if (static_cast<double>(next.rows()) >= RELOAD_MIN_ROWS_KEPT * static_cast<double>(current.rows())) {
+        return true;
+    }
+    cerr << "Reload of " << what << " has " << next.rows() << " rows instead of " << current.rows()
+         << ", taking the file for a truncated one" << endl;
+    return false;
+}
+
+// Compares the tables both versions load, a metric or embeddings the new config dropped are not a loss
+static bool kept_rows(const SearchService &current, const SearchService &next) {
+    bool need_resnet = false, need_resnet_raw = false;
+    for (const pair<const string, FeatureTable> &entry : next.tables) {
+        map<string, FeatureTable>::const_iterator table = current.tables.find(entry.first);
+        if (table != current.tables.end() && !kept_rows(entry.first, table->second, entry.second)) return false;
+        if (entry.first == "face") need_resnet_raw = true;
+        else if (metric_uses_resnet(entry.first)) need_resnet = true;
+    }
+    return (!need_resnet || kept_rows("resnet", current.resnet, next.resnet)) &&
+           (!need_resnet_raw || kept_rows("resnet", current.resnet_raw, next.resnet_raw));
+}
+
+int ServiceReloader::load(const std::string &config_file, int lanes, int num_threads) {
+    lock_guard<mutex> reload_lock(reload_mutex_);
+    config_file_ = config_file;
+    lanes_ = lanes;
+    num_threads_ = num_threads;
+    shared_ptr<SearchService> service;
+    if (build(service, files_, false) != 0) {
+        return -1;
+    }
+    lock_guard<mutex> lock(snapshot_mutex_);
+    snapshot_ = service;
+    stats_.version = 1;
+    return 0;
+}
+
+int ServiceReloader::reload() {
+    lock_guard<mutex> reload_lock(reload_mutex_);
+    auto start = chrono::steady_clock::now();
+    shared_ptr<SearchService> service;
+    vector<string> files;
+    // A file caught half written must not replace a good version, so no row may be left out
+    shared_ptr<SearchService> current = snapshot();
+    if (build(service, files, true) != 0 || (current && !kept_rows(*current, *service))) {
+        cerr << "Reload failed, still serving version " << stats().version << endl;
+        lock_guard<mutex> lock(snapshot_mutex_);
+        stats_.failures++;
+        return -1;
+    }
+    current.reset(); // the retire thread must see the previous version's last query go
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    {
+        lock_guard<mutex> lock(snapshot_mutex_);
+        snapshot_.swap(service);
+        stats_.version++;
+        stats_.reloads++;
+        stats_.last_reload_ms = ms;
+        cerr << "Reloaded " << config_file_ << " as version " << stats_.version << " in " << ms << " ms" << endl;
+    }
+    files_.swap(files);
+    if (inotify_fd_ >= 0) watch_files(files_);
+
+    // service now holds the previous version, freed on the retire thread once the queries reading it are done
+    {
+        lock_guard<mutex> lock(retire_mutex_);
+        retired_.push_back(move(service));
+        if (!retirer_.joinable()) retirer_ = thread(&ServiceReloader::retire_loop, this);
+    }
+    retire_cv_.notify_one();
+    return 0;
+}
+
+// Frees the previous versions no query holds any more; needs retire_mutex_
+void ServiceReloader::release_retired() {
+    for (size_t i = 0; i < retired_.size();) {
+        if (retired_[i].use_count() == 1) {
+            retired_[i] = retired_.back();
+            retired_.pop_back();
+        } else {
+            i++;
+        }
+    }
+}
+
+// Checks the retired versions every RELOAD_RETIRE_POLL_MS while there are any, whether or not files are watched
+void ServiceReloader::retire_loop() {
+#ifdef __linux__
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), RELOAD_NICE);
+#endif
+    unique_lock<mutex> lock(retire_mutex_);
+    while (!stopping_) {
+        if (retired_.empty()) {
+            retire_cv_.wait(lock);
+        } else {
+            retire_cv_.wait_for(lock, chrono::milliseconds(RELOAD_RETIRE_POLL_MS));
+        }
+        release_retired();
+    }
+}
+
+std::shared_ptr<SearchService> ServiceReloader::snapshot() const {
+    lock_guard<mutex> lock(snapshot_mutex_);
+    return snapshot_;
+}
+
+ReloadStats ServiceReloader::stats() const {
+    lock_guard<mutex> lock(snapshot_mutex_);
+    return stats_;
+}
+
+#ifdef __linux__
+
+// Watches the directory of every file, so a file renamed over the old one is seen too; needs reload_mutex_
+int ServiceReloader::watch_files(const std::vector<std::string> &files) {
+    for (pair<const int, vector<string>> &entry : watched_) entry.second.clear();
+    for (const string &file : files) {
+        size_t slash = file.rfind('/');
+        string directory = slash == string::npos ? "." : slash == 0 ? "/" : file.substr(0, slash);
+        string name = slash == string::npos ? file : file.substr(slash + 1);
+        int wd = inotify_add_watch(inotify_fd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0) {
+            perror(directory.c_str());
+            return -1;
+        }
+        watched_[wd].push_back(name);
+    }
+    return 0;
+}
+
+int ServiceReloader::start_watching() {
+    if (watcher_.joinable()) return 0;
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ < 0) {
+        perror("inotify_init1");
+        return -1;
+    }
+    int result = pipe(wake_pipe_);
+    if (result == 0) {
+        lock_guard<mutex> reload_lock(reload_mutex_);
+        result = watch_files(files_);
+    }
+    if (result != 0) {
+        stop_watching();
+        return -1;
+    }
+    watcher_ = thread(&ServiceReloader::watch_loop, this);
+    return 0;
+}
+
+void ServiceReloader::watch_loop() {
+    // Loader threads started from here inherit the lower priority
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), RELOAD_NICE);
+    alignas(inotify_event) char buffer[4096];
+    bool pending = false;
+    for (;;) {
+        pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {wake_pipe_[0], POLLIN, 0}};
+        int ready = poll(fds, 2, pending ? RELOAD_SETTLE_MS : -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return;
+        }
+        if (fds[1].revents != 0) return;
+        if (ready == 0 && pending) {
+            // Quiet for RELOAD_SETTLE_MS since the last change
+            pending = false;
+            reload();
+        }
+        if (ready == 0) continue;
+        // watched_ changes when a reload on another thread reads a new config
+        lock_guard<mutex> reload_lock(reload_mutex_);
+        ssize_t n;
+        while ((n = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+            for (char *p = buffer; p < buffer + n;) {
+                const inotify_event *event = reinterpret_cast<const inotify_event *>(p);
+                p += sizeof(inotify_event) + event->len;
+                map<int, vector<string>>::const_iterator names = watched_.find(event->wd);
+                if (event->len == 0 || names == watched_.end()) continue;
+                for (const string &name : names->second) {
+                    if (name == event->name) pending = true;
+                }
+            }
+        }
+    }
+}
+
+void ServiceReloader::stop_watching() {
+    if (watcher_.joinable()) {
+        char stop = 0;
+        if (write(wake_pipe_[1], &stop, 1) != 1) perror("write");
+        watcher_.join();
+    }
+    for (int &fd : wake_pipe_) {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+    if (inotify_fd_ >= 0) close(inotify_fd_);
+    inotify_fd_ = -1;
+    watched_.clear();
+}
+
+#else
+
+int ServiceReloader::watch_files(const std::vector<std::string> &) { return -1; }
+
+int ServiceReloader::start_watching() {
+    cerr << "Watching feature files needs inotify, call reload() instead" << endl;
+    return -1;
+}
+
+void ServiceReloader::watch_loop() {}
+
+void ServiceReloader::stop_watching() {}
+
+#endif
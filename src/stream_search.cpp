@@ -0,0 +1,324 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Out-of-core search streaming a feature file in fixed-size chunks
+ */
+#include "../include/stream_search.h"
+#include "../include/csv_loader.h"
+#include "../include/parallel_for.h"
+#include "../include/parallel_topn.h"
+#include "../include/search_engine.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <future>
+#include <iostream>
+#include <string_view>
+#include <unistd.h>
+#include <unordered_map>
+
+using namespace std;
+
+// Smallest part of a chunk worth its own thread
+#define STREAM_MIN_RANGE_BYTES (256 * 1024)
+
+// Metrics a streamed search scores with, the distance of the search engine policy
+struct StreamMetric {
+    const char *name;
+    float (*distance)(const float *, const float *, int);
+    bool ascending;
+};
+
+// Streamed rows are not normalized, so cosine computes the norms
+static const StreamMetric stream_metrics[] = {
+    {"ssd", SsdMetric::distance, true},
+    {"rgb-hist", HistIntersectionMetric::distance, false},
+    {"multi-hist", MultiHistMetric::distance, true},
+    {"texture-color", TextureColorMetric::distance, true},
+    {"cosine", CosineMetric::distance, true},
+};
+
+static const StreamMetric *find_stream_metric(const std::string &name) {
+    for (const StreamMetric &metric : stream_metrics) {
+        if (name == metric.name) return &metric;
+    }
+    return nullptr;
+}
+
+bool stream_supports_metric(const std::string &metric) { return find_stream_metric(metric) != nullptr; }
+
+/*
+  Reads a file in fixed-size chunks into two buffers. next() hands out the
+  chunk read last and starts reading the following one into the other
+  buffer, so the caller works on one chunk while the disk fills the next.
+ */
+class ChunkReader {
+public:
+    explicit ChunkReader(size_t chunk_bytes) : chunk_bytes_(chunk_bytes) {}
+
+    ~ChunkReader() {
+        if (pending_.valid()) pending_.wait();
+        if (fd_ >= 0) close(fd_);
+    }
+
+    int open(const char *filename) {
+        fd_ = ::open(filename, O_RDONLY);
+        if (fd_ < 0) return -1;
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        buffers_[0].resize(chunk_bytes_);
+        buffers_[1].resize(chunk_bytes_);
+        start_read(0);
+        return 0;
+    }
+
+    // The next chunk, valid until the following call; size is 0 at the end of the file
+    const char *next(size_t &size) {
+        auto t0 = chrono::steady_clock::now();
+        size = pending_.get();
+        wait_ms_ += chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+        bytes_ += size;
+        int ready = current_;
+        if (size > 0) start_read(1 - ready);
+        return buffers_[ready].data();
+    }
+
+    size_t bytes() const { return bytes_; }
+    double wait_ms() const { return wait_ms_; }
+
+private:
+    void start_read(int b) {
+        current_ = b;
+        char *buffer = buffers_[b].data();
+        pending_ = async(launch::async, [this, buffer]() {
+            size_t filled = 0;
+            while (filled < chunk_bytes_) {
+                ssize_t got = read(fd_, buffer + filled, chunk_bytes_ - filled);
+                if (got <= 0) break;
+                filled += static_cast<size_t>(got);
+            }
+            return filled;
+        });
+    }
+
+    size_t chunk_bytes_;
+    int fd_ = -1;
+    vector<char> buffers_[2];
+    int current_ = 0; // buffer the pending read fills
+    future<size_t> pending_;
+    size_t bytes_ = 0;
+    double wait_ms_ = 0.0;
+};
+
+/*
+  Calls fn(begin, end) on runs of whole lines, in file order, until it
+  returns false. A line cut by the end of a chunk is carried over and
+  handed out on its own once the rest of it arrives. Returns the number of
+  chunks read.
+ */
+template <typename Fn>
+static size_t for_each_lines(ChunkReader &reader, Fn fn) {
+    string carry;
+    size_t chunks = 0;
+    for (;;) {
+        size_t size;
+        const char *p = reader.next(size);
+        if (size == 0) break;
+        chunks++;
+        const char *end = p + size;
+        if (!carry.empty()) {
+            const char *newline = static_cast<const char *>(memchr(p, '\n', size));
+            if (newline == nullptr) {
+                carry.append(p, size);
+                continue;
+            }
+            carry.append(p, newline + 1 - p);
+            if (!fn(carry.data(), carry.data() + carry.size())) return chunks;
+            carry.clear();
+            p = newline + 1;
+        }
+        const char *last = end;
+        while (last > p && last[-1] != '\n') last--;
+        if (last > p && !fn(p, last)) return chunks;
+        carry.assign(last, end);
+    }
+    if (!carry.empty()) fn(carry.data(), carry.data() + carry.size());
+    return chunks;
+}
+
+// True if the line is a row, not empty and not metadata
+static bool is_row(const char *p, const char *eol) { return p < eol && *p != '#' && *p != '\r'; }
+
+// Canonical image name of a row, its filename without the directories
+static string_view row_name(const char *p, const char *eol, const char *&comma) {
+    comma = static_cast<const char *>(memchr(p, ',', eol - p));
+    return string_view(p, (comma ? comma : eol) - p);
+}
+
+
+// Scoring state of one thread: its heap and the filenames of the rows in it
+struct StreamWorker {
+    TopNHeap heap;
+    unordered_map<int, string> names;
+    vector<float> row;
+    size_t rows = 0;
+    size_t malformed = 0;
+
+    StreamWorker(int N, bool ascending, int dim) : heap(N, ascending), row(dim) {}
+
+    // Forgets the names of rows that dropped out of the heap
+    void prune() {
+        vector<pair<float, int>> kept;
+        heap.drain(kept);
+        unordered_map<int, string> kept_names;
+        for (const pair<float, int> &entry : kept) {
+            heap.push(entry.first, entry.second);
+            kept_names[entry.second].swap(names[entry.second]);
+        }
+        names.swap(kept_names);
+    }
+};
+
+int stream_topN_matches(const std::string &metric, const char *feature_file, const char *target_image_filename, int N,
+                        NameArena &names, std::vector<Match> &matches, int num_threads, size_t chunk_bytes,
+                        StreamStats *stats) {
+    matches.clear();
+    StreamStats local;
+    StreamStats &counters = stats ? *stats : local;
+    counters = StreamStats();
+    const StreamMetric *scorer = find_stream_metric(metric);
+    if (scorer == nullptr) {
+        cerr << "Streaming search does not support the " << metric << " metric" << endl;
+        return -1;
+    }
+    if (chunk_bytes == 0) chunk_bytes = STREAM_CHUNK_BYTES;
+
+    // First pass: the target's row, read only up to it
+    auto t0 = chrono::steady_clock::now();
+    vector<float> target;
+    int target_row = -1;
+    {
+        ChunkReader reader(chunk_bytes);
+        if (reader.open(feature_file) != 0) {
+            cerr << "Unable to open feature file " << feature_file << endl;
+            return -1;
+        }
+        int row = 0;
+        for_each_lines(reader, [&](const char *p, const char *end) {
+            while (p < end) {
+                const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+                if (eol == nullptr) eol = end;
+                if (is_row(p, eol)) {
+                    const char *comma;
+                    if (image_name_matches(row_name(p, eol, comma), target_image_filename) && comma != nullptr) {
+                        target.resize(std::count(comma, eol, ','));
+                        if (!parse_feature_row(comma + 1, eol, target.size(), target.data()).empty()) target.clear();
+                        target_row = row;
+                        return false;
+                    }
+                    row++;
+                }
+                p = eol + 1;
+            }
+            return true;
+        });
+        counters.bytes += reader.bytes();
+    }
+    auto t1 = chrono::steady_clock::now();
+    counters.find_ms = chrono::duration<double, milli>(t1 - t0).count();
+    if (target_row == -1) {
+        cerr << "Target image not found!" << endl;
+        return -1;
+    }
+    if (target.empty()) {
+        cerr << "The row of the target image is malformed" << endl;
+        return -1;
+    }
+    const int dim = static_cast<int>(target.size());
+
+    // Second pass: every row, chunk by chunk
+    const int threads = resolve_thread_count(num_threads);
+    vector<StreamWorker> workers;
+    for (int t = 0; t < threads; t++) workers.emplace_back(N, scorer->ascending, dim);
+    const TopNOrder better{scorer->ascending};
+    const size_t prune_at = 2 * static_cast<size_t>(N) + 64;
+    int next_row = 0;
+    ChunkReader reader(chunk_bytes);
+    if (reader.open(feature_file) != 0) {
+        cerr << "Unable to open feature file " << feature_file << endl;
+        return -1;
+    }
+    counters.chunks = for_each_lines(reader, [&](const char *begin, const char *end) {
+        // Newline-aligned ranges, one per thread, and the number of the first row of each
+        size_t parts = std::max<size_t>(1, std::min<size_t>(threads, (end - begin) / STREAM_MIN_RANGE_BYTES));
+        vector<const char *> bounds(1, begin);
+        for (size_t r = 1; r < parts; r++) {
+            const char *cut = std::max(bounds.back(), begin + (end - begin) * r / parts);
+            const char *newline = static_cast<const char *>(memchr(cut, '\n', end - cut));
+            bounds.push_back(newline ? newline + 1 : end);
+        }
+        bounds.push_back(end);
+        vector<int> first_row(parts + 1, next_row);
+        parallel_for(parts, threads, [&](size_t r, int) {
+            int count = 0;
+            for (const char *p = bounds[r]; p < bounds[r + 1];) {
+                const char *eol = static_cast<const char *>(memchr(p, '\n', bounds[r + 1] - p));
+                if (eol == nullptr) eol = bounds[r + 1];
+                if (is_row(p, eol)) count++;
+                p = eol + 1;
+            }
+            first_row[r + 1] = count;
+        });
+        for (size_t r = 0; r < parts; r++) first_row[r + 1] += first_row[r];
+        next_row = first_row[parts];
+
+        parallel_for(parts, threads, [&](size_t r, int t) {
+            StreamWorker &worker = workers[t];
+            int row = first_row[r];
+            for (const char *p = bounds[r]; p < bounds[r + 1];) {
+                const char *eol = static_cast<const char *>(memchr(p, '\n', bounds[r + 1] - p));
+                if (eol == nullptr) eol = bounds[r + 1];
+                if (is_row(p, eol)) {
+                    const char *comma = static_cast<const char *>(memchr(p, ',', eol - p));
+                    if (comma == nullptr || !parse_feature_row(comma + 1, eol, dim, worker.row.data()).empty()) {
+                        worker.malformed++;
+                    } else if (row != target_row) {
+                        worker.rows++;
+                        pair<float, int> candidate(scorer->distance(worker.row.data(), target.data(), dim), row);
+                        if (!worker.heap.full() || better(candidate, worker.heap.worst())) {
+                            worker.heap.push(candidate.first, candidate.second);
+                            worker.names[row].assign(p, comma - p);
+                            if (worker.names.size() > prune_at) worker.prune();
+                        }
+                    }
+                    row++;
+                }
+                p = eol + 1;
+            }
+        });
+        return true;
+    });
+    counters.bytes += reader.bytes();
+    counters.read_wait_ms = reader.wait_ms();
+
+    // Merge the heaps of the threads
+    TopNHeap best(N, scorer->ascending);
+    unordered_map<int, const string *> best_names;
+    for (StreamWorker &worker : workers) {
+        counters.rows += worker.rows;
+        counters.malformed += worker.malformed;
+        vector<pair<float, int>> kept;
+        worker.heap.drain(kept);
+        for (const pair<float, int> &entry : kept) {
+            best.push(entry.first, entry.second);
+            best_names[entry.second] = &worker.names[entry.second];
+        }
+    }
+    for (const pair<float, int> &match : best.sorted()) {
+        matches.push_back({names.store(best_names[match.second]->c_str()), match.first, match.second});
+    }
+    counters.scan_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t1).count();
+    return 0;
+}
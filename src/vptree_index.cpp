@@ -0,0 +1,315 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Building, saving and searching the vantage-point tree
+ */
+#include "../include/vptree_index.h"
+#include "../include/distance_calculate.h"
+#include "../include/parallel_for.h"
+#include "../include/parallel_topn.h"
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <thread>
+
+using namespace std;
+
+#define VPTREE_MAGIC "P2VPTRE1"
+// Nodes with more rows than this score their rows on several threads
+#define VPTREE_PARALLEL_ROWS 8192
+// Vantage point candidates per node, and rows each candidate is measured against
+#define VPTREE_CANDIDATES 5
+#define VPTREE_SAMPLE 32
+
+// Rows on each side of an inner node of size rows, the vantage point takes one
+static int inside_rows(int rows) { return (rows - 1) / 2; }
+
+// Nodes of a subtree of size rows, fixed by the size since every split is at the median
+static int subtree_nodes(int rows) {
+    if (rows <= VPTREE_LEAF_SIZE) return 1;
+    int inside = inside_rows(rows);
+    return 1 + subtree_nodes(inside) + subtree_nodes(rows - 1 - inside);
+}
+
+float VpTreeIndex::distance(const float *query, int row) const {
+    return calculate_ssd(query, vectors_ + static_cast<size_t>(row) * dim_, dim_);
+}
+
+/*
+  Picks the candidate whose distances to a random sample of the range spread
+  the most, so its median splits the range into well separated halves.
+  Returns its position in order_.
+ */
+int VpTreeIndex::choose_vantage_point(int begin, int end, unsigned int seed) const {
+    mt19937 rng(seed);
+    uniform_int_distribution<int> any(begin, end - 1);
+    int best = begin;
+    float best_spread = -1.0f;
+    for (int c = 0; c < VPTREE_CANDIDATES; c++) {
+        int candidate = any(rng);
+        const float *point = vectors_ + static_cast<size_t>(order_[candidate]) * dim_;
+        float sum = 0.0f, sum_sq = 0.0f;
+        for (int s = 0; s < VPTREE_SAMPLE; s++) {
+            float d = distance(point, order_[any(rng)]);
+            sum += d;
+            sum_sq += d * d;
+        }
+        float mean = sum / VPTREE_SAMPLE;
+        float spread = sum_sq / VPTREE_SAMPLE - mean * mean;
+        if (spread > best_spread) {
+            best_spread = spread;
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+/*
+  Builds the subtree of order_[begin, end) at nodes_[node]. dist is indexed
+  by position in order_, so subtrees on other threads never share entries.
+  spare_threads are handed down: one goes to the inside child's new thread,
+  and the rest are split between both children.
+ */
+void VpTreeIndex::build_node(int node, int begin, int end, int spare_threads, vector<float> &dist) {
+    Node &current = nodes_[node];
+    current.begin = begin;
+    current.end = end;
+    const int rows = end - begin;
+    if (rows <= VPTREE_LEAF_SIZE) {
+        current.outside = -1;
+        current.middle = end;
+        current.inside_min = current.inside_max = current.outside_min = current.outside_max = 0.0f;
+        return;
+    }
+
+    swap(order_[begin], order_[choose_vantage_point(begin, end, 5330u + static_cast<unsigned int>(node))]);
+    const float *point = vectors_ + static_cast<size_t>(order_[begin]) * dim_;
+    auto score = [&](size_t chunk, int) {
+        int from = begin + 1 + static_cast<int>(chunk) * VPTREE_PARALLEL_ROWS;
+        int to = std::min(end, from + VPTREE_PARALLEL_ROWS);
+        for (int i = from; i < to; i++) dist[i] = distance(point, order_[i]);
+    };
+    parallel_for((rows - 1 + VPTREE_PARALLEL_ROWS - 1) / VPTREE_PARALLEL_ROWS, spare_threads + 1, score);
+
+    // Median split on the distance to the vantage point
+    vector<pair<float, int32_t>> ranked(rows - 1);
+    for (int i = begin + 1; i < end; i++) ranked[i - begin - 1] = make_pair(dist[i], order_[i]);
+    const int inside = inside_rows(rows);
+    nth_element(ranked.begin(), ranked.begin() + inside, ranked.end());
+    current.middle = begin + 1 + inside;
+    current.inside_min = current.outside_min = FLT_MAX;
+    current.inside_max = current.outside_max = 0.0f;
+    for (int i = 0; i < rows - 1; i++) {
+        order_[begin + 1 + i] = ranked[i].second;
+        float d = ranked[i].first;
+        if (i < inside) {
+            current.inside_min = std::min(current.inside_min, d);
+            current.inside_max = std::max(current.inside_max, d);
+        } else {
+            current.outside_min = std::min(current.outside_min, d);
+            current.outside_max = std::max(current.outside_max, d);
+        }
+    }
+    current.outside = node + 1 + subtree_nodes(inside);
+
+    const int middle = current.middle, outside = current.outside;
+    if (spare_threads > 0) {
+        int inside_threads = (spare_threads - 1) / 2;
+        thread worker(&VpTreeIndex::build_node, this, node + 1, begin + 1, middle, inside_threads, std::ref(dist));
+        build_node(outside, middle, end, spare_threads - 1 - inside_threads, dist);
+        worker.join();
+    } else {
+        build_node(node + 1, begin + 1, middle, 0, dist);
+        build_node(outside, middle, end, 0, dist);
+    }
+}
+
+int VpTreeIndex::build(const FeatureTable &table, int num_threads) {
+    if (table.rows() == 0 || table.dim <= 0) {
+        cerr << "Can not build an index on an empty table" << endl;
+        return -1;
+    }
+    n_ = table.rows();
+    dim_ = table.dim;
+    vectors_ = table.values.data();
+    fingerprint_ = feature_table_fingerprint(table);
+    order_.resize(n_);
+    iota(order_.begin(), order_.end(), 0);
+    nodes_.assign(subtree_nodes(static_cast<int>(n_)), Node());
+    vector<float> dist(n_);
+    build_node(0, 0, static_cast<int>(n_), resolve_thread_count(num_threads) - 1, dist);
+    return 0;
+}
+
+/*
+  Every row x below a child satisfies lo <= d(vp, x) <= hi, so by the
+  triangle inequality d(q, x) >= max(d(q, vp) - hi, lo - d(q, vp)). A child
+  is skipped when that bound is above results.bound(). Children are pushed
+  far first so the near one is searched first and shrinks the bound; the
+  bound is checked again when a child is popped.
+ */
+template <typename Results>
+void VpTreeIndex::traverse(const float *query, int exclude, Results &results, VpTreeStats &stats) const {
+    vector<pair<float, int>> stack;
+    stack.push_back(make_pair(0.0f, 0));
+    while (!stack.empty()) {
+        pair<float, int> top = stack.back();
+        stack.pop_back();
+        if (top.first > results.bound()) continue;
+        const Node &node = nodes_[top.second];
+        stats.nodes_visited++;
+        if (node.outside < 0) {
+            for (int i = node.begin; i < node.end; i++) {
+                if (order_[i] == exclude) continue;
+                stats.distance_evaluations++;
+                results.add(distance(query, order_[i]), order_[i]);
+            }
+            continue;
+        }
+
+        float d = distance(query, order_[node.begin]);
+        stats.distance_evaluations++;
+        if (order_[node.begin] != exclude) results.add(d, order_[node.begin]);
+        float inside_bound = std::max(0.0f, std::max(d - node.inside_max, node.inside_min - d));
+        float outside_bound = std::max(0.0f, std::max(d - node.outside_max, node.outside_min - d));
+        pair<float, int> inside(inside_bound, top.second + 1), outside(outside_bound, node.outside);
+        if (d < node.outside_min) {
+            stack.push_back(outside);
+            stack.push_back(inside);
+        } else {
+            stack.push_back(inside);
+            stack.push_back(outside);
+        }
+    }
+}
+
+// The N closest rows so far, the worst on top
+struct KnnResults {
+    int N;
+    priority_queue<pair<float, int>, vector<pair<float, int>>, TopNOrder> heap{TopNOrder{true}};
+
+    float bound() const { return static_cast<int>(heap.size()) < N ? FLT_MAX : heap.top().first; }
+    void add(float d, int row) {
+        pair<float, int> candidate(d, row);
+        if (static_cast<int>(heap.size()) < N) {
+            heap.push(candidate);
+        } else if (TopNOrder{true}(candidate, heap.top())) {
+            heap.pop();
+            heap.push(candidate);
+        }
+    }
+};
+
+struct RadiusResults {
+    float radius;
+    vector<pair<float, int>> found;
+
+    float bound() const { return radius; }
+    void add(float d, int row) {
+        if (d <= radius) found.push_back(make_pair(d, row));
+    }
+};
+
+std::vector<std::pair<float, int>> VpTreeIndex::knn_search(const float *query, int N, int exclude,
+                                                           VpTreeStats *stats) const {
+    vector<pair<float, int>> result;
+    if (n_ == 0 || N <= 0) return result;
+    KnnResults knn;
+    knn.N = N;
+    VpTreeStats local;
+    traverse(query, exclude, knn, stats ? *stats : local);
+    while (!knn.heap.empty()) {
+        result.push_back(knn.heap.top());
+        knn.heap.pop();
+    }
+    reverse(result.begin(), result.end());
+    return result;
+}
+
+std::vector<std::pair<float, int>> VpTreeIndex::radius_search(const float *query, float radius, int exclude,
+                                                              VpTreeStats *stats) const {
+    RadiusResults within;
+    within.radius = radius;
+    if (n_ == 0 || radius < 0.0f) return within.found;
+    VpTreeStats local;
+    traverse(query, exclude, within, stats ? *stats : local);
+    sort(within.found.begin(), within.found.end(), TopNOrder{true});
+    return within.found;
+}
+
+// Fixed-size header of an index file, the nodes and the row order follow
+struct VpTreeFileHeader {
+    char magic[8];
+    uint64_t n;
+    uint64_t nodes;
+    uint64_t fingerprint;
+    int32_t dim;
+    int32_t leaf_size;
+};
+
+int VpTreeIndex::save(const char *filename) const {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        cerr << "Unable to open index file " << filename << endl;
+        return -1;
+    }
+    VpTreeFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VPTREE_MAGIC, sizeof(header.magic));
+    header.n = n_;
+    header.nodes = nodes_.size();
+    header.fingerprint = fingerprint_;
+    header.dim = dim_;
+    header.leaf_size = VPTREE_LEAF_SIZE;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(nodes_.data(), sizeof(Node), nodes_.size(), fp) == nodes_.size();
+    ok = ok && fwrite(order_.data(), sizeof(int32_t), order_.size(), fp) == order_.size();
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) {
+        cerr << "Failed to write index file " << filename << endl;
+        return -1;
+    }
+    return 0;
+}
+
+int VpTreeIndex::load(const char *filename, const FeatureTable &table) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return -1;
+    }
+    VpTreeFileHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, VPTREE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.leaf_size != VPTREE_LEAF_SIZE) {
+        cerr << "Index file " << filename << " is not a VP-tree index" << endl;
+        fclose(fp);
+        return -1;
+    }
+    if (header.n != table.rows() || header.dim != table.dim ||
+        header.fingerprint != feature_table_fingerprint(table) ||
+        header.nodes != static_cast<uint64_t>(subtree_nodes(static_cast<int>(header.n)))) {
+        cerr << "Index file " << filename << " was built on another feature table" << endl;
+        fclose(fp);
+        return -1;
+    }
+    nodes_.resize(header.nodes);
+    order_.resize(header.n);
+    bool ok = fread(nodes_.data(), sizeof(Node), nodes_.size(), fp) == nodes_.size();
+    ok = ok && fread(order_.data(), sizeof(int32_t), order_.size(), fp) == order_.size();
+    fclose(fp);
+    if (!ok) {
+        cerr << "Index file " << filename << " is truncated" << endl;
+        nodes_.clear();
+        n_ = 0;
+        return -1;
+    }
+    n_ = header.n;
+    dim_ = header.dim;
+    fingerprint_ = header.fingerprint;
+    vectors_ = table.values.data();
+    return 0;
+}
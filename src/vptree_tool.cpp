@@ -0,0 +1,163 @@
+/*
+ * Authors: Yuyang Tian and Arun Mekkad
+ * Date: February 25, 2025
+ * Purpose: Build a VP-tree over a feature file, query it, and measure the distance evaluations it saves over a linear scan
+ */
+#include "../include/feature_table.h"
+#include "../include/search_engine.h"
+#include "../include/vptree_index.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+static int build_index(FeatureTable &table, const char *index_file, int num_threads) {
+    VpTreeIndex index;
+    auto start = chrono::steady_clock::now();
+    if (index.build(table, num_threads) != 0) return -1;
+    double build_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (index.save(index_file) != 0) return -1;
+    printf("Built %zu rows into %zu nodes on %d threads in %.2f s, saved to %s\n", index.size(), index.node_count(),
+           resolve_thread_count(num_threads), build_s, index_file);
+    return 0;
+}
+
+// Prints the N nearest images of a target, or every image within radius if radius >= 0
+static int query_index(FeatureTable &table, const char *index_file, const char *target, int N, float radius) {
+    VpTreeIndex index;
+    if (index.load(index_file, table) != 0) {
+        printf("Can not load the index %s\n", index_file);
+        return -1;
+    }
+    int row = find_table_row(table, target);
+    if (row < 0) {
+        printf("Target image %s is not in the feature file\n", target);
+        return -1;
+    }
+    VpTreeStats stats;
+    vector<pair<float, int>> matches = radius >= 0.0f ? index.radius_search(table.row(row), radius, row, &stats)
+                                                      : index.knn_search(table.row(row), N, row, &stats);
+    for (const pair<float, int> &match : matches) {
+        printf("%s %f\n", table.filenames[match.second], match.first);
+    }
+    printf("%zu matches, %zu distance evaluations (a linear scan takes %zu)\n", matches.size(),
+           stats.distance_evaluations, table.rows() - 1);
+    return 0;
+}
+
+/*
+  Builds trees over growing prefixes of the table (1/2^k of the rows up to
+  all of them) and, for each, runs the same queries through the tree and
+  through the linear search_topN<SsdMetric> scan behind
+  find_topN_matches_ssd. Reports the distance evaluations per query, the
+  fraction a tree saves, both times per query, and checks that both return
+  the same distances.
+ */
+static int benchmark(FeatureTable &table, int N, int num_queries, int steps, int num_threads) {
+    printf("N = %d, %d queries per size, linear scan on 1 thread\n", N, num_queries);
+    printf("%10s %12s %12s %10s %12s %12s %8s\n", "rows", "tree evals", "linear evals", "saved", "tree ms", "linear ms",
+           "exact");
+    for (int step = steps - 1; step >= 0; step--) {
+        size_t rows = table.rows() >> step;
+        if (rows <= static_cast<size_t>(N)) continue;
+        FeatureTable prefix;
+        prefix.dim = table.dim;
+        prefix.filenames.assign(table.filenames.begin(), table.filenames.begin() + rows);
+        prefix.values.assign(table.values.begin(), table.values.begin() + rows * table.dim);
+
+        VpTreeIndex index;
+        if (index.build(prefix, num_threads) != 0) return -1;
+        VpTreeStats stats;
+        double tree_ms = 0.0, linear_ms = 0.0;
+        bool exact = true;
+        for (int q = 0; q < num_queries; q++) {
+            int target = static_cast<int>((static_cast<size_t>(q) * 7919) % rows);
+            const float *query = prefix.row(target);
+            auto t0 = chrono::steady_clock::now();
+            vector<pair<float, int>> tree = index.knn_search(query, N, target, &stats);
+            auto t1 = chrono::steady_clock::now();
+            vector<pair<float, int>> linear = search_topN<SsdMetric>(prefix, query, target, N, 1);
+            auto t2 = chrono::steady_clock::now();
+            tree_ms += chrono::duration<double, milli>(t1 - t0).count();
+            linear_ms += chrono::duration<double, milli>(t2 - t1).count();
+            if (tree.size() != linear.size()) exact = false;
+            for (size_t i = 0; exact && i < tree.size(); i++) {
+                if (tree[i].first != linear[i].first) exact = false;
+            }
+        }
+        double tree_evals = static_cast<double>(stats.distance_evaluations) / num_queries;
+        double linear_evals = static_cast<double>(rows - 1);
+        printf("%10zu %12.1f %12.0f %9.1f%% %12.3f %12.3f %8s\n", rows, tree_evals, linear_evals,
+               100.0 * (1.0 - tree_evals / linear_evals), tree_ms / num_queries, linear_ms / num_queries,
+               exact ? "yes" : "NO");
+    }
+    return 0;
+}
+
+/**
+ * Builds a VP-tree over a feature file for exact ssd search, queries a saved
+ * tree, or benchmarks trees against the linear scan as the collection grows.
+ *
+ * @param argv argv[1] - build, query or bench, argv[2] - feature file,
+ *             argv[3] - index file (build, query), argv[4] - target image (query)
+ *             Optional flags:
+ *             --N <n> - matches per query (query, bench; default 10)
+ *             --radius <d> - return every image within distance d instead of the N nearest (query)
+ *             --queries <q> - number of queries per size (bench, default 200)
+ *             --steps <s> - collection sizes, each half the next (bench, default 6)
+ *             --threads <n> - build threads, 0 uses every core
+ */
+int main(int argc, char *argv[]) {
+    const char *mode = argc > 1 ? argv[1] : "";
+    int positional = strcmp(mode, "build") == 0 ? 4 : strcmp(mode, "query") == 0 ? 5 : strcmp(mode, "bench") == 0 ? 3 : 0;
+    if (positional == 0 || argc < positional) {
+        printf("usage: %s build <feature_file> <index_file> [--threads n]\n", argv[0]);
+        printf("       %s query <feature_file> <index_file> <target_image> [--N n] [--radius d]\n", argv[0]);
+        printf("       %s bench <feature_file> [--N n] [--queries q] [--steps s] [--threads n]\n", argv[0]);
+        exit(-1);
+    }
+    int N = 10;
+    float radius = -1.0f;
+    int num_queries = 200;
+    int steps = 6;
+    int num_threads = 0;
+    for (int i = positional; i < argc; i++) {
+        if (i + 1 >= argc) {
+            printf("Missing value for %s\n", argv[i]);
+            exit(-1);
+        }
+        if (strcmp(argv[i], "--N") == 0) {
+            N = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--radius") == 0) {
+            radius = static_cast<float>(atof(argv[++i]));
+        } else if (strcmp(argv[i], "--queries") == 0) {
+            num_queries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--steps") == 0) {
+            steps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-t") == 0) {
+            num_threads = atoi(argv[++i]);
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+    if (N <= 0 || num_queries <= 0 || steps <= 0) {
+        printf("N, the number of queries and steps must be positive\n");
+        exit(-1);
+    }
+
+    FeatureTable table;
+    if (read_feature_table(argv[2], table) != 0 || table.rows() == 0) {
+        printf("Can not read the image csv file: %s\n", argv[2]);
+        exit(-1);
+    }
+    if (strcmp(mode, "build") == 0) {
+        return build_index(table, argv[3], num_threads);
+    } else if (strcmp(mode, "query") == 0) {
+        return query_index(table, argv[3], argv[4], N, radius);
+    }
+    return benchmark(table, N, num_queries, steps, num_threads);
+}